@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+// Conversion benchmark over synthetic frames, run with `make bench`
+// Times every route of src/convert.c from each SPA format the capture accepts
+// to YUYV, and checks the outputs against the scalar convert_bgrx_to_yuyv.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libyuv.h>
+#include "convert.h"
+#include "convert_bgrx.h"
+#include "thread_pool.h"
+
+// Each path runs until it has taken this long, and at least BENCH_MIN_RUNS times
+#define BENCH_MIN_SECONDS 0.5
+#define BENCH_MIN_RUNS 3
+
+// Source rows are padded like GPU allocations are, so strides are exercised
+#define BENCH_STRIDE_ALIGN 256
+
+struct bench_size {
+    int width;
+    int height;
+};
+
+static const struct bench_size bench_sizes[] = {
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 2560, 1440 },
+    { 3840, 2160 },
+};
+
+// Byte order in memory, 'X' and 'A' are filled with 0xff
+struct bench_format {
+    uint32_t spa_format;
+    const char *name;
+    const char *layout;
+};
+
+static const struct bench_format bench_formats[] = {
+    { 7,  "RGBx", "RGBX" },
+    { 8,  "BGRx", "BGRX" },
+    { 9,  "xRGB", "XRGB" },
+    { 10, "xBGR", "XBGR" },
+    { 11, "RGBA", "RGBA" },
+    { 12, "BGRA", "BGRA" },
+    { 13, "ARGB", "ARGB" },
+    { 14, "ABGR", "ABGR" },
+    { 15, "RGB",  "RGB" },
+    { 16, "BGR",  "BGR" },
+};
+
+#define BENCH_N_FORMATS (sizeof(bench_formats) / sizeof(bench_formats[0]))
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Gradients with noise, so neither flat nor random frames flatter a kernel
+static void fill_rgb(uint8_t *rgb, int width, int height) {
+    uint32_t state = 0x9e3779b9u;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            uint8_t *px = rgb + ((size_t)y * width + x) * 3;
+            px[0] = (uint8_t)(x * 255 / width + (state & 0x1f));
+            px[1] = (uint8_t)(y * 255 / height + ((state >> 8) & 0x1f));
+            px[2] = (uint8_t)((x + y) + ((state >> 16) & 0x3f));
+        }
+    }
+}
+
+static uint32_t source_stride(const struct bench_format *format, int width) {
+    uint32_t row = (uint32_t)(width * strlen(format->layout));
+    return (row + BENCH_STRIDE_ALIGN - 1) / BENCH_STRIDE_ALIGN * BENCH_STRIDE_ALIGN;
+}
+
+static void pack_frame(const struct bench_format *format, const uint8_t *rgb, uint8_t *dst,
+                       int width, int height, uint32_t stride) {
+    size_t bpp = strlen(format->layout);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const uint8_t *px = rgb + ((size_t)y * width + x) * 3;
+            uint8_t *out = dst + (size_t)y * stride + x * bpp;
+            for (size_t c = 0; c < bpp; c++) {
+                switch (format->layout[c]) {
+                    case 'R': out[c] = px[0]; break;
+                    case 'G': out[c] = px[1]; break;
+                    case 'B': out[c] = px[2]; break;
+                    default: out[c] = 0xff; break;
+                }
+            }
+        }
+    }
+}
+
+static int max_difference(const uint8_t *a, const uint8_t *b, size_t size) {
+    int max = 0;
+    for (size_t i = 0; i < size; i++) {
+        int diff = abs((int)a[i] - (int)b[i]);
+        if (diff > max) {
+            max = diff;
+        }
+    }
+    return max;
+}
+
+// Everything one conversion path needs, set up by the caller per frame size
+struct bench_run {
+    const struct bench_format *format;
+    const uint8_t *src;
+    uint32_t src_stride;
+    uint8_t *dst;
+    uint8_t *argb;  // Whole frame of ARGB for the two-pass libyuv path
+    int width;
+    int height;
+    const convert_context *ctx;
+};
+
+typedef bool (*bench_path_fn)(const struct bench_run *run);
+
+static bool run_bgrx_kernel(const struct bench_run *run) {
+    convert_bgrx_to_yuyv(run->src, run->dst, run->width, run->height, run->src_stride);
+    return true;
+}
+
+static bool run_route(const struct bench_run *run) {
+    return convert_frame(run->ctx, OUTPUT_FORMAT_YUYV, run->format->spa_format,
+                         run->src, run->dst, run->width, run->height, run->src_stride);
+}
+
+// What the conversion looked like before the routes: expand to ARGB, then libyuv to YUY2
+static bool run_libyuv(const struct bench_run *run) {
+    if (!convert_to_argb(run->format->spa_format, run->src, run->src_stride, run->argb, run->width, run->height)) {
+        return false;
+    }
+    return ARGBToYUY2(run->argb, run->width * 4, run->dst, run->width * 2, run->width, run->height) == 0;
+}
+
+// Time a path and compare its output
+// Parameters:
+//   expected: Output the path must match exactly, NULL to only report the
+//             difference from reference
+// Returns: false if the path failed or didn't match expected
+static bool bench_path(const char *label, bench_path_fn fn, const struct bench_run *run,
+                       const uint8_t *reference, const uint8_t *expected) {
+    size_t out_size = (size_t)run->width * run->height * 2;
+    memset(run->dst, 0, out_size);
+
+    uint64_t best_ns = UINT64_MAX;
+    uint64_t start_ns = monotonic_ns();
+    int runs = 0;
+    while (runs < BENCH_MIN_RUNS || monotonic_ns() - start_ns < (uint64_t)(BENCH_MIN_SECONDS * 1e9)) {
+        uint64_t t0 = monotonic_ns();
+        if (!fn(run)) {
+            printf("%-5s %4dx%-4d  %-10s FAILED\n", run->format->name, run->width, run->height, label);
+            return false;
+        }
+        uint64_t elapsed = monotonic_ns() - t0;
+        if (elapsed < best_ns) {
+            best_ns = elapsed;
+        }
+        runs++;
+    }
+
+    size_t pixels = (size_t)run->width * run->height;
+    size_t src_bytes = pixels * strlen(run->format->layout);
+    double mb_per_s = (double)src_bytes / ((double)best_ns / 1e9) / 1e6;
+    double ns_per_pixel = (double)best_ns / (double)pixels;
+    int diff = max_difference(run->dst, reference, out_size);
+
+    bool ok = !expected || memcmp(run->dst, expected, out_size) == 0;
+    const char *check = !ok ? "MISMATCH" : expected ? "exact" : "";
+    printf("%-5s %4dx%-4d  %-10s %9.1f %8.3f %8d  %s\n", run->format->name, run->width, run->height,
+           label, mb_per_s, ns_per_pixel, diff, check);
+    return ok;
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [--threads N]\n", name);
+    printf("  --threads N   Threads of the threaded path, 0 = one per CPU up to 8 (default: 0)\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t n_threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long threads = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || threads < 0 || threads > THREAD_POOL_MAX_THREADS) {
+                printf("Invalid thread count: %s (0-%d)\n", argv[i], THREAD_POOL_MAX_THREADS);
+                return 1;
+            }
+            n_threads = (uint32_t)threads;
+        } else {
+            usage(argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    if (n_threads == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? (uint32_t)n_cpus : 1;
+        if (n_threads > 8) {
+            n_threads = 8;
+        }
+    }
+
+    thread_pool *pool = thread_pool_create(n_threads, false);
+    if (!pool) {
+        return 1;
+    }
+
+    // The dispatcher's pick, restored after timing each kernel on its own
+    const char *best_kernel = convert_bgrx_kernel_name();
+    static const char *kernels[] = { "scalar", "sse2", "avx2", "neon" };
+
+    const struct bench_size *largest = &bench_sizes[sizeof(bench_sizes) / sizeof(bench_sizes[0]) - 1];
+    size_t max_pixels = (size_t)largest->width * largest->height;
+    uint32_t max_stride = source_stride(&bench_formats[0], largest->width);
+    size_t arena_size = convert_arena_size(largest->width, n_threads);
+
+    uint8_t *rgb = malloc(max_pixels * 3);
+    uint8_t *bgrx = malloc((size_t)max_stride * largest->height);
+    uint8_t *src = malloc((size_t)max_stride * largest->height);
+    uint8_t *argb = malloc(max_pixels * 4);
+    uint8_t *reference = malloc(max_pixels * 2);
+    uint8_t *single = malloc(max_pixels * 2);
+    uint8_t *dst = malloc(max_pixels * 2);
+    uint8_t *arena = malloc(arena_size);
+    if (!rgb || !bgrx || !src || !argb || !reference || !single || !dst || !arena) {
+        fprintf(stderr, "Failed to allocate benchmark frames\n");
+        return 1;
+    }
+
+    convert_context single_ctx = { NULL, arena, arena_size };
+    convert_context threaded_ctx = { pool, arena, arena_size };
+
+    printf("Dispatched BGRx kernel: %s, threaded path: %u threads\n", best_kernel, n_threads);
+    printf("%-5s %-9s  %-10s %9s %8s %8s  %s\n", "src", "size", "path", "MB/s", "ns/px", "maxdiff", "check");
+
+    bool all_ok = true;
+    for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        int width = bench_sizes[s].width;
+        int height = bench_sizes[s].height;
+        size_t out_size = (size_t)width * height * 2;
+
+        fill_rgb(rgb, width, height);
+        const struct bench_format *bgrx_format = &bench_formats[1];
+        uint32_t bgrx_stride = source_stride(bgrx_format, width);
+        pack_frame(bgrx_format, rgb, bgrx, width, height, bgrx_stride);
+
+        convert_bgrx_use_kernel("scalar");
+        convert_bgrx_to_yuyv(bgrx, reference, width, height, bgrx_stride);
+
+        for (size_t f = 0; f < BENCH_N_FORMATS; f++) {
+            const struct bench_format *format = &bench_formats[f];
+            uint32_t stride = source_stride(format, width);
+            pack_frame(format, rgb, src, width, height, stride);
+
+            struct bench_run run = { format, src, stride, dst, argb, width, height, &single_ctx };
+
+            if (format->spa_format == bgrx_format->spa_format) {
+                for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                    if (convert_bgrx_use_kernel(kernels[k])) {
+                        all_ok &= bench_path(kernels[k], run_bgrx_kernel, &run, reference, reference);
+                    }
+                }
+                convert_bgrx_use_kernel(best_kernel);
+            }
+
+            // Threaded output must be identical to the same route on one thread
+            all_ok &= bench_path("route", run_route, &run, reference,
+                                 format->spa_format == bgrx_format->spa_format ? reference : NULL);
+            memcpy(single, dst, out_size);
+
+            run.ctx = &threaded_ctx;
+            all_ok &= bench_path("threaded", run_route, &run, reference, single);
+
+            all_ok &= bench_path("libyuv", run_libyuv, &run, reference, NULL);
+        }
+    }
+
+    printf("maxdiff is the largest byte difference from the scalar BGRx converter,\n"
+           "libyuv's BT.601 coefficients differ from it by design.\n");
+    printf(all_ok ? "All outputs verified\n" : "Verification FAILED\n");
+
+    free(rgb);
+    free(bgrx);
+    free(src);
+    free(argb);
+    free(reference);
+    free(single);
+    free(dst);
+    free(arena);
+    thread_pool_destroy(pool);
+    return all_ok ? 0 : 1;
+}
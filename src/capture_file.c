@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include "capture_file.h"
+#include "convert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CAPTURE_FILE_MAGIC "G2V4LCAP"
+#define CAPTURE_FILE_VERSION 1
+#define CAPTURE_RECORD_MAGIC 0x454d5246u  // "FRME" in little endian
+
+// Frame data is aligned for the SIMD converters
+#define CAPTURE_ALIGN 64
+
+// The written file grows by this much at a time, about 8 frames of 4K BGRx
+#define CAPTURE_GROW_BYTES (256 * 1024 * 1024)
+
+struct capture_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct capture_record_header {
+    uint32_t magic;
+    uint32_t spa_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t timestamp_ns;
+};
+
+struct capture_file {
+    int fd;
+    bool writing;
+    uint8_t *map;
+    size_t map_size;  // Mapped and allocated bytes
+    size_t used;      // Bytes of complete records, the read position when reading
+    uint64_t frames;
+};
+
+static size_t align_up(size_t size) {
+    return (size + CAPTURE_ALIGN - 1) & ~(size_t)(CAPTURE_ALIGN - 1);
+}
+
+// Offset of a record's frame data from the start of the record
+static size_t record_data_offset(void) {
+    return align_up(sizeof(struct capture_record_header));
+}
+
+static size_t first_record_offset(void) {
+    return align_up(sizeof(struct capture_file_header));
+}
+
+// Allocate file blocks before mapping them, writes past the disk space would raise SIGBUS
+static bool grow_file(capture_file *file, size_t size) {
+    int err = posix_fallocate(file->fd, 0, (off_t)size);
+    if (err != 0) {
+        fprintf(stderr, "Failed to grow capture file to %zu bytes: %s\n", size, strerror(err));
+        return false;
+    }
+
+    void *map = file->map ? mremap(file->map, file->map_size, size, MREMAP_MAYMOVE) :
+                            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map capture file");
+        return false;
+    }
+
+    file->map = map;
+    file->map_size = size;
+    return true;
+}
+
+capture_file* capture_file_create(const char *path) {
+    capture_file *file = calloc(1, sizeof(capture_file));
+    if (!file) {
+        fprintf(stderr, "Failed to allocate capture file\n");
+        return NULL;
+    }
+
+    file->writing = true;
+    file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file->fd < 0) {
+        fprintf(stderr, "Failed to create capture file %s: %s\n", path, strerror(errno));
+        free(file);
+        return NULL;
+    }
+
+    if (!grow_file(file, CAPTURE_GROW_BYTES)) {
+        capture_file_destroy(file);
+        return NULL;
+    }
+
+    struct capture_file_header header = { .version = CAPTURE_FILE_VERSION };
+    memcpy(header.magic, CAPTURE_FILE_MAGIC, sizeof(header.magic));
+    memcpy(file->map, &header, sizeof(header));
+    file->used = first_record_offset();
+    return file;
+}
+
+capture_file* capture_file_open(const char *path) {
+    capture_file *file = calloc(1, sizeof(capture_file));
+    if (!file) {
+        fprintf(stderr, "Failed to allocate capture file\n");
+        return NULL;
+    }
+
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) {
+        fprintf(stderr, "Failed to open capture file %s: %s\n", path, strerror(errno));
+        free(file);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(file->fd, &st) < 0 || (size_t)st.st_size < first_record_offset()) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        capture_file_destroy(file);
+        return NULL;
+    }
+
+    file->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if (file->map == MAP_FAILED) {
+        perror("Failed to map capture file");
+        file->map = NULL;
+        capture_file_destroy(file);
+        return NULL;
+    }
+    file->map_size = (size_t)st.st_size;
+    madvise(file->map, file->map_size, MADV_SEQUENTIAL);
+
+    struct capture_file_header header;
+    memcpy(&header, file->map, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CAPTURE_FILE_VERSION) {
+        fprintf(stderr, "%s is not a version %d capture file\n", path, CAPTURE_FILE_VERSION);
+        capture_file_destroy(file);
+        return NULL;
+    }
+
+    file->used = first_record_offset();
+    return file;
+}
+
+void capture_file_destroy(capture_file *file) {
+    if (!file) {
+        return;
+    }
+
+    if (file->map) {
+        munmap(file->map, file->map_size);
+    }
+    if (file->fd >= 0) {
+        // Drop the preallocated space past the last frame
+        if (file->writing && file->used > 0 && ftruncate(file->fd, (off_t)file->used) < 0) {
+            perror("Failed to truncate capture file");
+        }
+        close(file->fd);
+    }
+    free(file);
+}
+
+bool capture_file_append(capture_file *file, const capture_frame *frame) {
+    if (!file || !file->writing || !frame || !frame->data) {
+        return false;
+    }
+
+    size_t record_size = record_data_offset() + align_up(frame->size);
+    if (file->used + record_size > file->map_size) {
+        size_t grow = record_size > CAPTURE_GROW_BYTES ? align_up(record_size) : CAPTURE_GROW_BYTES;
+        if (!grow_file(file, file->map_size + grow)) {
+            return false;
+        }
+    }
+
+    uint8_t *record = file->map + file->used;
+    struct capture_record_header header = {
+        .magic = CAPTURE_RECORD_MAGIC,
+        .spa_format = frame->spa_format,
+        .width = frame->width,
+        .height = frame->height,
+        .stride = frame->stride,
+        .size = frame->size,
+        .timestamp_ns = frame->timestamp_ns,
+    };
+    memcpy(record + record_data_offset(), frame->data, frame->size);
+    // The header goes last, a reader of an interrupted file stops before a torn record
+    memcpy(record, &header, sizeof(header));
+
+    file->used += record_size;
+    file->frames++;
+    return true;
+}
+
+bool capture_file_next(capture_file *file, capture_frame *frame) {
+    if (!file || file->writing || !frame) {
+        return false;
+    }
+
+    if (file->used + record_data_offset() > file->map_size) {
+        return false;
+    }
+
+    struct capture_record_header header;
+    memcpy(&header, file->map + file->used, sizeof(header));
+    if (header.magic != CAPTURE_RECORD_MAGIC) {
+        return false;
+    }
+
+    // Truncated or corrupted records end the file
+    size_t data_offset = file->used + record_data_offset();
+    if (header.size > file->map_size - data_offset ||
+        header.size < (uint64_t)header.stride * header.height) {
+        fprintf(stderr, "Capture file ends in an incomplete frame\n");
+        return false;
+    }
+
+    // Rows are read at the full width, so they have to fit the stride
+    int bytes_per_pixel = (header.spa_format == 15 || header.spa_format == 16) ? 3 : 4; // RGB/BGR are 24-bit
+    if (!convert_is_supported(header.spa_format) || header.width == 0 || header.height == 0 ||
+        header.stride < (uint64_t)header.width * bytes_per_pixel) {
+        fprintf(stderr, "Capture file has an invalid frame: %ux%u, stride %u, format %u\n",
+                header.width, header.height, header.stride, header.spa_format);
+        return false;
+    }
+
+    frame->spa_format = header.spa_format;
+    frame->width = header.width;
+    frame->height = header.height;
+    frame->stride = header.stride;
+    frame->timestamp_ns = header.timestamp_ns;
+    frame->data = file->map + data_offset;
+    frame->size = (size_t)header.size;
+
+    file->used = data_offset + align_up((size_t)header.size);
+    file->frames++;
+    return true;
+}
+
+uint64_t capture_file_get_frame_count(capture_file *file) {
+    return file ? file->frames : 0;
+}
@@ -0,0 +1,51 @@
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// One raw frame as the conversion stage sees it
+typedef struct {
+    uint32_t spa_format;    // SPA video format of data (RGBx ... BGR)
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // Bytes per row of data
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC capture time, replay keeps the spacing
+    const uint8_t *data;
+    size_t size;            // Bytes of data, at least stride * height
+} capture_frame;
+
+// Memory-mapped recording of raw frames (--record / --replay)
+// The file is a header followed by one record per frame: the format, size and
+// stride of the frame, then its pixels aligned to 64 bytes. Writing grows the
+// file in large preallocated steps, so appending a frame is a memcpy.
+typedef struct capture_file capture_file;
+
+// Create (or truncate) a capture file for writing
+// Returns NULL on failure
+capture_file* capture_file_create(const char *path);
+
+// Open a capture file for reading, the whole file is mapped read-only
+// Returns NULL on failure or if it isn't a capture file
+capture_file* capture_file_open(const char *path);
+
+// Unmap and close the file, a written file is truncated to its frames
+void capture_file_destroy(capture_file *file);
+
+// Append a frame to a file opened with capture_file_create
+// Returns: false on failure (e.g., out of disk space), the file keeps the
+// frames appended before
+bool capture_file_append(capture_file *file, const capture_frame *frame);
+
+// Read the next frame of a file opened with capture_file_open
+// frame->data points into the mapping and stays valid until the file is destroyed.
+// A file whose writer didn't exit cleanly ends at its first incomplete record.
+// Returns: false at the end of the file, or at a record with an unconvertible
+// format or rows that don't fit its stride
+bool capture_file_next(capture_file *file, capture_frame *frame);
+
+// Number of frames appended or read so far
+uint64_t capture_file_get_frame_count(capture_file *file);
+
+#endif // CAPTURE_FILE_H
@@ -0,0 +1,257 @@
+#include "convert.h"
+#include "convert_bgrx.h"
+#include <stdio.h>
+#include <libyuv.h>
+
+// Signature shared by all direct converters, the destination is packed YUYV with stride width * 2
+typedef void (*convert_fn)(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride);
+
+// libyuv converter of a packed RGB layout to libyuv's ARGB
+typedef int (*to_argb_fn)(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height);
+
+// libyuv names formats by a little-endian 32-bit word, like DRM does,
+// so its ARGB is [B][G][R][A] in memory: SPA's BGRA.
+static void convert_argb_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
+    int result = ARGBToYUY2(src, src_stride,           // source: use actual stride
+                           dst, width * 2,              // destination
+                           width, height);
+
+    if (result != 0) {
+        printf("ERROR: ARGBToYUY2 conversion failed with result %d\n", result);
+    }
+}
+
+// How a SPA format gets to the output format in a single pass over the frame
+// Formats that are libyuv's ARGB already have no to_argb step.
+struct convert_route {
+    uint32_t spa_format;
+    convert_fn direct;   // Converts straight to YUYV
+    to_argb_fn to_argb;  // Otherwise row strips go through ARGB while they are in cache
+};
+
+static const struct convert_route convert_routes[] = {
+    { 7,  NULL, ABGRToARGB },                 // SPA_VIDEO_FORMAT_RGBx - [R][G][B][X], libyuv's ABGR
+    { 8,  convert_bgrx_to_yuyv, NULL },       // SPA_VIDEO_FORMAT_BGRx - [B][G][R][X], SIMD kernels
+    { 9,  NULL, BGRAToARGB },                 // SPA_VIDEO_FORMAT_xRGB - [X][R][G][B], libyuv's BGRA
+    { 10, NULL, RGBAToARGB },                 // SPA_VIDEO_FORMAT_xBGR - [X][B][G][R], libyuv's RGBA
+    { 11, NULL, ABGRToARGB },                 // SPA_VIDEO_FORMAT_RGBA - [R][G][B][A]
+    { 12, convert_argb_to_yuyv, NULL },       // SPA_VIDEO_FORMAT_BGRA - [B][G][R][A], libyuv's ARGB
+    { 13, NULL, BGRAToARGB },                 // SPA_VIDEO_FORMAT_ARGB - [A][R][G][B]
+    { 14, NULL, RGBAToARGB },                 // SPA_VIDEO_FORMAT_ABGR - [A][B][G][R]
+    { 15, NULL, RAWToARGB },                  // SPA_VIDEO_FORMAT_RGB - [R][G][B], libyuv's RAW
+    { 16, NULL, RGB24ToARGB },                // SPA_VIDEO_FORMAT_BGR - [B][G][R], libyuv's RGB24
+};
+
+static const struct convert_route* find_convert_route(uint32_t spa_format) {
+    for (size_t i = 0; i < sizeof(convert_routes) / sizeof(convert_routes[0]); i++) {
+        if (convert_routes[i].spa_format == spa_format) {
+            return &convert_routes[i];
+        }
+    }
+    return NULL;
+}
+
+// ARGB rows converted at a time, small enough to stay in L2 next to their YUV output
+// Always even, so a strip never splits the row pair sharing a 4:2:0 chroma row.
+#define CONVERT_STRIP_BYTES (64 * 1024)
+
+static int strip_rows(int width) {
+    int rows = width > 0 ? CONVERT_STRIP_BYTES / (width * 4) : 2;
+    rows &= ~1;
+    return rows > 0 ? rows : 2;
+}
+
+// Arena bytes one band needs for its strip
+static size_t strip_size(int width) {
+    return (size_t)strip_rows(width) * width * 4;
+}
+
+// Frames below this many rows are converted on the worker alone
+#define MIN_ROWS_PER_BAND 64
+
+struct convert_job {
+    const struct convert_route *route;
+    output_format format;
+    const uint8_t *src;
+    uint8_t *dst;
+    uint8_t *arena;  // One strip per band
+    int width;
+    int height;
+    uint32_t src_stride;
+    uint32_t dst_stride;  // Of the YUYV rows or of the Y plane
+    bool failed;          // Set by any band that couldn't write its rows (atomic)
+};
+
+// Write rows y to y + rows of ARGB to the output layout, y is even unless it's the last row
+static bool emit_argb_rows(const struct convert_job *job, const uint8_t *argb, int argb_stride, int y, int rows) {
+    int width = job->width;
+    int chroma_width = (width + 1) / 2;
+    uint8_t *luma = job->dst + (size_t)y * job->dst_stride;
+    uint8_t *chroma = job->dst + (size_t)job->dst_stride * job->height;
+    int result;
+
+    switch (job->format) {
+        case OUTPUT_FORMAT_NV12:
+            result = ARGBToNV12(argb, argb_stride, luma, job->dst_stride,
+                                chroma + (size_t)(y / 2) * chroma_width * 2, chroma_width * 2,
+                                width, rows);
+            break;
+        case OUTPUT_FORMAT_I420: {
+            uint8_t *u = chroma;
+            uint8_t *v = u + (size_t)chroma_width * ((job->height + 1) / 2);
+            result = ARGBToI420(argb, argb_stride, luma, job->dst_stride,
+                                u + (size_t)(y / 2) * chroma_width, chroma_width,
+                                v + (size_t)(y / 2) * chroma_width, chroma_width,
+                                width, rows);
+            break;
+        }
+        default:
+            result = ARGBToYUY2(argb, argb_stride, luma, job->dst_stride, width, rows);
+            break;
+    }
+
+    if (result != 0) {
+        printf("ERROR: Conversion from ARGB failed with result %d\n", result);
+        return false;
+    }
+    return true;
+}
+
+// Convert rows strip by strip: to ARGB, then to the output before the strip leaves the cache
+static bool convert_strips(const struct convert_job *job, int y0, int y1, uint8_t *strip) {
+    int rows_per_strip = strip_rows(job->width);
+
+    for (int y = y0; y < y1; y += rows_per_strip) {
+        int rows = y1 - y < rows_per_strip ? y1 - y : rows_per_strip;
+
+        int result = job->route->to_argb(job->src + (size_t)y * job->src_stride, job->src_stride,
+                                         strip, job->width * 4, job->width, rows);
+        if (result != 0) {
+            printf("ERROR: Conversion to ARGB failed with result %d\n", result);
+            return false;
+        }
+
+        if (!emit_argb_rows(job, strip, job->width * 4, y, rows)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Output rows only depend on their source rows, so bands need no synchronization
+// Band edges are even, 4:2:0 chroma rows are computed from a pair of rows.
+static void convert_band(void *user_data, uint32_t band, uint32_t n_bands) {
+    struct convert_job *job = user_data;
+    int y0 = (int)((uint64_t)job->height * band / n_bands) & ~1;
+    int y1 = band + 1 == n_bands ? job->height : (int)((uint64_t)job->height * (band + 1) / n_bands) & ~1;
+    const uint8_t *src = job->src + (size_t)y0 * job->src_stride;
+    uint8_t *dst = job->dst + (size_t)y0 * job->dst_stride;
+    bool ok = true;
+
+    if (job->route->direct && job->format == OUTPUT_FORMAT_YUYV) {
+        if (job->dst_stride == (uint32_t)job->width * 2) {
+            job->route->direct(src, dst, job->width, y1 - y0, job->src_stride);
+        } else {
+            // Part of a wider frame, the direct converters assume packed output rows
+            for (int y = y0; y < y1; y++) {
+                job->route->direct(src, dst, job->width, 1, job->src_stride);
+                src += job->src_stride;
+                dst += job->dst_stride;
+            }
+        }
+    } else if (!job->route->to_argb) {
+        ok = emit_argb_rows(job, src, job->src_stride, y0, y1 - y0);
+    } else {
+        // convert_area checked that every band has its strip
+        ok = convert_strips(job, y0, y1, job->arena + band * strip_size(job->width));
+    }
+
+    if (!ok) {
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+    }
+}
+
+bool convert_is_supported(uint32_t spa_format) {
+    return find_convert_route(spa_format) != NULL;
+}
+
+size_t convert_arena_size(int width, uint32_t n_bands) {
+    return n_bands * strip_size(width);
+}
+
+bool convert_area(const convert_context *ctx, output_format format, uint32_t spa_format,
+                  const uint8_t *src, uint32_t src_stride,
+                  uint8_t *dst, uint32_t dst_stride, int width, int height) {
+    const struct convert_route *route = find_convert_route(spa_format);
+    if (!route) {
+        return false;
+    }
+
+    uint32_t n_bands = thread_pool_get_size(ctx->pool);
+    if ((uint32_t)height < n_bands * MIN_ROWS_PER_BAND) {
+        n_bands = (uint32_t)height / MIN_ROWS_PER_BAND;
+    }
+    if (n_bands == 0) {
+        n_bands = 1;
+    }
+
+    // Sized for the negotiated format, a wider frame must not use it
+    bool needs_arena = route->to_argb && !(route->direct && format == OUTPUT_FORMAT_YUYV);
+    if (needs_arena && (!ctx->arena || ctx->arena_size < convert_arena_size(width, n_bands))) {
+        printf("ERROR: No frame arena for conversion\n");
+        return false;
+    }
+
+    struct convert_job job = { route, format, src, dst, ctx->arena, width, height, src_stride, dst_stride, false };
+    thread_pool_run(ctx->pool, convert_band, &job, n_bands);
+
+    // thread_pool_run returns after every band, so their stores are visible
+    return !__atomic_load_n(&job.failed, __ATOMIC_RELAXED);
+}
+
+bool convert_frame(const convert_context *ctx, output_format format, uint32_t spa_format,
+                   const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
+    uint32_t dst_stride = format == OUTPUT_FORMAT_YUYV ? (uint32_t)width * 2 : (uint32_t)width;
+    return convert_area(ctx, format, spa_format, src, src_stride, dst, dst_stride, width, height);
+}
+
+bool convert_to_argb(uint32_t spa_format, const uint8_t *src, uint32_t src_stride,
+                     uint8_t *dst, int width, int height) {
+    const struct convert_route *route = find_convert_route(spa_format);
+    if (!route) {
+        return false;
+    }
+
+    // BGRx and BGRA are laid out as ARGB already
+    int result = route->to_argb ? route->to_argb(src, src_stride, dst, width * 4, width, height) :
+                                  ARGBCopy(src, src_stride, dst, width * 4, width, height);
+    if (result != 0) {
+        printf("ERROR: Conversion to ARGB failed with result %d\n", result);
+        return false;
+    }
+    return true;
+}
+
+const char* output_format_name(output_format format) {
+    switch (format) {
+        case OUTPUT_FORMAT_NV12: return "NV12";
+        case OUTPUT_FORMAT_I420: return "I420";
+        case OUTPUT_FORMAT_MJPEG: return "MJPEG";
+        default: return "YUYV";
+    }
+}
+
+// Bytes of one uncompressed output frame, MJPEG frames vary in size
+size_t output_frame_size(output_format format, uint32_t width, uint32_t height) {
+    size_t chroma_size = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    switch (format) {
+        case OUTPUT_FORMAT_NV12:
+        case OUTPUT_FORMAT_I420:
+            return (size_t)width * height + 2 * chroma_size;
+        case OUTPUT_FORMAT_MJPEG:
+            return 0;
+        default:
+            return (size_t)width * height * 2;
+    }
+}
+
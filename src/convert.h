@@ -0,0 +1,67 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "thread_pool.h"
+
+// Pixel format written to the loopback device
+typedef enum {
+    OUTPUT_FORMAT_YUYV,   // Packed 4:2:2, what most consumers expect
+    OUTPUT_FORMAT_NV12,   // Planar 4:2:0, Y plane then interleaved UV
+    OUTPUT_FORMAT_I420,   // Planar 4:2:0, Y, U and V planes (V4L2 YUV420)
+    OUTPUT_FORMAT_MJPEG,  // JPEG frames, needs libjpeg-turbo
+} output_format;
+
+// Threads and scratch memory a conversion may use
+typedef struct {
+    thread_pool *pool;  // Splits frames into bands, NULL converts on the calling thread
+    uint8_t *arena;     // ARGB row strips, see convert_arena_size
+    size_t arena_size;
+} convert_context;
+
+const char* output_format_name(output_format format);
+
+// Bytes of one uncompressed output frame, 0 for MJPEG whose frames vary in size
+size_t output_frame_size(output_format format, uint32_t width, uint32_t height);
+
+// Check whether a SPA video format (RGBx ... BGR) can be converted
+bool convert_is_supported(uint32_t spa_format);
+
+// Arena bytes needed to convert frames of the given width in up to n_bands bands
+// Formats without a direct route go through ARGB strips, one per band. A smaller
+// arena makes such conversions fail, frames of other formats don't need one.
+size_t convert_arena_size(int width, uint32_t n_bands);
+
+// Convert a width x height area to YUYV, NV12 or I420, split into horizontal
+// bands over the context's pool
+// Each SPA format has one route: a direct YUYV converter for BGRx and BGRA,
+// otherwise libyuv through ARGB row strips that stay in cache.
+// Planar formats are laid out for a whole width x height frame at dst.
+// Parameters:
+//   ctx: Threads and arena to use
+//   format: Output layout
+//   spa_format: SPA video format of src
+//   src: Top left pixel of the source area
+//   src_stride: Stride of the source in bytes
+//   dst: Top left pixel of the destination area
+//   dst_stride: Stride of the YUYV rows or of the Y plane in bytes
+//   width: Area width in pixels
+//   height: Area height in pixels
+// Returns: false if the format has no route, the arena is too small or a band
+// failed to convert, dst is then partly written
+bool convert_area(const convert_context *ctx, output_format format, uint32_t spa_format,
+                  const uint8_t *src, uint32_t src_stride,
+                  uint8_t *dst, uint32_t dst_stride, int width, int height);
+
+// Convert a whole frame with packed output rows, see convert_area
+bool convert_frame(const convert_context *ctx, output_format format, uint32_t spa_format,
+                   const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride);
+
+// Expand a frame to libyuv's ARGB ([B][G][R][A], SPA BGRA) with stride width * 4
+// Returns: false if the format has no route or the conversion failed
+bool convert_to_argb(uint32_t spa_format, const uint8_t *src, uint32_t src_stride,
+                     uint8_t *dst, int width, int height);
+
+#endif // CONVERT_H
@@ -0,0 +1,319 @@
+#include "convert_bgrx.h"
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL 1
+#endif
+
+// Converts the first pixels of a row, returns how many were done.
+// The scalar loop finishes the row, so kernels only handle whole blocks.
+typedef int (*bgrx_row_kernel)(const uint8_t *src, uint8_t *dst, int width);
+
+// Reference implementation, also used for the tail of each row
+static void bgrx_row_scalar(const uint8_t *src_row, uint8_t *dst_row, int x, int width) {
+    dst_row += x * 2;
+
+    for (; x < width; x += 2) {
+        // First pixel
+        const uint8_t *px0 = src_row + (x * 4);
+        uint8_t b0 = px0[0];
+        uint8_t g0 = px0[1];
+        uint8_t r0 = px0[2];
+
+        // Second pixel (or repeat first if at edge)
+        uint8_t b1, g1, r1;
+        if (x + 1 < width) {
+            const uint8_t *px1 = src_row + ((x + 1) * 4);
+            b1 = px1[0];
+            g1 = px1[1];
+            r1 = px1[2];
+        } else {
+            b1 = b0;
+            g1 = g0;
+            r1 = r0;
+        }
+
+        // ITU-R BT.601 coefficients scaled by 256, the results can't leave
+        // 0..255 (Y) or 16..239 (U/V) so no clamping is needed
+        int y0 = (77 * r0 + 150 * g0 + 29 * b0) >> 8;
+        int y1 = (77 * r1 + 150 * g1 + 29 * b1) >> 8;
+
+        // Average the two pixels for chroma
+        int ravg = (r0 + r1) / 2;
+        int gavg = (g0 + g1) / 2;
+        int bavg = (b0 + b1) / 2;
+
+        int u = ((-38 * ravg - 74 * gavg + 112 * bavg) >> 8) + 128;
+        int v = ((112 * ravg - 94 * gavg - 18 * bavg) >> 8) + 128;
+
+        // Write YUYV
+        *dst_row++ = (uint8_t)y0;
+        *dst_row++ = (uint8_t)u;
+        *dst_row++ = (uint8_t)y1;
+        *dst_row++ = (uint8_t)v;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// The 16-bit lane math below is exact: Y sums stay <= 65280 (unsigned),
+// U/V sums stay within +-28560 (signed), right shifts match the scalar ones.
+
+// 4 BGRx pixels -> B, G, R in 32-bit lanes
+static inline void sse2_split_bgrx(__m128i px, __m128i *b, __m128i *g, __m128i *r) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    *b = _mm_and_si128(px, mask);
+    *g = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+    *r = _mm_and_si128(_mm_srli_epi32(px, 16), mask);
+}
+
+__attribute__((target("sse2")))
+static int bgrx_row_sse2(const uint8_t *src, uint8_t *dst, int width) {
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i k_yr = _mm_set1_epi16(77), k_yg = _mm_set1_epi16(150), k_yb = _mm_set1_epi16(29);
+    const __m128i k_ur = _mm_set1_epi16(-38), k_ug = _mm_set1_epi16(-74), k_ub = _mm_set1_epi16(112);
+    const __m128i k_vr = _mm_set1_epi16(112), k_vg = _mm_set1_epi16(-94), k_vb = _mm_set1_epi16(-18);
+    const __m128i bias = _mm_set1_epi16(128);
+    int x = 0;
+
+    // 16 pixels (8 YUYV macropixels) per iteration
+    for (; x + 16 <= width; x += 16) {
+        __m128i b[2], g[2], r[2], bsum[2], gsum[2], rsum[2], y[2];
+
+        for (int half = 0; half < 2; half++) {
+            __m128i b0, g0, r0, b1, g1, r1;
+            sse2_split_bgrx(_mm_loadu_si128((const __m128i *)(src + (x + half * 8) * 4)), &b0, &g0, &r0);
+            sse2_split_bgrx(_mm_loadu_si128((const __m128i *)(src + (x + half * 8 + 4) * 4)), &b1, &g1, &r1);
+
+            // 8 pixels in 16-bit lanes
+            b[half] = _mm_packs_epi32(b0, b1);
+            g[half] = _mm_packs_epi32(g0, g1);
+            r[half] = _mm_packs_epi32(r0, r1);
+
+            y[half] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r[half], k_yr),
+                                                                 _mm_mullo_epi16(g[half], k_yg)),
+                                                   _mm_mullo_epi16(b[half], k_yb)), 8);
+
+            // Sums of each pixel pair in 32-bit lanes, halved
+            bsum[half] = _mm_srli_epi32(_mm_madd_epi16(b[half], one), 1);
+            gsum[half] = _mm_srli_epi32(_mm_madd_epi16(g[half], one), 1);
+            rsum[half] = _mm_srli_epi32(_mm_madd_epi16(r[half], one), 1);
+        }
+
+        // 8 pair averages in 16-bit lanes
+        __m128i bavg = _mm_packs_epi32(bsum[0], bsum[1]);
+        __m128i gavg = _mm_packs_epi32(gsum[0], gsum[1]);
+        __m128i ravg = _mm_packs_epi32(rsum[0], rsum[1]);
+
+        __m128i u = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(ravg, k_ur),
+                                                                             _mm_mullo_epi16(gavg, k_ug)),
+                                                               _mm_mullo_epi16(bavg, k_ub)), 8), bias);
+        __m128i v = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(ravg, k_vr),
+                                                                             _mm_mullo_epi16(gavg, k_vg)),
+                                                               _mm_mullo_epi16(bavg, k_vb)), 8), bias);
+
+        // y0..y15 and u0 v0 u1 v1 ..., interleaved they are Y0 U0 Y1 V0 ...
+        __m128i y8 = _mm_packus_epi16(y[0], y[1]);
+        __m128i uv8 = _mm_packus_epi16(_mm_unpacklo_epi16(u, v), _mm_unpackhi_epi16(u, v));
+
+        _mm_storeu_si128((__m128i *)(dst + x * 2), _mm_unpacklo_epi8(y8, uv8));
+        _mm_storeu_si128((__m128i *)(dst + x * 2 + 16), _mm_unpackhi_epi8(y8, uv8));
+    }
+
+    return x;
+}
+
+// 8 BGRx pixels -> B, G, R in 32-bit lanes
+__attribute__((target("avx2")))
+static inline void avx2_split_bgrx(__m256i px, __m256i *b, __m256i *g, __m256i *r) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    *b = _mm256_and_si256(px, mask);
+    *g = _mm256_and_si256(_mm256_srli_epi32(px, 8), mask);
+    *r = _mm256_and_si256(_mm256_srli_epi32(px, 16), mask);
+}
+
+// Pack two vectors of 32-bit lanes to 16 bits, keeping the element order
+// (the AVX2 pack works within each 128-bit lane)
+__attribute__((target("avx2")))
+static inline __m256i avx2_pack_ordered(__m256i lo, __m256i hi) {
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("avx2")))
+static int bgrx_row_avx2(const uint8_t *src, uint8_t *dst, int width) {
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i k_yr = _mm256_set1_epi16(77), k_yg = _mm256_set1_epi16(150), k_yb = _mm256_set1_epi16(29);
+    const __m256i k_ur = _mm256_set1_epi16(-38), k_ug = _mm256_set1_epi16(-74), k_ub = _mm256_set1_epi16(112);
+    const __m256i k_vr = _mm256_set1_epi16(112), k_vg = _mm256_set1_epi16(-94), k_vb = _mm256_set1_epi16(-18);
+    const __m256i bias = _mm256_set1_epi16(128);
+    int x = 0;
+
+    // 32 pixels (16 YUYV macropixels) per iteration
+    for (; x + 32 <= width; x += 32) {
+        __m256i y[2], bsum[2], gsum[2], rsum[2];
+
+        for (int half = 0; half < 2; half++) {
+            __m256i b0, g0, r0, b1, g1, r1;
+            avx2_split_bgrx(_mm256_loadu_si256((const __m256i *)(src + (x + half * 16) * 4)), &b0, &g0, &r0);
+            avx2_split_bgrx(_mm256_loadu_si256((const __m256i *)(src + (x + half * 16 + 8) * 4)), &b1, &g1, &r1);
+
+            // 16 pixels in 16-bit lanes
+            __m256i b = avx2_pack_ordered(b0, b1);
+            __m256i g = avx2_pack_ordered(g0, g1);
+            __m256i r = avx2_pack_ordered(r0, r1);
+
+            y[half] = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, k_yr),
+                                                                          _mm256_mullo_epi16(g, k_yg)),
+                                                         _mm256_mullo_epi16(b, k_yb)), 8);
+
+            bsum[half] = _mm256_srli_epi32(_mm256_madd_epi16(b, one), 1);
+            gsum[half] = _mm256_srli_epi32(_mm256_madd_epi16(g, one), 1);
+            rsum[half] = _mm256_srli_epi32(_mm256_madd_epi16(r, one), 1);
+        }
+
+        // 16 pair averages in 16-bit lanes
+        __m256i bavg = avx2_pack_ordered(bsum[0], bsum[1]);
+        __m256i gavg = avx2_pack_ordered(gsum[0], gsum[1]);
+        __m256i ravg = avx2_pack_ordered(rsum[0], rsum[1]);
+
+        __m256i u = _mm256_add_epi16(_mm256_srai_epi16(
+                        _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(ravg, k_ur),
+                                                          _mm256_mullo_epi16(gavg, k_ug)),
+                                         _mm256_mullo_epi16(bavg, k_ub)), 8), bias);
+        __m256i v = _mm256_add_epi16(_mm256_srai_epi16(
+                        _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(ravg, k_vr),
+                                                          _mm256_mullo_epi16(gavg, k_vg)),
+                                         _mm256_mullo_epi16(bavg, k_vb)), 8), bias);
+
+        // y0..y31 and u0 v0 u1 v1 ... in element order
+        __m256i y8 = _mm256_permute4x64_epi64(_mm256_packus_epi16(y[0], y[1]), _MM_SHUFFLE(3, 1, 2, 0));
+        __m256i uv16_lo = _mm256_unpacklo_epi16(u, v);  // Pairs 0-3 and 8-11
+        __m256i uv16_hi = _mm256_unpackhi_epi16(u, v);  // Pairs 4-7 and 12-15
+        __m256i uv8 = _mm256_packus_epi16(_mm256_permute2x128_si256(uv16_lo, uv16_hi, 0x20),
+                                          _mm256_permute2x128_si256(uv16_lo, uv16_hi, 0x31));
+        uv8 = _mm256_permute4x64_epi64(uv8, _MM_SHUFFLE(3, 1, 2, 0));
+
+        // Interleave per 128-bit lane, then put the lanes back in order
+        __m256i lo = _mm256_unpacklo_epi8(y8, uv8);
+        __m256i hi = _mm256_unpackhi_epi8(y8, uv8);
+        _mm256_storeu_si256((__m256i *)(dst + x * 2), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + x * 2 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    return x;
+}
+#endif // HAVE_X86_KERNELS
+
+#ifdef HAVE_NEON_KERNEL
+static int bgrx_row_neon(const uint8_t *src, uint8_t *dst, int width) {
+    int x = 0;
+
+    // 16 pixels (8 YUYV macropixels) per iteration
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t px = vld4q_u8(src + x * 4);  // val[0] = B, val[1] = G, val[2] = R
+        uint8x16_t b = px.val[0], g = px.val[1], r = px.val[2];
+
+        uint16x8_t y_lo = vmull_u8(vget_low_u8(r), vdup_n_u8(77));
+        y_lo = vmlal_u8(y_lo, vget_low_u8(g), vdup_n_u8(150));
+        y_lo = vmlal_u8(y_lo, vget_low_u8(b), vdup_n_u8(29));
+        uint16x8_t y_hi = vmull_u8(vget_high_u8(r), vdup_n_u8(77));
+        y_hi = vmlal_u8(y_hi, vget_high_u8(g), vdup_n_u8(150));
+        y_hi = vmlal_u8(y_hi, vget_high_u8(b), vdup_n_u8(29));
+        uint8x16_t y = vcombine_u8(vshrn_n_u16(y_lo, 8), vshrn_n_u16(y_hi, 8));
+
+        // Pair averages, 8 lanes
+        int16x8_t bavg = vreinterpretq_s16_u16(vshrq_n_u16(vpaddlq_u8(b), 1));
+        int16x8_t gavg = vreinterpretq_s16_u16(vshrq_n_u16(vpaddlq_u8(g), 1));
+        int16x8_t ravg = vreinterpretq_s16_u16(vshrq_n_u16(vpaddlq_u8(r), 1));
+
+        int16x8_t u = vmulq_n_s16(ravg, -38);
+        u = vmlaq_n_s16(u, gavg, -74);
+        u = vmlaq_n_s16(u, bavg, 112);
+        u = vaddq_s16(vshrq_n_s16(u, 8), vdupq_n_s16(128));
+        int16x8_t v = vmulq_n_s16(ravg, 112);
+        v = vmlaq_n_s16(v, gavg, -94);
+        v = vmlaq_n_s16(v, bavg, -18);
+        v = vaddq_s16(vshrq_n_s16(v, 8), vdupq_n_s16(128));
+
+        // Even/odd luma next to the shared chroma: Y0 U Y1 V
+        uint8x16x2_t y_split = vuzpq_u8(y, y);
+        uint8x8x4_t out;
+        out.val[0] = vget_low_u8(y_split.val[0]);
+        out.val[1] = vmovn_u16(vreinterpretq_u16_s16(u));
+        out.val[2] = vget_low_u8(y_split.val[1]);
+        out.val[3] = vmovn_u16(vreinterpretq_u16_s16(v));
+        vst4_u8(dst + x * 2, out);
+    }
+
+    return x;
+}
+#endif // HAVE_NEON_KERNEL
+
+static bgrx_row_kernel row_kernel = NULL;
+static const char *row_kernel_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        row_kernel = bgrx_row_avx2;
+        row_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        row_kernel = bgrx_row_sse2;
+        row_kernel_name = "sse2";
+    }
+#elif defined(HAVE_NEON_KERNEL)
+    row_kernel = bgrx_row_neon;
+    row_kernel_name = "neon";
+#endif
+}
+
+void convert_bgrx_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
+    pthread_once(&kernel_once, select_kernel);
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t *src_row = src + ((size_t)y * src_stride);
+        uint8_t *dst_row = dst + ((size_t)y * width * 2);  // YUYV has 2 bytes per pixel
+
+        int done = row_kernel ? row_kernel(src_row, dst_row, width) : 0;
+        bgrx_row_scalar(src_row, dst_row, done, width);
+    }
+}
+
+const char* convert_bgrx_kernel_name(void) {
+    pthread_once(&kernel_once, select_kernel);
+    return row_kernel_name;
+}
+
+bool convert_bgrx_use_kernel(const char *name) {
+    pthread_once(&kernel_once, select_kernel);
+
+    if (strcmp(name, "scalar") == 0) {
+        row_kernel = NULL;
+        row_kernel_name = "scalar";
+#ifdef HAVE_X86_KERNELS
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        row_kernel = bgrx_row_avx2;
+        row_kernel_name = "avx2";
+    } else if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        row_kernel = bgrx_row_sse2;
+        row_kernel_name = "sse2";
+#endif
+#ifdef HAVE_NEON_KERNEL
+    } else if (strcmp(name, "neon") == 0) {
+        row_kernel = bgrx_row_neon;
+        row_kernel_name = "neon";
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef CONVERT_BGRX_H
+#define CONVERT_BGRX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Convert BGRx ([B][G][R][X], GNOME's usual format) to YUYV using the BT.601
+// integer coefficients: Y = (77R + 150G + 29B) >> 8 per pixel, and U/V
+// computed from the average of each pixel pair.
+// The fastest kernel the CPU supports (AVX2, SSE2, NEON or scalar) is picked
+// on first use. All kernels produce identical output.
+// Parameters:
+//   src: BGRx source frame
+//   dst: YUYV destination, width * 2 bytes per row
+//   width: Frame width in pixels
+//   height: Frame height in pixels
+//   src_stride: Stride of the source in bytes
+void convert_bgrx_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride);
+
+// Name of the kernel convert_bgrx_to_yuyv dispatches to (e.g., "avx2")
+const char* convert_bgrx_kernel_name(void);
+
+// Make convert_bgrx_to_yuyv use the named kernel ("scalar", "sse2", "avx2" or
+// "neon") instead of the fastest one, for benchmarks
+// Must not be called while a conversion is running.
+// Returns: false if it isn't built in or the CPU doesn't support it
+bool convert_bgrx_use_kernel(const char *name);
+
+#endif // CONVERT_BGRX_H
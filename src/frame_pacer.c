@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include "frame_pacer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+struct frame_pacer {
+    uint64_t interval_ns;
+    uint64_t tolerance_ns;  // How early a frame may arrive for its slot
+    uint64_t next_ns;       // Start of the next slot, 0 before the first frame
+    uint64_t dropped;
+};
+
+static uint64_t pacer_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Move past the slot starting at slot_ns, restarting the grid at now_ns if it fell behind
+static void consume_slot(frame_pacer *pacer, uint64_t slot_ns, uint64_t now_ns) {
+    pacer->next_ns = slot_ns + pacer->interval_ns;
+    if (pacer->next_ns + pacer->interval_ns <= now_ns) {
+        pacer->next_ns = now_ns + pacer->interval_ns;
+    }
+}
+
+frame_pacer* frame_pacer_create(uint32_t fps) {
+    if (fps == 0 || fps > FRAME_PACER_MAX_FPS) {
+        fprintf(stderr, "Invalid frame rate: %u\n", fps);
+        return NULL;
+    }
+
+    frame_pacer *pacer = calloc(1, sizeof(frame_pacer));
+    if (!pacer) {
+        fprintf(stderr, "Failed to allocate frame pacer\n");
+        return NULL;
+    }
+
+    pacer->interval_ns = 1000000000ULL / fps;
+    pacer->tolerance_ns = pacer->interval_ns / 4;
+    return pacer;
+}
+
+void frame_pacer_destroy(frame_pacer *pacer) {
+    free(pacer);
+}
+
+bool frame_pacer_accept(frame_pacer *pacer, uint64_t now_ns) {
+    if (!pacer) {
+        return true;
+    }
+
+    if (pacer->next_ns != 0 && now_ns + pacer->tolerance_ns < pacer->next_ns) {
+        pacer->dropped++;
+        return false;
+    }
+
+    consume_slot(pacer, pacer->next_ns != 0 ? pacer->next_ns : now_ns, now_ns);
+    return true;
+}
+
+void frame_pacer_wait(frame_pacer *pacer) {
+    if (!pacer) {
+        return;
+    }
+
+    uint64_t now_ns = pacer_now_ns();
+    if (pacer->next_ns == 0) {
+        pacer->next_ns = now_ns;
+    }
+
+    if (pacer->next_ns > now_ns) {
+        struct timespec deadline = {
+            .tv_sec = (time_t)(pacer->next_ns / 1000000000ULL),
+            .tv_nsec = (long)(pacer->next_ns % 1000000000ULL),
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+            // Signals only cut the sleep short, the deadline stays the same
+        }
+        now_ns = pacer_now_ns();
+    }
+
+    consume_slot(pacer, pacer->next_ns, now_ns);
+}
+
+uint64_t frame_pacer_get_dropped(frame_pacer *pacer) {
+    return pacer ? pacer->dropped : 0;
+}
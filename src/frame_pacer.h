@@ -0,0 +1,35 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Largest rate a pacer can be set to
+#define FRAME_PACER_MAX_FPS 240
+
+// Fixed-rate frame schedule on CLOCK_MONOTONIC
+// Frames are due on a grid of 1/fps intervals, so the average rate stays on
+// target even when arrivals jitter. Falling behind by more than an interval
+// restarts the grid instead of bursting to catch up.
+typedef struct frame_pacer frame_pacer;
+
+// Create a pacer for fps frames per second (1..FRAME_PACER_MAX_FPS)
+// Returns NULL on invalid rate or allocation failure
+frame_pacer* frame_pacer_create(uint32_t fps);
+
+void frame_pacer_destroy(frame_pacer *pacer);
+
+// Decide whether a frame arriving at now_ns (CLOCK_MONOTONIC) is kept
+// Frames a little early for their slot are kept, so a source running at an
+// exact multiple of the rate isn't halved by jitter.
+// Returns: true if the frame is due (its slot is consumed), false to drop it
+bool frame_pacer_accept(frame_pacer *pacer, uint64_t now_ns);
+
+// Sleep until the next slot (clock_nanosleep with TIMER_ABSTIME) and consume it
+// For sources that generate their own frames, like the color bars.
+void frame_pacer_wait(frame_pacer *pacer);
+
+// Number of frames frame_pacer_accept dropped so far
+uint64_t frame_pacer_get_dropped(frame_pacer *pacer);
+
+#endif // FRAME_PACER_H
@@ -0,0 +1,108 @@
+#include "frame_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// head and tail only ever grow, the slot is the index modulo the capacity.
+// Producer: writes the slot at tail, then publishes it with a release store.
+// Consumer: reads the slot at head, then claims it with a CAS on head. The
+// producer evicts with the same CAS, so whoever wins the CAS owns the entry
+// and the slot can't be overwritten before a losing reader notices.
+struct frame_queue {
+    uint32_t capacity;
+    uint32_t mask;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    void *slots[];
+};
+
+frame_queue* frame_queue_create(uint32_t capacity) {
+    if (capacity == 0 || capacity > FRAME_QUEUE_MAX_CAPACITY) {
+        fprintf(stderr, "Invalid frame queue capacity: %u\n", capacity);
+        return NULL;
+    }
+
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    frame_queue *q = calloc(1, sizeof(frame_queue) + size * sizeof(void*));
+    if (!q) {
+        fprintf(stderr, "Failed to allocate frame queue\n");
+        return NULL;
+    }
+
+    q->capacity = capacity;
+    q->mask = size - 1;
+    return q;
+}
+
+void frame_queue_destroy(frame_queue *q) {
+    free(q);
+}
+
+bool frame_queue_push(frame_queue *q, void *item) {
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= q->capacity) {
+        return false;
+    }
+
+    q->slots[tail & q->mask] = item;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void* frame_queue_push_drop_oldest(frame_queue *q, void *item) {
+    void *evicted = NULL;
+
+    while (!frame_queue_push(q, item)) {
+        // Full: claim the oldest entry, unless the consumer takes it first
+        uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail - head < q->capacity) {
+            // The consumer made room meanwhile
+            continue;
+        }
+
+        void *oldest = q->slots[head & q->mask];
+        if (__atomic_compare_exchange_n(&q->head, &head, head + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+            evicted = oldest;
+        }
+    }
+
+    return evicted;
+}
+
+void* frame_queue_pop(frame_queue *q) {
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    while (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        void *item = q->slots[head & q->mask];
+        if (__atomic_compare_exchange_n(&q->head, &head, head + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return item;
+        }
+        // Evicted by the producer meanwhile, head was reloaded by the CAS
+    }
+
+    return NULL;
+}
+
+uint32_t frame_queue_count(frame_queue *q) {
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    return (uint32_t)(tail - head);
+}
+
+bool frame_queue_is_full(frame_queue *q) {
+    return frame_queue_count(q) >= q->capacity;
+}
+
+uint64_t frame_queue_get_dropped(frame_queue *q) {
+    return __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,45 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest supported queue, the capacity is rounded up to a power of two
+#define FRAME_QUEUE_MAX_CAPACITY 64
+
+// Bounded lock-free ring of opaque frame pointers
+// Exactly one thread pushes and one thread pops at a time. The producer may
+// also evict the oldest entry (frame_queue_push_drop_oldest), which is safe
+// against a concurrent pop.
+typedef struct frame_queue frame_queue;
+
+// Create a queue holding up to capacity entries (1..FRAME_QUEUE_MAX_CAPACITY)
+// Returns NULL on invalid capacity or allocation failure
+frame_queue* frame_queue_create(uint32_t capacity);
+
+// Destroy the queue, entries still queued are not touched
+void frame_queue_destroy(frame_queue *q);
+
+// Append an entry (producer side)
+// Returns: true if queued, false if the queue is full
+bool frame_queue_push(frame_queue *q, void *item);
+
+// Append an entry, evicting the oldest one if the queue is full (producer side)
+// Returns: The evicted entry, now owned by the caller, or NULL if none
+void* frame_queue_push_drop_oldest(frame_queue *q, void *item);
+
+// Remove the oldest entry (consumer side)
+// Returns: The entry, or NULL if the queue is empty
+void* frame_queue_pop(frame_queue *q);
+
+// Number of entries currently queued (a snapshot when used concurrently)
+uint32_t frame_queue_count(frame_queue *q);
+
+// Check if another push would fail or evict
+bool frame_queue_is_full(frame_queue *q);
+
+// Number of entries evicted by frame_queue_push_drop_oldest so far
+uint64_t frame_queue_get_dropped(frame_queue *q);
+
+#endif // FRAME_QUEUE_H
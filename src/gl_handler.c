@@ -1,11 +1,18 @@
+#define _GNU_SOURCE
 #include "gl_handler.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
-#include <GLES2/gl2.h>
+#include <GLES3/gl3.h>
 #include <GLES2/gl2ext.h>
 #include <drm/drm_fourcc.h>
 
@@ -13,27 +20,206 @@
 typedef EGLImageKHR (*PFNEGLCREATEIMAGEKHRPROC)(EGLDisplay, EGLContext, EGLenum, EGLClientBuffer, const EGLint *);
 typedef EGLBoolean (*PFNEGLDESTROYIMAGEKHRPROC)(EGLDisplay, EGLImageKHR);
 typedef void (*PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)(GLenum, GLeglImageOES);
+typedef EGLBoolean (*PFNEGLQUERYDMABUFMODIFIERSEXTPROC)(EGLDisplay, EGLint, EGLint, EGLuint64KHR *,
+                                                         EGLBoolean *, EGLint *);
+
+// PipeWire recycles a small fixed pool of buffers per stream, so a handful of
+// entries for each of a few streams is enough
+#define GL_DMA_BUF_CACHE_SIZE 32
+
+// Frames of latency the asynchronous readback can trade for throughput
+#define GL_MAX_READBACK_DEPTH 3
+
+// EGL devices looked at for --render-node, GPUs plus software renderers
+#define GL_MAX_EGL_DEVICES 16
+
+// One GL_PIXEL_PACK_BUFFER of the asynchronous readback ring
+struct gl_readback_slot {
+    GLuint pbo;
+    size_t pbo_size;
+    GLsync fence;           // Signalled when the readback into the PBO has finished
+    bool pending;           // Holds a frame that has not been handed out yet
+    gl_readback_format format;
+    uint32_t width;
+    uint32_t height;
+    size_t size;            // Bytes of frame data in the PBO
+};
+
+// One imported pool buffer, reused for as long as PipeWire keeps it around
+struct gl_dma_buf_cache_entry {
+    bool used;
+    bool stale;             // Invalidated, destroyed on the next import (needs the GL thread)
+
+    // Cache key
+    gl_dma_buf dmabuf;
+
+    EGLImageKHR image;
+    GLuint texture;
+    GLuint framebuffer;     // Created on first RGBA readback
+    uint64_t last_used;
+};
 
 // GL context structure
 struct gl_context {
     EGLDisplay egl_display;
     EGLContext egl_context;
-    EGLSurface egl_surface;
+    EGLSurface egl_surface;  // EGL_NO_SURFACE with EGL_KHR_surfaceless_context
     EGLConfig egl_config;
 
+    // GPU of the display, empty if EGL picked it (EGL_DEFAULT_DISPLAY)
+    char render_node[64];
+    char driver[32];
+    bool checked_exporter;  // The first imported buffer was compared against driver
+
     // Extension functions
     PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
     PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
     PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+    PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT;  // NULL without EGL_EXT_image_dma_buf_import_modifiers
 
     // Framebuffer for rendering
     GLuint framebuffer;
     GLuint renderbuffer;
 
+    // RGB -> YUYV conversion pass
+    GLuint yuyv_program;
+    GLint yuyv_position_attrib;
+    GLint yuyv_texture_uniform;
+    GLint yuyv_texel_size_uniform;
+    GLuint yuyv_texture;       // Half-width RGBA target, one texel per YUYV macropixel
+    GLuint yuyv_framebuffer;
+    uint32_t yuyv_width;       // Size of the target texture in texels
+    uint32_t yuyv_height;
+
+    // Crop and scale pass, renders the output region into an RGBA texture of the output size
+    GLuint scale_program;
+    GLint scale_position_attrib;
+    GLint scale_texture_uniform;
+    GLint scale_source_uniform;
+    GLint scale_target_size_uniform;
+    GLint scale_tap_uniform;
+    GLuint scale_texture;
+    GLuint scale_framebuffer;
+    uint32_t scale_width;
+    uint32_t scale_height;
+    bool has_output_region;
+    gl_output_region output_region;
+
+    // Compositing pass, draws sources into rectangles of an RGBA texture of the frame size
+    GLuint composite_program;
+    GLint composite_position_attrib;
+    GLint composite_texture_uniform;
+    GLint composite_tap_uniform;
+    GLuint composite_texture;
+    GLuint composite_framebuffer;
+    uint32_t composite_width;
+    uint32_t composite_height;
+
+    // Imported DMA buffers, keyed by their full plane layout and modifier
+    struct gl_dma_buf_cache_entry dma_buf_cache[GL_DMA_BUF_CACHE_SIZE];
+    uint64_t dma_buf_cache_clock;
+    pthread_mutex_t dma_buf_cache_lock;  // Invalidation may come from another thread
+
+    // Asynchronous readback ring (GLES3 only), depth + 1 slots in use
+    bool is_gles3;
+    uint32_t readback_depth;
+    uint64_t readback_serial;
+    struct gl_readback_slot readback_slots[GL_MAX_READBACK_DEPTH + 1];
+
+    // Duration of the last import, for stats
+    uint64_t last_import_ns;
+    uint64_t last_readback_ns;
+
     // Check for extension support
     bool has_dma_buf_import;
 };
 
+static const char *yuyv_vertex_shader_source =
+    "attribute vec2 a_position;\n"
+    "void main() {\n"
+    "    gl_Position = vec4(a_position, 0.0, 1.0);\n"
+    "}\n";
+
+// Packs two source pixels into one RGBA texel as (Y0, U, Y1, V) so that
+// glReadPixels returns YUYV directly. The integer BT.601 math matches
+// bgrx_row_scalar in convert_bgrx.c exactly (all values stay exact in highp).
+static const char *yuyv_fragment_shader_source =
+    "#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+    "precision highp float;\n"
+    "#else\n"
+    "precision mediump float;\n"
+    "#endif\n"
+    "uniform sampler2D u_texture;\n"
+    "uniform vec2 u_texel_size;\n"
+    "vec3 fetch(float x, float y) {\n"
+    "    return floor(texture2D(u_texture, vec2(x, y) * u_texel_size).rgb * 255.0 + 0.5);\n"
+    "}\n"
+    "void main() {\n"
+    "    float x0 = floor(gl_FragCoord.x) * 2.0 + 0.5;\n"
+    "    vec3 p0 = fetch(x0, gl_FragCoord.y);\n"
+    "    vec3 p1 = fetch(x0 + 1.0, gl_FragCoord.y);\n"
+    "    float y0 = floor(dot(p0, vec3(77.0, 150.0, 29.0)) / 256.0);\n"
+    "    float y1 = floor(dot(p1, vec3(77.0, 150.0, 29.0)) / 256.0);\n"
+    "    vec3 avg = floor((p0 + p1) / 2.0);\n"
+    "    float u = floor(dot(avg, vec3(-38.0, -74.0, 112.0)) / 256.0) + 128.0;\n"
+    "    float v = floor(dot(avg, vec3(112.0, -94.0, -18.0)) / 256.0) + 128.0;\n"
+    "    gl_FragColor = clamp(vec4(y0, u, y1, v), 0.0, 255.0) / 255.0;\n"
+    "}\n";
+
+// Box-filtered resampling of a source rectangle: four bilinear taps a quarter
+// output pixel apart average a 4x4 texel footprint, enough for a 2-4x downscale
+static const char *scale_fragment_shader_source =
+    "#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+    "precision highp float;\n"
+    "#else\n"
+    "precision mediump float;\n"
+    "#endif\n"
+    "uniform sampler2D u_texture;\n"
+    "uniform vec4 u_source;\n"
+    "uniform vec2 u_target_size;\n"
+    "uniform vec2 u_tap;\n"
+    "void main() {\n"
+    "    vec2 uv = u_source.xy + gl_FragCoord.xy / u_target_size * u_source.zw;\n"
+    "    gl_FragColor = 0.25 * (texture2D(u_texture, uv + vec2(-u_tap.x, -u_tap.y)) +\n"
+    "                           texture2D(u_texture, uv + vec2( u_tap.x, -u_tap.y)) +\n"
+    "                           texture2D(u_texture, uv + vec2(-u_tap.x,  u_tap.y)) +\n"
+    "                           texture2D(u_texture, uv + vec2( u_tap.x,  u_tap.y)));\n"
+    "}\n";
+
+// Like the YUYV pass' vertex shader, plus texture coordinates over the viewport,
+// which the compositing pass sets to each source's rectangle
+static const char *composite_vertex_shader_source =
+    "attribute vec2 a_position;\n"
+    "varying vec2 v_uv;\n"
+    "void main() {\n"
+    "    v_uv = a_position * 0.5 + 0.5;\n"
+    "    gl_Position = vec4(a_position, 0.0, 1.0);\n"
+    "}\n";
+
+// The scaling pass' box filter over a whole source
+static const char *composite_fragment_shader_source =
+    "#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+    "precision highp float;\n"
+    "#else\n"
+    "precision mediump float;\n"
+    "#endif\n"
+    "uniform sampler2D u_texture;\n"
+    "uniform vec2 u_tap;\n"
+    "varying vec2 v_uv;\n"
+    "void main() {\n"
+    "    vec4 color = 0.25 * (texture2D(u_texture, v_uv + vec2(-u_tap.x, -u_tap.y)) +\n"
+    "                         texture2D(u_texture, v_uv + vec2( u_tap.x, -u_tap.y)) +\n"
+    "                         texture2D(u_texture, v_uv + vec2(-u_tap.x,  u_tap.y)) +\n"
+    "                         texture2D(u_texture, v_uv + vec2( u_tap.x,  u_tap.y)));\n"
+    "    gl_FragColor = vec4(color.rgb, 1.0);\n"
+    "}\n";
+
+static uint64_t gl_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 static bool check_egl_extension(EGLDisplay display, const char *extension) {
     const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
     if (!extensions) {
@@ -42,6 +228,187 @@ static bool check_egl_extension(EGLDisplay display, const char *extension) {
     return strstr(extensions, extension) != NULL;
 }
 
+// Sysfs directory of the GPU a DRM node belongs to, the render and primary nodes of a GPU share it
+static bool drm_node_device(const char *node, char *device, size_t size) {
+    struct stat st;
+    if (stat(node, &st) < 0 || !S_ISCHR(st.st_mode)) {
+        return false;
+    }
+
+    char link[64];
+    char resolved[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/dev/char/%u:%u/device", major(st.st_rdev), minor(st.st_rdev));
+    if (!realpath(link, resolved)) {
+        return false;
+    }
+    snprintf(device, size, "%s", resolved);
+    return true;
+}
+
+// Kernel driver of a GPU, e.g. "i915" or "amdgpu"
+static bool device_driver_name(const char *device, char *name, size_t size) {
+    char link[PATH_MAX + 8];
+    char target[PATH_MAX];
+    snprintf(link, sizeof(link), "%s/driver", device);
+    ssize_t length = readlink(link, target, sizeof(target) - 1);
+    if (length < 0) {
+        return false;
+    }
+    target[length] = '\0';
+
+    const char *base = strrchr(target, '/');
+    return snprintf(name, size, "%s", base ? base + 1 : target) < (int)size;
+}
+
+static bool is_boot_vga(const char *device) {
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/boot_vga", device);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    bool boot_vga = fgetc(file) == '1';
+    fclose(file);
+    return boot_vga;
+}
+
+// Find a render node in /dev/dri
+// Parameters:
+//   driver: Only consider GPUs of this kernel driver, NULL = any GPU, preferring
+//           the one the firmware booted the display on (the integrated GPU on
+//           hybrid laptops, where the compositor renders)
+// Returns: false if there is none, otherwise the lowest numbered match in node
+static bool find_render_node(const char *driver, char *node, size_t size) {
+    DIR *dir = opendir("/dev/dri");
+    if (!dir) {
+        return false;
+    }
+
+    bool found = false;
+    bool found_boot_vga = false;
+    unsigned int found_number = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        unsigned int number;
+        if (sscanf(entry->d_name, "renderD%u", &number) != 1) {
+            continue;
+        }
+
+        char path[64];
+        char device[PATH_MAX];
+        if (snprintf(path, sizeof(path), "/dev/dri/%s", entry->d_name) >= (int)sizeof(path) ||
+            !drm_node_device(path, device, sizeof(device))) {
+            continue;
+        }
+
+        bool boot_vga = false;
+        if (driver) {
+            char name[32];
+            if (!device_driver_name(device, name, sizeof(name)) || strcmp(name, driver) != 0) {
+                continue;
+            }
+        } else {
+            boot_vga = is_boot_vga(device);
+        }
+
+        if (!found || (boot_vga && !found_boot_vga) || (boot_vga == found_boot_vga && number < found_number)) {
+            found = true;
+            found_boot_vga = boot_vga;
+            found_number = number;
+            snprintf(node, size, "%s", path);
+        }
+    }
+
+    closedir(dir);
+    return found;
+}
+
+// Display on the EGL device of a DRM node (EGL_EXT_platform_device), so that
+// neither the display server nor libglvnd's vendor order decide the GPU
+// Returns EGL_NO_DISPLAY if EGL can't enumerate devices or none matches
+static EGLDisplay get_render_node_display(const char *render_node) {
+    if (!check_egl_extension(EGL_NO_DISPLAY, "EGL_EXT_platform_device") ||
+        !check_egl_extension(EGL_NO_DISPLAY, "EGL_EXT_device_enumeration")) {
+        fprintf(stderr, "Warning: EGL can't select a device (no EGL_EXT_platform_device)\n");
+        return EGL_NO_DISPLAY;
+    }
+
+    PFNEGLQUERYDEVICESEXTPROC query_devices =
+        (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+    PFNEGLQUERYDEVICESTRINGEXTPROC query_device_string =
+        (PFNEGLQUERYDEVICESTRINGEXTPROC)eglGetProcAddress("eglQueryDeviceStringEXT");
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (!query_devices || !query_device_string || !get_platform_display) {
+        return EGL_NO_DISPLAY;
+    }
+
+    char wanted[PATH_MAX];
+    if (!drm_node_device(render_node, wanted, sizeof(wanted))) {
+        fprintf(stderr, "%s is not a DRM device\n", render_node);
+        return EGL_NO_DISPLAY;
+    }
+
+    EGLDeviceEXT devices[GL_MAX_EGL_DEVICES];
+    EGLint n_devices = 0;
+    if (!query_devices(GL_MAX_EGL_DEVICES, devices, &n_devices)) {
+        return EGL_NO_DISPLAY;
+    }
+
+    for (EGLint i = 0; i < n_devices; i++) {
+        // Software renderers have no DRM node and never match
+        const char *extensions = query_device_string(devices[i], EGL_EXTENSIONS);
+        const char *file = NULL;
+        if (extensions && strstr(extensions, "EGL_EXT_device_drm_render_node")) {
+            file = query_device_string(devices[i], EGL_DRM_RENDER_NODE_FILE_EXT);
+        }
+        if (!file && extensions && strstr(extensions, "EGL_EXT_device_drm")) {
+            file = query_device_string(devices[i], EGL_DRM_DEVICE_FILE_EXT);
+        }
+
+        char device[PATH_MAX];
+        if (file && drm_node_device(file, device, sizeof(device)) && strcmp(device, wanted) == 0) {
+            return get_platform_display(EGL_PLATFORM_DEVICE_EXT, devices[i], NULL);
+        }
+    }
+
+    fprintf(stderr, "No EGL device drives %s\n", render_node);
+    return EGL_NO_DISPLAY;
+}
+
+// Warn if the compositor's buffers come from another GPU than the context's,
+// every import then crosses the bus. The exporter is named in the fdinfo of
+// the DMA-BUF; generic exporters like dma-buf heaps match no render node.
+static void check_dma_buf_exporter(gl_context *ctx, int fd) {
+    ctx->checked_exporter = true;
+    if (!ctx->driver[0]) {
+        return;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
+
+    char line[128];
+    char exporter[32] = "";
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "exp_name: %31s", exporter) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+
+    char node[64];
+    if (exporter[0] && strcmp(exporter, ctx->driver) != 0 && find_render_node(exporter, node, sizeof(node))) {
+        fprintf(stderr, "Warning: Screen buffers come from %s (%s), but OpenGL runs on %s (%s), "
+                        "use --render-node %s to avoid copies between GPUs\n",
+                node, exporter, ctx->render_node, ctx->driver, node);
+    }
+}
+
 static bool check_gl_extension(const char *extension) {
     const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
     if (!extensions) {
@@ -50,15 +417,218 @@ static bool check_gl_extension(const char *extension) {
     return strstr(extensions, extension) != NULL;
 }
 
-gl_context* gl_context_create(void) {
+static GLuint compile_shader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    if (!shader) {
+        return 0;
+    }
+
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[512];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to compile shader: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+// Compile and link a full-screen quad pass, returns 0 on failure
+static GLuint create_program(const char *vertex_source, const char *fragment_source, const char *name) {
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_source);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+    if (!vertex_shader || !fragment_shader) {
+        if (vertex_shader) glDeleteShader(vertex_shader);
+        if (fragment_shader) glDeleteShader(fragment_shader);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+
+    // The program keeps the shaders alive while attached
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[512];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to link %s program: %s\n", name, log);
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+static bool create_yuyv_program(gl_context *ctx) {
+    GLuint program = create_program(yuyv_vertex_shader_source, yuyv_fragment_shader_source, "YUYV conversion");
+    if (!program) {
+        return false;
+    }
+
+    ctx->yuyv_program = program;
+    ctx->yuyv_position_attrib = glGetAttribLocation(program, "a_position");
+    ctx->yuyv_texture_uniform = glGetUniformLocation(program, "u_texture");
+    ctx->yuyv_texel_size_uniform = glGetUniformLocation(program, "u_texel_size");
+
+    glGenFramebuffers(1, &ctx->yuyv_framebuffer);
+    return true;
+}
+
+// (Re)allocate the half-width conversion target for a source of the given size
+static bool ensure_yuyv_target(gl_context *ctx, uint32_t width, uint32_t height) {
+    uint32_t target_width = (width + 1) / 2;
+
+    if (ctx->yuyv_texture && ctx->yuyv_width == target_width && ctx->yuyv_height == height) {
+        return true;
+    }
+
+    if (!ctx->yuyv_texture) {
+        glGenTextures(1, &ctx->yuyv_texture);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, ctx->yuyv_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, target_width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->yuyv_framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->yuyv_texture, 0);
+
+    GLenum fb_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (fb_status != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "YUYV framebuffer incomplete: 0x%x\n", fb_status);
+        ctx->yuyv_width = 0;
+        ctx->yuyv_height = 0;
+        return false;
+    }
+
+    ctx->yuyv_width = target_width;
+    ctx->yuyv_height = height;
+    return true;
+}
+
+static bool create_scale_program(gl_context *ctx) {
+    GLuint program = create_program(yuyv_vertex_shader_source, scale_fragment_shader_source, "scaling");
+    if (!program) {
+        return false;
+    }
+
+    ctx->scale_program = program;
+    ctx->scale_position_attrib = glGetAttribLocation(program, "a_position");
+    ctx->scale_texture_uniform = glGetUniformLocation(program, "u_texture");
+    ctx->scale_source_uniform = glGetUniformLocation(program, "u_source");
+    ctx->scale_target_size_uniform = glGetUniformLocation(program, "u_target_size");
+    ctx->scale_tap_uniform = glGetUniformLocation(program, "u_tap");
+
+    glGenFramebuffers(1, &ctx->scale_framebuffer);
+    return true;
+}
+
+// (Re)allocate the RGBA render target of a pass, attached to its framebuffer
+static bool ensure_rgba_target(GLuint *texture, GLuint framebuffer, uint32_t *target_width, uint32_t *target_height,
+                               uint32_t width, uint32_t height, const char *name) {
+    if (*texture && *target_width == width && *target_height == height) {
+        return true;
+    }
+
+    if (!*texture) {
+        glGenTextures(1, texture);
+    }
+
+    // Sampled per texel by the YUYV pass, so no filtering
+    glBindTexture(GL_TEXTURE_2D, *texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, *texture, 0);
+
+    GLenum fb_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (fb_status != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "%s framebuffer incomplete: 0x%x\n", name, fb_status);
+        *target_width = 0;
+        *target_height = 0;
+        return false;
+    }
+
+    *target_width = width;
+    *target_height = height;
+    return true;
+}
+
+// (Re)allocate the RGBA target of the scale pass
+static bool ensure_scale_target(gl_context *ctx, uint32_t width, uint32_t height) {
+    return ensure_rgba_target(&ctx->scale_texture, ctx->scale_framebuffer, &ctx->scale_width, &ctx->scale_height,
+                              width, height, "Scaling");
+}
+
+static bool create_composite_program(gl_context *ctx) {
+    GLuint program = create_program(composite_vertex_shader_source, composite_fragment_shader_source,
+                                    "compositing");
+    if (!program) {
+        return false;
+    }
+
+    ctx->composite_program = program;
+    ctx->composite_position_attrib = glGetAttribLocation(program, "a_position");
+    ctx->composite_texture_uniform = glGetUniformLocation(program, "u_texture");
+    ctx->composite_tap_uniform = glGetUniformLocation(program, "u_tap");
+
+    glGenFramebuffers(1, &ctx->composite_framebuffer);
+    return true;
+}
+
+gl_context* gl_context_create(const char *render_node) {
     gl_context *ctx = calloc(1, sizeof(gl_context));
     if (!ctx) {
         fprintf(stderr, "Failed to allocate GL context\n");
         return NULL;
     }
 
-    // Initialize EGL
-    ctx->egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    pthread_mutex_init(&ctx->dma_buf_cache_lock, NULL);
+
+    // Initialize EGL on the chosen GPU, or whatever EGL defaults to without device enumeration
+    char node[64];
+    if (render_node) {
+        snprintf(node, sizeof(node), "%s", render_node);
+    } else if (!find_render_node(NULL, node, sizeof(node))) {
+        node[0] = '\0';
+    }
+
+    ctx->egl_display = node[0] ? get_render_node_display(node) : EGL_NO_DISPLAY;
+    if (ctx->egl_display != EGL_NO_DISPLAY) {
+        char device[PATH_MAX];
+        snprintf(ctx->render_node, sizeof(ctx->render_node), "%s", node);
+        if (!drm_node_device(node, device, sizeof(device)) ||
+            !device_driver_name(device, ctx->driver, sizeof(ctx->driver))) {
+            ctx->driver[0] = '\0';
+        }
+    } else if (render_node) {
+        fprintf(stderr, "Failed to get EGL display for %s\n", render_node);
+        free(ctx);
+        return NULL;
+    } else {
+        ctx->egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
     if (ctx->egl_display == EGL_NO_DISPLAY) {
         fprintf(stderr, "Failed to get EGL display\n");
         free(ctx);
@@ -73,6 +643,12 @@ gl_context* gl_context_create(void) {
     }
 
     printf("EGL version: %d.%d\n", major, minor);
+    if (ctx->render_node[0]) {
+        printf("EGL device: %s (%s)\n", ctx->render_node, ctx->driver[0] ? ctx->driver : "unknown driver");
+    }
+
+    // Nothing is ever presented, without a surface there is no pbuffer to allocate
+    bool surfaceless = check_egl_extension(ctx->egl_display, "EGL_KHR_surfaceless_context");
 
     // Check for required extensions
     ctx->has_dma_buf_import = check_egl_extension(ctx->egl_display, "EGL_EXT_image_dma_buf_import");
@@ -80,47 +656,62 @@ gl_context* gl_context_create(void) {
         fprintf(stderr, "Warning: EGL_EXT_image_dma_buf_import not supported\n");
     }
 
-    // Configure EGL
-    static const EGLint config_attribs[] = {
-        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    // Configure EGL, preferring GLES3 for asynchronous PBO readback
+    EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
         EGL_RED_SIZE, 8,
         EGL_GREEN_SIZE, 8,
         EGL_BLUE_SIZE, 8,
         EGL_ALPHA_SIZE, 8,
-        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR,
         EGL_NONE
     };
 
-    EGLint num_configs;
-    if (!eglChooseConfig(ctx->egl_display, config_attribs, &ctx->egl_config, 1, &num_configs) || num_configs == 0) {
+    EGLint num_configs = 0;
+    ctx->is_gles3 = eglChooseConfig(ctx->egl_display, config_attribs, &ctx->egl_config, 1, &num_configs) &&
+                    num_configs > 0;
+    if (!ctx->is_gles3) {
+        config_attribs[11] = EGL_OPENGL_ES2_BIT;
+        if (!eglChooseConfig(ctx->egl_display, config_attribs, &ctx->egl_config, 1, &num_configs)) {
+            num_configs = 0;
+        }
+    }
+
+    if (num_configs == 0) {
         fprintf(stderr, "Failed to choose EGL config\n");
         eglTerminate(ctx->egl_display);
         free(ctx);
         return NULL;
     }
 
-    // Create a pbuffer surface (1x1 pixel, we don't actually render to screen)
+    // Otherwise a pbuffer surface (1x1 pixel, we don't actually render to screen)
     static const EGLint pbuffer_attribs[] = {
         EGL_WIDTH, 1,
         EGL_HEIGHT, 1,
         EGL_NONE
     };
 
-    ctx->egl_surface = eglCreatePbufferSurface(ctx->egl_display, ctx->egl_config, pbuffer_attribs);
-    if (ctx->egl_surface == EGL_NO_SURFACE) {
+    ctx->egl_surface = surfaceless ? EGL_NO_SURFACE :
+                       eglCreatePbufferSurface(ctx->egl_display, ctx->egl_config, pbuffer_attribs);
+    if (!surfaceless && ctx->egl_surface == EGL_NO_SURFACE) {
         fprintf(stderr, "Failed to create EGL pbuffer surface\n");
         eglTerminate(ctx->egl_display);
         free(ctx);
         return NULL;
     }
 
-    // Create OpenGL ES 2.0 context
-    static const EGLint context_attribs[] = {
-        EGL_CONTEXT_CLIENT_VERSION, 2,
+    // Create OpenGL ES 3.0 context, or 2.0 if that is all the driver offers
+    EGLint context_attribs[] = {
+        EGL_CONTEXT_CLIENT_VERSION, ctx->is_gles3 ? 3 : 2,
         EGL_NONE
     };
 
     ctx->egl_context = eglCreateContext(ctx->egl_display, ctx->egl_config, EGL_NO_CONTEXT, context_attribs);
+    if (ctx->egl_context == EGL_NO_CONTEXT && ctx->is_gles3) {
+        ctx->is_gles3 = false;
+        context_attribs[1] = 2;
+        ctx->egl_context = eglCreateContext(ctx->egl_display, ctx->egl_config, EGL_NO_CONTEXT, context_attribs);
+    }
     if (ctx->egl_context == EGL_NO_CONTEXT) {
         fprintf(stderr, "Failed to create EGL context\n");
         eglDestroySurface(ctx->egl_display, ctx->egl_surface);
@@ -154,6 +745,17 @@ gl_context* gl_context_create(void) {
         return NULL;
     }
 
+    // Explicit modifiers let the compositor hand over tiled/compressed buffers
+    if (ctx->has_dma_buf_import &&
+        check_egl_extension(ctx->egl_display, "EGL_EXT_image_dma_buf_import_modifiers")) {
+        ctx->eglQueryDmaBufModifiersEXT =
+            (PFNEGLQUERYDMABUFMODIFIERSEXTPROC)eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+    }
+    if (ctx->has_dma_buf_import && !ctx->eglQueryDmaBufModifiersEXT) {
+        fprintf(stderr, "Warning: EGL_EXT_image_dma_buf_import_modifiers not supported, "
+                        "only implicit modifiers can be imported\n");
+    }
+
     // Check for GL_OES_EGL_image extension
     if (!check_gl_extension("GL_OES_EGL_image")) {
         fprintf(stderr, "Warning: GL_OES_EGL_image not supported\n");
@@ -162,13 +764,58 @@ gl_context* gl_context_create(void) {
     // Create framebuffer for rendering
     glGenFramebuffers(1, &ctx->framebuffer);
 
+    // Shader pass for GPU-side YUYV packing (optional, RGBA readback still works without it)
+    if (!create_yuyv_program(ctx)) {
+        fprintf(stderr, "Warning: GPU YUYV conversion unavailable, using CPU conversion\n");
+    }
+    if (!create_scale_program(ctx)) {
+        fprintf(stderr, "Warning: GPU scaling unavailable, crop and scale happen on the CPU\n");
+    }
+    if (!create_composite_program(ctx)) {
+        fprintf(stderr, "Warning: GPU compositing unavailable\n");
+    }
+
     printf("OpenGL ES vendor: %s\n", glGetString(GL_VENDOR));
     printf("OpenGL ES renderer: %s\n", glGetString(GL_RENDERER));
     printf("OpenGL ES version: %s\n", glGetString(GL_VERSION));
 
+    // Imports may happen on another thread, which can only bind a context no thread holds
+    gl_release_current(ctx);
+
     return ctx;
 }
 
+static void destroy_cache_entry(gl_context *ctx, struct gl_dma_buf_cache_entry *entry) {
+    if (!entry->used) {
+        return;
+    }
+
+    if (entry->framebuffer) {
+        glDeleteFramebuffers(1, &entry->framebuffer);
+    }
+    if (entry->texture) {
+        glDeleteTextures(1, &entry->texture);
+    }
+    if (entry->image != EGL_NO_IMAGE_KHR) {
+        ctx->eglDestroyImageKHR(ctx->egl_display, entry->image);
+    }
+
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Drop all frames in flight, e.g. after a format change
+static void reset_readback_ring(gl_context *ctx) {
+    for (int i = 0; i <= GL_MAX_READBACK_DEPTH; i++) {
+        struct gl_readback_slot *slot = &ctx->readback_slots[i];
+        if (slot->fence) {
+            glDeleteSync(slot->fence);
+            slot->fence = NULL;
+        }
+        slot->pending = false;
+    }
+    ctx->readback_serial = 0;
+}
+
 void gl_context_destroy(gl_context *ctx) {
     if (!ctx) {
         return;
@@ -177,127 +824,787 @@ void gl_context_destroy(gl_context *ctx) {
     // Make context current before destroying GL objects
     eglMakeCurrent(ctx->egl_display, ctx->egl_surface, ctx->egl_surface, ctx->egl_context);
 
+    // Release all cached DMA buffer imports
+    for (int i = 0; i < GL_DMA_BUF_CACHE_SIZE; i++) {
+        destroy_cache_entry(ctx, &ctx->dma_buf_cache[i]);
+    }
+
+    // Release the readback ring
+    reset_readback_ring(ctx);
+    for (int i = 0; i <= GL_MAX_READBACK_DEPTH; i++) {
+        if (ctx->readback_slots[i].pbo) {
+            glDeleteBuffers(1, &ctx->readback_slots[i].pbo);
+        }
+    }
+
     // Delete framebuffer
     if (ctx->framebuffer) {
         glDeleteFramebuffers(1, &ctx->framebuffer);
     }
 
+    // Delete YUYV conversion resources
+    if (ctx->yuyv_framebuffer) {
+        glDeleteFramebuffers(1, &ctx->yuyv_framebuffer);
+    }
+    if (ctx->yuyv_texture) {
+        glDeleteTextures(1, &ctx->yuyv_texture);
+    }
+    if (ctx->yuyv_program) {
+        glDeleteProgram(ctx->yuyv_program);
+    }
+
+    // Delete scaling resources
+    if (ctx->scale_framebuffer) {
+        glDeleteFramebuffers(1, &ctx->scale_framebuffer);
+    }
+    if (ctx->scale_texture) {
+        glDeleteTextures(1, &ctx->scale_texture);
+    }
+    if (ctx->scale_program) {
+        glDeleteProgram(ctx->scale_program);
+    }
+
+    // Delete compositing resources
+    if (ctx->composite_framebuffer) {
+        glDeleteFramebuffers(1, &ctx->composite_framebuffer);
+    }
+    if (ctx->composite_texture) {
+        glDeleteTextures(1, &ctx->composite_texture);
+    }
+    if (ctx->composite_program) {
+        glDeleteProgram(ctx->composite_program);
+    }
+
     // Clean up EGL
     eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
     eglDestroyContext(ctx->egl_display, ctx->egl_context);
-    eglDestroySurface(ctx->egl_display, ctx->egl_surface);
+    if (ctx->egl_surface != EGL_NO_SURFACE) {
+        eglDestroySurface(ctx->egl_display, ctx->egl_surface);
+    }
     eglTerminate(ctx->egl_display);
 
+    pthread_mutex_destroy(&ctx->dma_buf_cache_lock);
     free(ctx);
 }
 
-bool gl_import_dma_buffer(gl_context *ctx,
-                          int dma_fd,
-                          uint32_t width,
-                          uint32_t height,
-                          uint32_t stride,
-                          uint32_t offset,
-                          uint32_t fourcc,
-                          uint8_t *out_buffer,
-                          size_t out_buffer_size) {
-    if (!ctx || !ctx->has_dma_buf_import || dma_fd < 0 || !out_buffer) {
+// Bind the imported texture as read framebuffer for an RGBA readback
+static bool prepare_rgba_readback(struct gl_dma_buf_cache_entry *entry, uint32_t width, uint32_t height) {
+    // Create a framebuffer and attach the texture once per imported buffer
+    if (!entry->framebuffer) {
+        glGenFramebuffers(1, &entry->framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, entry->framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, entry->texture, 0);
+
+        GLenum fb_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (fb_status != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Framebuffer incomplete: 0x%x\n", fb_status);
+            glDeleteFramebuffers(1, &entry->framebuffer);
+            entry->framebuffer = 0;
+            return false;
+        }
+    } else {
+        glBindFramebuffer(GL_FRAMEBUFFER, entry->framebuffer);
+    }
+
+    // Set viewport to match texture size
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+// Full-viewport quad drawn by the shader passes
+static const GLfloat pass_quad[] = {
+    -1.0f, -1.0f,
+     1.0f, -1.0f,
+    -1.0f,  1.0f,
+     1.0f,  1.0f,
+};
+
+// Render the output region of the imported texture into the scale target, which
+// is left bound as read framebuffer
+static bool prepare_scaled_texture(gl_context *ctx, GLuint texture, uint32_t width, uint32_t height,
+                                   const gl_output_region *region) {
+    if (!ctx->scale_program || !ensure_scale_target(ctx, region->width, region->height)) {
         return false;
     }
 
-    // Make context current
-    if (!eglMakeCurrent(ctx->egl_display, ctx->egl_surface, ctx->egl_surface, ctx->egl_context)) {
-        fprintf(stderr, "Failed to make EGL context current\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->scale_framebuffer);
+    glViewport(0, 0, region->width, region->height);
+
+    glUseProgram(ctx->scale_program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glUniform1i(ctx->scale_texture_uniform, 0);
+    glUniform4f(ctx->scale_source_uniform,
+                (float)region->crop_x / width, (float)region->crop_y / height,
+                (float)region->crop_width / width, (float)region->crop_height / height);
+    glUniform2f(ctx->scale_target_size_uniform, (float)region->width, (float)region->height);
+    glUniform2f(ctx->scale_tap_uniform,
+                0.25f * region->crop_width / region->width / width,
+                0.25f * region->crop_height / region->height / height);
+
+    glVertexAttribPointer(ctx->scale_position_attrib, 2, GL_FLOAT, GL_FALSE, 0, pass_quad);
+    glEnableVertexAttribArray(ctx->scale_position_attrib);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glDisableVertexAttribArray(ctx->scale_position_attrib);
+    glUseProgram(0);
+
+    // The unscaled passes fetch exact texels
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    GLenum gl_error = glGetError();
+    if (gl_error != GL_NO_ERROR) {
+        fprintf(stderr, "Scaling pass failed: 0x%x\n", gl_error);
         return false;
     }
 
-    // Create EGLImage from DMA buffer
-    EGLint attribs[] = {
-        EGL_WIDTH, (EGLint)width,
-        EGL_HEIGHT, (EGLint)height,
-        EGL_LINUX_DRM_FOURCC_EXT, (EGLint)fourcc,
-        EGL_DMA_BUF_PLANE0_FD_EXT, dma_fd,
-        EGL_DMA_BUF_PLANE0_OFFSET_EXT, (EGLint)offset,
-        EGL_DMA_BUF_PLANE0_PITCH_EXT, (EGLint)stride,
-        EGL_NONE
+    return true;
+}
+
+// Render the imported texture through the YUYV packing shader, leaving the
+// half-width target (2 bytes per pixel) bound for readback
+static bool prepare_yuyv_readback(gl_context *ctx, GLuint texture, uint32_t width, uint32_t height) {
+    if (!ctx->yuyv_program || !ensure_yuyv_target(ctx, width, height)) {
+        return false;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->yuyv_framebuffer);
+    glViewport(0, 0, ctx->yuyv_width, height);
+
+    glUseProgram(ctx->yuyv_program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glUniform1i(ctx->yuyv_texture_uniform, 0);
+    glUniform2f(ctx->yuyv_texel_size_uniform, 1.0f / width, 1.0f / height);
+
+    glVertexAttribPointer(ctx->yuyv_position_attrib, 2, GL_FLOAT, GL_FALSE, 0, pass_quad);
+    glEnableVertexAttribArray(ctx->yuyv_position_attrib);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glDisableVertexAttribArray(ctx->yuyv_position_attrib);
+    glUseProgram(0);
+
+    GLenum gl_error = glGetError();
+    if (gl_error != GL_NO_ERROR) {
+        fprintf(stderr, "YUYV conversion pass failed: 0x%x\n", gl_error);
+        return false;
+    }
+
+    return true;
+}
+
+// Synchronous readback of the bound framebuffer, stalls until the GPU is done
+static bool read_pixels_sync(uint32_t read_width, uint32_t height,
+                             uint8_t *out_buffer, size_t out_buffer_size) {
+    size_t expected_size = (size_t)read_width * 4 * height;
+    if (out_buffer_size < expected_size) {
+        fprintf(stderr, "Output buffer too small: %zu < %zu\n", out_buffer_size, expected_size);
+        return false;
+    }
+
+    glReadPixels(0, 0, read_width, height, GL_RGBA, GL_UNSIGNED_BYTE, out_buffer);
+
+    GLenum gl_error = glGetError();
+    if (gl_error != GL_NO_ERROR) {
+        fprintf(stderr, "glReadPixels failed: 0x%x\n", gl_error);
+        return false;
+    }
+
+    return true;
+}
+
+// Queue a readback of the bound framebuffer into the next PBO of the ring
+static bool read_pixels_async(gl_context *ctx, gl_readback_format format,
+                              uint32_t read_width, uint32_t width, uint32_t height) {
+    uint32_t ring_size = ctx->readback_depth + 1;
+    struct gl_readback_slot *slot = &ctx->readback_slots[ctx->readback_serial % ring_size];
+    size_t size = (size_t)read_width * 4 * height;
+
+    // The slot is about to be overwritten, whatever it held is dropped
+    if (slot->fence) {
+        glDeleteSync(slot->fence);
+        slot->fence = NULL;
+    }
+    slot->pending = false;
+
+    if (!slot->pbo) {
+        glGenBuffers(1, &slot->pbo);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    if (slot->pbo_size < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        slot->pbo_size = size;
+    }
+
+    // With a pack buffer bound the last argument is an offset into it
+    glReadPixels(0, 0, read_width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    GLenum gl_error = glGetError();
+    if (gl_error != GL_NO_ERROR) {
+        fprintf(stderr, "Asynchronous glReadPixels failed: 0x%x\n", gl_error);
+        return false;
+    }
+
+    slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+
+    slot->pending = true;
+    slot->format = format;
+    slot->width = width;
+    slot->height = height;
+    slot->size = size;
+    ctx->readback_serial++;
+    return true;
+}
+
+// Copy out the oldest frame of the ring, the one readback_depth frames back
+static gl_import_result collect_readback(gl_context *ctx, gl_readback_format format,
+                                         uint32_t width, uint32_t height,
+                                         uint8_t *out_buffer, size_t out_buffer_size) {
+    uint32_t ring_size = ctx->readback_depth + 1;
+    struct gl_readback_slot *slot = &ctx->readback_slots[ctx->readback_serial % ring_size];
+
+    if (!slot->pending) {
+        // Pipeline is still filling up
+        return GL_IMPORT_PENDING;
+    }
+
+    if (slot->format != format || slot->width != width || slot->height != height) {
+        // Read back under a different format, nobody wants it anymore
+        slot->pending = false;
+        return GL_IMPORT_PENDING;
+    }
+
+    if (out_buffer_size < slot->size) {
+        fprintf(stderr, "Output buffer too small: %zu < %zu\n", out_buffer_size, slot->size);
+        return GL_IMPORT_ERROR;
+    }
+
+    // Normally signalled long ago, the wait only bounds a GPU hang
+    GLenum wait = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100 * 1000 * 1000);
+    if (wait == GL_TIMEOUT_EXPIRED || wait == GL_WAIT_FAILED) {
+        fprintf(stderr, "Timed out waiting for asynchronous readback\n");
+        return GL_IMPORT_PENDING;
+    }
+
+    glDeleteSync(slot->fence);
+    slot->fence = NULL;
+    slot->pending = false;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot->size, GL_MAP_READ_BIT);
+    if (!mapped) {
+        fprintf(stderr, "Failed to map readback buffer: 0x%x\n", glGetError());
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        return GL_IMPORT_ERROR;
+    }
+
+    memcpy(out_buffer, mapped, slot->size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    return GL_IMPORT_DONE;
+}
+
+// Create the EGLImage and texture for a DMA buffer
+static bool import_cache_entry(gl_context *ctx, struct gl_dma_buf_cache_entry *entry) {
+    static const EGLint plane_attribs[GL_DMA_BUF_MAX_PLANES][5] = {
+        { EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT,
+          EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+        { EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT,
+          EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+        { EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT,
+          EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+        { EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT, EGL_DMA_BUF_PLANE3_PITCH_EXT,
+          EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT },
     };
+    const gl_dma_buf *dmabuf = &entry->dmabuf;
+
+    // Create EGLImage from DMA buffer, 6 fixed values plus up to 10 per plane
+    EGLint attribs[7 + GL_DMA_BUF_MAX_PLANES * 10];
+    int n = 0;
+    attribs[n++] = EGL_WIDTH;
+    attribs[n++] = (EGLint)dmabuf->width;
+    attribs[n++] = EGL_HEIGHT;
+    attribs[n++] = (EGLint)dmabuf->height;
+    attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+    attribs[n++] = (EGLint)dmabuf->fourcc;
 
-    EGLImageKHR egl_image = ctx->eglCreateImageKHR(ctx->egl_display,
-                                                    EGL_NO_CONTEXT,
-                                                    EGL_LINUX_DMA_BUF_EXT,
-                                                    (EGLClientBuffer)NULL,
-                                                    attribs);
+    bool explicit_modifier = dmabuf->modifier != DRM_FORMAT_MOD_INVALID;
+    for (uint32_t i = 0; i < dmabuf->n_planes; i++) {
+        attribs[n++] = plane_attribs[i][0];
+        attribs[n++] = dmabuf->fd[i];
+        attribs[n++] = plane_attribs[i][1];
+        attribs[n++] = (EGLint)dmabuf->offset[i];
+        attribs[n++] = plane_attribs[i][2];
+        attribs[n++] = (EGLint)dmabuf->stride[i];
+        if (explicit_modifier) {
+            attribs[n++] = plane_attribs[i][3];
+            attribs[n++] = (EGLint)(dmabuf->modifier & 0xffffffff);
+            attribs[n++] = plane_attribs[i][4];
+            attribs[n++] = (EGLint)(dmabuf->modifier >> 32);
+        }
+    }
+    attribs[n++] = EGL_NONE;
+
+    if (!ctx->checked_exporter) {
+        check_dma_buf_exporter(ctx, dmabuf->fd[0]);
+    }
+
+    entry->image = ctx->eglCreateImageKHR(ctx->egl_display,
+                                          EGL_NO_CONTEXT,
+                                          EGL_LINUX_DMA_BUF_EXT,
+                                          (EGLClientBuffer)NULL,
+                                          attribs);
 
-    if (egl_image == EGL_NO_IMAGE_KHR) {
+    if (entry->image == EGL_NO_IMAGE_KHR) {
         EGLint error = eglGetError();
         fprintf(stderr, "Failed to create EGLImage from DMA buffer: 0x%x\n", error);
         return false;
     }
 
     // Create texture from EGLImage
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    glGenTextures(1, &entry->texture);
+    glBindTexture(GL_TEXTURE_2D, entry->texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
     // Bind EGLImage to texture
-    ctx->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)egl_image);
+    ctx->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)entry->image);
 
     GLenum gl_error = glGetError();
     if (gl_error != GL_NO_ERROR) {
         fprintf(stderr, "Failed to bind EGLImage to texture: 0x%x\n", gl_error);
-        glDeleteTextures(1, &texture);
-        ctx->eglDestroyImageKHR(ctx->egl_display, egl_image);
         return false;
     }
 
-    // Create a framebuffer and attach the texture
-    glBindFramebuffer(GL_FRAMEBUFFER, ctx->framebuffer);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    return true;
+}
 
-    GLenum fb_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (fb_status != GL_FRAMEBUFFER_COMPLETE) {
-        fprintf(stderr, "Framebuffer incomplete: 0x%x\n", fb_status);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glDeleteTextures(1, &texture);
-        ctx->eglDestroyImageKHR(ctx->egl_display, egl_image);
+static bool dma_buf_equal(const gl_dma_buf *a, const gl_dma_buf *b) {
+    if (a->width != b->width || a->height != b->height || a->fourcc != b->fourcc ||
+        a->modifier != b->modifier || a->n_planes != b->n_planes) {
         return false;
     }
 
-    // Set viewport to match texture size
-    glViewport(0, 0, width, height);
+    for (uint32_t i = 0; i < a->n_planes; i++) {
+        if (a->fd[i] != b->fd[i] || a->offset[i] != b->offset[i] || a->stride[i] != b->stride[i]) {
+            return false;
+        }
+    }
 
-    // Read pixels from framebuffer
-    size_t expected_size = width * height * 4; // RGBA
-    if (out_buffer_size < expected_size) {
-        fprintf(stderr, "Output buffer too small: %zu < %zu\n", out_buffer_size, expected_size);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glDeleteTextures(1, &texture);
-        ctx->eglDestroyImageKHR(ctx->egl_display, egl_image);
+    return true;
+}
+
+// Find the cached import for a DMA buffer, importing it on first use
+// Must be called with the context current
+static struct gl_dma_buf_cache_entry* lookup_dma_buffer(gl_context *ctx, const gl_dma_buf *dmabuf) {
+    struct gl_dma_buf_cache_entry *found = NULL;
+    struct gl_dma_buf_cache_entry *victim = NULL;
+
+    pthread_mutex_lock(&ctx->dma_buf_cache_lock);
+    for (int i = 0; i < GL_DMA_BUF_CACHE_SIZE; i++) {
+        struct gl_dma_buf_cache_entry *entry = &ctx->dma_buf_cache[i];
+
+        // Invalidated entries can only be released here, on the thread that owns the context
+        if (entry->used && entry->stale) {
+            destroy_cache_entry(ctx, entry);
+        }
+
+        if (!entry->used) {
+            if (!victim || victim->used) {
+                victim = entry;
+            }
+            continue;
+        }
+
+        if (dma_buf_equal(&entry->dmabuf, dmabuf)) {
+            found = entry;
+        } else if (!victim || (victim->used && entry->last_used < victim->last_used)) {
+            // Least recently used entry makes room if the cache is full
+            victim = entry;
+        }
+    }
+
+    if (!found) {
+        destroy_cache_entry(ctx, victim);
+
+        victim->used = true;
+        victim->dmabuf = *dmabuf;
+
+        if (import_cache_entry(ctx, victim)) {
+            found = victim;
+        } else {
+            destroy_cache_entry(ctx, victim);
+        }
+    }
+
+    if (found) {
+        found->last_used = ++ctx->dma_buf_cache_clock;
+    }
+    pthread_mutex_unlock(&ctx->dma_buf_cache_lock);
+
+    return found;
+}
+
+// Check that a DMA buffer description can be passed to EGL
+static bool dma_buf_importable(gl_context *ctx, const gl_dma_buf *dmabuf) {
+    if (dmabuf->n_planes == 0 || dmabuf->n_planes > GL_DMA_BUF_MAX_PLANES || dmabuf->fd[0] < 0) {
         return false;
     }
 
-    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, out_buffer);
+    // Explicit modifiers can't be passed without the modifiers extension
+    return dmabuf->modifier == DRM_FORMAT_MOD_INVALID || ctx->eglQueryDmaBufModifiersEXT;
+}
 
-    gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        fprintf(stderr, "glReadPixels failed: 0x%x\n", gl_error);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glDeleteTextures(1, &texture);
-        ctx->eglDestroyImageKHR(ctx->egl_display, egl_image);
+// Read back the bound framebuffer, right away or through the asynchronous ring
+// Returns false if the readback failed, *result is what the caller returns
+static bool read_back_frame(gl_context *ctx, gl_readback_format format,
+                            uint32_t read_width, uint32_t width, uint32_t height,
+                            uint8_t *out_buffer, size_t out_buffer_size, gl_import_result *result) {
+    if (ctx->readback_depth == 0) {
+        bool success = read_pixels_sync(read_width, height, out_buffer, out_buffer_size);
+        *result = success ? GL_IMPORT_DONE : GL_IMPORT_ERROR;
+        return success;
+    }
+
+    // Frame N is read back into a PBO while an older one is handed out
+    *result = GL_IMPORT_ERROR;
+    if (!read_pixels_async(ctx, format, read_width, width, height)) {
         return false;
     }
+    *result = collect_readback(ctx, format, width, height, out_buffer, out_buffer_size);
+    return true;
+}
+
+gl_import_result gl_import_dma_buffer(gl_context *ctx,
+                                      const gl_dma_buf *dmabuf,
+                                      gl_readback_format format,
+                                      uint8_t *out_buffer,
+                                      size_t out_buffer_size) {
+    if (!ctx || !ctx->has_dma_buf_import || !dmabuf || !out_buffer || !dma_buf_importable(ctx, dmabuf)) {
+        return GL_IMPORT_ERROR;
+    }
+
+    uint32_t width = dmabuf->width;
+    uint32_t height = dmabuf->height;
+
+    // Region clipped to this buffer, skipped if it covers the whole buffer unscaled
+    gl_output_region region = { 0, 0, width, height, width, height };
+    if (ctx->has_output_region) {
+        region = ctx->output_region;
+        if (region.crop_x >= width || region.crop_y >= height) {
+            region.crop_x = 0;
+            region.crop_y = 0;
+        }
+        if (region.crop_width == 0 || region.crop_width > width - region.crop_x) {
+            region.crop_width = width - region.crop_x;
+        }
+        if (region.crop_height == 0 || region.crop_height > height - region.crop_y) {
+            region.crop_height = height - region.crop_y;
+        }
+        if (region.width == 0 || region.height == 0) {
+            region.width = region.crop_width;
+            region.height = region.crop_height;
+        }
+    }
+    bool scaled = region.crop_x != 0 || region.crop_y != 0 ||
+                  region.crop_width != width || region.crop_height != height ||
+                  region.width != width || region.height != height;
+
+    uint64_t start_ns = gl_now_ns();
+    ctx->last_import_ns = 0;
+    ctx->last_readback_ns = 0;
+
+    // Make context current
+    if (!eglMakeCurrent(ctx->egl_display, ctx->egl_surface, ctx->egl_surface, ctx->egl_context)) {
+        fprintf(stderr, "Failed to make EGL context current\n");
+        return GL_IMPORT_ERROR;
+    }
+
+    struct gl_dma_buf_cache_entry *entry = lookup_dma_buffer(ctx, dmabuf);
+    if (!entry) {
+        return GL_IMPORT_ERROR;
+    }
+
+    bool success = true;
+    GLuint texture = entry->texture;
+    if (scaled) {
+        // Everything after this pass runs at the output size
+        success = prepare_scaled_texture(ctx, entry->texture, width, height, &region);
+        texture = ctx->scale_texture;
+        width = region.width;
+        height = region.height;
+    }
+
+    uint32_t read_width = width;
+    if (success && format == GL_READBACK_YUYV) {
+        success = prepare_yuyv_readback(ctx, texture, width, height);
+        read_width = ctx->yuyv_width;
+    } else if (success && !scaled) {
+        success = prepare_rgba_readback(entry, width, height);
+    }
+
+    uint64_t readback_start_ns = gl_now_ns();
+    ctx->last_import_ns = readback_start_ns - start_ns;
+
+    gl_import_result result = GL_IMPORT_ERROR;
+    if (success) {
+        success = read_back_frame(ctx, format, read_width, width, height, out_buffer, out_buffer_size, &result);
+    }
 
-    // Clean up
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDeleteTextures(1, &texture);
-    ctx->eglDestroyImageKHR(ctx->egl_display, egl_image);
+    ctx->last_readback_ns = gl_now_ns() - readback_start_ns;
+
+    if (!success) {
+        // Don't keep an import that could not be read, it will be retried next frame
+        // Invalidation reads the entry from other threads
+        pthread_mutex_lock(&ctx->dma_buf_cache_lock);
+        destroy_cache_entry(ctx, entry);
+        pthread_mutex_unlock(&ctx->dma_buf_cache_lock);
+    }
+
+    return result;
+}
+
+gl_import_result gl_composite_dma_buffers(gl_context *ctx,
+                                          const gl_dma_buf *const *sources,
+                                          const gl_composite_rect *rects,
+                                          uint32_t n_sources,
+                                          uint32_t width,
+                                          uint32_t height,
+                                          gl_readback_format format,
+                                          uint8_t *out_buffer,
+                                          size_t out_buffer_size) {
+    if (!gl_has_composite_support(ctx) || !sources || !rects || !out_buffer || width == 0 || height == 0) {
+        return GL_IMPORT_ERROR;
+    }
+
+    uint64_t start_ns = gl_now_ns();
+    ctx->last_import_ns = 0;
+    ctx->last_readback_ns = 0;
+
+    if (!eglMakeCurrent(ctx->egl_display, ctx->egl_surface, ctx->egl_surface, ctx->egl_context)) {
+        fprintf(stderr, "Failed to make EGL context current\n");
+        return GL_IMPORT_ERROR;
+    }
+
+    if (!ensure_rgba_target(&ctx->composite_texture, ctx->composite_framebuffer,
+                            &ctx->composite_width, &ctx->composite_height, width, height, "Compositing")) {
+        return GL_IMPORT_ERROR;
+    }
+
+    // Imports bind their own textures, do them all before drawing
+    struct gl_dma_buf_cache_entry *entries[GL_DMA_BUF_CACHE_SIZE] = {0};
+    if (n_sources > GL_DMA_BUF_CACHE_SIZE) {
+        n_sources = GL_DMA_BUF_CACHE_SIZE;
+    }
+    for (uint32_t i = 0; i < n_sources; i++) {
+        if (sources[i] && dma_buf_importable(ctx, sources[i])) {
+            entries[i] = lookup_dma_buffer(ctx, sources[i]);
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->composite_framebuffer);
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glUseProgram(ctx->composite_program);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(ctx->composite_texture_uniform, 0);
+    glVertexAttribPointer(ctx->composite_position_attrib, 2, GL_FLOAT, GL_FALSE, 0, pass_quad);
+    glEnableVertexAttribArray(ctx->composite_position_attrib);
+
+    for (uint32_t i = 0; i < n_sources; i++) {
+        const gl_composite_rect *rect = &rects[i];
+        if (!entries[i] || rect->width == 0 || rect->height == 0 ||
+            rect->x >= width || rect->y >= height) {
+            continue;
+        }
+
+        // Framebuffer rows follow image rows like in the scaling pass, so y is not flipped
+        glViewport(rect->x, rect->y, rect->width, rect->height);
+        glBindTexture(GL_TEXTURE_2D, entries[i]->texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glUniform2f(ctx->composite_tap_uniform, 0.25f / rect->width, 0.25f / rect->height);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+        // The unscaled passes fetch exact texels
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+
+    glDisableVertexAttribArray(ctx->composite_position_attrib);
+    glUseProgram(0);
+
+    bool success = true;
+    GLenum gl_error = glGetError();
+    if (gl_error != GL_NO_ERROR) {
+        fprintf(stderr, "Compositing pass failed: 0x%x\n", gl_error);
+        success = false;
+    }
+
+    uint32_t read_width = width;
+    if (success && format == GL_READBACK_YUYV) {
+        success = prepare_yuyv_readback(ctx, ctx->composite_texture, width, height);
+        read_width = ctx->yuyv_width;
+    } else if (success) {
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx->composite_framebuffer);
+    }
+
+    uint64_t readback_start_ns = gl_now_ns();
+    ctx->last_import_ns = readback_start_ns - start_ns;
+
+    gl_import_result result = GL_IMPORT_ERROR;
+    if (success) {
+        read_back_frame(ctx, format, read_width, width, height, out_buffer, out_buffer_size, &result);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    ctx->last_readback_ns = gl_now_ns() - readback_start_ns;
+    return result;
+}
+
+bool gl_set_readback_depth(gl_context *ctx, uint32_t depth) {
+    if (!ctx) {
+        return false;
+    }
+
+    if (depth > GL_MAX_READBACK_DEPTH) {
+        depth = GL_MAX_READBACK_DEPTH;
+    }
+
+    if (depth > 0 && !ctx->is_gles3) {
+        // PBOs and fence sync objects need GLES3
+        ctx->readback_depth = 0;
+        return false;
+    }
 
+    if (eglMakeCurrent(ctx->egl_display, ctx->egl_surface, ctx->egl_surface, ctx->egl_context)) {
+        reset_readback_ring(ctx);
+        gl_release_current(ctx);
+    }
+    ctx->readback_depth = depth;
     return true;
 }
 
+void gl_release_current(gl_context *ctx) {
+    if (!ctx) {
+        return;
+    }
+
+    eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+void gl_set_output_region(gl_context *ctx, const gl_output_region *region) {
+    if (!ctx) {
+        return;
+    }
+
+    ctx->has_output_region = region != NULL;
+    if (region) {
+        ctx->output_region = *region;
+    }
+}
+
+void gl_get_last_import_timing(gl_context *ctx, uint64_t *import_ns, uint64_t *readback_ns) {
+    *import_ns = ctx ? ctx->last_import_ns : 0;
+    *readback_ns = ctx ? ctx->last_readback_ns : 0;
+}
+
+bool gl_has_composite_support(gl_context *ctx) {
+    return ctx && ctx->has_dma_buf_import && ctx->composite_program != 0;
+}
+
+bool gl_has_scaling_support(gl_context *ctx) {
+    return ctx && ctx->has_dma_buf_import && ctx->scale_program != 0;
+}
+
+uint32_t gl_get_readback_depth(gl_context *ctx) {
+    return ctx ? ctx->readback_depth : 0;
+}
+
+void gl_forget_dma_buffer(gl_context *ctx, int dma_fd) {
+    if (!ctx) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->dma_buf_cache_lock);
+    for (int i = 0; i < GL_DMA_BUF_CACHE_SIZE; i++) {
+        struct gl_dma_buf_cache_entry *entry = &ctx->dma_buf_cache[i];
+        if (!entry->used) {
+            continue;
+        }
+        for (uint32_t p = 0; p < entry->dmabuf.n_planes; p++) {
+            if (entry->dmabuf.fd[p] == dma_fd) {
+                entry->stale = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->dma_buf_cache_lock);
+}
+
+void gl_clear_dma_buffer_cache(gl_context *ctx) {
+    if (!ctx) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->dma_buf_cache_lock);
+    for (int i = 0; i < GL_DMA_BUF_CACHE_SIZE; i++) {
+        if (ctx->dma_buf_cache[i].used) {
+            ctx->dma_buf_cache[i].stale = true;
+        }
+    }
+    pthread_mutex_unlock(&ctx->dma_buf_cache_lock);
+}
+
+uint32_t gl_query_dma_buf_modifiers(gl_context *ctx, uint32_t fourcc,
+                                    uint64_t *modifiers, uint32_t max_modifiers) {
+    if (!ctx || !ctx->has_dma_buf_import || !modifiers || max_modifiers == 0) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    EGLint n_total = 0;
+    if (ctx->eglQueryDmaBufModifiersEXT &&
+        ctx->eglQueryDmaBufModifiersEXT(ctx->egl_display, (EGLint)fourcc, 0, NULL, NULL, &n_total) &&
+        n_total > 0) {
+        EGLuint64KHR *queried = calloc(n_total, sizeof(EGLuint64KHR));
+        EGLBoolean *external_only = calloc(n_total, sizeof(EGLBoolean));
+        EGLint n_queried = 0;
+
+        if (queried && external_only &&
+            ctx->eglQueryDmaBufModifiersEXT(ctx->egl_display, (EGLint)fourcc, n_total,
+                                            queried, external_only, &n_queried)) {
+            // Leave room for the implicit modifier added below
+            for (EGLint i = 0; i < n_queried && count + 1 < max_modifiers; i++) {
+                // Imports are sampled as GL_TEXTURE_2D, external-only layouts can't be used
+                if (!external_only[i]) {
+                    modifiers[count++] = queried[i];
+                }
+            }
+        }
+
+        free(queried);
+        free(external_only);
+    }
+
+    // The implicit modifier always works for linear and driver-negotiated layouts
+    modifiers[count++] = DRM_FORMAT_MOD_INVALID;
+    return count;
+}
+
 bool gl_has_dma_buf_import_support(gl_context *ctx) {
     return ctx && ctx->has_dma_buf_import;
+}
+
+bool gl_has_yuyv_conversion_support(gl_context *ctx) {
+    return ctx && ctx->has_dma_buf_import && ctx->yuyv_program != 0;
 }
\ No newline at end of file
@@ -8,36 +8,153 @@
 // Forward declaration to avoid circular dependencies
 typedef struct gl_context gl_context;
 
-// Initialize the OpenGL/EGL context
-// Returns NULL if initialization fails (e.g., extensions not available)
-gl_context* gl_context_create(void);
+// Layout of the data written by gl_import_dma_buffer
+typedef enum {
+    GL_READBACK_RGBA,  // 4 bytes per pixel: R, G, B, A
+    GL_READBACK_YUYV,  // 2 bytes per pixel: Y0, U, Y1, V (packed on the GPU)
+} gl_readback_format;
+
+// Maximum number of memory planes of an imported DMA buffer
+#define GL_DMA_BUF_MAX_PLANES 4
+
+// Description of a (possibly multi-planar, tiled or compressed) DMA buffer
+typedef struct {
+    uint32_t width;                       // Width of the buffer in pixels
+    uint32_t height;                      // Height of the buffer in pixels
+    uint32_t fourcc;                      // DRM fourcc format code (e.g., DRM_FORMAT_XRGB8888)
+    uint64_t modifier;                    // DRM format modifier, DRM_FORMAT_MOD_INVALID if implicit
+    uint32_t n_planes;                    // Number of valid entries below
+    int fd[GL_DMA_BUF_MAX_PLANES];        // File descriptor of each plane
+    uint32_t offset[GL_DMA_BUF_MAX_PLANES]; // Offset of each plane in its DMA buffer
+    uint32_t stride[GL_DMA_BUF_MAX_PLANES]; // Stride of each plane in bytes
+} gl_dma_buf;
+
+// Part of each DMA buffer that is read back, and the size it is scaled to
+typedef struct {
+    uint32_t crop_x;       // Top-left corner of the source rectangle in pixels
+    uint32_t crop_y;
+    uint32_t crop_width;   // Size of the source rectangle, 0 = up to the buffer edge
+    uint32_t crop_height;
+    uint32_t width;        // Size of the readback, 0 = size of the source rectangle
+    uint32_t height;
+} gl_output_region;
+
+// Where a source goes in a composited frame, in pixels from the top-left corner
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} gl_composite_rect;
+
+// Outcome of gl_import_dma_buffer
+typedef enum {
+    GL_IMPORT_ERROR = -1,  // Import or readback failed, fall back to another path
+    GL_IMPORT_PENDING = 0, // Readback queued, no frame ready yet (pipeline filling)
+    GL_IMPORT_DONE = 1,    // out_buffer holds a frame
+} gl_import_result;
+
+// Initialize the OpenGL/EGL context, surfaceless where EGL allows it
+// Parameters:
+//   render_node: DRM render node of the GPU to use, e.g. "/dev/dri/renderD128",
+//                NULL = the GPU the display was booted on, falling back to
+//                EGL_DEFAULT_DISPLAY if EGL can't select devices
+// Returns NULL if initialization fails (e.g., extensions not available or
+// render_node isn't an EGL device)
+gl_context* gl_context_create(const char *render_node);
 
 // Destroy the OpenGL/EGL context and free resources
 void gl_context_destroy(gl_context *ctx);
 
-// Import a DMA buffer and convert it to linear RGB data
+// Import a DMA buffer and read it back as linear RGBA or YUYV data
+// The EGLImage and texture are cached per buffer, so each buffer of the
+// PipeWire pool is only imported once.
+// With a readback depth above 0 (see gl_set_readback_depth) the frame is read
+// into a pixel buffer object and the returned data is the frame submitted
+// that many calls earlier, so the CPU never waits on the GPU.
 // Parameters:
 //   ctx: The GL context
-//   dma_fd: File descriptor of the DMA buffer
-//   width: Width of the buffer in pixels
-//   height: Height of the buffer in pixels
-//   stride: Stride of the buffer in bytes
-//   offset: Offset in the DMA buffer
-//   fourcc: DRM fourcc format code (e.g., DRM_FORMAT_XRGB8888)
-//   out_buffer: Pre-allocated buffer to store the linear RGB data
+//   dmabuf: Planes, format and modifier of the DMA buffer
+//   format: Layout to read back (GL_READBACK_YUYV halves the readback size)
+//   out_buffer: Pre-allocated buffer to store the linear data
 //   out_buffer_size: Size of the output buffer
-// Returns: true on success, false on failure
-bool gl_import_dma_buffer(gl_context *ctx,
-                          int dma_fd,
-                          uint32_t width,
-                          uint32_t height,
-                          uint32_t stride,
-                          uint32_t offset,
-                          uint32_t fourcc,
-                          uint8_t *out_buffer,
-                          size_t out_buffer_size);
+// Returns: GL_IMPORT_DONE when out_buffer was filled, GL_IMPORT_PENDING while
+//          the readback pipeline is filling, GL_IMPORT_ERROR on failure
+gl_import_result gl_import_dma_buffer(gl_context *ctx,
+                                      const gl_dma_buf *dmabuf,
+                                      gl_readback_format format,
+                                      uint8_t *out_buffer,
+                                      size_t out_buffer_size);
+
+// Render several DMA buffers into one frame and read that frame back
+// Each source is imported and cached like with gl_import_dma_buffer, scaled
+// into its rectangle and drawn in order over black, so later sources cover
+// earlier ones (picture-in-picture). A NULL source leaves its rectangle black.
+// The output region doesn't apply, the readback depth does.
+// Parameters:
+//   sources, rects: n_sources DMA buffers and where each one goes
+//   width, height: Size of the composited frame
+//   format, out_buffer, out_buffer_size: As for gl_import_dma_buffer
+// Returns: like gl_import_dma_buffer
+gl_import_result gl_composite_dma_buffers(gl_context *ctx,
+                                          const gl_dma_buf *const *sources,
+                                          const gl_composite_rect *rects,
+                                          uint32_t n_sources,
+                                          uint32_t width,
+                                          uint32_t height,
+                                          gl_readback_format format,
+                                          uint8_t *out_buffer,
+                                          size_t out_buffer_size);
+
+// Set how many frames of latency the readback may add (0 = synchronous)
+// Nothing drains the ring, so with a producer that only sends frames on damage
+// the last frames of an update wait there for the next one.
+// Values above 3 are clamped. Returns false if asynchronous readback is not
+// available (GLES2 context), in which case readback stays synchronous.
+bool gl_set_readback_depth(gl_context *ctx, uint32_t depth);
+
+// Crop and scale every following import on the GPU before readback
+// The readback (and so out_buffer_size) is then region->width x region->height.
+// Pass NULL to read back whole buffers at their own size.
+void gl_set_output_region(gl_context *ctx, const gl_output_region *region);
+
+// Time the last gl_import_dma_buffer spent importing and rendering, and reading back
+// With asynchronous readback the latter covers queuing one frame and copying out an older one.
+void gl_get_last_import_timing(gl_context *ctx, uint64_t *import_ns, uint64_t *readback_ns);
+
+// Get the readback depth in effect
+uint32_t gl_get_readback_depth(gl_context *ctx);
+
+// Unbind the context from the calling thread
+// The context is bound by each import, call this before another thread
+// imports (e.g., when a worker thread exits) or destroys the context.
+void gl_release_current(gl_context *ctx);
+
+// Drop the cached EGLImage/texture of every import using a DMA buffer fd
+// Call when PipeWire removes the buffer from its pool. Safe to call from any
+// thread, the GL objects are released on the next import.
+void gl_forget_dma_buffer(gl_context *ctx, int dma_fd);
+
+// Drop all cached DMA buffer imports (e.g., after a format change)
+void gl_clear_dma_buffer_cache(gl_context *ctx);
+
+// Query the modifiers a fourcc can be imported with, in driver preference order
+// Modifiers that only work with external textures are skipped, and
+// DRM_FORMAT_MOD_INVALID (implicit modifier) is always appended last.
+// Returns the number of modifiers written, 0 if DMA buffer import is unavailable.
+uint32_t gl_query_dma_buf_modifiers(gl_context *ctx, uint32_t fourcc,
+                                    uint64_t *modifiers, uint32_t max_modifiers);
 
 // Check if EGL DMA buffer import extension is available
 bool gl_has_dma_buf_import_support(gl_context *ctx);
 
+// Check if DMA buffers can be cropped and scaled on the GPU (gl_set_output_region)
+bool gl_has_scaling_support(gl_context *ctx);
+
+// Check if DMA buffers can be composited (gl_composite_dma_buffers)
+bool gl_has_composite_support(gl_context *ctx);
+
+// Check if DMA buffers can be converted to YUYV on the GPU
+bool gl_has_yuyv_conversion_support(gl_context *ctx);
+
 #endif // GL_HANDLER_H
\ No newline at end of file
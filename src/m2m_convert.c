@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+#include "m2m_convert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+#include <drm/drm_fourcc.h>
+
+// Devices m2m_find_devices looks at, /dev/video0 and up
+#define M2M_MAX_PROBED_DEVICES 64
+
+// A frame the device hasn't returned after this long counts as failed
+#define M2M_TIMEOUT_MS 100
+
+// A DMA-BUF attached to one buffer index of the OUTPUT queue
+struct m2m_input_slot {
+    int dmabuf_fd;       // -1 if unused
+    uint64_t last_used;  // For replacing the least recently used index
+};
+
+struct m2m_converter {
+    int fd;
+    char device[32];
+    m2m_config config;
+
+    // Single- or multi-planar API, whichever the driver implements
+    bool mplane;
+    enum v4l2_buf_type output_type;   // Captured frames into the device
+    enum v4l2_buf_type capture_type;  // Converted frames out of it
+
+    // The converted frame, a single mmap'd buffer since conversion is synchronous
+    void *capture_map;
+    size_t capture_length;
+    uint32_t capture_bytesperline;
+
+    struct m2m_input_slot inputs[M2M_MAX_INPUT_BUFFERS];
+    uint32_t n_inputs;
+    uint64_t clock;
+};
+
+static int xioctl(int fd, unsigned long request, void *arg) {
+    int ret;
+    do {
+        ret = ioctl(fd, request, arg);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// V4L2's XBGR32, ABGR32, BGRX32 and BGRA32 read reversed relative to memory order,
+// the same way every DRM name does; its RGB-first 32-bit names are in memory order.
+// E.g. DRM XRGB8888 is B, G, R, X in memory, V4L2's XBGR32.
+static uint32_t drm_to_v4l2_format(uint32_t drm_format) {
+    switch (drm_format) {
+        case DRM_FORMAT_XRGB8888: return V4L2_PIX_FMT_XBGR32;
+        case DRM_FORMAT_ARGB8888: return V4L2_PIX_FMT_ABGR32;
+        case DRM_FORMAT_XBGR8888: return V4L2_PIX_FMT_RGBX32;
+        case DRM_FORMAT_ABGR8888: return V4L2_PIX_FMT_RGBA32;
+        case DRM_FORMAT_RGBX8888: return V4L2_PIX_FMT_BGRX32;
+        case DRM_FORMAT_RGBA8888: return V4L2_PIX_FMT_BGRA32;
+        case DRM_FORMAT_BGRX8888: return V4L2_PIX_FMT_XRGB32;
+        case DRM_FORMAT_BGRA8888: return V4L2_PIX_FMT_ARGB32;
+        case DRM_FORMAT_RGB888:   return V4L2_PIX_FMT_BGR24;
+        case DRM_FORMAT_BGR888:   return V4L2_PIX_FMT_RGB24;
+        default: return 0;
+    }
+}
+
+static uint32_t output_to_v4l2_format(output_format format) {
+    switch (format) {
+        case OUTPUT_FORMAT_YUYV: return V4L2_PIX_FMT_YUYV;
+        case OUTPUT_FORMAT_NV12: return V4L2_PIX_FMT_NV12;
+        case OUTPUT_FORMAT_I420: return V4L2_PIX_FMT_YUV420;
+        default: return 0;
+    }
+}
+
+// Set a queue's format, the driver must take it unchanged
+// Returns: false if it was refused or adjusted, *bytesperline and *sizeimage are what the driver chose
+static bool set_format(m2m_converter *m2m, enum v4l2_buf_type type, uint32_t pixelformat,
+                       uint32_t width, uint32_t height, uint32_t bytesperline,
+                       uint32_t *result_bytesperline, uint32_t *result_sizeimage) {
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = type;
+    if (m2m->mplane) {
+        fmt.fmt.pix_mp.width = width;
+        fmt.fmt.pix_mp.height = height;
+        fmt.fmt.pix_mp.pixelformat = pixelformat;
+        fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+        fmt.fmt.pix_mp.num_planes = 1;
+        fmt.fmt.pix_mp.plane_fmt[0].bytesperline = bytesperline;
+    } else {
+        fmt.fmt.pix.width = width;
+        fmt.fmt.pix.height = height;
+        fmt.fmt.pix.pixelformat = pixelformat;
+        fmt.fmt.pix.field = V4L2_FIELD_NONE;
+        fmt.fmt.pix.bytesperline = bytesperline;
+    }
+
+    if (xioctl(m2m->fd, VIDIOC_S_FMT, &fmt) < 0) {
+        return false;
+    }
+
+    if (m2m->mplane) {
+        *result_bytesperline = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+        *result_sizeimage = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+        return fmt.fmt.pix_mp.pixelformat == pixelformat && fmt.fmt.pix_mp.num_planes == 1 &&
+               fmt.fmt.pix_mp.width == width && fmt.fmt.pix_mp.height == height;
+    }
+    *result_bytesperline = fmt.fmt.pix.bytesperline;
+    *result_sizeimage = fmt.fmt.pix.sizeimage;
+    return fmt.fmt.pix.pixelformat == pixelformat && fmt.fmt.pix.width == width && fmt.fmt.pix.height == height;
+}
+
+// Convert only the configured area of the source
+static bool set_crop(m2m_converter *m2m) {
+    const m2m_config *config = &m2m->config;
+    if (config->crop_width == 0 ||
+        (config->crop_x == 0 && config->crop_y == 0 &&
+         config->crop_width == config->width && config->crop_height == config->height)) {
+        return true;
+    }
+
+    struct v4l2_selection selection;
+    memset(&selection, 0, sizeof(selection));
+    // VIDIOC_S_SELECTION takes the single-planar type for both APIs
+    selection.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    selection.target = V4L2_SEL_TGT_CROP;
+    selection.r.left = (int32_t)config->crop_x;
+    selection.r.top = (int32_t)config->crop_y;
+    selection.r.width = config->crop_width;
+    selection.r.height = config->crop_height;
+
+    if (xioctl(m2m->fd, VIDIOC_S_SELECTION, &selection) < 0) {
+        return false;
+    }
+    return selection.r.left == (int32_t)config->crop_x && selection.r.top == (int32_t)config->crop_y &&
+           selection.r.width == config->crop_width && selection.r.height == config->crop_height;
+}
+
+static bool request_buffers(m2m_converter *m2m, enum v4l2_buf_type type, enum v4l2_memory memory,
+                            uint32_t count, uint32_t *granted) {
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.type = type;
+    req.memory = memory;
+    req.count = count;
+    if (xioctl(m2m->fd, VIDIOC_REQBUFS, &req) < 0 || req.count == 0) {
+        return false;
+    }
+    *granted = req.count;
+    return true;
+}
+
+static bool map_capture_buffer(m2m_converter *m2m) {
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    memset(planes, 0, sizeof(planes));
+    buf.type = m2m->capture_type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = 0;
+    if (m2m->mplane) {
+        buf.m.planes = planes;
+        buf.length = 1;
+    }
+
+    if (xioctl(m2m->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+        return false;
+    }
+
+    size_t length = m2m->mplane ? planes[0].length : buf.length;
+    off_t offset = m2m->mplane ? (off_t)planes[0].m.mem_offset : (off_t)buf.m.offset;
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, m2m->fd, offset);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    m2m->capture_map = map;
+    m2m->capture_length = length;
+    return true;
+}
+
+static bool set_streaming(m2m_converter *m2m, bool on) {
+    enum v4l2_buf_type types[2] = { m2m->output_type, m2m->capture_type };
+    for (int i = 0; i < 2; i++) {
+        if (xioctl(m2m->fd, on ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &types[i]) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Set up a device that is known to be mem2mem
+// Returns: false with a reason in *why if it can't do the conversion
+static bool configure_device(m2m_converter *m2m, const char **why) {
+    const m2m_config *config = &m2m->config;
+    uint32_t in_format = drm_to_v4l2_format(config->drm_format);
+    uint32_t out_format = output_to_v4l2_format(config->format);
+    uint32_t bytesperline, sizeimage;
+
+    if (!set_format(m2m, m2m->output_type, in_format, config->width, config->height, config->stride,
+                    &bytesperline, &sizeimage) || bytesperline != config->stride) {
+        *why = "source format or stride not supported";
+        return false;
+    }
+    if (!set_crop(m2m)) {
+        *why = "cropping not supported";
+        return false;
+    }
+    if (!set_format(m2m, m2m->capture_type, out_format, config->out_width, config->out_height, 0,
+                    &bytesperline, &sizeimage) || bytesperline < config->out_width) {
+        *why = "output format or size not supported";
+        return false;
+    }
+    m2m->capture_bytesperline = bytesperline;
+
+    uint32_t granted;
+    if (!request_buffers(m2m, m2m->output_type, V4L2_MEMORY_DMABUF, M2M_MAX_INPUT_BUFFERS, &granted)) {
+        *why = "DMA-BUF import not supported";
+        return false;
+    }
+    m2m->n_inputs = granted < M2M_MAX_INPUT_BUFFERS ? granted : M2M_MAX_INPUT_BUFFERS;
+
+    if (!request_buffers(m2m, m2m->capture_type, V4L2_MEMORY_MMAP, 1, &granted) || !map_capture_buffer(m2m)) {
+        *why = "output buffers can't be mapped";
+        return false;
+    }
+    if (m2m->capture_length < (size_t)bytesperline * config->out_height) {
+        *why = "output buffer too small";
+        return false;
+    }
+
+    if (!set_streaming(m2m, true)) {
+        *why = "streaming failed to start";
+        return false;
+    }
+    return true;
+}
+
+// Open a device and set it up if it is a mem2mem device
+// Parameters:
+//   verbose: Say why a device was rejected, for devices asked for by name
+static bool open_device(m2m_converter *m2m, const char *device, bool verbose) {
+    m2m->fd = open(device, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (m2m->fd < 0) {
+        if (verbose) {
+            fprintf(stderr, "Failed to open %s: %s\n", device, strerror(errno));
+        }
+        return false;
+    }
+
+    const char *why = NULL;
+    struct v4l2_capability cap;
+    memset(&cap, 0, sizeof(cap));
+    if (xioctl(m2m->fd, VIDIOC_QUERYCAP, &cap) < 0) {
+        why = "not a V4L2 device";
+    } else {
+        uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+        if (!(caps & V4L2_CAP_STREAMING) || !(caps & (V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE))) {
+            why = "not a mem2mem device";
+        } else {
+            m2m->mplane = (caps & V4L2_CAP_VIDEO_M2M_MPLANE) != 0;
+            m2m->output_type = m2m->mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+            m2m->capture_type = m2m->mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if (configure_device(m2m, &why)) {
+                snprintf(m2m->device, sizeof(m2m->device), "%s", device);
+                printf("Mem2mem converter: %s (%s)\n", device, (const char *)cap.card);
+                return true;
+            }
+        }
+    }
+
+    if (verbose) {
+        fprintf(stderr, "%s can't convert: %s\n", device, why);
+    }
+    if (m2m->capture_map) {
+        munmap(m2m->capture_map, m2m->capture_length);
+        m2m->capture_map = NULL;
+    }
+    close(m2m->fd);
+    m2m->fd = -1;
+    return false;
+}
+
+// Whether a node is one of the devices not to open
+static bool is_excluded(const struct stat *st, const char *const *exclude, uint32_t n_exclude) {
+    for (uint32_t i = 0; i < n_exclude; i++) {
+        struct stat excluded;
+        if (stat(exclude[i], &excluded) == 0 && S_ISCHR(excluded.st_mode) && excluded.st_rdev == st->st_rdev) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t m2m_find_devices(const char *const *exclude, uint32_t n_exclude, m2m_device *devices, uint32_t max) {
+    uint32_t n_devices = 0;
+
+    for (int i = 0; i < M2M_MAX_PROBED_DEVICES && n_devices < max; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/video%d", i);
+
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISCHR(st.st_mode) || is_excluded(&st, exclude, n_exclude)) {
+            continue;
+        }
+
+        int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+
+        struct v4l2_capability cap;
+        memset(&cap, 0, sizeof(cap));
+        if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == 0) {
+            uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+            // v4l2loopback without exclusive_caps reports both directions as mem2mem
+            if ((caps & V4L2_CAP_STREAMING) && (caps & (V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE)) &&
+                strcmp((const char *)cap.driver, "v4l2 loopback") != 0) {
+                snprintf(devices[n_devices].path, sizeof(devices[n_devices].path), "%s", path);
+                n_devices++;
+            }
+        }
+        close(fd);
+    }
+
+    return n_devices;
+}
+
+m2m_converter* m2m_converter_create(const char *device, const m2m_config *config) {
+    if (drm_to_v4l2_format(config->drm_format) == 0 || output_to_v4l2_format(config->format) == 0) {
+        return NULL;
+    }
+
+    m2m_converter *m2m = calloc(1, sizeof(m2m_converter));
+    if (!m2m) {
+        fprintf(stderr, "Failed to allocate mem2mem converter\n");
+        return NULL;
+    }
+    m2m->fd = -1;
+    m2m->config = *config;
+    for (uint32_t i = 0; i < M2M_MAX_INPUT_BUFFERS; i++) {
+        m2m->inputs[i].dmabuf_fd = -1;
+    }
+
+    if (!device || !open_device(m2m, device, true)) {
+        free(m2m);
+        return NULL;
+    }
+    return m2m;
+}
+
+void m2m_converter_destroy(m2m_converter *m2m) {
+    if (!m2m) {
+        return;
+    }
+
+    if (m2m->fd >= 0) {
+        set_streaming(m2m, false);
+    }
+    if (m2m->capture_map) {
+        munmap(m2m->capture_map, m2m->capture_length);
+    }
+    if (m2m->fd >= 0) {
+        close(m2m->fd);
+    }
+    free(m2m);
+}
+
+// Buffer index for a DMA-BUF, the same buffer keeps its index so the driver
+// reuses its attachment instead of mapping it for the device again
+static uint32_t input_index(m2m_converter *m2m, int dmabuf_fd) {
+    uint32_t oldest = 0;
+    for (uint32_t i = 0; i < m2m->n_inputs; i++) {
+        if (m2m->inputs[i].dmabuf_fd == dmabuf_fd) {
+            oldest = i;
+            break;
+        }
+        if (m2m->inputs[i].last_used < m2m->inputs[oldest].last_used) {
+            oldest = i;
+        }
+    }
+
+    m2m->inputs[oldest].dmabuf_fd = dmabuf_fd;
+    m2m->inputs[oldest].last_used = ++m2m->clock;
+    return oldest;
+}
+
+static bool queue_buffer(m2m_converter *m2m, enum v4l2_buf_type type, enum v4l2_memory memory, uint32_t index,
+                         int dmabuf_fd, uint32_t offset, size_t length, size_t bytesused) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    memset(&plane, 0, sizeof(plane));
+    buf.type = type;
+    buf.memory = memory;
+    buf.index = index;
+    buf.field = V4L2_FIELD_NONE;
+
+    if (m2m->mplane) {
+        plane.length = (uint32_t)length;
+        plane.bytesused = (uint32_t)(bytesused + offset);
+        plane.data_offset = offset;
+        if (memory == V4L2_MEMORY_DMABUF) {
+            plane.m.fd = dmabuf_fd;
+        }
+        buf.m.planes = &plane;
+        buf.length = 1;
+    } else {
+        buf.length = (uint32_t)length;
+        buf.bytesused = (uint32_t)bytesused;
+        if (memory == V4L2_MEMORY_DMABUF) {
+            buf.m.fd = dmabuf_fd;
+        }
+    }
+
+    return xioctl(m2m->fd, VIDIOC_QBUF, &buf) == 0;
+}
+
+// Wait for and take back the buffer of one queue
+static bool dequeue_buffer(m2m_converter *m2m, enum v4l2_buf_type type, enum v4l2_memory memory, size_t *bytesused) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buf;
+
+    while (true) {
+        memset(&buf, 0, sizeof(buf));
+        memset(&plane, 0, sizeof(plane));
+        buf.type = type;
+        buf.memory = memory;
+        if (m2m->mplane) {
+            buf.m.planes = &plane;
+            buf.length = 1;
+        }
+
+        if (xioctl(m2m->fd, VIDIOC_DQBUF, &buf) == 0) {
+            break;
+        }
+        if (errno != EAGAIN) {
+            return false;
+        }
+
+        // Finished capture buffers wake POLLIN, consumed output buffers POLLOUT
+        struct pollfd pfd = { .fd = m2m->fd, .events = type == m2m->capture_type ? POLLIN : POLLOUT };
+        if (poll(&pfd, 1, M2M_TIMEOUT_MS) <= 0 || (pfd.revents & POLLERR)) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+    }
+
+    if (bytesused) {
+        *bytesused = m2m->mplane ? plane.bytesused - plane.data_offset : buf.bytesused;
+    }
+    return (buf.flags & V4L2_BUF_FLAG_ERROR) == 0;
+}
+
+static void copy_plane(uint8_t *dst, uint32_t dst_stride, const uint8_t *src, uint32_t src_stride,
+                       uint32_t row_bytes, uint32_t rows) {
+    if (dst_stride == src_stride && row_bytes == src_stride) {
+        memcpy(dst, src, (size_t)row_bytes * rows);
+        return;
+    }
+    for (uint32_t y = 0; y < rows; y++) {
+        memcpy(dst + (size_t)y * dst_stride, src + (size_t)y * src_stride, row_bytes);
+    }
+}
+
+// Copy the capture buffer into out with packed rows, V4L2 pads each plane's rows to bytesperline
+static bool copy_output(m2m_converter *m2m, size_t used, uint8_t *out, size_t out_size) {
+    const m2m_config *config = &m2m->config;
+    uint32_t width = config->out_width;
+    uint32_t height = config->out_height;
+    uint32_t chroma_width = (width + 1) / 2;
+    uint32_t chroma_height = (height + 1) / 2;
+    uint32_t stride = m2m->capture_bytesperline;
+    const uint8_t *src = m2m->capture_map;
+
+    size_t needed;
+    switch (config->format) {
+        case OUTPUT_FORMAT_NV12:
+            needed = (size_t)stride * (height + chroma_height);
+            break;
+        case OUTPUT_FORMAT_I420:
+            needed = (size_t)stride * height + (size_t)(stride / 2) * chroma_height * 2;
+            break;
+        default:
+            needed = (size_t)stride * height;
+            break;
+    }
+    if (used < needed || needed > m2m->capture_length || out_size < output_frame_size(config->format, width, height)) {
+        return false;
+    }
+
+    switch (config->format) {
+        case OUTPUT_FORMAT_NV12:
+            copy_plane(out, width, src, stride, width, height);
+            copy_plane(out + (size_t)width * height, chroma_width * 2, src + (size_t)stride * height, stride,
+                       chroma_width * 2, chroma_height);
+            break;
+        case OUTPUT_FORMAT_I420: {
+            const uint8_t *u = src + (size_t)stride * height;
+            const uint8_t *v = u + (size_t)(stride / 2) * chroma_height;
+            uint8_t *out_u = out + (size_t)width * height;
+            uint8_t *out_v = out_u + (size_t)chroma_width * chroma_height;
+            copy_plane(out, width, src, stride, width, height);
+            copy_plane(out_u, chroma_width, u, stride / 2, chroma_width, chroma_height);
+            copy_plane(out_v, chroma_width, v, stride / 2, chroma_width, chroma_height);
+            break;
+        }
+        default:
+            copy_plane(out, width * 2, src, stride, width * 2, height);
+            break;
+    }
+    return true;
+}
+
+bool m2m_converter_convert(m2m_converter *m2m, int dmabuf_fd, uint32_t offset, size_t length,
+                           uint8_t *out, size_t out_size) {
+    if (!m2m || dmabuf_fd < 0) {
+        return false;
+    }
+
+    // The single-planar API has no data offset for imported buffers
+    size_t frame_bytes = (size_t)m2m->config.stride * m2m->config.height;
+    if ((!m2m->mplane && offset != 0) || (size_t)offset + frame_bytes > length) {
+        return false;
+    }
+
+    uint32_t index = input_index(m2m, dmabuf_fd);
+    if (!queue_buffer(m2m, m2m->output_type, V4L2_MEMORY_DMABUF, index, dmabuf_fd, offset, length, frame_bytes)) {
+        m2m->inputs[index].dmabuf_fd = -1;
+        return false;
+    }
+
+    size_t used = 0;
+    bool converted = queue_buffer(m2m, m2m->capture_type, V4L2_MEMORY_MMAP, 0, -1, 0, m2m->capture_length, 0) &&
+                     dequeue_buffer(m2m, m2m->capture_type, V4L2_MEMORY_MMAP, &used);
+    bool released = dequeue_buffer(m2m, m2m->output_type, V4L2_MEMORY_DMABUF, NULL);
+
+    if (!converted || !released) {
+        // Take back whatever the device still holds, so the next frame starts clean
+        fprintf(stderr, "Mem2mem conversion on %s failed: %s\n", m2m->device, strerror(errno));
+        set_streaming(m2m, false);
+        set_streaming(m2m, true);
+        return false;
+    }
+
+    return copy_output(m2m, used, out, out_size);
+}
+
+const char* m2m_converter_get_device(m2m_converter *m2m) {
+    return m2m ? m2m->device : NULL;
+}
+
+const m2m_config* m2m_converter_get_config(m2m_converter *m2m) {
+    return m2m ? &m2m->config : NULL;
+}
@@ -0,0 +1,79 @@
+#ifndef M2M_CONVERT_H
+#define M2M_CONVERT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "convert.h"
+
+// DMA-BUFs kept attached to the device at once, one per buffer of the PipeWire pool
+#define M2M_MAX_INPUT_BUFFERS 8
+
+// Upper bound of mem2mem devices m2m_find_devices reports
+#define M2M_MAX_DEVICES 8
+
+// Color conversion on a V4L2 mem2mem device (--convert-backend m2m)
+// The scaler/CSC blocks of many SoCs (e.g., Rockchip RGA, NXP PXP, Samsung
+// GScaler) take a linear DMA-BUF on their OUTPUT queue and write YUYV, NV12 or
+// I420 into mmap'd CAPTURE buffers, which are copied into the loopback buffer.
+// Neither the CPU nor the GPU touches the pixels.
+typedef struct m2m_converter m2m_converter;
+
+// What one converter does, fixed when it is created
+typedef struct {
+    uint32_t drm_format;  // DRM fourcc of the captured buffers (XRGB8888 ...)
+    uint32_t width;       // Captured frame size
+    uint32_t height;
+    uint32_t stride;      // Bytes per row of the captured buffers
+    uint32_t crop_x;      // Area that is converted, crop_width 0 = the whole frame
+    uint32_t crop_y;
+    uint32_t crop_width;
+    uint32_t crop_height;
+    output_format format;  // YUYV, NV12 or I420
+    uint32_t out_width;    // Converted size, the device scales the area to it
+    uint32_t out_height;
+} m2m_config;
+
+// Node of a mem2mem device
+typedef struct {
+    char path[32];
+} m2m_device;
+
+// Find the mem2mem devices among /dev/videoN, only querying their capabilities
+// Loopback devices may advertise mem2mem too and are skipped: the ones in
+// exclude by device number without being opened, others by driver name.
+// Opening a webcam's node wakes the camera, so this is meant to run once.
+// Parameters:
+//   exclude: Device paths not to open, e.g. the loopback devices written to
+//   devices: Receives up to max devices
+// Returns: Number of devices found
+uint32_t m2m_find_devices(const char *const *exclude, uint32_t n_exclude, m2m_device *devices, uint32_t max);
+
+// Set up a mem2mem device for this conversion and start it
+// Parameters:
+//   device: Device to use, e.g. one found by m2m_find_devices
+//   config: Source layout and output of the conversion
+// Returns NULL if the device doesn't take the formats, sizes or crop exactly
+m2m_converter* m2m_converter_create(const char *device, const m2m_config *config);
+
+// Stop the device and close it
+void m2m_converter_destroy(m2m_converter *m2m);
+
+// Convert one frame, waits until the device returns it
+// Parameters:
+//   dmabuf_fd: Linear buffer in the layout of the config
+//   offset: Start of the frame in the buffer
+//   length: Size of the buffer in bytes
+//   out: Receives the output frame with packed rows, as convert_frame writes it
+//   out_size: Size of out, at least output_frame_size of the config
+// Returns: false if the device failed or timed out, the converter stays usable
+bool m2m_converter_convert(m2m_converter *m2m, int dmabuf_fd, uint32_t offset, size_t length,
+                           uint8_t *out, size_t out_size);
+
+// Device node the converter runs on
+const char* m2m_converter_get_device(m2m_converter *m2m);
+
+// The config the converter was created with
+const m2m_config* m2m_converter_get_config(m2m_converter *m2m);
+
+#endif // M2M_CONVERT_H
@@ -3,12 +3,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <inttypes.h>
 #include <locale.h>
 #include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <linux/videodev2.h>
 #include <pipewire/pipewire.h>
 #include <spa/param/video/format-utils.h>
@@ -23,78 +27,281 @@
 #include <spa/param/video/format.h>
 #include "portal.h"
 #include "gl_handler.h"
+#include "v4l2_sink.h"
+#include "frame_queue.h"
+#include "thread_pool.h"
+#include "convert_bgrx.h"
+#include "convert.h"
+#include "mjpeg_encoder.h"
+#include "m2m_convert.h"
+#include "frame_pacer.h"
+#include "stats.h"
+#include "capture_file.h"
+#include "trace.h"
+#include "realtime.h"
 
 #define DEFAULT_V4L2_DEVICE "/dev/video0"
 
-// Global debug flag
-static bool debug_enabled = false;
+// Streams of one portal session, each written to its own loopback device
+#define MAX_STREAMS 8
 
-// Global app data for signal handling
-static struct app_data *global_app_data = NULL;
+struct app_shared;
 
-#define DEBUG_PRINT(...) do { \
-    if (debug_enabled) { \
-        printf(__VA_ARGS__); \
-    } \
-} while(0)
+// Global app state for signal handling
+static struct app_shared *global_app = NULL;
 
+// Debug messages for setup and rare events, per-frame ones use TRACE_FRAME
+#define DEBUG_PRINT(...) TRACE(__VA_ARGS__)
+
+// What the capture thread does when the conversion worker falls behind
+typedef enum {
+    QUEUE_POLICY_DROP_OLDEST,  // Evict the oldest queued frame, keeps latency low
+    QUEUE_POLICY_BLOCK,        // Leave new buffers with PipeWire until there is room
+} queue_policy;
+
+// Frames the worker may lag behind by default
+#define DEFAULT_QUEUE_DEPTH 2
+
+// Frame rate of the color bars without --fps
+#define COLOR_BARS_FPS 30
+
+// Frames per second re-sent while the screen is idle by default
+#define DEFAULT_KEEP_ALIVE_FPS 2
+
+// Frames dropped after the device format is set, the first ones may be uninitialized
+#define STARTUP_SKIP_FRAMES 5
+
+// Wait before the second reconnect attempt in a row, doubled up to the maximum
+#define RECONNECT_DELAY_MS 250
+#define RECONNECT_MAX_DELAY_MS 5000
+
+// How often portal signals are delivered while the PipeWire loop runs
+#define PORTAL_DISPATCH_INTERVAL_MS 100
+
+// How the streams are arranged when composited into one device (--compose)
+typedef enum {
+    COMPOSE_NONE,          // Each stream goes to its own device
+    COMPOSE_SIDE_BY_SIDE,  // Streams next to each other in selection order, vertically centered
+    COMPOSE_PIP,           // First stream fills the frame, the others are insets in the bottom right
+} compose_layout;
+
+// Picture-in-picture insets are this fraction of the frame width, with a margin of PIP_MARGIN_DIV
+#define PIP_INSET_DIV 4
+#define PIP_MARGIN_DIV 32
+
+// What converts DMA-BUF frames (--convert-backend), shared memory frames always go to the CPU
+typedef enum {
+    CONVERT_BACKEND_AUTO,  // Time the others on the first frames of each format, keep the fastest
+    CONVERT_BACKEND_GL,    // Pack YUYV on the GPU, other formats are read back as RGBA for the CPU
+    CONVERT_BACKEND_CPU,   // Map linear buffers and convert on the CPU, the GPU only detiles
+    CONVERT_BACKEND_M2M,   // V4L2 mem2mem scaler/CSC device, linear buffers only
+} convert_backend;
+
+// Frames each backend converts while --convert-backend auto calibrates
+#define CALIBRATION_FRAMES 10
+
+// Frame rate deadlines are counted against when neither the producer nor --fps sets one
+#define DEADLINE_DEFAULT_FPS 60
+
+// One captured stream and the loopback device it goes to
 struct app_data {
-    struct pw_main_loop *loop;
-    struct pw_context *context;
-    struct pw_core *core;
+    struct app_shared *shared;
     struct pw_stream *stream;
     struct spa_hook stream_listener;
-    PortalSession *portal_session;
-    int v4l2_fd;
+    const char *device;  // Path of the loopback device
+    v4l2_sink *sink;  // Loopback device (streaming I/O or write() fallback)
     uint32_t width;
     uint32_t height;
     uint32_t stride;  // Stride in bytes (may be larger than width * bytes_per_pixel due to padding)
     uint32_t node_id;
     uint32_t spa_format;
+    uint64_t modifier;  // DRM format modifier of DMA buffers, DRM_FORMAT_MOD_INVALID if implicit
     uint32_t v4l2_format;
-    bool portal_ready;
     bool stream_ready;
     bool format_set;
+    bool output_failed;     // The current format couldn't be set up, frames are skipped until the next one
     bool color_bars_mode;
+    bool zero_copy;         // Pass linear DMA-BUFs straight to the device (--zero-copy)
+    bool zero_copy_active;  // Device is configured for DMA-BUF passthrough of the current format
     int frame_skip_count;
-    uint8_t *conversion_buffer;
-    size_t conversion_buffer_size;
-    gl_context *gl_ctx;  // OpenGL context for DMA buffer handling
+    int write_error_count;  // Consecutive failed device writes
     uint8_t *gl_buffer;  // Buffer for OpenGL readback
     size_t gl_buffer_size;
+    uint8_t *frame_arena;  // ARGB row strips for formats without a direct route, sized per format
+    size_t frame_arena_size;
+    gl_output_region requested_region;  // --crop and --size, zeros = the whole stream at its own size
+    gl_output_region region;            // Resolved against the stream size, what reaches the device
+    struct spa_region content;          // SPA_META_VideoCrop of the last frame, zero size = the whole buffer
+    bool region_active;                 // region differs from the whole stream
+    bool gpu_region;                    // GL readback is cropped and scaled to region already
+    uint8_t *scaled_frame;              // CPU crop/scale output (ARGBScale)
+    size_t scaled_frame_size;
+    output_format requested_format;  // --format
+    output_format out_format;        // Format the device accepted, YUYV if the requested one was refused
+    mjpeg_encoder *mjpeg;            // Created on first use of MJPEG output
+    int jpeg_quality;
+    uint8_t *shadow_frame;  // Last YUYV frame, damaged regions are reconverted into it
+    size_t shadow_frame_size;
+    bool shadow_valid;      // shadow_frame matches the previous buffer the producer sent
+    uint64_t shadow_dropped;  // Frames dropped by the queue when shadow_frame was last updated
+
+    // Capture -> conversion pipeline
+    // The PipeWire RT thread only moves buffers between the queues, the worker
+    // converts and writes.
+    frame_queue *frame_queue;    // RT thread -> worker, buffers waiting for conversion
+    frame_queue *return_queue;   // worker -> RT thread, buffers to give back to PipeWire
+    queue_policy queue_policy;
+    uint32_t queue_depth;
+    struct spa_source *return_event;
+    uint64_t frames_converted;
+
+    // Raw frame recording and offline replay through the same pipeline
+    capture_file *recorder;      // --record, owned by the conversion worker
+    const char *replay_path;     // --replay
+    bool replay_realtime;        // Keep the recorded frame spacing instead of going flat out
+
+    // Duplicate frame suppression, owned by the conversion worker
+    uint32_t keep_alive_fps;     // Minimum rate frames reach the device while nothing changes, 0 = none
+    uint64_t last_push_ns;       // CLOCK_MONOTONIC time of the last frame sent, 0 if none since the format was set
+    uint64_t last_hash;          // Sampled hash of the last frame, for producers without damage metadata
+    bool last_hash_valid;
+
+    // Frame rate cap (--fps), asked of the producer with maxFramerate and enforced by pacer
+    uint32_t max_fps;            // 0 = as fast as the producer sends
+    frame_pacer *pacer;          // NULL without a cap, owned by the conversion worker
+    uint64_t frame_interval_ns;  // Negotiated frame rate, 0 = not announced by the producer
+
+    bool latency_barcode;        // Stamp color bars with a frame counter and time (--latency-barcode)
+    uint32_t barcode_frame;      // Frame counter of the next barcode
+
+    struct pw_buffer *compose_buffer;  // Newest frame of a --compose source, held until a newer one arrives
+
+    // Conversion backend of the current format, owned by the conversion worker
+    convert_backend requested_backend;   // --convert-backend
+    convert_backend backend;             // Converting the current format, changes while calibrating
+    bool calibrating;                    // Auto selection is still timing backends
+    uint32_t calibration_frames;         // Frames timed of backend so far
+    uint64_t calibration_total_ns;
+    uint64_t backend_ns[CONVERT_BACKEND_M2M + 1];  // Mean time per frame of each timed backend, 0 = not timed
+    m2m_converter *m2m;                  // Created on the first DMA-BUF of a format
+    bool m2m_failed;                     // No device takes the current format, or it failed
+};
+
+// State shared by every stream: one PipeWire connection, one GL context and
+// one conversion worker, whose thread pool converts the frames of all streams
+struct app_shared {
+    struct pw_main_loop *loop;
+    struct pw_context *context;
+    struct pw_core *core;
+    struct pw_loop *data_loop;   // Loop running on_stream_process (PW_STREAM_FLAG_RT_PROCESS)
+    PortalSession *portal_session;
+    bool portal_ready;
+    struct spa_source *portal_timer;  // Delivers portal signals while the PipeWire loop runs
+
+    // A lost capture (session closed, stream error, failing writes) is set up
+    // again in place: only the PipeWire streams, the core and the portal
+    // session are replaced, the devices stay open and the worker keeps
+    // repeating their last frame meanwhile
+    bool reconnect;              // Reconnect instead of exiting (default, --no-reconnect)
+    bool reconnect_pending;      // Set from any thread along with quitting the loop
+    uint32_t n_devices;          // Streams with a device, n_streams is lower while some have no node
+    gl_context *gl_ctx;          // OpenGL context for DMA buffer handling, used by the worker
+    pthread_t gl_init_thread;    // Creates gl_ctx while the devices and the portal are set up
+    bool gl_init_running;        // gl_ctx may only be used after join_gl_init
+    bool gl_init_reported;       // join_gl_init printed what the context supports
+    uint32_t readback_depth;     // --readback-depth, applied by the init thread
+    const char *render_node;     // --render-node, NULL = the GPU the display was booted on
+    uint64_t gl_init_ns;         // How long creating the context took
+    m2m_device m2m_devices[M2M_MAX_DEVICES];  // Found once at startup for --convert-backend auto/m2m
+    uint32_t n_m2m_devices;
+    struct app_data *streams[MAX_STREAMS];
+    uint32_t n_streams;
+    const struct app_data *options;  // Command line settings new streams start from
+    uint32_t source_types;       // PORTAL_SOURCE_* the dialog offers (--source)
+    char *restore_token_path;    // Where the portal selection is persisted, NULL with --no-restore
+
+    // With --compose the streams are sources without a device, composited on
+    // the GPU into the frames of compose_output, which owns the device
+    compose_layout compose;
+    struct app_data *compose_output;
+    uint32_t compose_width;      // --size, 0 = the size of the layout at 1:1
+    uint32_t compose_height;
+    gl_composite_rect compose_rects[MAX_STREAMS];
+
+    // The worker takes queued buffers from the streams in turn. pipeline_lock
+    // is held by the worker for each frame and by the main thread while the
+    // format or buffer pool of a stream changes.
+    pthread_t worker_thread;
+    bool worker_running;
+    sem_t worker_sem;            // Posted once per buffer queued on any stream
+    pthread_mutex_t pipeline_lock;
+    uint32_t next_stream;        // Stream the worker looks at first for the next frame
+    bool stopping;               // Set by the signal handler to end a replay
+
+    // Band-parallel color conversion, owned by the conversion worker
+    thread_pool *convert_pool;
+    uint32_t convert_threads;    // Threads per conversion including the worker, 0 = one per CPU
+    bool pin_cores;
+    bool realtime;               // --rt: SCHED_FIFO conversion threads, locked frame buffers
+
+    // Instrumentation of all streams together, recorded from any thread
+    stats *stats;
+    uint32_t stats_interval;     // Seconds between stats lines on stderr, 0 = none
+    struct spa_source *stats_timer;
+};
+
+// Attached to each pw_buffer of the pool (pw_buffer.user_data)
+struct buffer_info {
+    uint64_t dequeue_ns;  // When the RT thread took the buffer from PipeWire
+    uint64_t pts_ns;      // Compositor's presentation time on CLOCK_MONOTONIC, 0 if unknown
 };
 
+// Producer pts further than this from the graph clock is taken to be on another clock
+#define PTS_MAX_SKEW_NS 1000000000LL
+
 // Signal handler for graceful shutdown
 static void signal_handler(int sig) {
     printf("\nReceived signal %d, shutting down gracefully...\n", sig);
 
-    if (global_app_data) {
-        if (global_app_data->loop) {
-            pw_main_loop_quit(global_app_data->loop);
+    if (global_app) {
+        __atomic_store_n(&global_app->stopping, true, __ATOMIC_RELAXED);
+
+        if (global_app->loop) {
+            pw_main_loop_quit(global_app->loop);
         }
 
-        if (global_app_data->portal_session) {
-            portal_quit_main_loop(global_app_data->portal_session);
+        if (global_app->portal_session) {
+            portal_quit_main_loop(global_app->portal_session);
         }
     }
 }
 
-// Session closed callback
-static void on_portal_session_closed(PortalSession *session, void *user_data) {
-    struct app_data *data = (struct app_data*)user_data;
-    (void)session; // Mark parameter as intentionally unused
-
-    DEBUG_PRINT("DEBUG: on_portal_session_closed callback invoked\n");
-    printf("Screen sharing stopped from GNOME UI, shutting down...\n");
+// Leave the PipeWire loop so that main sets the capture up again, or exits
+// with --no-reconnect. Can be called from any thread, only the first call counts.
+static void request_reconnect(struct app_shared *app, const char *reason) {
+    if (__atomic_load_n(&app->stopping, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&app->reconnect_pending, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
 
-    if (data->loop) {
+    printf("%s, %s...\n", reason, app->reconnect ? "reconnecting" : "shutting down");
+    if (app->loop) {
         DEBUG_PRINT("DEBUG: Quitting PipeWire main loop\n");
-        pw_main_loop_quit(data->loop);
+        pw_main_loop_quit(app->loop);
     } else {
         DEBUG_PRINT("DEBUG: No PipeWire loop to quit\n");
     }
 }
 
+// Session closed callback
+static void on_portal_session_closed(PortalSession *session, void *user_data) {
+    struct app_shared *app = (struct app_shared*)user_data;
+    (void)session; // Mark parameter as intentionally unused
+
+    DEBUG_PRINT("DEBUG: on_portal_session_closed callback invoked\n");
+    request_reconnect(app, "Screen sharing stopped from GNOME UI");
+}
+
 // Helper function to copy frame data line by line, removing stride padding
 static void copy_frame_data_with_stride(uint8_t *dst, const uint8_t *src,
                                         uint32_t width, uint32_t height,
@@ -108,46 +315,27 @@ static void copy_frame_data_with_stride(uint8_t *dst, const uint8_t *src,
     }
 }
 
-// Helper to create a packed buffer from strided data
-static uint8_t* create_packed_buffer(const uint8_t *src, uint32_t width, uint32_t height,
-                                     uint32_t src_stride, uint32_t bytes_per_pixel) {
-    uint32_t packed_stride = width * bytes_per_pixel;
-    uint32_t packed_size = packed_stride * height;
-    uint8_t *packed = malloc(packed_size);
-
-    if (!packed) {
-        printf("ERROR: Failed to allocate packed buffer\n");
-        return NULL;
-    }
-
-    // Copy line by line to remove padding
-    for (uint32_t y = 0; y < height; y++) {
-        const uint8_t *src_line = src + (y * src_stride);
-        uint8_t *dst_line = packed + (y * packed_stride);
-        memcpy(dst_line, src_line, packed_stride);
-    }
-
-    return packed;
-}
-
+// V4L2's XBGR32, ABGR32, BGRX32 and BGRA32 read reversed relative to memory order,
+// the same way every DRM name does; its RGB-first 32-bit names are in memory order.
+// SPA names are in memory order, e.g. BGRx is XBGR32.
 static uint32_t spa_to_v4l2_format(uint32_t spa_format) {
     switch (spa_format) {
         case 7: // SPA_VIDEO_FORMAT_RGBx
-            return V4L2_PIX_FMT_RGB32;
+            return V4L2_PIX_FMT_RGBX32;
         case 8: // SPA_VIDEO_FORMAT_BGRx
-            return V4L2_PIX_FMT_BGR32;
+            return V4L2_PIX_FMT_XBGR32;
         case 9: // SPA_VIDEO_FORMAT_xRGB
             return V4L2_PIX_FMT_XRGB32;
         case 10: // SPA_VIDEO_FORMAT_xBGR
-            return V4L2_PIX_FMT_XBGR32;
+            return V4L2_PIX_FMT_BGRX32;
         case 11: // SPA_VIDEO_FORMAT_RGBA
             return V4L2_PIX_FMT_RGBA32;
         case 12: // SPA_VIDEO_FORMAT_BGRA
-            return V4L2_PIX_FMT_BGRA32;
+            return V4L2_PIX_FMT_ABGR32;
         case 13: // SPA_VIDEO_FORMAT_ARGB
             return V4L2_PIX_FMT_ARGB32;
         case 14: // SPA_VIDEO_FORMAT_ABGR
-            return V4L2_PIX_FMT_ABGR32;
+            return V4L2_PIX_FMT_BGRA32;
         case 15: // SPA_VIDEO_FORMAT_RGB
             return V4L2_PIX_FMT_RGB24;
         case 16: // SPA_VIDEO_FORMAT_BGR
@@ -158,6 +346,31 @@ static uint32_t spa_to_v4l2_format(uint32_t spa_format) {
     }
 }
 
+// SPA names formats by byte order in memory, DRM by a little-endian 32-bit word,
+// so the component order reads reversed. Returns 0 for formats GL can't import.
+static uint32_t spa_to_drm_format(uint32_t spa_format) {
+    switch (spa_format) {
+        case 7: // SPA_VIDEO_FORMAT_RGBx
+            return DRM_FORMAT_XBGR8888;
+        case 8: // SPA_VIDEO_FORMAT_BGRx
+            return DRM_FORMAT_XRGB8888;
+        case 9: // SPA_VIDEO_FORMAT_xRGB
+            return DRM_FORMAT_BGRX8888;
+        case 10: // SPA_VIDEO_FORMAT_xBGR
+            return DRM_FORMAT_RGBX8888;
+        case 11: // SPA_VIDEO_FORMAT_RGBA
+            return DRM_FORMAT_ABGR8888;
+        case 12: // SPA_VIDEO_FORMAT_BGRA
+            return DRM_FORMAT_ARGB8888;
+        case 13: // SPA_VIDEO_FORMAT_ARGB
+            return DRM_FORMAT_BGRA8888;
+        case 14: // SPA_VIDEO_FORMAT_ABGR
+            return DRM_FORMAT_RGBA8888;
+        default:
+            return 0;
+    }
+}
+
 static void generate_color_bars_yuyv(uint8_t *dst, int width, int height) {
     // Generate SMPTE color bars in YUYV format
     // Colors: White, Yellow, Cyan, Green, Magenta, Red, Blue, Black
@@ -215,195 +428,68 @@ static void generate_color_bars_xrgb32(uint8_t *dst, int width, int height) {
     }
 }
 
-static void convert_rgb24_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
-    // RGB24 format: [R][G][B]
-    // Need to convert to ARGB format first (add alpha), then to YUY2
-
-    uint8_t *temp_argb = malloc(width * height * 4);
-    if (!temp_argb) {
-        printf("ERROR: Failed to allocate temporary buffer for RGB24 conversion\n");
-        return;
-    }
-
-    // Convert RGB24 to ARGB
-    int result1 = RGB24ToARGB(src, src_stride,          // source: use actual stride
-                              temp_argb, width * 4,     // destination: stride = width * 4 bytes
-                              width, height);
-
-    if (result1 != 0) {
-        printf("ERROR: RGB24ToARGB conversion failed with result %d\n", result1);
-        free(temp_argb);
-        return;
-    }
-
-    // Convert ARGB to YUY2
-    int result2 = ARGBToYUY2(temp_argb, width * 4,     // source
-                             dst, width * 2,            // destination
-                             width, height);
-
-    if (result2 != 0) {
-        printf("ERROR: ARGBToYUY2 conversion failed with result %d\n", result2);
-    }
-
-    free(temp_argb);
-}
-
-static void convert_rgba32_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
-    // RGBA format: [R][G][B][A]
-    // Need to convert to ARGB format first, then to YUY2
-
-    uint8_t *temp_argb = malloc(width * height * 4);
-    if (!temp_argb) {
-        printf("ERROR: Failed to allocate temporary buffer for RGBA conversion\n");
+// Paint the latency barcode over the bottom rows of a YUYV frame
+// Layout, so a consumer can decode it: LATENCY_BARCODE_BITS cells side by side from
+// the left edge, each (width / LATENCY_BARCODE_BITS) & ~1 pixels wide, in the bottom
+// height / LATENCY_BARCODE_HEIGHT_DIV rows. A white cell (Y 235) is a 1 and a black cell
+// (Y 16) a 0, read MSB first: the 32-bit frame counter, then the 64-bit CLOCK_MONOTONIC
+// time in nanoseconds at which the frame was queued. Sample the luma at each cell's
+// center and threshold it at 128, the cells survive scaling and MJPEG re-encoding.
+#define LATENCY_BARCODE_BITS 96
+#define LATENCY_BARCODE_HEIGHT_DIV 16
+#define LATENCY_BARCODE_MIN_WIDTH (LATENCY_BARCODE_BITS * 2)
+
+static void draw_latency_barcode_yuyv(uint8_t *dst, int width, int height, uint32_t frame, uint64_t timestamp_ns) {
+    int cell_width = (width / LATENCY_BARCODE_BITS) & ~1;
+    int rows = height / LATENCY_BARCODE_HEIGHT_DIV;
+    if (cell_width < 2 || rows < 1) {
         return;
     }
 
-    // Convert RGBA to ARGB
-    int result1 = RGBAToARGB(src, src_stride,           // source: use actual stride
-                             temp_argb, width * 4,      // destination
-                             width, height);
-
-    if (result1 != 0) {
-        printf("ERROR: RGBAToARGB conversion failed with result %d\n", result1);
-        free(temp_argb);
-        return;
+    size_t row_size = (size_t)width * 2;
+    uint8_t *row = dst + (size_t)(height - rows) * row_size;
+    for (int x = 0; x < width; x += 2) {
+        int bit = x / cell_width;
+        bool set = false;
+        if (bit < 32) {
+            set = (frame >> (31 - bit)) & 1;
+        } else if (bit < LATENCY_BARCODE_BITS) {
+            set = (timestamp_ns >> (LATENCY_BARCODE_BITS - 1 - bit)) & 1;
+        }
+        uint8_t luma = set ? 235 : 16;
+        row[x * 2 + 0] = luma;
+        row[x * 2 + 1] = 128;
+        row[x * 2 + 2] = luma;
+        row[x * 2 + 3] = 128;
     }
 
-    // Convert ARGB to YUY2
-    int result2 = ARGBToYUY2(temp_argb, width * 4,     // source
-                             dst, width * 2,            // destination
-                             width, height);
-
-    if (result2 != 0) {
-        printf("ERROR: ARGBToYUY2 conversion failed with result %d\n", result2);
+    for (int y = 1; y < rows; y++) {
+        memcpy(row + (size_t)y * row_size, row, row_size);
     }
-
-    free(temp_argb);
 }
 
-static void convert_bgrx_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
-    // BGRx format: [B][G][R][X] (X is padding, typically 0xFF)
-    // Direct conversion to YUYV using ITU-R BT.601 coefficients
-    // This avoids any issues with alpha channel interpretation
+static bool validate_yuyv_frame_data(const uint8_t *data, int width, int height) {
+    // Same sampling as validate_frame_data, but on the luma bytes of a packed YUYV frame
+    int non_black_count = 0;
+    int total_pixels_checked = 0;
 
-    for (int y = 0; y < height; y++) {
-        const uint8_t *src_row = src + (y * src_stride);
-        uint8_t *dst_row = dst + (y * width * 2);  // YUYV has 2 bytes per pixel
+    int y_step = height > 100 ? height / 100 : 1;
+    int x_step = width > 10 ? width / 10 : 1;
 
-        for (int x = 0; x < width; x += 2) {
-            // Process two pixels at a time for YUYV format
-            // YUYV format: [Y0][U][Y1][V]
-
-            // First pixel
-            const uint8_t *px0 = src_row + (x * 4);
-            uint8_t b0 = px0[0];
-            uint8_t g0 = px0[1];
-            uint8_t r0 = px0[2];
-            // px0[3] is X (padding), ignore it
-
-            // Second pixel (or repeat first if at edge)
-            uint8_t b1, g1, r1;
-            if (x + 1 < width) {
-                const uint8_t *px1 = src_row + ((x + 1) * 4);
-                b1 = px1[0];
-                g1 = px1[1];
-                r1 = px1[2];
-            } else {
-                b1 = b0;
-                g1 = g0;
-                r1 = r0;
+    for (int y = 0; y < height && total_pixels_checked < 1000; y += y_step) {
+        for (int x = 0; x < width && total_pixels_checked < 1000; x += x_step) {
+            if (data[(y * width + x) * 2] != 0) {
+                non_black_count++;
             }
-
-            // Convert to YUV using ITU-R BT.601 coefficients
-            // Y = 0.299*R + 0.587*G + 0.114*B
-            // U = -0.147*R - 0.289*G + 0.436*B + 128
-            // V = 0.615*R - 0.515*G - 0.100*B + 128
-
-            // Using integer math (scaled by 256 for precision)
-            int y0 = (77 * r0 + 150 * g0 + 29 * b0) >> 8;
-            int y1 = (77 * r1 + 150 * g1 + 29 * b1) >> 8;
-
-            // Average the two pixels for chroma
-            int ravg = (r0 + r1) / 2;
-            int gavg = (g0 + g1) / 2;
-            int bavg = (b0 + b1) / 2;
-
-            int u = ((-38 * ravg - 74 * gavg + 112 * bavg) >> 8) + 128;
-            int v = ((112 * ravg - 94 * gavg - 18 * bavg) >> 8) + 128;
-
-            // Clamp values to valid range
-            y0 = (y0 < 0) ? 0 : ((y0 > 255) ? 255 : y0);
-            y1 = (y1 < 0) ? 0 : ((y1 > 255) ? 255 : y1);
-            u = (u < 0) ? 0 : ((u > 255) ? 255 : u);
-            v = (v < 0) ? 0 : ((v > 255) ? 255 : v);
-
-            // Write YUYV
-            *dst_row++ = y0;
-            *dst_row++ = u;
-            *dst_row++ = y1;
-            *dst_row++ = v;
+            total_pixels_checked++;
         }
     }
-}
-
-static void convert_xrgb_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
-    // xRGB format: [X][R][G][B] (X is padding)
-    // This is actually ARGB layout with X as alpha, so we can use ARGBToYUY2 directly
-
-    // Convert ARGB to YUY2 directly (xRGB has same memory layout as ARGB)
-    int result = ARGBToYUY2(src, src_stride,           // source: use actual stride
-                           dst, width * 2,              // destination
-                           width, height);
-
-    if (result != 0) {
-        printf("ERROR: ARGBToYUY2 conversion failed with result %d\n", result);
-    }
-}
-
-static void convert_bgra_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
-    // BGRA format: [B][G][R][A]
-    // Use libyuv's BGRAToARGB then ARGBToYUY2
-
-    uint8_t *temp_argb = malloc(width * height * 4);
-    if (!temp_argb) {
-        printf("ERROR: Failed to allocate temporary buffer for BGRA conversion\n");
-        return;
-    }
-
-    // Convert BGRA to ARGB
-    int result1 = BGRAToARGB(src, src_stride,           // source: use actual stride
-                             temp_argb, width * 4,       // destination: stride = width * 4 bytes
-                             width, height);
-
-    if (result1 != 0) {
-        printf("ERROR: BGRAToARGB conversion failed with result %d\n", result1);
-        free(temp_argb);
-        return;
-    }
-
-    // Convert ARGB to YUY2 (which is the same as YUYV)
-    int result2 = ARGBToYUY2(temp_argb, width * 4,     // source
-                            dst, width * 2,             // destination
-                            width, height);
-
-    if (result2 != 0) {
-        printf("ERROR: ARGBToYUY2 conversion failed with result %d\n", result2);
-    }
-
-    free(temp_argb);
-}
-
-static void convert_argb_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
-    // ARGB format: [A][R][G][B]
-    // Can use ARGBToYUY2 directly
 
-    int result = ARGBToYUY2(src, src_stride,           // source: use actual stride
-                           dst, width * 2,              // destination
-                           width, height);
+    double non_black_ratio = (double)non_black_count / total_pixels_checked;
+    TRACE_FRAME("DEBUG: YUYV frame validation: %d/%d non-black pixels (%.1f%%)\n",
+           non_black_count, total_pixels_checked, non_black_ratio * 100);
 
-    if (result != 0) {
-        printf("ERROR: ARGBToYUY2 conversion failed with result %d\n", result);
-    }
+    return non_black_ratio > 0.01;
 }
 
 static bool validate_frame_data(const uint8_t *data, int width, int height, uint32_t spa_format, uint32_t stride) {
@@ -428,57 +514,87 @@ static bool validate_frame_data(const uint8_t *data, int width, int height, uint
     }
 
     double non_black_ratio = (double)non_black_count / total_pixels_checked;
-    DEBUG_PRINT("DEBUG: Frame validation: %d/%d non-black pixels (%.1f%%)\n",
+    TRACE_FRAME("DEBUG: Frame validation: %d/%d non-black pixels (%.1f%%)\n",
            non_black_count, total_pixels_checked, non_black_ratio * 100);
 
     // Consider frame valid if at least 1% of pixels are non-black
     return non_black_ratio > 0.01;
 }
 
+// Hash the rows validate_frame_data samples, to spot repeated frames when the
+// producer sends no damage. Whole rows are hashed so that small updates, like a
+// typed character, still change the hash.
+static uint64_t sample_frame_hash(const uint8_t *data, int width, int height, int bytes_per_pixel, uint32_t stride) {
+    int y_step = height > 100 ? height / 100 : 1;
+    size_t row_bytes = (size_t)width * bytes_per_pixel;
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a, a 64-bit word at a time
+
+    for (int y = 0; y < height; y += y_step) {
+        const uint8_t *row = data + (size_t)y * stride;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= row_bytes; i += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, row + i, sizeof(word));
+            hash = (hash ^ word) * 1099511628211ULL;
+        }
+        for (; i < row_bytes; i++) {
+            hash = (hash ^ row[i]) * 1099511628211ULL;
+        }
+    }
+
+    return hash;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 
 
 
 static void debug_pixel_data(const uint8_t *data, int width, int height, uint32_t spa_format, uint32_t stride) {
-    DEBUG_PRINT("DEBUG: Analyzing pixel data for format %u\n", spa_format);
+    TRACE_FRAME("DEBUG: Analyzing pixel data for format %u\n", spa_format);
     int bytes_per_pixel = (spa_format == 15 || spa_format == 16) ? 3 : 4;
 
     // Print first few pixels in hex to understand the byte order
-    DEBUG_PRINT("DEBUG: First 32 bytes (8 pixels for 32-bit formats): ");
+    TRACE_FRAME("DEBUG: First 32 bytes (8 pixels for 32-bit formats): ");
     for (int i = 0; i < 32 && i < stride; i++) {
-        DEBUG_PRINT("%02X ", data[i]);
-        if ((i + 1) % 16 == 0) DEBUG_PRINT("\n                                                  ");
+        TRACE_FRAME("%02X ", data[i]);
+        if ((i + 1) % 16 == 0) TRACE_FRAME("\n                                                  ");
     }
-    DEBUG_PRINT("\n");
+    TRACE_FRAME("\n");
 
     // Interpret first 4 pixels assuming different formats
     if (width >= 4 && height >= 1) {
-        DEBUG_PRINT("DEBUG: First 4 pixels interpreted as:\n");
+        TRACE_FRAME("DEBUG: First 4 pixels interpreted as:\n");
         for (int p = 0; p < 4; p++) {
             const uint8_t *pixel = data + (p * bytes_per_pixel);
-            DEBUG_PRINT("DEBUG:   Pixel %d: [%02X %02X %02X %02X]", p, pixel[0], pixel[1], pixel[2], pixel[3]);
-            DEBUG_PRINT(" -> as BGRx: B=%02X G=%02X R=%02X X=%02X", pixel[0], pixel[1], pixel[2], pixel[3]);
-            DEBUG_PRINT(" -> as RGBx: R=%02X G=%02X B=%02X X=%02X\n", pixel[0], pixel[1], pixel[2], pixel[3]);
+            TRACE_FRAME("DEBUG:   Pixel %d: [%02X %02X %02X %02X]", p, pixel[0], pixel[1], pixel[2], pixel[3]);
+            TRACE_FRAME(" -> as BGRx: B=%02X G=%02X R=%02X X=%02X", pixel[0], pixel[1], pixel[2], pixel[3]);
+            TRACE_FRAME(" -> as RGBx: R=%02X G=%02X B=%02X X=%02X\n", pixel[0], pixel[1], pixel[2], pixel[3]);
         }
     }
 
     // Check line boundaries to detect stride issues
-    DEBUG_PRINT("DEBUG: Checking for stride issues:\n");
-    DEBUG_PRINT("DEBUG: Stride: %u bytes, width * bytes_per_pixel: %d bytes\n", stride, width * bytes_per_pixel);
+    TRACE_FRAME("DEBUG: Checking for stride issues:\n");
+    TRACE_FRAME("DEBUG: Stride: %u bytes, width * bytes_per_pixel: %d bytes\n", stride, width * bytes_per_pixel);
     if (height >= 2) {
         // Compare end of first line with start of second line
-        DEBUG_PRINT("DEBUG: End of line 0 (last 4 pixels): ");
+        TRACE_FRAME("DEBUG: End of line 0 (last 4 pixels): ");
         for (int p = width-4; p < width && p >= 0; p++) {
             const uint8_t *pixel = data + (p * bytes_per_pixel);
-            DEBUG_PRINT("[%02X %02X %02X %02X] ", pixel[0], pixel[1], pixel[2], pixel[3]);
+            TRACE_FRAME("[%02X %02X %02X %02X] ", pixel[0], pixel[1], pixel[2], pixel[3]);
         }
-        DEBUG_PRINT("\n");
+        TRACE_FRAME("\n");
 
-        DEBUG_PRINT("DEBUG: Start of line 1 (first 4 pixels): ");
+        TRACE_FRAME("DEBUG: Start of line 1 (first 4 pixels): ");
         for (int p = 0; p < 4 && p < width; p++) {
             const uint8_t *pixel = data + (stride + p * bytes_per_pixel);
-            DEBUG_PRINT("[%02X %02X %02X %02X] ", pixel[0], pixel[1], pixel[2], pixel[3]);
+            TRACE_FRAME("[%02X %02X %02X %02X] ", pixel[0], pixel[1], pixel[2], pixel[3]);
         }
-        DEBUG_PRINT("\n");
+        TRACE_FRAME("\n");
     }
 
     // Check if data looks like it has reasonable RGB values
@@ -492,52 +608,485 @@ static void debug_pixel_data(const uint8_t *data, int width, int height, uint32_
         // Check if RGB components look reasonable (any format, check all bytes)
         if (pixel[0] == 0 && pixel[1] == 0 && pixel[2] == 0) suspicious_count++;
     }
-    DEBUG_PRINT("DEBUG: Suspicious (all-zero color) pixels in first 1000: %d\n", suspicious_count);
+    TRACE_FRAME("DEBUG: Suspicious (all-zero color) pixels in first 1000: %d\n", suspicious_count);
 
     // If we're getting all-black frames, something is wrong with the capture
     if (suspicious_count >= 950) { // Allow some tolerance
-        DEBUG_PRINT("DEBUG: *** ALL-BLACK FRAME DETECTED ***\n");
-        DEBUG_PRINT("DEBUG: This usually means:\n");
-        DEBUG_PRINT("DEBUG: 1. Stream hasn't started yet (try waiting longer)\n");
-        DEBUG_PRINT("DEBUG: 2. Wrong screen/window selected in portal\n");
-        DEBUG_PRINT("DEBUG: 3. Display is off or screensaver is active\n");
-        DEBUG_PRINT("DEBUG: 4. Buffer offset issue or wrong memory region\n");
+        TRACE_FRAME("DEBUG: *** ALL-BLACK FRAME DETECTED ***\n");
+        TRACE_FRAME("DEBUG: This usually means:\n");
+        TRACE_FRAME("DEBUG: 1. Stream hasn't started yet (try waiting longer)\n");
+        TRACE_FRAME("DEBUG: 2. Wrong screen/window selected in portal\n");
+        TRACE_FRAME("DEBUG: 3. Display is off or screensaver is active\n");
+        TRACE_FRAME("DEBUG: 4. Buffer offset issue or wrong memory region\n");
     }
 }
 
-static void convert_xbgr_to_yuyv(const uint8_t *src, uint8_t *dst, int width, int height, uint32_t src_stride) {
-    // xBGR format: [X][B][G][R] (X is padding)
-    // This actually matches ABGR layout when we treat the padding as alpha
-    // Use libyuv for reliable conversion
+// Formats offered with DMA-BUF modifiers, GNOME's native BGRx first
+static const uint32_t dma_buf_spa_formats[] = {
+    8,  // SPA_VIDEO_FORMAT_BGRx
+    12, // SPA_VIDEO_FORMAT_BGRA
+    7,  // SPA_VIDEO_FORMAT_RGBx
+    11, // SPA_VIDEO_FORMAT_RGBA
+    9,  // SPA_VIDEO_FORMAT_xRGB
+    13, // SPA_VIDEO_FORMAT_ARGB
+    10, // SPA_VIDEO_FORMAT_xBGR
+    14, // SPA_VIDEO_FORMAT_ABGR
+};
 
-    // Allocate temporary buffer for ARGB conversion
-    uint8_t *temp_argb = malloc(width * height * 4);
-    if (!temp_argb) {
-        printf("ERROR: Failed to allocate temporary buffer for conversion\n");
-        return;
+// Upper bound of modifiers advertised per format
+#define MAX_DMA_BUF_MODIFIERS 32
+
+// Largest size offered to producers that can scale on their side
+#define MAX_STREAM_SIZE 8192
+
+// Ask for the --size resolution and --fps rate, so compositors that can scale
+// and throttle on their side save us the work
+// Crop coordinates refer to the native size, so no size is asked for with --crop.
+static void add_stream_preferences(struct app_data *data, struct spa_pod_builder *b) {
+    if (data->requested_region.width != 0 && data->requested_region.crop_width == 0) {
+        spa_pod_builder_add(b,
+            SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
+                &SPA_RECTANGLE(data->requested_region.width, data->requested_region.height),
+                &SPA_RECTANGLE(1, 1),
+                &SPA_RECTANGLE(MAX_STREAM_SIZE, MAX_STREAM_SIZE)),
+            0);
+    }
+
+    if (data->max_fps > 0) {
+        spa_pod_builder_add(b,
+            SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(
+                &SPA_FRACTION(data->max_fps, 1),
+                &SPA_FRACTION(1, 1),
+                &SPA_FRACTION(data->max_fps, 1)),
+            0);
+    }
+}
+
+// Build a video/raw EnumFormat restricted to a DMA-BUF format and modifier list
+// With more than one modifier the producer picks and we fixate (DONT_FIXATE)
+static const struct spa_pod* build_dma_buf_format(struct app_data *data, struct spa_pod_builder *b,
+                                                  uint32_t spa_format,
+                                                  const uint64_t *modifiers, uint32_t n_modifiers) {
+    struct spa_pod_frame format_frame;
+    struct spa_pod_frame choice_frame;
+
+    spa_pod_builder_push_object(b, &format_frame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+    spa_pod_builder_add(b,
+        SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+        SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+        SPA_FORMAT_VIDEO_format, SPA_POD_Id(spa_format),
+        0);
+    add_stream_preferences(data, b);
+
+    if (n_modifiers == 1) {
+        spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY);
+        spa_pod_builder_long(b, (int64_t)modifiers[0]);
+    } else {
+        spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_modifier,
+                             SPA_POD_PROP_FLAG_MANDATORY | SPA_POD_PROP_FLAG_DONT_FIXATE);
+        spa_pod_builder_push_choice(b, &choice_frame, SPA_CHOICE_Enum, 0);
+        // The first value of an enum choice is its default
+        spa_pod_builder_long(b, (int64_t)modifiers[0]);
+        for (uint32_t i = 0; i < n_modifiers; i++) {
+            spa_pod_builder_long(b, (int64_t)modifiers[i]);
+        }
+        spa_pod_builder_pop(b, &choice_frame);
+    }
+
+    return spa_pod_builder_pop(b, &format_frame);
+}
+
+// Build the video/raw EnumFormat without format constraints, for shared memory
+// and implicit buffers, with the --size and --fps preferences
+static const struct spa_pod* build_fallback_format(struct app_data *data, struct spa_pod_builder *b) {
+    struct spa_pod_frame format_frame;
+    spa_pod_builder_push_object(b, &format_frame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+    spa_pod_builder_add(b,
+        SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+        SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+        0);
+    add_stream_preferences(data, b);
+    return spa_pod_builder_pop(b, &format_frame);
+}
+
+// Build the EnumFormat params: modifier-aware DMA-BUF formats first, then
+// an unconstrained video/raw format for shared memory and implicit buffers
+static uint32_t build_format_params(struct app_data *data, struct spa_pod_builder *b,
+                                    const struct spa_pod **params, uint32_t max_params) {
+    uint32_t n_params = 0;
+    size_t n_formats = sizeof(dma_buf_spa_formats) / sizeof(dma_buf_spa_formats[0]);
+
+    if (data->zero_copy || (data->requested_backend == CONVERT_BACKEND_M2M && data->shared->n_m2m_devices > 0)) {
+        // The device reads the memory as is, so only linear buffers can be passed through or converted
+        uint64_t linear = DRM_FORMAT_MOD_LINEAR;
+        for (size_t i = 0; i < n_formats && n_params + 1 < max_params; i++) {
+            params[n_params++] = build_dma_buf_format(data, b, dma_buf_spa_formats[i], &linear, 1);
+        }
+    } else if (data->shared->gl_ctx && gl_has_dma_buf_import_support(data->shared->gl_ctx)) {
+        for (size_t i = 0; i < n_formats && n_params + 1 < max_params; i++) {
+            uint64_t modifiers[MAX_DMA_BUF_MODIFIERS];
+            uint32_t n_modifiers = gl_query_dma_buf_modifiers(data->shared->gl_ctx,
+                                                              spa_to_drm_format(dma_buf_spa_formats[i]),
+                                                              modifiers, MAX_DMA_BUF_MODIFIERS);
+            if (n_modifiers == 0) {
+                continue;
+            }
+
+            DEBUG_PRINT("DEBUG: Offering SPA format %u with %u DMA-BUF modifier(s)\n",
+                        dma_buf_spa_formats[i], n_modifiers);
+            params[n_params++] = build_dma_buf_format(data, b, dma_buf_spa_formats[i], modifiers, n_modifiers);
+        }
+    }
+
+    // No specific format constraints, let PipeWire negotiate the format based on what the portal offers
+    params[n_params++] = build_fallback_format(data, b);
+
+    return n_params;
+}
+
+// The producer left the modifier open (DONT_FIXATE), pick its preferred one
+// and renegotiate with that single modifier. Returns true if params were updated.
+static bool fixate_dma_buf_modifier(struct app_data *data, const struct spa_pod *param,
+                                    const struct spa_video_info_raw *info) {
+    const struct spa_pod_prop *prop = spa_pod_find_prop(param, NULL, SPA_FORMAT_VIDEO_modifier);
+    if (!prop || !(prop->flags & SPA_POD_PROP_FLAG_DONT_FIXATE)) {
+        return false;
+    }
+
+    uint32_t n_values = 0;
+    uint32_t choice = 0;
+    const struct spa_pod *values = spa_pod_get_values(&prop->value, &n_values, &choice);
+    if (!values || SPA_POD_TYPE(values) != SPA_TYPE_Long || n_values == 0) {
+        return false;
+    }
+
+    // Values start with the default, i.e. the producer's preferred modifier
+    const uint64_t *modifiers = (const uint64_t *)SPA_POD_BODY(values);
+    uint64_t modifier = modifiers[0];
+    printf("Fixating DMA-BUF modifier 0x%" PRIx64 " (of %u offered)\n", modifier, n_values);
+
+    uint8_t buffer[1024];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const struct spa_pod *params[2];
+
+    params[0] = build_dma_buf_format(data, &b, info->format, &modifier, 1);
+    params[1] = build_fallback_format(data, &b);
+
+    pw_stream_update_params(data->stream, params, 2);
+    return true;
+}
+
+// Damage rectangles requested per buffer, more than that is treated as full damage
+#define MAX_DAMAGE_RECTS 16
+
+// Tell the producer which buffer types we can consume for the negotiated format,
+// and ask for the header and damage metadata
+static void update_buffer_params(struct app_data *data, bool dma_buf_only) {
+    uint8_t buffer[512];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const struct spa_pod *params[4];
+
+    // Explicit modifiers only exist for DMA buffers
+    int data_types = dma_buf_only ? (1 << SPA_DATA_DmaBuf)
+                                  : (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_DmaBuf);
+
+    params[0] = spa_pod_builder_add_object(&b,
+        SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+        SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(data_types));
+
+    params[1] = spa_pod_builder_add_object(&b,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+        SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+
+    params[2] = spa_pod_builder_add_object(&b,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+        SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+            sizeof(struct spa_meta_region) * MAX_DAMAGE_RECTS,
+            sizeof(struct spa_meta_region) * 1,
+            sizeof(struct spa_meta_region) * MAX_DAMAGE_RECTS));
+
+    // Window streams may only fill part of each buffer
+    params[3] = spa_pod_builder_add_object(&b,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoCrop),
+        SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_region)));
+
+    pw_stream_update_params(data->stream, params, 4);
+}
+
+// Make a buffer hold at least size bytes, it only grows so that
+// renegotiating back to a smaller format doesn't reallocate
+static bool reserve_buffer(uint8_t **buffer, size_t *buffer_size, size_t size, const char *what) {
+    if (*buffer_size >= size) {
+        return true;
+    }
+
+    uint8_t *grown = realtime_realloc(*buffer, *buffer_size, size);
+    if (!grown) {
+        fprintf(stderr, "Failed to allocate %zu byte %s\n", size, what);
+        return false;
+    }
+
+    *buffer = grown;
+    *buffer_size = size;
+    return true;
+}
+
+// Conversions run on the worker's pool with the per-session frame arena
+static convert_context worker_convert_context(struct app_data *data) {
+    convert_context ctx = { data->shared->convert_pool, data->frame_arena, data->frame_arena_size };
+    return ctx;
+}
+
+static uint32_t output_pixelformat(output_format format) {
+    switch (format) {
+        case OUTPUT_FORMAT_NV12: return V4L2_PIX_FMT_NV12;
+        case OUTPUT_FORMAT_I420: return V4L2_PIX_FMT_YUV420;
+        case OUTPUT_FORMAT_MJPEG: return V4L2_PIX_FMT_MJPEG;
+        default: return V4L2_PIX_FMT_YUYV;
+    }
+}
+
+// Clip the requested crop and size to a stream of the given size
+// The requested crop is relative to the producer's content rectangle (e.g. a
+// window in a larger buffer), so only that part is read back and converted.
+static void resolve_output_region(struct app_data *data) {
+    gl_output_region region = data->requested_region;
+    uint32_t content_x = 0;
+    uint32_t content_y = 0;
+    uint32_t content_width = data->width;
+    uint32_t content_height = data->height;
+    if (data->content.size.width != 0 && data->content.size.height != 0) {
+        content_x = (uint32_t)data->content.position.x;
+        content_y = (uint32_t)data->content.position.y;
+        content_width = data->content.size.width;
+        content_height = data->content.size.height;
+    }
+
+    if (region.crop_x >= content_width || region.crop_y >= content_height) {
+        if (region.crop_width != 0) {
+            printf("Warning: Crop origin %u,%u is outside the %ux%u stream, not cropping\n",
+                   region.crop_x, region.crop_y, content_width, content_height);
+        }
+        region.crop_x = 0;
+        region.crop_y = 0;
+        region.crop_width = 0;
+        region.crop_height = 0;
+    }
+    if (region.crop_width == 0 || region.crop_width > content_width - region.crop_x) {
+        region.crop_width = content_width - region.crop_x;
+    }
+    if (region.crop_height == 0 || region.crop_height > content_height - region.crop_y) {
+        region.crop_height = content_height - region.crop_y;
+    }
+    if (region.width == 0 || region.height == 0) {
+        region.width = region.crop_width;
+        region.height = region.crop_height;
+    }
+    region.crop_x += content_x;
+    region.crop_y += content_y;
+
+    data->region = region;
+    data->region_active = region.crop_x != 0 || region.crop_y != 0 ||
+                          region.crop_width != data->width || region.crop_height != data->height ||
+                          region.width != data->width || region.height != data->height;
+
+    // Without the GPU pass readback stays full size and the CPU crops and scales
+    // The GL context serves every stream, so the region is set with each import
+    data->gpu_region = data->shared->gl_ctx && gl_has_scaling_support(data->shared->gl_ctx);
+}
+
+// Scale a source area to the output size into scaled_frame with ARGBScale
+// 24-bit layouts are expanded to ARGB first, the result is always 4 bytes per pixel.
+static bool scale_frame(struct app_data *data, uint32_t *spa_format, const uint8_t **src, uint32_t *src_stride,
+                        int width, int height) {
+    size_t out_size = (size_t)data->region.width * data->region.height * 4;
+    size_t argb_size = (*spa_format == 15 || *spa_format == 16) ? (size_t)width * height * 4 : 0;
+    if (!reserve_buffer(&data->scaled_frame, &data->scaled_frame_size, out_size + argb_size, "scaled frame")) {
+        return false;
+    }
+
+    const uint8_t *scale_src = *src;
+    uint32_t scale_stride = *src_stride;
+    if (argb_size > 0) {
+        uint8_t *argb = data->scaled_frame + out_size;
+        if (!convert_to_argb(*spa_format, *src, *src_stride, argb, width, height)) {
+            return false;
+        }
+        scale_src = argb;
+        scale_stride = width * 4;
+        *spa_format = 12; // SPA_VIDEO_FORMAT_BGRA, libyuv's ARGB
+    }
+
+    // ARGBScale only moves whole 4 byte pixels, so any channel order works
+    int result = ARGBScale(scale_src, scale_stride, width, height,
+                           data->scaled_frame, data->region.width * 4, data->region.width, data->region.height,
+                           kFilterBox);
+    if (result != 0) {
+        printf("ERROR: ARGBScale failed with result %d\n", result);
+        return false;
+    }
+
+    *src = data->scaled_frame;
+    *src_stride = data->region.width * 4;
+    return true;
+}
+
+// Damaged area of a frame in pixels, x and width are even so YUYV pairs stay whole
+struct damage_rect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Collect the damage of a buffer, clipped to the frame
+// Returns the number of rectangles, or -1 if the damage is unknown and the
+// whole frame has to be converted
+static int get_frame_damage(struct app_data *data, struct spa_buffer *buf, struct damage_rect *rects) {
+    struct spa_meta *meta = spa_buffer_find_meta(buf, SPA_META_VideoDamage);
+    if (!meta || data->width % 2 != 0) {
+        return -1;
+    }
+
+    int n_rects = 0;
+    struct spa_meta_region *r;
+    spa_meta_for_each(r, meta) {
+        if (!spa_meta_region_is_valid(r)) {
+            break;
+        }
+        if (n_rects == MAX_DAMAGE_RECTS) {
+            return -1;
+        }
+
+        int64_t x0 = r->region.position.x;
+        int64_t y0 = r->region.position.y;
+        int64_t x1 = x0 + r->region.size.width;
+        int64_t y1 = y0 + r->region.size.height;
+
+        x0 = x0 < 0 ? 0 : x0 & ~(int64_t)1;
+        y0 = y0 < 0 ? 0 : y0;
+        x1 = x1 > data->width ? data->width : (x1 + 1) & ~(int64_t)1;
+        y1 = y1 > data->height ? data->height : y1;
+        if (x0 >= x1 || y0 >= y1) {
+            continue;
+        }
+
+        rects[n_rects].x = (uint32_t)x0;
+        rects[n_rects].y = (uint32_t)y0;
+        rects[n_rects].width = (uint32_t)(x1 - x0);
+        rects[n_rects].height = (uint32_t)(y1 - y0);
+        n_rects++;
+    }
+
+    return n_rects;
+}
+
+// Bring the shadow frame up to date, only reconverting the damaged rectangles if
+// it held the previous frame (shadow_valid)
+// Returns false if the frame has to be converted as a whole
+static bool update_shadow_frame(struct app_data *data, bool shadow_valid, uint32_t spa_format,
+                                const uint8_t *src, uint32_t src_stride, int bytes_per_pixel,
+                                const struct damage_rect *rects, int n_rects) {
+    size_t frame_size = (size_t)data->width * data->height * 2;
+    if (!reserve_buffer(&data->shadow_frame, &data->shadow_frame_size, frame_size, "shadow frame")) {
+        return false;
+    }
+
+    // Damage is relative to the previous buffer, which a dropped frame makes us miss
+    convert_context ctx = worker_convert_context(data);
+    uint64_t dropped = frame_queue_get_dropped(data->frame_queue);
+    if (!shadow_valid || dropped != data->shadow_dropped) {
+        data->shadow_dropped = dropped;
+        return convert_frame(&ctx, OUTPUT_FORMAT_YUYV, spa_format, src, data->shadow_frame,
+                             data->width, data->height, src_stride);
+    }
+
+    uint32_t dst_stride = data->width * 2;
+    for (int i = 0; i < n_rects; i++) {
+        const struct damage_rect *rect = &rects[i];
+        if (!convert_area(&ctx, OUTPUT_FORMAT_YUYV, spa_format,
+                          src + (size_t)rect->y * src_stride + (size_t)rect->x * bytes_per_pixel, src_stride,
+                          data->shadow_frame + (size_t)rect->y * dst_stride + (size_t)rect->x * 2, dst_stride,
+                          rect->width, rect->height)) {
+            return false;
+        }
     }
 
-    // Convert ABGR (our xBGR) to ARGB
-    int result1 = ABGRToARGB(src, src_stride,           // source: use actual stride
-                             temp_argb, width * 4,      // destination: stride = width * 4 bytes
-                             width, height);
+    TRACE_FRAME("DEBUG: Reconverted %d damaged rectangle(s)\n", n_rects);
+    return true;
+}
+
+// Give a buffer back to PipeWire through the RT thread, called with pipeline_lock held
+static void return_buffer(struct app_data *data, struct pw_buffer *b) {
+    if (!data->return_queue) {
+        // Replayed frames don't belong to a stream
+        return;
+    }
 
-    if (result1 != 0) {
-        printf("ERROR: ABGRToARGB conversion failed with result %d\n", result1);
-        free(temp_argb);
+    if (!frame_queue_push(data->return_queue, b)) {
+        // Can't happen with the return queue larger than any buffer pool
+        fprintf(stderr, "Return queue full, buffer lost\n");
         return;
     }
 
-    // Convert ARGB to YUY2 (which is the same as YUYV)
-    int result2 = ARGBToYUY2(temp_argb, width * 4,     // source: stride = width * 4 bytes
-                             dst, width * 2,            // destination: stride = width * 2 bytes
-                             width, height);
+    pw_loop_signal_event(data->shared->data_loop, data->return_event);
+}
+
+// Return all frames waiting for conversion unprocessed, called with pipeline_lock held
+static void flush_frame_queue(struct app_data *data) {
+    struct pw_buffer *b;
+    while ((b = frame_queue_pop(data->frame_queue)) != NULL) {
+        return_buffer(data, b);
+    }
+
+    if (data->compose_buffer) {
+        return_buffer(data, data->compose_buffer);
+        data->compose_buffer = NULL;
+    }
+}
+
+static void update_stream_format(struct app_data *data, const struct spa_pod *param);
+
+// Configure the device for the requested output format, falling back to YUYV
+// if the consumer side (device) refuses it or it can't be produced
+static bool configure_output_format(struct app_data *data) {
+    output_format format = data->requested_format;
+
+    if (format == OUTPUT_FORMAT_MJPEG && !data->mjpeg) {
+        data->mjpeg = mjpeg_encoder_create(data->jpeg_quality);
+        if (!data->mjpeg) {
+            format = OUTPUT_FORMAT_YUYV;
+        }
+    }
+
+    uint32_t width = data->region.width;
+    uint32_t height = data->region.height;
+    if (format != OUTPUT_FORMAT_YUYV &&
+        !v4l2_sink_try_format(data->sink, width, height, output_pixelformat(format))) {
+        printf("V4L2 device refused %s, using YUYV\n", output_format_name(format));
+        format = OUTPUT_FORMAT_YUYV;
+    }
+
+    if (!v4l2_sink_configure(data->sink, width, height, output_pixelformat(format))) {
+        if (format == OUTPUT_FORMAT_YUYV ||
+            !v4l2_sink_configure(data->sink, width, height, V4L2_PIX_FMT_YUYV)) {
+            return false;
+        }
+        format = OUTPUT_FORMAT_YUYV;
+    }
 
-    if (result2 != 0) {
-        printf("ERROR: ARGBToYUY2 conversion failed with result %d\n", result2);
+    // S_FMT may still have settled on something else
+    if (v4l2_sink_get_pixelformat(data->sink) != output_pixelformat(format)) {
+        fprintf(stderr, "V4L2 device doesn't accept %s or YUYV output\n", output_format_name(format));
+        return false;
     }
 
-    free(temp_argb);
+    data->out_format = format;
+    data->v4l2_format = v4l2_sink_get_pixelformat(data->sink);
+    return true;
 }
 
 static void on_stream_param_changed(void *userdata, uint32_t id,
@@ -620,9 +1169,200 @@ static void on_stream_param_changed(void *userdata, uint32_t id,
     if (id != SPA_PARAM_Format)
         return;
 
-    struct spa_video_info_raw info;
-    if (spa_format_video_raw_parse(param, &info) < 0) {
-        printf("Failed to parse video format\n");
+    // The worker must not convert a frame while the format changes under it
+    pthread_mutex_lock(&data->shared->pipeline_lock);
+    update_stream_format(data, param);
+    pthread_mutex_unlock(&data->shared->pipeline_lock);
+}
+
+static const char* convert_backend_name(convert_backend backend) {
+    switch (backend) {
+        case CONVERT_BACKEND_GL: return "gl";
+        case CONVERT_BACKEND_CPU: return "cpu";
+        case CONVERT_BACKEND_M2M: return "m2m";
+        default: return "auto";
+    }
+}
+
+// Calibration order, the GL readback ring keeps frames in flight, so GL goes
+// last and carries on without a stale frame if it wins
+static const convert_backend calibration_order[] = {
+    CONVERT_BACKEND_M2M,
+    CONVERT_BACKEND_CPU,
+    CONVERT_BACKEND_GL,
+};
+
+// Whether a backend can convert the DMA-BUFs of the current format at all
+static bool backend_available(const struct app_data *data, convert_backend backend) {
+    switch (backend) {
+        case CONVERT_BACKEND_GL:
+            return data->shared->gl_ctx && gl_has_dma_buf_import_support(data->shared->gl_ctx);
+        case CONVERT_BACKEND_M2M:
+            return data->shared->n_m2m_devices > 0 && !data->m2m_failed &&
+                   data->modifier == DRM_FORMAT_MOD_LINEAR && data->out_format != OUTPUT_FORMAT_MJPEG;
+        default:
+            return true;
+    }
+}
+
+// Switch to the next backend that hasn't been timed, or settle on the fastest one
+static void advance_calibration(struct app_data *data) {
+    data->calibration_frames = 0;
+    data->calibration_total_ns = 0;
+
+    size_t n_candidates = sizeof(calibration_order) / sizeof(calibration_order[0]);
+    for (size_t i = 0; i < n_candidates; i++) {
+        convert_backend candidate = calibration_order[i];
+        if (data->backend_ns[candidate] == 0 && backend_available(data, candidate)) {
+            data->backend = candidate;
+            DEBUG_PRINT("DEBUG: Calibrating conversion backend %s\n", convert_backend_name(candidate));
+            return;
+        }
+    }
+
+    char timings[128] = "";
+    size_t length = 0;
+    uint64_t best_ns = UINT64_MAX;
+    for (size_t i = 0; i < n_candidates; i++) {
+        convert_backend candidate = calibration_order[i];
+        uint64_t ns = data->backend_ns[candidate];
+        if (ns == 0 || !backend_available(data, candidate)) {
+            continue;
+        }
+        if (ns < best_ns) {
+            best_ns = ns;
+            data->backend = candidate;
+        }
+        int written = snprintf(timings + length, sizeof(timings) - length, "%s%s %.2f ms",
+                               length ? ", " : "", convert_backend_name(candidate), ns / 1e6);
+        if (written > 0 && (size_t)written < sizeof(timings) - length) {
+            length += (size_t)written;
+        }
+    }
+
+    data->calibrating = false;
+    printf("Conversion backend: %s (%s per frame)\n", convert_backend_name(data->backend), timings);
+}
+
+// Start over for a new format: the mem2mem device is set up for one layout
+static void reset_convert_backend(struct app_data *data) {
+    m2m_converter_destroy(data->m2m);
+    data->m2m = NULL;
+    data->m2m_failed = false;
+    memset(data->backend_ns, 0, sizeof(data->backend_ns));
+
+    data->calibrating = data->requested_backend == CONVERT_BACKEND_AUTO;
+    if (data->calibrating) {
+        advance_calibration(data);
+    } else {
+        data->backend = data->requested_backend;
+    }
+}
+
+// Add the time of a frame the current backend wrote, each is on for CALIBRATION_FRAMES frames
+static void calibrate_backend(struct app_data *data, uint64_t frame_ns) {
+    data->calibration_total_ns += frame_ns;
+    if (++data->calibration_frames < CALIBRATION_FRAMES) {
+        return;
+    }
+
+    // Never 0, that marks a backend as not timed
+    uint64_t mean_ns = data->calibration_total_ns / data->calibration_frames;
+    data->backend_ns[data->backend] = mean_ns > 0 ? mean_ns : 1;
+    DEBUG_PRINT("DEBUG: Conversion backend %s took %.2f ms per frame\n",
+                convert_backend_name(data->backend), mean_ns / 1e6);
+    advance_calibration(data);
+}
+
+// Stop using the mem2mem device for this format
+static void disable_m2m(struct app_data *data, const char *why) {
+    m2m_converter_destroy(data->m2m);
+    data->m2m = NULL;
+    data->m2m_failed = true;
+
+    if (data->calibrating) {
+        DEBUG_PRINT("DEBUG: Mem2mem conversion unavailable: %s\n", why);
+        advance_calibration(data);
+        return;
+    }
+    data->backend = backend_available(data, CONVERT_BACKEND_GL) ? CONVERT_BACKEND_GL : CONVERT_BACKEND_CPU;
+    printf("Mem2mem conversion unavailable (%s), converting with %s\n", why, convert_backend_name(data->backend));
+}
+
+// Take on a new frame format and size, reconfiguring the device if the output changes
+// Also used by --replay, whose frames don't come with a negotiated format.
+static void apply_stream_format(struct app_data *data, uint32_t spa_format, uint32_t width, uint32_t height) {
+    uint32_t old_width = data->region.width;
+    uint32_t old_height = data->region.height;
+    data->width = width;
+    data->height = height;
+    resolve_output_region(data);
+
+    // Only the output size matters to the device
+    bool dimensions_changed = (data->region.width != old_width || data->region.height != old_height);
+    if (data->region_active) {
+        printf("Output region: %ux%u at %u,%u scaled to %ux%u (%s)\n",
+               data->region.crop_width, data->region.crop_height, data->region.crop_x, data->region.crop_y,
+               data->region.width, data->region.height, data->gpu_region ? "GPU" : "CPU");
+    }
+    data->spa_format = spa_format;
+    data->v4l2_format = spa_to_v4l2_format(spa_format);
+
+    // Calculate stride - for 32-bit formats it's typically aligned
+    // For now, assume no padding (will be corrected in on_stream_process if needed)
+    int bytes_per_pixel = (spa_format == 15 || spa_format == 16) ? 3 : 4; // RGB/BGR are 24-bit
+    data->stride = data->width * bytes_per_pixel;
+
+    printf("Initial stride estimate: %u bytes (width * bytes_per_pixel)\n", data->stride);
+
+    // Formats without a direct route go through ARGB strips, one per conversion thread
+    data->output_failed = !reserve_buffer(&data->frame_arena, &data->frame_arena_size,
+                                          convert_arena_size(data->region.width, data->shared->convert_threads),
+                                          "frame arena");
+    if (data->output_failed) {
+        fprintf(stderr, "Skipping frames until the stream format changes\n");
+        return;
+    }
+
+    // The previous frame's pixels don't carry over to the new format
+    data->shadow_valid = false;
+    data->last_hash_valid = false;
+    data->last_push_ns = 0;
+
+    // Passthrough is re-established on the next frame, with the new stride
+    data->zero_copy_active = false;
+
+    // The mem2mem device is set up again for the new layout, and auto selection starts over
+    reset_convert_backend(data);
+
+    // Update V4L2 device format if this is the first time we're setting it or dimensions changed
+    if ((!data->format_set || dimensions_changed || data->zero_copy) && data->sink) {
+        // Frames are converted straight into the device's mmap'd buffers
+        if (!configure_output_format(data)) {
+            fprintf(stderr, "Failed to set the V4L2 output format, skipping frames until the stream format changes\n");
+            data->output_failed = true;
+            return;
+        }
+
+        if (data->max_fps > 0) {
+            v4l2_sink_set_frame_rate(data->sink, data->max_fps);
+        }
+
+        printf("V4L2 format updated: %ux%u, %s (%s)\n", data->region.width, data->region.height,
+               output_format_name(data->out_format),
+               v4l2_sink_is_streaming(data->sink) ? "streaming I/O" : "write()");
+        data->format_set = true;
+
+        // Reset frame skip counter when format changes
+        data->frame_skip_count = 0;
+    }
+}
+
+// Apply a negotiated Format param, called with pipeline_lock held
+static void update_stream_format(struct app_data *data, const struct spa_pod *param) {
+    struct spa_video_info_raw info;
+    if (spa_format_video_raw_parse(param, &info) < 0) {
+        printf("Failed to parse video format\n");
         return;
     }
 
@@ -643,60 +1383,35 @@ static void on_stream_param_changed(void *userdata, uint32_t id,
     printf("Stream format negotiated: %ux%u, format=%u (%s)\n",
            info.size.width, info.size.height, info.format, format_name);
 
-    // Check if dimensions have changed
-    bool dimensions_changed = (data->width != info.size.width || data->height != info.size.height);
-
-    // Update our stored dimensions and format
-    data->width = info.size.width;
-    data->height = info.size.height;
-    data->spa_format = info.format;
-    data->v4l2_format = spa_to_v4l2_format(info.format);
-
-    // Calculate stride - for 32-bit formats it's typically aligned
-    // For now, assume no padding (will be corrected in on_stream_process if needed)
-    int bytes_per_pixel = (info.format == 15 || info.format == 16) ? 3 : 4; // RGB/BGR are 24-bit
-    data->stride = data->width * bytes_per_pixel;
+    // Variable rate screencasts announce 0/1 and their maximum separately
+    struct spa_fraction rate = info.framerate.num > 0 ? info.framerate : info.max_framerate;
+    data->frame_interval_ns = rate.num > 0 ? (uint64_t)rate.denom * 1000000000ULL / rate.num : 0;
 
-    printf("Initial stride estimate: %u bytes (width * bytes_per_pixel)\n", data->stride);
+    if (fixate_dma_buf_modifier(data, param, &info)) {
+        // A fixated Format follows
+        return;
+    }
 
-    // Update V4L2 device format if this is the first time we're setting it or dimensions changed
-    if ((!data->format_set || dimensions_changed) && data->v4l2_fd >= 0) {
-        struct v4l2_format fmt = {0};
-        fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-        fmt.fmt.pix.width = data->width;
-        fmt.fmt.pix.height = data->height;
-        fmt.fmt.pix.field = V4L2_FIELD_NONE;
-
-        // Always use YUYV format for consistency (same as color bars)
-        uint32_t target_format = V4L2_PIX_FMT_YUYV;
-        size_t bytes_per_pixel = 2;
-
-        fmt.fmt.pix.pixelformat = target_format;
-        fmt.fmt.pix.bytesperline = data->width * bytes_per_pixel;
-        fmt.fmt.pix.sizeimage = data->width * data->height * bytes_per_pixel;
-
-        if (ioctl(data->v4l2_fd, VIDIOC_S_FMT, &fmt) < 0) {
-            perror("Failed to update V4L2 format");
-            return;
-        }
+    bool has_modifier = (info.flags & SPA_VIDEO_FLAG_MODIFIER) != 0;
+    data->modifier = has_modifier ? info.modifier : DRM_FORMAT_MOD_INVALID;
+    if (has_modifier) {
+        printf("DMA-BUF modifier: 0x%" PRIx64 "\n", info.modifier);
+    }
+    // Compositing imports every source on the GPU
+    update_buffer_params(data, has_modifier || data->shared->compose != COMPOSE_NONE);
 
-        // Store the actual format that was set
-        data->v4l2_format = fmt.fmt.pix.pixelformat;
+    // Frames still queued were captured with the previous format
+    flush_frame_queue(data);
 
-        printf("V4L2 format updated: %dx%d, YUYV\n", data->width, data->height);
-        data->format_set = true;
+    // Buffers imported for the previous format can't be reused
+    if (data->shared->gl_ctx) {
+        gl_clear_dma_buffer_cache(data->shared->gl_ctx);
+    }
 
-        // Reset frame skip counter when format changes
-        data->frame_skip_count = 0;
+    // The content rectangle comes with the frames of the new buffers
+    memset(&data->content, 0, sizeof(data->content));
 
-        // Allocate conversion buffer
-        data->conversion_buffer_size = data->width * data->height * bytes_per_pixel;
-        data->conversion_buffer = realloc(data->conversion_buffer, data->conversion_buffer_size);
-        if (!data->conversion_buffer) {
-            fprintf(stderr, "Failed to allocate conversion buffer\n");
-        }
-        DEBUG_PRINT("Conversion buffer allocated: %zu bytes\n", data->conversion_buffer_size);
-    }
+    apply_stream_format(data, info.format, info.size.width, info.size.height);
 }
 
 static void on_stream_state_changed(void *userdata, enum pw_stream_state old,
@@ -725,30 +1440,378 @@ static void on_stream_state_changed(void *userdata, enum pw_stream_state old,
     if (state == PW_STREAM_STATE_STREAMING) {
         data->stream_ready = true;
         printf("Stream is now ready for processing\n");
+    } else if (state == PW_STREAM_STATE_ERROR) {
+        request_reconnect(data->shared, "Stream failed");
+    } else if (state == PW_STREAM_STATE_UNCONNECTED && data->stream_ready) {
+        // E.g. the producer went away, the compositor restarting
+        request_reconnect(data->shared, "Stream disconnected");
     }
 }
 
-static void on_stream_process(void *userdata) {
+static void on_stream_add_buffer(void *userdata, struct pw_buffer *b) {
+    (void)userdata;
+    b->user_data = calloc(1, sizeof(struct buffer_info));
+}
+
+static void on_stream_remove_buffer(void *userdata, struct pw_buffer *b) {
     struct app_data *data = userdata;
-    struct pw_buffer *b;
+    struct spa_buffer *buf = b->buffer;
+
+    free(b->user_data);
+    b->user_data = NULL;
+
+    // Nothing may requeue the buffer once it is gone, wherever it is in the pipeline.
+    // The stream's data thread is idle while PipeWire reallocates buffers.
+    pthread_mutex_lock(&data->shared->pipeline_lock);
+    v4l2_sink_forget_dmabuf(data->sink, b);
+    if (data->compose_buffer == b) {
+        data->compose_buffer = NULL;
+    }
+
+    struct pw_buffer *queued;
+    while ((queued = frame_queue_pop(data->frame_queue)) != NULL) {
+        if (queued != b) {
+            return_buffer(data, queued);
+        }
+    }
+
+    uint32_t n_returned = frame_queue_count(data->return_queue);
+    for (uint32_t i = 0; i < n_returned; i++) {
+        queued = frame_queue_pop(data->return_queue);
+        if (queued && queued != b) {
+            frame_queue_push(data->return_queue, queued);
+        }
+    }
+    pthread_mutex_unlock(&data->shared->pipeline_lock);
+
+    if (!data->shared->gl_ctx) {
+        return;
+    }
+
+    // The fd may be reused for a different buffer, so drop its cached import
+    for (uint32_t i = 0; i < buf->n_datas; i++) {
+        if (buf->datas[i].type == SPA_DATA_DmaBuf) {
+            DEBUG_PRINT("DEBUG: Buffer with DMA fd %ld removed from pool\n", (long)buf->datas[i].fd);
+            gl_forget_dma_buffer(data->shared->gl_ctx, (int)buf->datas[i].fd);
+        }
+    }
+}
+
+// The device is done with a passed-through DMA-BUF, give it back to the producer
+static void on_sink_release_buffer(void *cookie, void *user_data) {
+    struct app_data *data = user_data;
+    return_buffer(data, (struct pw_buffer *)cookie);
+}
+
+// Hand a linear DMA-BUF to the device without mapping or reading it back
+// Returns true if the frame was consumed (and b is owned by the device or
+// already requeued), false to convert it on the regular path instead.
+static bool pass_through_dma_buffer(struct app_data *data, struct pw_buffer *b) {
+    struct spa_buffer *buf = b->buffer;
+    struct spa_data *d = &buf->datas[0];
+
+    if (buf->n_datas != 1 || d->type != SPA_DATA_DmaBuf || data->modifier != DRM_FORMAT_MOD_LINEAR) {
+        return false;
+    }
+
+    uint32_t stride = d->chunk->stride > 0 ? (uint32_t)d->chunk->stride : data->width * 4;
+
+    if (!data->zero_copy_active) {
+        if (!v4l2_sink_configure_dmabuf(data->sink, data->width, data->height,
+                                        spa_to_v4l2_format(data->spa_format), stride)) {
+            // Not supported by this device (or v4l2loopback build), convert from now on
+            printf("Zero-copy passthrough unavailable, falling back to conversion\n");
+            data->zero_copy = false;
+            // S_FMT may have succeeded, the device is left in the packed RGB format without buffers
+            if (!configure_output_format(data)) {
+                fprintf(stderr, "Failed to set the V4L2 output format, skipping frames until the stream format changes\n");
+                data->output_failed = true;
+                return_buffer(data, b);
+                return true;
+            }
+            return false;
+        }
+        data->zero_copy_active = true;
+        data->v4l2_format = v4l2_sink_get_pixelformat(data->sink);
+        printf("Zero-copy passthrough active: %ux%u, stride %u\n", data->width, data->height, stride);
+    }
+
+    uint32_t bytesused = d->chunk->size > 0 ? d->chunk->size : stride * data->height;
+    const struct buffer_info *info = b->user_data;
+    uint64_t pts_ns = info ? info->pts_ns : 0;
+    if (!v4l2_sink_queue_dmabuf(data->sink, (int)d->fd, d->maxsize, bytesused, pts_ns, b)) {
+        // All slots busy (or the queue failed), drop this frame
+        TRACE_FRAME("DEBUG: DMA-BUF passthrough dropped a frame: %s\n", strerror(errno));
+        return_buffer(data, b);
+        return true;
+    }
+
+    uint64_t now_ns = monotonic_ns();
+    if (pts_ns && now_ns > pts_ns) {
+        stats_record(data->shared->stats, STATS_STAGE_LATENCY, now_ns - pts_ns);
+    }
+    TRACE_FRAME("DEBUG: Passed DMA-BUF fd %ld through to V4L2\n", (long)d->fd);
+    return true;
+}
+
+// Append the frame about to be converted to the --record file, stops recording on failure
+static void record_frame(struct app_data *data, const void *frame, uint32_t spa_format,
+                         int width, int height, uint32_t stride, const struct buffer_info *info) {
+    capture_frame record = {
+        .spa_format = spa_format,
+        .width = (uint32_t)width,
+        .height = (uint32_t)height,
+        .stride = stride,
+        .timestamp_ns = info && info->dequeue_ns ? info->dequeue_ns : monotonic_ns(),
+        .data = frame,
+        .size = (size_t)stride * height,
+    };
+
+    if (!capture_file_append(data->recorder, &record)) {
+        fprintf(stderr, "Recording stopped after %" PRIu64 " frames\n",
+                capture_file_get_frame_count(data->recorder));
+        capture_file_destroy(data->recorder);
+        data->recorder = NULL;
+    }
+}
+
+// Time a frame may take from dequeue to the device before the next one is due
+static uint64_t frame_interval_ns(struct app_data *data) {
+    if (data->frame_interval_ns > 0) {
+        return data->frame_interval_ns;
+    }
+    return 1000000000ULL / (data->max_fps > 0 ? data->max_fps : DEADLINE_DEFAULT_FPS);
+}
+
+// Commit an output frame, timing the write and the frame's whole trip from
+// dequeue and from the compositor. The compositor's pts becomes the buffer timestamp.
+static bool commit_output_frame(struct app_data *data, size_t size, const struct buffer_info *info) {
+    uint64_t pts_ns = info ? info->pts_ns : 0;
+    uint64_t start_ns = monotonic_ns();
+    bool written = v4l2_sink_commit(data->sink, size, pts_ns);
+    uint64_t end_ns = monotonic_ns();
+
+    stats_record(data->shared->stats, STATS_STAGE_WRITE, end_ns - start_ns);
+    if (written && info && info->dequeue_ns) {
+        stats_record(data->shared->stats, STATS_STAGE_TOTAL, end_ns - info->dequeue_ns);
+        if (end_ns - info->dequeue_ns > frame_interval_ns(data)) {
+            stats_count(data->shared->stats, STATS_DEADLINES_MISSED);
+        }
+    }
+    if (written && pts_ns && end_ns > pts_ns) {
+        stats_record(data->shared->stats, STATS_STAGE_LATENCY, end_ns - pts_ns);
+    }
+    return written;
+}
+
+// Count a device write, repeated failures mean the capture was lost
+static void note_write_result(struct app_data *data, bool written, size_t frame_size) {
+    if (!written) {
+        perror("Failed to write to V4L2 device");
+        stats_count(data->shared->stats, STATS_WRITE_ERRORS);
+        data->write_error_count++;
+
+        // Check if the portal session is still active
+        if (data->shared->portal_session && !data->shared->portal_session->session_active) {
+            request_reconnect(data->shared, "Portal session is no longer active");
+            return;
+        }
+
+        // If we get multiple consecutive write errors, assume sharing has stopped
+        if (data->write_error_count >= 5) {
+            data->write_error_count = 0;
+            request_reconnect(data->shared, "Multiple V4L2 write failures detected, assuming sharing stopped");
+        }
+        return;
+    }
+
+    // Reset error count on successful write
+    data->write_error_count = 0;
+    data->last_push_ns = monotonic_ns();
+    stats_count(data->shared->stats, STATS_FRAMES_WRITTEN);
+    TRACE_FRAME("DEBUG: Wrote %zu converted bytes to V4L2 device (format %u to %s)\n", frame_size,
+                data->spa_format, output_format_name(data->out_format));
+}
+
+// Convert a DMA-BUF on the mem2mem device straight into the next device buffer
+// Returns: true if the frame was consumed, false to convert it on the regular path
+static bool convert_with_m2m(struct app_data *data, struct spa_buffer *buf, const struct buffer_info *info) {
+    struct spa_data *d = &buf->datas[0];
+    if (buf->n_datas != 1 || d->type != SPA_DATA_DmaBuf || !backend_available(data, CONVERT_BACKEND_M2M)) {
+        return false;
+    }
+
+    // The stride is only known from the buffers
+    uint32_t stride = d->chunk->stride > 0 ? (uint32_t)d->chunk->stride : data->width * 4;
+    if (data->m2m && m2m_converter_get_config(data->m2m)->stride != stride) {
+        m2m_converter_destroy(data->m2m);
+        data->m2m = NULL;
+    }
+    if (!data->m2m) {
+        m2m_config config = {
+            .drm_format = spa_to_drm_format(data->spa_format),
+            .width = data->width,
+            .height = data->height,
+            .stride = stride,
+            .crop_x = data->region.crop_x,
+            .crop_y = data->region.crop_y,
+            .crop_width = data->region.crop_width,
+            .crop_height = data->region.crop_height,
+            .format = data->out_format,
+            .out_width = data->region.width,
+            .out_height = data->region.height,
+        };
+        for (uint32_t i = 0; i < data->shared->n_m2m_devices && !data->m2m; i++) {
+            data->m2m = m2m_converter_create(data->shared->m2m_devices[i].path, &config);
+        }
+        if (!data->m2m) {
+            disable_m2m(data, "no mem2mem device takes this format and size");
+            return false;
+        }
+    }
+
+    size_t frame_size = output_frame_size(data->out_format, data->region.width, data->region.height);
+    size_t out_size = 0;
+    uint8_t *out_buffer = v4l2_sink_acquire(data->sink, &out_size);
+    if (!out_buffer || out_size < frame_size) {
+        return false;
+    }
+
+    uint64_t convert_start_ns = monotonic_ns();
+    if (!m2m_converter_convert(data->m2m, (int)d->fd, d->chunk->offset, d->maxsize, out_buffer, out_size)) {
+        disable_m2m(data, "the device failed to convert a frame");
+        return false;
+    }
+    stats_record(data->shared->stats, STATS_STAGE_CONVERT, monotonic_ns() - convert_start_ns);
+    TRACE_FRAME("DEBUG: Converted DMA-BUF fd %ld on %s\n", (long)d->fd, m2m_converter_get_device(data->m2m));
+
+    note_write_result(data, commit_output_frame(data, frame_size, info), frame_size);
+    return true;
+}
+
+// Describe every plane of a DMA buffer for import, tiled/compressed layouts may carry extra planes
+static void describe_dma_buffer(const struct app_data *data, const struct spa_buffer *buf, gl_dma_buf *dmabuf) {
+    const struct spa_data *d = &buf->datas[0];
+    uint32_t fourcc = spa_to_drm_format(data->spa_format);
+    if (fourcc == 0) {
+        TRACE_FRAME("DEBUG: Unknown SPA format %u, using XRGB8888\n", data->spa_format);
+        fourcc = DRM_FORMAT_XRGB8888;
+    }
+
+    *dmabuf = (gl_dma_buf){
+        .width = data->width,
+        .height = data->height,
+        .fourcc = fourcc,
+        .modifier = data->modifier,
+        .n_planes = 0,
+    };
+    for (uint32_t i = 0; i < buf->n_datas && i < GL_DMA_BUF_MAX_PLANES; i++) {
+        const struct spa_data *plane = &buf->datas[i];
+        if (plane->type != SPA_DATA_DmaBuf) {
+            break;
+        }
+        dmabuf->fd[i] = (int)plane->fd;
+        dmabuf->offset[i] = plane->chunk->offset;
+        dmabuf->stride[i] = plane->chunk->stride;
+        dmabuf->n_planes++;
+    }
+    dmabuf->stride[0] = d->chunk->stride > 0 ? d->chunk->stride : data->width * 4;
+}
+
+// Follow the producer's content rectangle, e.g. of a shared window being
+// resized. Called with pipeline_lock held, before anything is read from the frame.
+static void update_content_crop(struct app_data *data, struct spa_buffer *buf) {
+    struct spa_meta_region *crop = spa_buffer_find_meta_data(buf, SPA_META_VideoCrop, sizeof(*crop));
+    struct spa_region content = {0};
+    if (crop && spa_meta_region_is_valid(crop) && crop->region.position.x >= 0 && crop->region.position.y >= 0 &&
+        (uint64_t)crop->region.position.x + crop->region.size.width <= data->width &&
+        (uint64_t)crop->region.position.y + crop->region.size.height <= data->height &&
+        (crop->region.size.width != data->width || crop->region.size.height != data->height)) {
+        content = crop->region;
+    }
+
+    if (memcmp(&content, &data->content, sizeof(content)) == 0) {
+        return;
+    }
+
+    data->content = content;
+    if (content.size.width != 0) {
+        printf("Stream content: %ux%u at %d,%d of the %ux%u buffer\n", content.size.width, content.size.height,
+               content.position.x, content.position.y, data->width, data->height);
+    } else {
+        printf("Stream content: the whole %ux%u buffer\n", data->width, data->height);
+    }
+    apply_stream_format(data, data->spa_format, data->width, data->height);
+}
+
+// Convert one captured frame and write it to the device, runs on the worker thread
+static void process_frame(struct app_data *data, struct pw_buffer *b) {
     struct spa_buffer *buf;
     struct spa_data *d;
     void *frame_data = NULL;
-    static int write_error_count = 0;
+    uint32_t frame_format = data->spa_format;  // Layout of frame_data (GL readback is always RGBA)
+    bool frame_is_yuyv = false;                // frame_data already holds the YUYV output
+    bool gl_readback = false;
+
+    buf = b->buffer;
+
+    // Diagnostics below only run on sampled frames, and not at all with NO_TRACE
+    bool trace_frame = trace_begin_frame();
+
+    uint64_t start_ns = monotonic_ns();
+    const struct buffer_info *info = b->user_data;
+    uint64_t dequeue_ns = info ? info->dequeue_ns : 0;
+    if (dequeue_ns) {
+        stats_record(data->shared->stats, STATS_STAGE_QUEUE, start_ns - dequeue_ns);
+    }
+    if (dequeue_ns && info->pts_ns && dequeue_ns > info->pts_ns) {
+        stats_record(data->shared->stats, STATS_STAGE_CAPTURE, dequeue_ns - info->pts_ns);
+    }
+
+    if (data->output_failed) {
+        stats_count(data->shared->stats, STATS_FRAMES_INVALID);
+        goto done;
+    }
+
+    // Only the content rectangle is read back and converted
+    update_content_crop(data, buf);
+
+    // Any frame that doesn't end up in the shadow frame leaves it behind
+    bool shadow_was_valid = data->shadow_valid;
+    data->shadow_valid = false;
+
+    struct spa_meta_header *header = spa_buffer_find_meta_data(buf, SPA_META_Header, sizeof(*header));
+    if (header && (header->flags & SPA_META_HEADER_FLAG_CORRUPTED)) {
+        TRACE_FRAME("DEBUG: Skipping corrupted frame\n");
+        stats_count(data->shared->stats, STATS_FRAMES_INVALID);
+        goto done;
+    }
+
+    // Producers may ignore maxFramerate, drop frames over the cap before any work
+    if (!frame_pacer_accept(data->pacer, start_ns)) {
+        TRACE_FRAME("DEBUG: Frame over the --fps cap, dropped\n");
+        stats_count(data->shared->stats, STATS_FRAMES_PACED);
+        goto done;
+    }
 
-    if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL) {
-        DEBUG_PRINT("DEBUG: No buffer available\n");
+    // The device would get the whole buffer, so passthrough can't crop or scale
+    if (data->zero_copy && data->sink && !data->color_bars_mode && !data->region_active && !data->recorder &&
+        pass_through_dma_buffer(data, b)) {
         return;
     }
 
-    buf = b->buffer;
+    // The mem2mem device reads the buffer itself, nothing is mapped or read back
+    if (data->backend == CONVERT_BACKEND_M2M && data->sink && !data->color_bars_mode && !data->recorder &&
+        data->frame_skip_count >= STARTUP_SKIP_FRAMES && convert_with_m2m(data, buf, info)) {
+        goto done;
+    }
 
     // Debug: Check for multiple data planes
-    DEBUG_PRINT("DEBUG: Buffer has %u data planes (n_datas)\n", buf->n_datas);
+    TRACE_FRAME("DEBUG: Buffer has %u data planes (n_datas)\n", buf->n_datas);
     if (buf->n_datas > 1) {
-        DEBUG_PRINT("DEBUG: WARNING: Multiple data planes detected! This might indicate tiled or planar format.\n");
+        TRACE_FRAME("DEBUG: WARNING: Multiple data planes detected! This might indicate tiled or planar format.\n");
         for (uint32_t i = 0; i < buf->n_datas; i++) {
-            DEBUG_PRINT("DEBUG: Data plane %u: type=%d, fd=%ld, maxsize=%u\n",
+            TRACE_FRAME("DEBUG: Data plane %u: type=%d, fd=%ld, maxsize=%u\n",
                    i, buf->datas[i].type, (long)buf->datas[i].fd, buf->datas[i].maxsize);
         }
     }
@@ -758,73 +1821,87 @@ static void on_stream_process(void *userdata) {
     void *mapped_data = NULL;
 
     if (d->type == SPA_DATA_MemFd || d->type == SPA_DATA_DmaBuf) {
-        DEBUG_PRINT("DEBUG: Mapping buffer: fd=%ld, maxsize=%u, mapoffset=%u, chunk offset=%u\n",
+        TRACE_FRAME("DEBUG: Mapping buffer: fd=%ld, maxsize=%u, mapoffset=%u, chunk offset=%u\n",
                (long)d->fd, d->maxsize, d->mapoffset, d->chunk->offset);
 
         // Handle DMA buffer tiling issues
         if (d->type == SPA_DATA_DmaBuf) {
-            DEBUG_PRINT("DEBUG: DMA buffer detected. Checking if GPU processing is needed...\n");
+            TRACE_FRAME("DEBUG: DMA buffer detected. Checking if GPU processing is needed...\n");
+
+            // The CPU backend reads linear buffers in place, the GPU only detiles
+            bool map_directly = data->backend == CONVERT_BACKEND_CPU && (d->flags & SPA_DATA_FLAG_MAPPABLE) &&
+                                data->modifier == DRM_FORMAT_MOD_LINEAR;
 
             // Try to use OpenGL to handle the DMA buffer if available
-            if (data->gl_ctx && gl_has_dma_buf_import_support(data->gl_ctx)) {
-                DEBUG_PRINT("DEBUG: Using OpenGL to import DMA buffer\n");
-
-                // Ensure GL buffer is allocated
-                size_t required_size = data->width * data->height * 4; // RGBA
-                if (!data->gl_buffer || data->gl_buffer_size < required_size) {
-                    data->gl_buffer = realloc(data->gl_buffer, required_size);
-                    data->gl_buffer_size = required_size;
-                    if (!data->gl_buffer) {
-                        DEBUG_PRINT("ERROR: Failed to allocate GL buffer\n");
-                        goto done;
+            if (!map_directly && data->shared->gl_ctx && gl_has_dma_buf_import_support(data->shared->gl_ctx)) {
+                TRACE_FRAME("DEBUG: Using OpenGL to import DMA buffer\n");
+
+                // Import DMA buffer and read it back as linear YUYV or RGBA
+                gl_dma_buf dmabuf;
+                describe_dma_buffer(data, buf, &dmabuf);
+
+                if (data->gpu_region) {
+                    gl_set_output_region(data->shared->gl_ctx, data->region_active ? &data->region : NULL);
+                }
+
+                gl_import_result import_result = GL_IMPORT_ERROR;
+
+                // Preferred: pack YUYV on the GPU and read it straight into the V4L2 buffer
+                // A recording needs the RGBA frame it was converted from
+                if (!data->color_bars_mode && !data->recorder && data->sink && data->out_format == OUTPUT_FORMAT_YUYV &&
+                    data->backend != CONVERT_BACKEND_CPU &&
+                    (data->gpu_region || !data->region_active) && gl_has_yuyv_conversion_support(data->shared->gl_ctx)) {
+                    size_t out_size = 0;
+                    uint8_t *out_buffer = v4l2_sink_acquire(data->sink, &out_size);
+                    if (out_buffer) {
+                        import_result = gl_import_dma_buffer(data->shared->gl_ctx, &dmabuf, GL_READBACK_YUYV,
+                                                             out_buffer, out_size);
+                    }
+                    if (import_result == GL_IMPORT_DONE) {
+                        frame_data = out_buffer;
+                        frame_is_yuyv = true;
+                        TRACE_FRAME("DEBUG: Converted DMA buffer to YUYV via OpenGL\n");
                     }
                 }
 
-                // Import DMA buffer and read it back as linear RGBA
-                uint32_t stride = d->chunk->stride > 0 ? d->chunk->stride : data->width * 4;
-                uint32_t fourcc = DRM_FORMAT_XRGB8888; // Default format, adjust based on spa_format
+                if (import_result == GL_IMPORT_PENDING) {
+                    // Readback is in flight, this frame comes out of a later process call
+                    TRACE_FRAME("DEBUG: Asynchronous readback pending, no frame to output yet\n");
+                    goto done;
+                }
 
-                // Map SPA format to DRM fourcc
-                switch (data->spa_format) {
-                    case 7: // SPA_VIDEO_FORMAT_RGBx
-                        fourcc = DRM_FORMAT_RGBX8888;
-                        break;
-                    case 8: // SPA_VIDEO_FORMAT_BGRx
-                        fourcc = DRM_FORMAT_BGRX8888;
-                        break;
-                    case 9: // SPA_VIDEO_FORMAT_xRGB
-                        fourcc = DRM_FORMAT_XRGB8888;
-                        break;
-                    case 10: // SPA_VIDEO_FORMAT_xBGR
-                        fourcc = DRM_FORMAT_XBGR8888;
-                        break;
-                    case 11: // SPA_VIDEO_FORMAT_RGBA
-                        fourcc = DRM_FORMAT_RGBA8888;
-                        break;
-                    case 12: // SPA_VIDEO_FORMAT_BGRA
-                        fourcc = DRM_FORMAT_BGRA8888;
-                        break;
-                    case 13: // SPA_VIDEO_FORMAT_ARGB
-                        fourcc = DRM_FORMAT_ARGB8888;
-                        break;
-                    case 14: // SPA_VIDEO_FORMAT_ABGR
-                        fourcc = DRM_FORMAT_ABGR8888;
-                        break;
-                    default:
-                        DEBUG_PRINT("DEBUG: Unknown SPA format %u, using XRGB8888\n", data->spa_format);
-                        break;
+                if (!frame_data) {
+                    // Ensure GL buffer is allocated
+                    size_t required_size = data->gpu_region ? (size_t)data->region.width * data->region.height * 4 :
+                                           (size_t)data->width * data->height * 4; // RGBA
+                    if (!reserve_buffer(&data->gl_buffer, &data->gl_buffer_size, required_size, "GL buffer")) {
+                        goto done;
+                    }
+
+                    import_result = gl_import_dma_buffer(data->shared->gl_ctx, &dmabuf, GL_READBACK_RGBA,
+                                                         data->gl_buffer, data->gl_buffer_size);
+                    if (import_result == GL_IMPORT_DONE) {
+                        // Success! Use the GL buffer as frame data
+                        frame_data = data->gl_buffer;
+                        frame_format = 11; // glReadPixels returns [R][G][B][A]
+                        TRACE_FRAME("DEBUG: Successfully imported DMA buffer via OpenGL\n");
+                    } else if (import_result == GL_IMPORT_PENDING) {
+                        TRACE_FRAME("DEBUG: Asynchronous readback pending, no frame to output yet\n");
+                        goto done;
+                    } else {
+                        DEBUG_PRINT("ERROR: Failed to import DMA buffer via OpenGL, trying fallback...\n");
+                        // Fall through to try mmap
+                    }
                 }
 
-                if (gl_import_dma_buffer(data->gl_ctx, d->fd, data->width, data->height,
-                                         stride, d->mapoffset, fourcc,
-                                         data->gl_buffer, data->gl_buffer_size)) {
-                    // Success! Use the GL buffer as frame data
-                    frame_data = data->gl_buffer;
+                if (frame_data) {
+                    gl_readback = true;
                     mapped_data = NULL; // No mmap needed
-                    DEBUG_PRINT("DEBUG: Successfully imported DMA buffer via OpenGL\n");
-                } else {
-                    DEBUG_PRINT("ERROR: Failed to import DMA buffer via OpenGL, trying fallback...\n");
-                    // Fall through to try mmap
+
+                    uint64_t import_ns, readback_ns;
+                    gl_get_last_import_timing(data->shared->gl_ctx, &import_ns, &readback_ns);
+                    stats_record(data->shared->stats, STATS_STAGE_IMPORT, import_ns);
+                    stats_record(data->shared->stats, STATS_STAGE_READBACK, readback_ns);
                 }
             }
 
@@ -834,161 +1911,181 @@ static void on_stream_process(void *userdata) {
                 if (!(d->flags & SPA_DATA_FLAG_MAPPABLE)) {
                     DEBUG_PRINT("ERROR: DMA buffer is not mappable and OpenGL import failed/unavailable\n");
                     DEBUG_PRINT("ERROR: Cannot process tiled DMA buffers. Skipping frame.\n");
+                    stats_count(data->shared->stats, STATS_FRAMES_INVALID);
                     goto done;  // Skip this frame entirely
                 }
 
-                DEBUG_PRINT("DEBUG: DMA buffer has MAPPABLE flag, attempting direct mmap...\n");
+                TRACE_FRAME("DEBUG: DMA buffer has MAPPABLE flag, attempting direct mmap...\n");
             }
         }
 
         // If we haven't successfully imported via OpenGL, try mmap
         if (!frame_data) {
+            uint64_t map_start_ns = monotonic_ns();
             mapped_data = mmap(NULL, d->maxsize, PROT_READ, MAP_PRIVATE, d->fd, d->mapoffset);
             if (mapped_data == MAP_FAILED) {
-                DEBUG_PRINT("DEBUG: Failed to map buffer\n");
+                TRACE_FRAME("DEBUG: Failed to map buffer\n");
+                stats_count(data->shared->stats, STATS_FRAMES_INVALID);
                 goto done;
             }
-            DEBUG_PRINT("DEBUG: Buffer mapped successfully at %p\n", mapped_data);
+            stats_record(data->shared->stats, STATS_STAGE_IMPORT, monotonic_ns() - map_start_ns);
+            TRACE_FRAME("DEBUG: Buffer mapped successfully at %p\n", mapped_data);
 
             // Apply chunk offset to get actual frame data
             frame_data = (uint8_t*)mapped_data + d->chunk->offset;
-            DEBUG_PRINT("DEBUG: Frame data at %p (mapped + %u offset)\n", frame_data, d->chunk->offset);
+            TRACE_FRAME("DEBUG: Frame data at %p (mapped + %u offset)\n", frame_data, d->chunk->offset);
         }
 
     } else if (d->type == SPA_DATA_MemPtr) {
         // For memory pointers, chunk offset should already be applied
         frame_data = (uint8_t*)d->data + d->chunk->offset;
-        DEBUG_PRINT("DEBUG: Using direct memory pointer: %p + offset %u = %p\n",
+        TRACE_FRAME("DEBUG: Using direct memory pointer: %p + offset %u = %p\n",
                d->data, d->chunk->offset, frame_data);
     } else {
-        DEBUG_PRINT("DEBUG: Unsupported buffer type: %d\n", d->type);
+        TRACE_FRAME("DEBUG: Unsupported buffer type: %d\n", d->type);
         goto done;
     }
 
     if (frame_data == NULL) {
-        DEBUG_PRINT("DEBUG: Frame data is NULL\n");
+        TRACE_FRAME("DEBUG: Frame data is NULL\n");
         goto cleanup_map;
     }
 
+    // Size of frame_data, GL readback may be cropped and scaled already
+    bool frame_in_region = gl_readback && data->gpu_region;
+    int frame_width = frame_in_region ? (int)data->region.width : (int)data->width;
+    int frame_height = frame_in_region ? (int)data->region.height : (int)data->height;
+
     // Get stride from the chunk structure if available
     uint32_t actual_stride;
-    int bytes_per_pixel = (data->spa_format == 15 || data->spa_format == 16) ? 3 : 4;
-    uint32_t min_stride = data->width * bytes_per_pixel;
+    int bytes_per_pixel = frame_is_yuyv ? 2 : ((frame_format == 15 || frame_format == 16) ? 3 : 4);
+    uint32_t min_stride = frame_width * bytes_per_pixel;
 
-    if (d->chunk->stride > 0) {
+    if (gl_readback) {
+        // GPU readback is always tightly packed
+        actual_stride = min_stride;
+        TRACE_FRAME("DEBUG: Using packed stride of GL readback: %u bytes\n", actual_stride);
+    } else if (d->chunk->stride > 0) {
         actual_stride = d->chunk->stride;
-        DEBUG_PRINT("DEBUG: Using stride from chunk: %u bytes (chunk->stride)\n", actual_stride);
+        TRACE_FRAME("DEBUG: Using stride from chunk: %u bytes (chunk->stride)\n", actual_stride);
     } else if (data->height > 0 && d->chunk->size > 0) {
         // Fallback: Calculate stride from chunk size (like PipeWire video-play.c does)
         actual_stride = d->chunk->size / data->height;
-        DEBUG_PRINT("DEBUG: chunk->stride is 0, calculated stride from size/height: %u bytes\n", actual_stride);
+        TRACE_FRAME("DEBUG: chunk->stride is 0, calculated stride from size/height: %u bytes\n", actual_stride);
     } else {
         actual_stride = min_stride;
-        DEBUG_PRINT("DEBUG: Using minimum stride (width * bytes_per_pixel): %u bytes\n", actual_stride);
+        TRACE_FRAME("DEBUG: Using minimum stride (width * bytes_per_pixel): %u bytes\n", actual_stride);
     }
 
     // Validate stride
     if (actual_stride < min_stride) {
-        DEBUG_PRINT("DEBUG: WARNING: Stride %u is less than minimum %u, using minimum\n", actual_stride, min_stride);
+        TRACE_FRAME("DEBUG: WARNING: Stride %u is less than minimum %u, using minimum\n", actual_stride, min_stride);
         actual_stride = min_stride;
     }
 
     // Update stored stride if different
     if (data->stride != actual_stride) {
-        DEBUG_PRINT("DEBUG: Updating stored stride from %u to %u\n", data->stride, actual_stride);
+        TRACE_FRAME("DEBUG: Updating stored stride from %u to %u\n", data->stride, actual_stride);
         data->stride = actual_stride;
     }
 
-    DEBUG_PRINT("DEBUG: Processing frame: %u bytes, type=%d, spa_format=%u\n", d->chunk->size, d->type, data->spa_format);
-    DEBUG_PRINT("DEBUG: Frame dimensions: %ux%u, stride: %d bytes (chunk->stride=%d)\n",
+    TRACE_FRAME("DEBUG: Processing frame: %u bytes, type=%d, spa_format=%u\n", d->chunk->size, d->type, data->spa_format);
+    TRACE_FRAME("DEBUG: Frame dimensions: %ux%u, stride: %d bytes (chunk->stride=%d)\n",
            data->width, data->height, actual_stride, d->chunk->stride);
-    DEBUG_PRINT("DEBUG: Buffer maxsize: %u, chunk offset: %u, chunk size: %u\n",
+    TRACE_FRAME("DEBUG: Buffer maxsize: %u, chunk offset: %u, chunk size: %u\n",
            d->maxsize, d->chunk->offset, d->chunk->size);
 
     // Check if size matches expectations with stride
     size_t expected_size = (size_t)actual_stride * data->height;
     if (d->chunk->size != expected_size) {
-        DEBUG_PRINT("DEBUG: *** SIZE MISMATCH *** chunk size %u != expected %zu (stride * height)\n", d->chunk->size, expected_size);
+        TRACE_FRAME("DEBUG: *** SIZE MISMATCH *** chunk size %u != expected %zu (stride * height)\n", d->chunk->size, expected_size);
     } else {
-        DEBUG_PRINT("DEBUG: Size matches expectations (stride * height)\n");
+        TRACE_FRAME("DEBUG: Size matches expectations (stride * height)\n");
     }
 
     // Skip the first few frames as they may be uninitialized
-    if (data->frame_skip_count < 5) {
+    if (data->frame_skip_count < STARTUP_SKIP_FRAMES) {
         data->frame_skip_count++;
-        DEBUG_PRINT("DEBUG: Skipping frame %d (waiting for stream to stabilize)\n", data->frame_skip_count);
+        TRACE_FRAME("DEBUG: Skipping frame %d (waiting for stream to stabilize)\n", data->frame_skip_count);
+        stats_count(data->shared->stats, STATS_FRAMES_INVALID);
         goto cleanup_map;
     }
 
-    if (data->v4l2_fd >= 0) {
-        // Ensure conversion buffer is allocated if needed
-        if (!data->conversion_buffer && !data->color_bars_mode) {
-            data->conversion_buffer_size = data->width * data->height * 2; // YUYV
-            data->conversion_buffer = malloc(data->conversion_buffer_size);
-            if (!data->conversion_buffer) {
-                DEBUG_PRINT("DEBUG: Failed to allocate conversion buffer on-demand\n");
-                goto cleanup_map;
-            }
-            DEBUG_PRINT("DEBUG: Allocated conversion buffer on-demand: %zu bytes\n", data->conversion_buffer_size);
-        }
+    if (data->recorder) {
+        record_frame(data, frame_data, frame_format, frame_width, frame_height, actual_stride, info);
+    }
+
+    if (data->sink) {
+        // Frames are rendered straight into the next V4L2 output buffer
+        size_t frame_size = data->color_bars_mode ? (size_t)data->width * data->height * 2 :
+                            output_frame_size(data->out_format, data->region.width, data->region.height);
+        size_t out_size = 0;
 
         if (data->color_bars_mode) {
             // Generate color bars test pattern
-            generate_color_bars_yuyv(data->conversion_buffer, data->width, data->height);
-            ssize_t written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-            if (written < 0) {
+            uint8_t *out_buffer = v4l2_sink_acquire(data->sink, &out_size);
+            if (!out_buffer || out_size < frame_size) {
+                perror("Failed to get V4L2 output buffer");
+                goto cleanup_map;
+            }
+            generate_color_bars_yuyv(out_buffer, data->width, data->height);
+            uint64_t timestamp_ns = 0;
+            if (data->latency_barcode) {
+                timestamp_ns = monotonic_ns();
+                draw_latency_barcode_yuyv(out_buffer, data->width, data->height, data->barcode_frame++, timestamp_ns);
+            }
+            if (!v4l2_sink_commit(data->sink, frame_size, timestamp_ns)) {
                 perror("Failed to write to V4L2 device");
             } else {
-                DEBUG_PRINT("DEBUG: Wrote %zd color bars bytes to V4L2 device\n", written);
+                TRACE_FRAME("DEBUG: Wrote %zu color bars bytes to V4L2 device\n", frame_size);
             }
         } else {
             // Validate the frame data
-            bool frame_valid = validate_frame_data((const uint8_t*)frame_data, data->width, data->height, data->spa_format, actual_stride);
+            bool frame_valid = frame_is_yuyv ?
+                validate_yuyv_frame_data((const uint8_t*)frame_data, frame_width, frame_height) :
+                validate_frame_data((const uint8_t*)frame_data, frame_width, frame_height, frame_format, actual_stride);
 
             // Debug: Analyze the incoming pixel data
             static int debug_frame_count = 0;
-            static time_t last_color_sample = 0;
-            time_t current_time = time(NULL);
-
-            if (debug_frame_count < 3) { // Only debug first 3 frames to avoid spam
-                debug_pixel_data((const uint8_t*)frame_data, data->width, data->height, data->spa_format, actual_stride);
+            if (trace_frame && debug_frame_count < 3) { // Only debug first 3 sampled frames to avoid spam
+                debug_pixel_data((const uint8_t*)frame_data, frame_width, frame_height, frame_format, actual_stride);
                 debug_frame_count++;
             }
 
-
             // Skip invalid frames (all-black or mostly black)
             if (!frame_valid) {
-                DEBUG_PRINT("DEBUG: Skipping invalid frame (mostly black pixels)\n");
+                TRACE_FRAME("DEBUG: Skipping invalid frame (mostly black pixels)\n");
+                stats_count(data->shared->stats, STATS_FRAMES_INVALID);
                 goto cleanup_map;
             }
 
-            // Sample colors every second
-            if (current_time - last_color_sample >= 1) {
+            // Sample colors of sampled frames
+            if (trace_frame) {
                 const uint8_t *sample_data = (const uint8_t*)frame_data;
 
                 // Sample from center of frame
-                int center_x = data->width / 2;
-                int center_y = data->height / 2;
+                int center_x = frame_width / 2;
+                int center_y = frame_height / 2;
                 int center_idx = center_y * actual_stride + center_x * 4;
 
                 // Sample from a few different locations
-                DEBUG_PRINT("COLOR SAMPLE: Center pixel [%02X %02X %02X %02X] -> BGRx(B=%02X G=%02X R=%02X)\n",
+                TRACE_FRAME("COLOR SAMPLE: Center pixel [%02X %02X %02X %02X] -> BGRx(B=%02X G=%02X R=%02X)\n",
                        sample_data[center_idx], sample_data[center_idx+1],
                        sample_data[center_idx+2], sample_data[center_idx+3],
                        sample_data[center_idx], sample_data[center_idx+1], sample_data[center_idx+2]);
 
                 // Sample from corners to see if there's variation
-                int corners[4][2] = {{10, 10}, {data->width-10, 10}, {10, data->height-10}, {data->width-10, data->height-10}};
+                int corners[4][2] = {{10, 10}, {frame_width-10, 10}, {10, frame_height-10}, {frame_width-10, frame_height-10}};
                 for (int c = 0; c < 4; c++) {
                     int corner_idx = corners[c][1] * actual_stride + corners[c][0] * 4;
-                    DEBUG_PRINT("COLOR SAMPLE: Corner %d [%02X %02X %02X %02X]\n", c,
+                    TRACE_FRAME("COLOR SAMPLE: Corner %d [%02X %02X %02X %02X]\n", c,
                            sample_data[corner_idx], sample_data[corner_idx+1],
                            sample_data[corner_idx+2], sample_data[corner_idx+3]);
                 }
 
                 // Count different color patterns
                 int black_pixels = 0, white_pixels = 0, red_pixels = 0, other_pixels = 0;
-                for (int i = 0; i < 100 && i < data->width; i++) {  // Sample first line
+                for (int i = 0; i < 100 && i < frame_width; i++) {  // Sample first line
                     const uint8_t *pixel = sample_data + (i * 4);
                     if (pixel[0] == 0 && pixel[1] == 0 && pixel[2] == 0) {
                         black_pixels++;
@@ -1000,139 +2097,131 @@ static void on_stream_process(void *userdata) {
                         other_pixels++;
                     }
                 }
-                DEBUG_PRINT("COLOR SAMPLE: Black=%d White=%d Red=%d Other=%d (out of 100)\n",
+                TRACE_FRAME("COLOR SAMPLE: Black=%d White=%d Red=%d Other=%d (out of 100)\n",
                        black_pixels, white_pixels, red_pixels, other_pixels);
-
-                last_color_sample = current_time;
             }
 
-            // Check if we need to create a packed buffer (stride has padding)
-            uint8_t *conversion_src = (uint8_t*)frame_data;
-            uint8_t *packed_buffer = NULL;
+            // The converters honor the stride, padded rows are read in place
+            const uint8_t *conversion_src = (const uint8_t*)frame_data;
             uint32_t conversion_stride = actual_stride;
 
-            int local_bytes_per_pixel = (data->spa_format == 15 || data->spa_format == 16) ? 3 : 4;
-            uint32_t expected_stride = data->width * local_bytes_per_pixel;
+            // Cropping on the CPU is only an offset into the frame
+            int area_width = frame_width;
+            int area_height = frame_height;
+            if (!frame_in_region) {
+                conversion_src += (size_t)data->region.crop_y * conversion_stride +
+                                  (size_t)data->region.crop_x * bytes_per_pixel;
+                area_width = data->region.crop_width;
+                area_height = data->region.crop_height;
+            }
 
-            if (actual_stride > expected_stride) {
-                DEBUG_PRINT("DEBUG: Stride has padding (%u > %u), creating packed buffer\n", actual_stride, expected_stride);
-                packed_buffer = create_packed_buffer((const uint8_t*)frame_data, data->width, data->height,
-                                                    actual_stride, local_bytes_per_pixel);
-                if (packed_buffer) {
-                    conversion_src = packed_buffer;
-                    conversion_stride = expected_stride;
-                } else {
-                    DEBUG_PRINT("ERROR: Failed to create packed buffer, using original with stride\n");
-                }
+            // Readback may return an earlier frame, so damage only applies to mapped buffers
+            // The shadow frame is packed YUYV, other outputs are always converted whole
+            struct damage_rect damage[MAX_DAMAGE_RECTS];
+            int n_damage = gl_readback || data->region_active || data->out_format != OUTPUT_FORMAT_YUYV ? -1 :
+                           get_frame_damage(data, buf, damage);
+
+            // Skip frames identical to the previous one, unless a keep-alive frame is due
+            bool unchanged;
+            if (n_damage >= 0) {
+                unchanged = n_damage == 0 && shadow_was_valid &&
+                            frame_queue_get_dropped(data->frame_queue) == data->shadow_dropped;
+                data->last_hash_valid = false;
+            } else {
+                uint64_t hash = sample_frame_hash(conversion_src, area_width, area_height,
+                                                  bytes_per_pixel, conversion_stride);
+                unchanged = data->last_hash_valid && hash == data->last_hash;
+                data->last_hash = hash;
+                data->last_hash_valid = true;
             }
 
-            // Always convert to YUYV format
-            ssize_t written = -1;
-            switch (data->spa_format) {
-                case 7: // SPA_VIDEO_FORMAT_RGBx - [R][G][B][X]
-                case 11: // SPA_VIDEO_FORMAT_RGBA - [R][G][B][A]
-                    convert_rgba32_to_yuyv((const uint8_t*)conversion_src, data->conversion_buffer,
-                                          data->width, data->height, conversion_stride);
-                    written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-                    break;
-                case 8: // SPA_VIDEO_FORMAT_BGRx - [B][G][R][X]
-                    // Debug: Let's verify the actual format by checking sample pixels
-                    {
-                        const uint8_t *debug_src = (const uint8_t*)conversion_src;
-                        DEBUG_PRINT("DEBUG BGRx: First pixel bytes: [%02X %02X %02X %02X]\n",
-                               debug_src[0], debug_src[1], debug_src[2], debug_src[3]);
-                        DEBUG_PRINT("DEBUG BGRx: Interpreting as BGRx: B=%d G=%d R=%d\n",
-                               debug_src[0], debug_src[1], debug_src[2]);
-                        // Check a non-black pixel if available
-                        for (int i = 0; i < 100 && i < data->width; i++) {
-                            const uint8_t *px = debug_src + i * 4;
-                            if (px[0] != 0 || px[1] != 0 || px[2] != 0) {
-                                DEBUG_PRINT("DEBUG BGRx: Non-black pixel at %d: [%02X %02X %02X %02X] -> RGB(%d,%d,%d)\n",
-                                       i, px[0], px[1], px[2], px[3], px[2], px[1], px[0]);
-                                break;
-                            }
-                        }
-                    }
-                    convert_bgrx_to_yuyv((const uint8_t*)conversion_src, data->conversion_buffer,
-                                        data->width, data->height, conversion_stride);
-                    // Debug: Check the YUV output
-                    {
-                        uint8_t *yuv = data->conversion_buffer;
-                        DEBUG_PRINT("DEBUG YUV: First 8 bytes (2 pixels): [%02X %02X %02X %02X %02X %02X %02X %02X]\n",
-                               yuv[0], yuv[1], yuv[2], yuv[3], yuv[4], yuv[5], yuv[6], yuv[7]);
-                        DEBUG_PRINT("DEBUG YUV: Pixel 0: Y0=%d U=%d, Pixel 1: Y1=%d V=%d\n",
-                               yuv[0], yuv[1], yuv[2], yuv[3]);
-                    }
-                    written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-                    break;
-                case 9: // SPA_VIDEO_FORMAT_xRGB - [X][R][G][B]
-                    convert_xrgb_to_yuyv((const uint8_t*)conversion_src, data->conversion_buffer,
-                                        data->width, data->height, conversion_stride);
-                    written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-                    break;
-                case 10: // SPA_VIDEO_FORMAT_xBGR - [X][B][G][R]
-                    convert_xbgr_to_yuyv((const uint8_t*)conversion_src, data->conversion_buffer,
-                                        data->width, data->height, conversion_stride);
-                    written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-                    break;
-                case 12: // SPA_VIDEO_FORMAT_BGRA - [B][G][R][A]
-                    convert_bgra_to_yuyv((const uint8_t*)conversion_src, data->conversion_buffer,
-                                        data->width, data->height, conversion_stride);
-                    written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-                    break;
-                case 13: // SPA_VIDEO_FORMAT_ARGB - [A][R][G][B]
-                    convert_argb_to_yuyv((const uint8_t*)conversion_src, data->conversion_buffer,
-                                        data->width, data->height, conversion_stride);
-                    written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-                    break;
-                case 14: // SPA_VIDEO_FORMAT_ABGR - [A][B][G][R]
-                    // ABGR uses the xBGR conversion (same as convert_xbgr_to_yuyv handles ABGR)
-                    convert_xbgr_to_yuyv((const uint8_t*)conversion_src, data->conversion_buffer,
-                                        data->width, data->height, conversion_stride);
-                    written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-                    break;
-                case 15: // SPA_VIDEO_FORMAT_RGB - [R][G][B]
-                case 16: // SPA_VIDEO_FORMAT_BGR - [B][G][R]
-                    convert_rgb24_to_yuyv((const uint8_t*)conversion_src, data->conversion_buffer,
-                                         data->width, data->height, conversion_stride);
-                    written = write(data->v4l2_fd, data->conversion_buffer, data->conversion_buffer_size);
-                    break;
-                default:
-                    DEBUG_PRINT("DEBUG: Unsupported format %u for conversion\n", data->spa_format);
-                    break;
+            bool keep_alive_due = data->keep_alive_fps > 0 &&
+                monotonic_ns() - data->last_push_ns >= 1000000000ULL / data->keep_alive_fps;
+            if (unchanged && !keep_alive_due) {
+                TRACE_FRAME("DEBUG: Frame unchanged, skipping conversion\n");
+                stats_count(data->shared->stats, STATS_FRAMES_UNCHANGED);
+                if (n_damage >= 0) {
+                    data->shadow_valid = true;
+                }
+                goto cleanup_map;
             }
 
-            // Clean up packed buffer if we created one
-            if (packed_buffer) {
-                free(packed_buffer);
+            // Scale on the CPU what the GPU didn't
+            uint64_t convert_start_ns = monotonic_ns();
+            if (!frame_is_yuyv && ((uint32_t)area_width != data->region.width ||
+                                   (uint32_t)area_height != data->region.height)) {
+                if (!scale_frame(data, &frame_format, &conversion_src, &conversion_stride,
+                                 area_width, area_height)) {
+                    goto cleanup_map;
+                }
+                bytes_per_pixel = 4;
             }
 
-            if (written < 0) {
-                perror("Failed to write to V4L2 device");
-                write_error_count++;
+            // Time spent in v4l2_sink_acquire isn't conversion work
+            uint64_t convert_ns = monotonic_ns() - convert_start_ns;
 
-                // Check if the portal session is still active
-                if (data->portal_session && !data->portal_session->session_active) {
-                    printf("Portal session is no longer active, stopping stream...\n");
-                    if (data->loop) {
-                        pw_main_loop_quit(data->loop);
+            uint8_t *out_buffer = v4l2_sink_acquire(data->sink, &out_size);
+            if (out_buffer && out_size < frame_size) {
+                DEBUG_PRINT("ERROR: V4L2 buffer too small: %zu < %zu\n", out_size, frame_size);
+                out_buffer = NULL;
+            }
+            convert_start_ns = monotonic_ns();
+
+            bool written = false;
+            if (out_buffer && frame_is_yuyv) {
+                // Already packed on the GPU straight into this buffer
+                written = commit_output_frame(data, frame_size, info);
+            } else if (out_buffer && data->out_format == OUTPUT_FORMAT_MJPEG) {
+                // Compressed from the captured layout, no conversion pass
+                frame_size = mjpeg_encoder_encode(data->mjpeg, conversion_src, frame_format,
+                                                  data->region.width, data->region.height, conversion_stride,
+                                                  out_buffer, out_size);
+                stats_record(data->shared->stats, STATS_STAGE_CONVERT, convert_ns + monotonic_ns() - convert_start_ns);
+                written = frame_size > 0 && commit_output_frame(data, frame_size, info);
+            } else if (out_buffer) {
+                if (trace_frame && frame_format == 8) { // SPA_VIDEO_FORMAT_BGRx - [B][G][R][X]
+                    // Debug: Let's verify the actual format by checking sample pixels
+                    const uint8_t *debug_src = conversion_src;
+                    TRACE_FRAME("DEBUG BGRx: First pixel bytes: [%02X %02X %02X %02X]\n",
+                           debug_src[0], debug_src[1], debug_src[2], debug_src[3]);
+                    TRACE_FRAME("DEBUG BGRx: Interpreting as BGRx: B=%d G=%d R=%d\n",
+                           debug_src[0], debug_src[1], debug_src[2]);
+                    // Check a non-black pixel if available
+                    for (int i = 0; i < 100 && i < data->width; i++) {
+                        const uint8_t *px = debug_src + i * 4;
+                        if (px[0] != 0 || px[1] != 0 || px[2] != 0) {
+                            TRACE_FRAME("DEBUG BGRx: Non-black pixel at %d: [%02X %02X %02X %02X] -> RGB(%d,%d,%d)\n",
+                                   i, px[0], px[1], px[2], px[3], px[2], px[1], px[0]);
+                            break;
+                        }
                     }
-                    goto cleanup_map;
                 }
 
-                // If we get multiple consecutive write errors, assume sharing has stopped
-                if (write_error_count >= 5) {
-                    printf("Multiple V4L2 write failures detected, assuming sharing stopped. Exiting...\n");
-                    if (data->loop) {
-                        pw_main_loop_quit(data->loop);
-                    }
-                    goto cleanup_map;
+                bool converted;
+                if (n_damage >= 0 && update_shadow_frame(data, shadow_was_valid, frame_format, conversion_src,
+                                                         conversion_stride, bytes_per_pixel, damage, n_damage)) {
+                    memcpy(out_buffer, data->shadow_frame, frame_size);
+                    data->shadow_valid = true;
+                    converted = true;
+                } else {
+                    convert_context ctx = worker_convert_context(data);
+                    converted = convert_frame(&ctx, data->out_format, frame_format, conversion_src, out_buffer,
+                                              data->region.width, data->region.height, conversion_stride);
+                }
+
+                if (converted) {
+                    // Debug: Check the YUV output
+                    uint8_t *yuv = out_buffer;
+                    TRACE_FRAME("DEBUG YUV: First 8 bytes (2 pixels): [%02X %02X %02X %02X %02X %02X %02X %02X]\n",
+                           yuv[0], yuv[1], yuv[2], yuv[3], yuv[4], yuv[5], yuv[6], yuv[7]);
+                    TRACE_FRAME("DEBUG YUV: Pixel 0: Y0=%d U=%d, Pixel 1: Y1=%d V=%d\n",
+                           yuv[0], yuv[1], yuv[2], yuv[3]);
+                    stats_record(data->shared->stats, STATS_STAGE_CONVERT, convert_ns + monotonic_ns() - convert_start_ns);
+                    written = commit_output_frame(data, frame_size, info);
                 }
-            } else if (written > 0) {
-                // Reset error count on successful write
-                write_error_count = 0;
-                DEBUG_PRINT("DEBUG: Wrote %zd converted bytes to V4L2 device (format %u)\n", written, data->spa_format);
             }
+
+            note_write_result(data, written, frame_size);
         }
     }
 
@@ -1142,49 +2231,677 @@ cleanup_map:
     }
 
 done:
-    pw_stream_queue_buffer(data->stream, b);
-}
+    // Under --convert-backend auto, whole frames are timed to pick the backend
+    if (data->calibrating && data->last_push_ns >= start_ns && buf->n_datas > 0 &&
+        buf->datas[0].type == SPA_DATA_DmaBuf) {
+        calibrate_backend(data, monotonic_ns() - start_ns);
+    }
 
-static const struct pw_stream_events stream_events = {
-    PW_VERSION_STREAM_EVENTS,
-    .state_changed = on_stream_state_changed,
-    .param_changed = on_stream_param_changed,
-    .process = on_stream_process,
-};
+    data->frames_converted++;
+    return_buffer(data, b);
+}
 
-static int setup_v4l2_device(const char *device) {
-    int fd = open(device, O_RDWR);
-    if (fd < 0) {
-        perror("Failed to open V4L2 device");
-        return -1;
+// Requeue the buffers the worker is done with, runs on the data loop
+static void requeue_returned_buffers(struct app_data *data) {
+    struct pw_buffer *b;
+    while ((b = frame_queue_pop(data->return_queue)) != NULL) {
+        pw_stream_queue_buffer(data->stream, b);
+    }
+}
+
+static void on_return_event(void *userdata, uint64_t count) {
+    (void)count;
+    requeue_returned_buffers(userdata);
+}
+
+// Presentation time of a buffer from its header metadata
+// Mutter stamps buffers with CLOCK_MONOTONIC, the clock of pw_time.now, but other
+// producers may use their own, so pts far from the graph time is ignored.
+// Returns: pts in nanoseconds, 0 if missing or not on CLOCK_MONOTONIC
+static uint64_t buffer_pts_ns(struct pw_buffer *b, const struct pw_time *time) {
+    struct spa_meta_header *header = spa_buffer_find_meta_data(b->buffer, SPA_META_Header, sizeof(*header));
+    if (!header || header->pts <= 0 || !time || time->now <= 0) {
+        return 0;
+    }
+
+    int64_t skew = time->now - header->pts;
+    if (skew < -PTS_MAX_SKEW_NS || skew > PTS_MAX_SKEW_NS) {
+        return 0;
+    }
+    return (uint64_t)header->pts;
+}
+
+// RT thread: only hand buffers over to the worker, the frame work happens there
+static void on_stream_process(void *userdata) {
+    struct app_data *data = userdata;
+    struct pw_buffer *b;
+
+    trace_begin_frame();
+    requeue_returned_buffers(data);
+
+    struct pw_time time;
+    bool have_time = pw_stream_get_time_n(data->stream, &time, sizeof(time)) == 0;
+
+    while (true) {
+        // Blocking leaves the buffers queued in PipeWire, so GNOME runs out and waits for us
+        if (data->queue_policy == QUEUE_POLICY_BLOCK && frame_queue_is_full(data->frame_queue)) {
+            break;
+        }
+
+        if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL) {
+            break;
+        }
+
+        struct buffer_info *info = b->user_data;
+        if (info) {
+            info->dequeue_ns = monotonic_ns();
+            info->pts_ns = buffer_pts_ns(b, have_time ? &time : NULL);
+        }
+        stats_count(data->shared->stats, STATS_FRAMES_IN);
+
+        if (data->queue_policy == QUEUE_POLICY_BLOCK) {
+            frame_queue_push(data->frame_queue, b);
+        } else {
+            struct pw_buffer *dropped = frame_queue_push_drop_oldest(data->frame_queue, b);
+            if (dropped) {
+                TRACE_FRAME("DEBUG: Conversion is behind, dropped the oldest queued frame\n");
+                stats_count(data->shared->stats, STATS_FRAMES_QUEUE_DROPPED);
+                pw_stream_queue_buffer(data->stream, dropped);
+            }
+        }
+
+        sem_post(&data->shared->worker_sem);
+    }
+}
+
+// Wait for the RT thread of any stream to queue a buffer, or until a
+// keep-alive frame of one is due
+// Returns false on timeout
+static bool wait_for_frame(struct app_shared *app) {
+    uint64_t due_ns = 0;
+    for (uint32_t i = 0; i <= app->n_streams; i++) {
+        // Composited sources never push, the output does
+        struct app_data *data = i < app->n_streams ? app->streams[i] : app->compose_output;
+        if (!data) {
+            continue;
+        }
+        uint64_t last_push_ns = data->last_push_ns;
+        if (data->keep_alive_fps == 0 || last_push_ns == 0) {
+            continue;
+        }
+        uint64_t stream_due_ns = last_push_ns + 1000000000ULL / data->keep_alive_fps;
+        if (due_ns == 0 || stream_due_ns < due_ns) {
+            due_ns = stream_due_ns;
+        }
+    }
+
+    if (due_ns == 0) {
+        while (sem_wait(&app->worker_sem) < 0 && errno == EINTR) {
+        }
+        return true;
+    }
+
+    // sem_timedwait only takes CLOCK_REALTIME deadlines
+    uint64_t now_ns = monotonic_ns();
+    uint64_t wait_ns = due_ns > now_ns ? due_ns - now_ns : 0;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t nsec = (uint64_t)deadline.tv_nsec + wait_ns;
+    deadline.tv_sec += (time_t)(nsec / 1000000000ULL);
+    deadline.tv_nsec = (long)(nsec % 1000000000ULL);
+
+    while (sem_timedwait(&app->worker_sem, &deadline) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Re-send the last frame if none went out for a keep-alive interval, so that
+// consumers don't consider the camera frozen. Called with pipeline_lock held.
+static void send_keep_alive(struct app_data *data) {
+    if (!data->sink || data->keep_alive_fps == 0 || data->last_push_ns == 0) {
+        return;
     }
 
-    printf("V4L2 device opened: %s\n", device);
-    return fd;
+    uint64_t now_ns = monotonic_ns();
+    if (now_ns - data->last_push_ns < 1000000000ULL / data->keep_alive_fps) {
+        // A frame went out while waiting for the lock
+        return;
+    }
+
+    if (v4l2_sink_repeat(data->sink)) {
+        stats_count(data->shared->stats, STATS_FRAMES_REPEATED);
+        DEBUG_PRINT("DEBUG: Producer idle, repeated the last frame\n");
+    }
+
+    // Also on failure (e.g. DMA-BUF passthrough), to not retry in a busy loop
+    data->last_push_ns = now_ns;
 }
 
+// Take the next queued buffer, looking at the streams in turn so that a
+// stream sending at a high rate can't starve the others
+// Returns NULL if every queue is empty, with *stream set to the buffer's stream otherwise
+static struct pw_buffer* pop_next_frame(struct app_shared *app, struct app_data **stream) {
+    for (uint32_t i = 0; i < app->n_streams; i++) {
+        uint32_t index = (app->next_stream + i) % app->n_streams;
+        struct pw_buffer *b = frame_queue_pop(app->streams[index]->frame_queue);
+        if (b) {
+            app->next_stream = (index + 1) % app->n_streams;
+            *stream = app->streams[index];
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Place the sources of --compose in the output frame and size the output
+// Returns false until the layout has something to show
+static bool update_compose_layout(struct app_shared *app) {
+    struct app_data *output = app->compose_output;
+    gl_composite_rect natural[MAX_STREAMS] = {{0}};
+    uint32_t natural_width = 0;
+    uint32_t natural_height = 0;
+
+    if (app->compose == COMPOSE_SIDE_BY_SIDE) {
+        for (uint32_t i = 0; i < app->n_streams; i++) {
+            const struct app_data *source = app->streams[i];
+            natural[i] = (gl_composite_rect){ natural_width, 0, source->width, source->height };
+            natural_width += source->width;
+            if (source->height > natural_height) {
+                natural_height = source->height;
+            }
+        }
+        for (uint32_t i = 0; i < app->n_streams; i++) {
+            natural[i].y = (natural_height - natural[i].height) / 2;
+        }
+    } else {
+        natural_width = app->streams[0]->width;
+        natural_height = app->streams[0]->height;
+        natural[0] = (gl_composite_rect){ 0, 0, natural_width, natural_height };
+
+        // Insets are stacked upwards from the bottom right corner
+        uint32_t margin = natural_width / PIP_MARGIN_DIV;
+        uint32_t inset_width = natural_width / PIP_INSET_DIV;
+        uint32_t bottom = natural_height > margin ? natural_height - margin : 0;
+        for (uint32_t i = 1; i < app->n_streams; i++) {
+            const struct app_data *source = app->streams[i];
+            if (source->width == 0) {
+                continue;
+            }
+            uint32_t inset_height = (uint32_t)((uint64_t)inset_width * source->height / source->width);
+            if (inset_height + margin > bottom) {
+                break;
+            }
+            bottom -= inset_height;
+            natural[i] = (gl_composite_rect){ natural_width - margin - inset_width, bottom, inset_width, inset_height };
+            bottom -= margin;
+        }
+    }
+
+    if (natural_width == 0 || natural_height == 0) {
+        return false;
+    }
+
+    // --size scales the whole layout to fit, keeping its aspect ratio
+    // YUYV packs pixel pairs
+    uint32_t width = (app->compose_width ? app->compose_width : natural_width) & ~1u;
+    uint32_t height = app->compose_height ? app->compose_height : natural_height;
+    if (width == 0) {
+        return false;
+    }
+    double scale = (double)width / natural_width;
+    if ((double)height / natural_height < scale) {
+        scale = (double)height / natural_height;
+    }
+    uint32_t offset_x = (uint32_t)((width - natural_width * scale) / 2);
+    uint32_t offset_y = (uint32_t)((height - natural_height * scale) / 2);
+    for (uint32_t i = 0; i < app->n_streams; i++) {
+        app->compose_rects[i] = (gl_composite_rect){
+            offset_x + (uint32_t)(natural[i].x * scale),
+            offset_y + (uint32_t)(natural[i].y * scale),
+            (uint32_t)(natural[i].width * scale),
+            (uint32_t)(natural[i].height * scale),
+        };
+    }
+
+    if (!output->format_set || output->width != width || output->height != height) {
+        printf("Compositing %u stream(s) into %ux%u\n", app->n_streams, width, height);
+        apply_stream_format(output, 11, width, height);
+    }
+    return output->format_set;
+}
+
+// Composite the newest frame of every source and send the result through
+// process_frame like a mapped RGBA buffer. Called with pipeline_lock held.
+static void compose_frame(struct app_shared *app) {
+    struct app_data *output = app->compose_output;
+    gl_dma_buf dmabufs[MAX_STREAMS];
+    const gl_dma_buf *sources[MAX_STREAMS] = {0};
+    const struct buffer_info *newest = NULL;
+
+    for (uint32_t i = 0; i < app->n_streams; i++) {
+        struct app_data *source = app->streams[i];
+        struct pw_buffer *b = source->compose_buffer;
+        if (!b || b->buffer->n_datas == 0 || b->buffer->datas[0].type != SPA_DATA_DmaBuf) {
+            continue;
+        }
+        describe_dma_buffer(source, b->buffer, &dmabufs[i]);
+        sources[i] = &dmabufs[i];
+
+        const struct buffer_info *info = b->user_data;
+        if (info && (!newest || info->dequeue_ns > newest->dequeue_ns)) {
+            newest = info;
+        }
+    }
+
+    if (!update_compose_layout(app)) {
+        return;
+    }
+
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    if (!reserve_buffer(&output->gl_buffer, &output->gl_buffer_size, (size_t)width * height * 4, "composite frame")) {
+        return;
+    }
+
+    gl_import_result result = gl_composite_dma_buffers(app->gl_ctx, sources, app->compose_rects, app->n_streams,
+                                                       width, height, GL_READBACK_RGBA,
+                                                       output->gl_buffer, output->gl_buffer_size);
+    if (result == GL_IMPORT_PENDING) {
+        TRACE_FRAME("DEBUG: Asynchronous readback pending, no composite to output yet\n");
+        return;
+    }
+    if (result != GL_IMPORT_DONE) {
+        DEBUG_PRINT("ERROR: Failed to composite the streams\n");
+        stats_count(app->stats, STATS_FRAMES_INVALID);
+        return;
+    }
+
+    uint64_t import_ns, readback_ns;
+    gl_get_last_import_timing(app->gl_ctx, &import_ns, &readback_ns);
+    stats_record(app->stats, STATS_STAGE_IMPORT, import_ns);
+    stats_record(app->stats, STATS_STAGE_READBACK, readback_ns);
+
+    // The composite takes the timing of the newest frame in it
+    struct spa_chunk chunk = { .size = width * height * 4, .stride = (int32_t)(width * 4) };
+    struct spa_data plane = {
+        .type = SPA_DATA_MemPtr,
+        .data = output->gl_buffer,
+        .maxsize = chunk.size,
+        .chunk = &chunk,
+    };
+    struct spa_buffer buffer = { .n_datas = 1, .datas = &plane };
+    struct buffer_info info = {0};
+    if (newest) {
+        info = *newest;
+    }
+    struct pw_buffer b = { .buffer = &buffer, .user_data = &info };
+    process_frame(output, &b);
+}
+
+// Hold on to the newest frame of every source, the older ones go back to PipeWire
+// Returns true if any source has a new frame
+static bool collect_compose_frames(struct app_shared *app) {
+    bool any_new = false;
+    for (uint32_t i = 0; i < app->n_streams; i++) {
+        struct app_data *source = app->streams[i];
+        struct pw_buffer *b;
+        while ((b = frame_queue_pop(source->frame_queue)) != NULL) {
+            if (source->compose_buffer) {
+                return_buffer(source, source->compose_buffer);
+            }
+            source->compose_buffer = b;
+            any_new = true;
+        }
+    }
+    return any_new;
+}
+
+// With --rt, give the calling thread and the helpers of its pool SCHED_FIFO
+static void make_conversion_realtime(struct app_shared *app) {
+    if (!app->realtime) {
+        return;
+    }
+
+    pid_t ids[THREAD_POOL_MAX_THREADS];
+    uint32_t n_ids = thread_pool_get_thread_ids(app->convert_pool, ids, THREAD_POOL_MAX_THREADS);
+    bool ok = realtime_make_thread_realtime(0, REALTIME_PRIORITY);
+    for (uint32_t i = 0; ok && i < n_ids; i++) {
+        ok = realtime_make_thread_realtime(ids[i], REALTIME_PRIORITY);
+    }
+
+    if (ok) {
+        printf("Conversion threads run with SCHED_FIFO priority %d\n", REALTIME_PRIORITY);
+    } else {
+        fprintf(stderr, "Warning: Conversion threads keep normal scheduling\n");
+    }
+}
+
+static void* conversion_worker(void *userdata) {
+    struct app_shared *app = userdata;
+
+    // Created here so that with --pin-cores this thread is pinned along with its helpers
+    uint32_t n_threads = app->convert_threads;
+    app->convert_pool = thread_pool_create(n_threads, app->pin_cores);
+    if (app->convert_pool) {
+        printf("Color conversion uses %u thread(s)%s, %s BGRx kernel\n", n_threads,
+               app->pin_cores ? ", pinned to cores" : "", convert_bgrx_kernel_name());
+    } else {
+        fprintf(stderr, "Warning: Failed to create conversion threads, converting on one thread\n");
+    }
+    make_conversion_realtime(app);
+
+    while (true) {
+        bool frame_ready = wait_for_frame(app);
+
+        if (!__atomic_load_n(&app->worker_running, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        pthread_mutex_lock(&app->pipeline_lock);
+        if (app->compose_output) {
+            // One pass over every source per wakeup, later wakeups find the queues empty
+            if (frame_ready && collect_compose_frames(app)) {
+                compose_frame(app);
+            }
+            send_keep_alive(app->compose_output);
+        } else if (frame_ready) {
+            struct app_data *data = NULL;
+            struct pw_buffer *b = pop_next_frame(app, &data);
+            if (b) {
+                process_frame(data, b);
+            }
+        }
+        // Idle streams keep their rate while other streams send frames
+        for (uint32_t i = 0; i < app->n_streams; i++) {
+            send_keep_alive(app->streams[i]);
+        }
+        pthread_mutex_unlock(&app->pipeline_lock);
+    }
+
+    thread_pool_destroy(app->convert_pool);
+    app->convert_pool = NULL;
+
+    // Let the main thread bind the context for cleanup
+    if (app->gl_ctx) {
+        gl_release_current(app->gl_ctx);
+    }
+    return NULL;
+}
+
+// EGL initialization and the driver load take 100 ms and more, they run here
+// while the main thread opens the devices and goes through the portal dialog
+static void* gl_init_thread(void *userdata) {
+    struct app_shared *app = userdata;
+    uint64_t start_ns = monotonic_ns();
+
+    // The context is released again, the conversion worker binds it
+    app->gl_ctx = gl_context_create(app->render_node);
+    if (app->gl_ctx && gl_has_dma_buf_import_support(app->gl_ctx)) {
+        gl_set_readback_depth(app->gl_ctx, app->readback_depth);
+    }
+
+    app->gl_init_ns = monotonic_ns() - start_ns;
+    return NULL;
+}
+
+static void start_gl_init(struct app_shared *app) {
+    printf("Initializing OpenGL/EGL context for DMA buffer support...\n");
+    app->gl_init_running = true;
+    if (pthread_create(&app->gl_init_thread, NULL, gl_init_thread, app) != 0) {
+        app->gl_init_running = false;
+        gl_init_thread(app);
+    }
+}
+
+// Wait for the context, before anything asks about GL support (format params, --compose)
+// Returns false if the context can't do what the options need
+static bool join_gl_init(struct app_shared *app) {
+    if (app->gl_init_running) {
+        pthread_join(app->gl_init_thread, NULL);
+        app->gl_init_running = false;
+    }
+    if (app->gl_init_reported) {
+        // Reconnects set the streams up again with the same context
+        return app->compose == COMPOSE_NONE || gl_has_composite_support(app->gl_ctx);
+    }
+    app->gl_init_reported = true;
+
+    DEBUG_PRINT("DEBUG: OpenGL context created in %.1f ms\n", app->gl_init_ns / 1e6);
+
+    if (app->gl_ctx) {
+        if (gl_has_dma_buf_import_support(app->gl_ctx)) {
+            printf("OpenGL DMA buffer import support is available\n");
+            if (app->readback_depth > 0 && gl_get_readback_depth(app->gl_ctx) == 0) {
+                printf("Warning: Asynchronous readback needs OpenGL ES 3, using synchronous readback\n");
+            } else if (gl_get_readback_depth(app->gl_ctx) > 0) {
+                printf("Asynchronous GPU readback enabled (%u frame(s) latency)\n",
+                       gl_get_readback_depth(app->gl_ctx));
+            }
+        } else {
+            printf("Warning: OpenGL context created but DMA buffer import not supported\n");
+            printf("Will fall back to direct memory mapping when possible\n");
+        }
+    } else if (app->render_node) {
+        fprintf(stderr, "Failed to create an OpenGL context on %s\n", app->render_node);
+        return false;
+    } else {
+        printf("Warning: Failed to create OpenGL context\n");
+        printf("DMA buffer handling will be limited - may fail on tiled buffers\n");
+    }
+
+    if (app->compose != COMPOSE_NONE && !gl_has_composite_support(app->gl_ctx)) {
+        fprintf(stderr, "--compose needs OpenGL DMA buffer import\n");
+        return false;
+    }
+    return true;
+}
+
+// Allocate the per-frame buffers for the size the portal reported, so that
+// the first frames after negotiation don't wait on allocations. The size is
+// only a hint, the buffers still grow if the negotiated one is larger.
+static void presize_stream_buffers(struct app_data *data, uint32_t width, uint32_t height) {
+    if (!data->sink || width == 0 || height == 0 || width > MAX_STREAM_SIZE || height > MAX_STREAM_SIZE) {
+        return;
+    }
+
+    uint32_t out_width = data->requested_region.width ? data->requested_region.width : width;
+    uint32_t out_height = data->requested_region.height ? data->requested_region.height : height;
+    size_t readback_pixels = (size_t)width * height > (size_t)out_width * out_height ?
+                             (size_t)width * height : (size_t)out_width * out_height;
+
+    reserve_buffer(&data->gl_buffer, &data->gl_buffer_size, readback_pixels * 4, "GL buffer");
+    reserve_buffer(&data->frame_arena, &data->frame_arena_size,
+                   convert_arena_size(out_width, data->shared->convert_threads), "frame arena");
+    if (data->requested_format == OUTPUT_FORMAT_YUYV) {
+        reserve_buffer(&data->shadow_frame, &data->shadow_frame_size, (size_t)out_width * out_height * 2,
+                       "shadow frame");
+    }
+}
+
+// Resolved before any format arrives, the frame arena holds a strip per thread
+static void resolve_convert_threads(struct app_shared *app) {
+    if (app->convert_threads == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        app->convert_threads = n_cpus > 0 ? (uint32_t)n_cpus : 1;
+        if (app->convert_threads > 8) {
+            app->convert_threads = 8;
+        }
+    }
+}
+
+// Queues between a stream's RT thread and the worker
+static bool create_stream_queues(struct app_data *data) {
+    struct app_shared *app = data->shared;
+
+    data->frame_queue = frame_queue_create(data->queue_depth);
+    data->return_queue = frame_queue_create(FRAME_QUEUE_MAX_CAPACITY);
+    if (!data->frame_queue || !data->return_queue) {
+        return false;
+    }
+
+    data->return_event = pw_loop_add_event(app->data_loop, on_return_event, data);
+    if (!data->return_event) {
+        fprintf(stderr, "Failed to add buffer return event\n");
+        return false;
+    }
+    return true;
+}
+
+// A stream starting from the command line settings, device NULL for a --compose source
+// Returns NULL on failure, the stream is in app->streams either way
+static struct app_data* create_stream(struct app_shared *app, const char *device) {
+    struct app_data *stream = malloc(sizeof(*stream));
+    if (!stream) {
+        fprintf(stderr, "Failed to allocate stream\n");
+        return NULL;
+    }
+    *stream = *app->options;
+    stream->shared = app;
+    stream->device = device;
+    app->streams[app->n_streams++] = stream;
+
+    if (!device) {
+        // Sources are shown whole, --size and --fps apply to the composite
+        memset(&stream->requested_region, 0, sizeof(stream->requested_region));
+        return stream;
+    }
+
+    if (stream->max_fps > 0 || stream->color_bars_mode) {
+        stream->pacer = frame_pacer_create(stream->max_fps > 0 ? stream->max_fps : COLOR_BARS_FPS);
+        if (!stream->pacer) {
+            return NULL;
+        }
+    }
+
+    stream->sink = v4l2_sink_open(stream->device);
+    if (!stream->sink) {
+        fprintf(stderr, "Failed to setup V4L2 device %s\n", stream->device);
+        return NULL;
+    }
+    v4l2_sink_set_release_callback(stream->sink, on_sink_release_buffer, stream);
+    return stream;
+}
+
+static void destroy_stream(struct app_data *stream) {
+    if (!stream) {
+        return;
+    }
+
+    if (stream->recorder) {
+        printf("Recorded %" PRIu64 " frames\n", capture_file_get_frame_count(stream->recorder));
+        capture_file_destroy(stream->recorder);
+    }
+    v4l2_sink_set_release_callback(stream->sink, NULL, NULL);
+    if (stream->stream)
+        pw_stream_destroy(stream->stream);
+    frame_queue_destroy(stream->frame_queue);
+    frame_queue_destroy(stream->return_queue);
+    if (stream->sink)
+        v4l2_sink_destroy(stream->sink);
+    free(stream->gl_buffer);
+    free(stream->scaled_frame);
+    frame_pacer_destroy(stream->pacer);
+    m2m_converter_destroy(stream->m2m);
+    free(stream->frame_arena);
+    free(stream->shadow_frame);
+    mjpeg_encoder_destroy(stream->mjpeg);
+    free(stream);
+}
+
+// Start the worker once the queues of every stream exist
+static bool start_conversion_worker(struct app_shared *app) {
+    __atomic_store_n(&app->worker_running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&app->worker_thread, NULL, conversion_worker, app) != 0) {
+        fprintf(stderr, "Failed to start conversion thread\n");
+        app->worker_running = false;
+        return false;
+    }
+
+    printf("Conversion thread started for %u stream(s) (queue depth %u, %s)\n", app->n_streams,
+           app->streams[0]->queue_depth,
+           app->streams[0]->queue_policy == QUEUE_POLICY_BLOCK ? "block" : "drop-oldest");
+    return true;
+}
+
+static void stop_conversion_worker(struct app_shared *app) {
+    if (__atomic_load_n(&app->worker_running, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&app->worker_running, false, __ATOMIC_RELEASE);
+        sem_post(&app->worker_sem);
+        pthread_join(app->worker_thread, NULL);
+    }
+
+    bool any_queue = false;
+    for (uint32_t i = 0; i < app->n_streams; i++) {
+        struct app_data *data = app->streams[i];
+        if (data->frame_queue && data->device) {
+            printf("%s: frames converted: %" PRIu64 ", dropped while conversion was behind: %" PRIu64 "\n",
+                   data->device, data->frames_converted, frame_queue_get_dropped(data->frame_queue));
+            any_queue = true;
+        } else if (data->frame_queue) {
+            printf("Source %u: frames dropped while compositing was behind: %" PRIu64 "\n",
+                   i + 1, frame_queue_get_dropped(data->frame_queue));
+        }
+    }
+    if (app->compose_output && app->n_streams > 0) {
+        printf("%s: composited frames converted: %" PRIu64 "\n",
+               app->compose_output->device, app->compose_output->frames_converted);
+        any_queue = true;
+    }
+
+    if (any_queue) {
+        printf("Frames skipped as unchanged: %" PRIu64 ", keep-alive repeats: %" PRIu64
+               ", over the frame rate cap: %" PRIu64 "\n",
+               stats_get_counter(app->stats, STATS_FRAMES_UNCHANGED),
+               stats_get_counter(app->stats, STATS_FRAMES_REPEATED),
+               stats_get_counter(app->stats, STATS_FRAMES_PACED));
+    }
+}
+
+static const struct pw_stream_events stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .state_changed = on_stream_state_changed,
+    .param_changed = on_stream_param_changed,
+    .add_buffer = on_stream_add_buffer,
+    .remove_buffer = on_stream_remove_buffer,
+    .process = on_stream_process,
+};
+
 // Portal callback functions
 static void on_session_created(PortalSession *session, bool success, void *user_data);
 static void on_sources_selected(PortalSession *session, bool success, void *user_data);
 static void on_session_started(PortalSession *session, uint32_t node_id, int pipewire_fd, void *user_data);
 static void on_pipewire_ready(PortalSession *session, uint32_t node_id, int pipewire_fd, void *user_data);
 
-static int setup_pipewire_via_portal(struct app_data *data) {
+static int setup_pipewire_via_portal(struct app_shared *app) {
     // Create portal session
-    data->portal_session = portal_session_new();
-    if (!data->portal_session) {
+    app->portal_session = portal_session_new();
+    if (!app->portal_session) {
         fprintf(stderr, "Failed to create portal session\n");
         return -1;
     }
 
     // Register session closed callback
-    portal_set_session_closed_callback(data->portal_session, on_portal_session_closed, data);
+    portal_set_session_closed_callback(app->portal_session, on_portal_session_closed, app);
+    portal_set_restore_token_file(app->portal_session, app->restore_token_path);
 
     printf("Starting portal-based screen capture...\n");
-    printf("A dialog will appear asking you to select which monitor to capture.\n");
+    if (app->compose != COMPOSE_NONE) {
+        printf("A dialog will appear asking you to select the monitors to composite, in layout order.\n");
+    } else if (app->n_streams > 1) {
+        printf("A dialog will appear asking you to select up to %u monitors to capture, in device order.\n",
+               app->n_streams);
+    } else if (app->source_types == PORTAL_SOURCE_MONITOR) {
+        printf("A dialog will appear asking you to select which monitor to capture.\n");
+    } else {
+        printf("A dialog will appear asking you to select what to capture.\n");
+    }
 
     // Start the portal workflow
-    if (!portal_create_session(data->portal_session, on_session_created, data)) {
+    if (!portal_create_session(app->portal_session, on_session_created, app)) {
         fprintf(stderr, "Failed to create portal session\n");
         return -1;
     }
@@ -1192,31 +2909,14 @@ static int setup_pipewire_via_portal(struct app_data *data) {
     return 0;
 }
 
-static int setup_pipewire_stream(struct app_data *data, int pipewire_fd, uint32_t node_id) {
-    const struct spa_pod *params[1];
-    uint8_t buffer[1024];
+static int setup_pipewire_stream(struct app_data *data, uint32_t node_id) {
+    // One EnumFormat per DMA-BUF format plus the unconstrained fallback
+    const struct spa_pod *params[sizeof(dma_buf_spa_formats) / sizeof(dma_buf_spa_formats[0]) + 1];
+    uint8_t buffer[8192];
     struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-    // Create PipeWire context and connect using the portal's file descriptor
-    data->context = pw_context_new(pw_main_loop_get_loop(data->loop), NULL, 0);
-    if (!data->context) {
-        fprintf(stderr, "Failed to create PipeWire context\n");
-        return -1;
-    }
-
-    // Connect to PipeWire using the file descriptor from the portal
-    struct pw_properties *props = pw_properties_new(
-        PW_KEY_REMOTE_NAME, "portal-screencast",
-        NULL);
-
-    data->core = pw_context_connect_fd(data->context, pipewire_fd, props, 0);
-    if (!data->core) {
-        fprintf(stderr, "Failed to connect to PipeWire via portal\n");
-        return -1;
-    }
-
     // Create stream
-    data->stream = pw_stream_new(data->core, "gnome-screen-capture",
+    data->stream = pw_stream_new(data->shared->core, "gnome-screen-capture",
         pw_properties_new(
             PW_KEY_MEDIA_TYPE, "Video",
             PW_KEY_MEDIA_CATEGORY, "Capture",
@@ -1230,12 +2930,13 @@ static int setup_pipewire_stream(struct app_data *data, int pipewire_fd, uint32_
 
     pw_stream_add_listener(data->stream, &data->stream_listener, &stream_events, data);
 
-    // Setup format parameters - no specific format constraints
-    // Let PipeWire negotiate the format based on what the portal offers
-    params[0] = spa_pod_builder_add_object(&b,
-        SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
-        SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
-        SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw));
+    // A reconnected stream keeps its queues and return event
+    if (!data->frame_queue && !create_stream_queues(data)) {
+        return -1;
+    }
+
+    // Setup format parameters, advertising the DMA-BUF modifiers we can import
+    uint32_t n_params = build_format_params(data, &b, params, sizeof(params) / sizeof(params[0]));
 
     // Connect to the specific node ID provided by the portal
     // Don't force buffer mapping since we support DMA buffers via OpenGL
@@ -1244,19 +2945,124 @@ static int setup_pipewire_stream(struct app_data *data, int pipewire_fd, uint32_
                          node_id,
                          PW_STREAM_FLAG_AUTOCONNECT |
                          PW_STREAM_FLAG_RT_PROCESS,
-                         params, 1) < 0) {
+                         params, n_params) < 0) {
         fprintf(stderr, "Failed to connect PipeWire stream to node %u\n", node_id);
         return -1;
     }
 
-    printf("PipeWire stream connected to portal node %u\n", node_id);
-    data->stream_ready = true;
+    data->node_id = node_id;
+    printf("PipeWire stream connected to portal node %u, output to %s\n", node_id,
+           data->device ? data->device : "the composite");
+    return 0;
+}
+
+// Connect to PipeWire once and start a stream per portal node
+// On reconnect the context and its data loop are kept, only the core is new
+static int setup_pipewire_streams(struct app_shared *app, int pipewire_fd, const uint32_t *node_ids,
+                                  const PortalDimensions *sizes, uint32_t n_nodes) {
+    // The format params advertise the modifiers the GL context imports
+    if (!join_gl_init(app)) {
+        return -1;
+    }
+
+    // Create PipeWire context and connect using the portal's file descriptor
+    if (!app->context) {
+        app->context = pw_context_new(pw_main_loop_get_loop(app->loop), NULL, 0);
+        if (!app->context) {
+            fprintf(stderr, "Failed to create PipeWire context\n");
+            return -1;
+        }
+        app->data_loop = pw_data_loop_get_loop(pw_context_get_data_loop(app->context));
+    }
+
+    // Connect to PipeWire using the file descriptor from the portal
+    struct pw_properties *props = pw_properties_new(
+        PW_KEY_REMOTE_NAME, "portal-screencast",
+        NULL);
+
+    app->core = pw_context_connect_fd(app->context, pipewire_fd, props, 0);
+    if (!app->core) {
+        fprintf(stderr, "Failed to connect to PipeWire via portal\n");
+        return -1;
+    }
+
+    // The worker may be running already, sending keep-alive frames while reconnecting
+    pthread_mutex_lock(&app->pipeline_lock);
+    if (app->compose != COMPOSE_NONE) {
+        // Every stream picked is a source of the composite, sources of an earlier session are reused
+        uint32_t n_sources = n_nodes < MAX_STREAMS ? n_nodes : MAX_STREAMS;
+        app->n_streams = 0;
+        while (app->n_streams < n_sources && app->streams[app->n_streams]) {
+            app->n_streams++;
+        }
+        while (app->n_streams < n_sources) {
+            if (!create_stream(app, NULL)) {
+                pthread_mutex_unlock(&app->pipeline_lock);
+                return -1;
+            }
+        }
+        printf("Compositing %u stream(s) %s into %s\n", app->n_streams,
+               app->compose == COMPOSE_PIP ? "picture-in-picture" : "side by side", app->compose_output->device);
+    } else {
+        // Streams are matched to devices in the order the user picked them
+        if (n_nodes != app->n_devices) {
+            printf("Warning: %u stream(s) selected for %u device(s), %u will be used\n",
+                   n_nodes, app->n_devices, n_nodes < app->n_devices ? n_nodes : app->n_devices);
+        }
+        for (uint32_t i = n_nodes; i < app->n_devices; i++) {
+            printf("%s gets no stream\n", app->streams[i]->device);
+        }
+        // The worker never looks at devices without a stream
+        app->n_streams = n_nodes < app->n_devices ? n_nodes : app->n_devices;
+    }
+    pthread_mutex_unlock(&app->pipeline_lock);
+
+    for (uint32_t i = 0; i < app->n_streams; i++) {
+        presize_stream_buffers(app->streams[i], sizes[i].width, sizes[i].height);
+        if (setup_pipewire_stream(app->streams[i], node_ids[i]) < 0) {
+            return -1;
+        }
+    }
+
+    if (!app->worker_running && !start_conversion_worker(app)) {
+        return -1;
+    }
     return 0;
 }
 
+// Drop the PipeWire streams, the core and the portal session after the
+// capture was lost, keeping the devices, queues, GL context and worker.
+// Called on the main thread with the PipeWire loop stopped.
+static void teardown_capture(struct app_shared *app) {
+    for (uint32_t i = 0; i < MAX_STREAMS; i++) {
+        struct app_data *data = app->streams[i];
+        if (!data || !data->stream) {
+            continue;
+        }
+
+        // remove_buffer takes every buffer of the pool out of the queues
+        pw_stream_destroy(data->stream);
+        data->stream = NULL;
+        data->stream_ready = false;
+    }
+
+    if (app->core) {
+        pw_core_disconnect(app->core);
+        app->core = NULL;
+    }
+
+    // The worker looks at the session when a write fails
+    pthread_mutex_lock(&app->pipeline_lock);
+    PortalSession *session = app->portal_session;
+    app->portal_session = NULL;
+    pthread_mutex_unlock(&app->pipeline_lock);
+    portal_session_free(session);
+    app->portal_ready = false;
+}
+
 // Portal callback implementations
 static void on_session_created(PortalSession *session, bool success, void *user_data) {
-    struct app_data *data = (struct app_data*)user_data;
+    struct app_shared *app = (struct app_shared*)user_data;
 
     if (!success) {
         fprintf(stderr, "Failed to create portal session\n");
@@ -1267,15 +3073,14 @@ static void on_session_created(PortalSession *session, bool success, void *user_
     printf("Portal session created successfully\n");
 
     // Proceed to source selection
-    if (!portal_select_sources(session, on_sources_selected, user_data)) {
+    bool multiple = app->n_streams > 1 || app->compose != COMPOSE_NONE;
+    if (!portal_select_sources(session, app->source_types, multiple, on_sources_selected, user_data)) {
         fprintf(stderr, "Failed to start source selection\n");
         portal_quit_main_loop(session);
     }
 }
 
 static void on_sources_selected(PortalSession *session, bool success, void *user_data) {
-    struct app_data *data = (struct app_data*)user_data;
-
     if (!success) {
         fprintf(stderr, "Failed to select sources\n");
         portal_quit_main_loop(session);
@@ -1292,10 +3097,9 @@ static void on_sources_selected(PortalSession *session, bool success, void *user
 }
 
 static void on_session_started(PortalSession *session, uint32_t node_id, int pipewire_fd, void *user_data) {
-    struct app_data *data = (struct app_data*)user_data;
+    (void)pipewire_fd;
 
     printf("Session started with node ID: %u\n", node_id);
-    data->node_id = node_id;
 
     // Open PipeWire remote to get file descriptor
     if (!portal_open_pipewire_remote(session, on_pipewire_ready, user_data)) {
@@ -1304,39 +3108,190 @@ static void on_session_started(PortalSession *session, uint32_t node_id, int pip
     }
 }
 
+// Periodic stats line on stderr (--stats), runs on the main loop
+// Portal signals arrive on the GLib main context, which isn't run by the PipeWire loop
+static void on_portal_timer(void *user_data, uint64_t expirations) {
+    struct app_shared *app = user_data;
+    (void)expirations;
+    portal_dispatch_pending(app->portal_session);
+}
+
+static void on_stats_timer(void *user_data, uint64_t expirations) {
+    struct app_shared *app = user_data;
+    (void)expirations;
+    stats_log_interval(app->stats, stderr);
+}
+
 static void on_pipewire_ready(PortalSession *session, uint32_t node_id, int pipewire_fd, void *user_data) {
-    struct app_data *data = (struct app_data*)user_data;
+    struct app_shared *app = (struct app_shared*)user_data;
+    (void)node_id;
 
     printf("PipeWire remote ready with fd: %d\n", pipewire_fd);
 
-    // Create PipeWire main loop now that portal is ready
-    data->loop = pw_main_loop_new(NULL);
-    if (!data->loop) {
-        fprintf(stderr, "Failed to create PipeWire main loop\n");
-        portal_quit_main_loop(session);
-        return;
+    // Create PipeWire main loop now that portal is ready, a reconnect keeps it
+    if (!app->loop) {
+        app->loop = pw_main_loop_new(NULL);
+        if (!app->loop) {
+            fprintf(stderr, "Failed to create PipeWire main loop\n");
+            portal_quit_main_loop(session);
+            return;
+        }
+
+        struct pw_loop *loop = pw_main_loop_get_loop(app->loop);
+        if (app->stats_interval > 0) {
+            app->stats_timer = pw_loop_add_timer(loop, on_stats_timer, app);
+            if (app->stats_timer) {
+                struct timespec interval = { .tv_sec = app->stats_interval, .tv_nsec = 0 };
+                pw_loop_update_timer(loop, app->stats_timer, &interval, &interval, false);
+            }
+        }
+
+        app->portal_timer = pw_loop_add_timer(loop, on_portal_timer, app);
+        if (app->portal_timer) {
+            struct timespec interval = { .tv_sec = 0, .tv_nsec = PORTAL_DISPATCH_INTERVAL_MS * 1000000L };
+            pw_loop_update_timer(loop, app->portal_timer, &interval, &interval, false);
+        }
     }
 
-    // Setup PipeWire stream with the portal's file descriptor
-    if (setup_pipewire_stream(data, pipewire_fd, node_id) < 0) {
+    // Setup the PipeWire streams with the portal's file descriptor
+    if (setup_pipewire_streams(app, pipewire_fd, session->node_ids, session->node_sizes, session->n_nodes) < 0) {
         fprintf(stderr, "Failed to setup PipeWire stream\n");
         portal_quit_main_loop(session);
         return;
     }
 
-    data->portal_ready = true;
+    app->portal_ready = true;
     printf("Portal setup complete. Screen capture is now active.\n");
 
     // Exit the portal main loop so we can switch to PipeWire main loop
     portal_quit_main_loop(session);
 }
 
+// Every device setup restores its own selection, e.g. video0+video1.token
+static char* default_restore_token_path(const struct app_shared *app, const char *const *devices, uint32_t n_devices) {
+    GString *name = g_string_new(NULL);
+    for (uint32_t i = 0; i < n_devices; i++) {
+        const char *slash = strrchr(devices[i], '/');
+        g_string_append_printf(name, "%s%s", i > 0 ? "+" : "", slash ? slash + 1 : devices[i]);
+    }
+    if (app->compose != COMPOSE_NONE) {
+        g_string_append(name, app->compose == COMPOSE_PIP ? "-pip" : "-side-by-side");
+    }
+
+    char *path = portal_restore_token_path(name->str);
+    g_string_free(name, TRUE);
+    return path;
+}
+
+static void sleep_until_ns(struct app_data *data, uint64_t deadline_ns) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(deadline_ns / 1000000000ULL),
+        .tv_nsec = (long)(deadline_ns % 1000000000ULL),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR &&
+           !__atomic_load_n(&data->shared->stopping, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Feed the frames of a --record file through process_frame on this thread,
+// as fast as the pipeline goes or with the recorded spacing
+static bool run_replay(struct app_data *data) {
+    capture_file *file = capture_file_open(data->replay_path);
+    if (!file) {
+        return false;
+    }
+
+    // The queue never holds frames, process_frame only reads its drop count
+    data->frame_queue = frame_queue_create(data->queue_depth);
+    if (!data->frame_queue) {
+        capture_file_destroy(file);
+        return false;
+    }
+    data->shared->convert_pool = thread_pool_create(data->shared->convert_threads, data->shared->pin_cores);
+    printf("Color conversion uses %u thread(s), %s BGRx kernel\n",
+           thread_pool_get_size(data->shared->convert_pool), convert_bgrx_kernel_name());
+    make_conversion_realtime(data->shared);
+
+    // Replayed frames look like mapped PipeWire buffers
+    struct spa_chunk chunk = {0};
+    struct spa_data plane = {0};
+    struct spa_buffer buffer = {0};
+    struct buffer_info info = {0};
+    struct pw_buffer b = {0};
+    plane.type = SPA_DATA_MemPtr;
+    plane.chunk = &chunk;
+    buffer.n_datas = 1;
+    buffer.datas = &plane;
+    b.buffer = &buffer;
+    b.user_data = &info;
+
+    printf("Replaying %s%s... Press Ctrl+C to stop.\n", data->replay_path,
+           data->replay_realtime ? " at the recorded pace" : "");
+
+    capture_frame frame;
+    uint64_t first_timestamp_ns = 0;
+    uint64_t start_ns = monotonic_ns();
+    uint64_t last_stats_ns = start_ns;
+    uint64_t bytes = 0;
+    bool ok = true;
+    while (!__atomic_load_n(&data->shared->stopping, __ATOMIC_RELAXED) && capture_file_next(file, &frame)) {
+        if (!data->format_set || frame.spa_format != data->spa_format ||
+            frame.width != data->width || frame.height != data->height) {
+            apply_stream_format(data, frame.spa_format, frame.width, frame.height);
+            if (!data->format_set || data->output_failed) {
+                ok = false;
+                break;
+            }
+            // Recorded frames were past the skip already
+            data->frame_skip_count = STARTUP_SKIP_FRAMES;
+        }
+
+        if (data->replay_realtime) {
+            if (capture_file_get_frame_count(file) == 1) {
+                first_timestamp_ns = frame.timestamp_ns;
+            }
+            uint64_t offset_ns = frame.timestamp_ns > first_timestamp_ns ? frame.timestamp_ns - first_timestamp_ns : 0;
+            sleep_until_ns(data, start_ns + offset_ns);
+        }
+
+        plane.data = (void*)frame.data;
+        plane.maxsize = (uint32_t)frame.size;
+        chunk.size = (uint32_t)frame.size;
+        chunk.stride = (int32_t)frame.stride;
+        info.dequeue_ns = monotonic_ns();
+        stats_count(data->shared->stats, STATS_FRAMES_IN);
+        process_frame(data, &b);
+        bytes += frame.size;
+
+        if (data->shared->stats_interval > 0 && info.dequeue_ns - last_stats_ns >= data->shared->stats_interval * 1000000000ULL) {
+            stats_log_interval(data->shared->stats, stderr);
+            last_stats_ns = info.dequeue_ns;
+        }
+    }
+
+    double seconds = (double)(monotonic_ns() - start_ns) / 1e9;
+    uint64_t frames = capture_file_get_frame_count(file);
+    printf("Replayed %" PRIu64 " frames in %.2f s: %.1f fps, %.1f MB/s of source frames, %" PRIu64 " written\n",
+           frames, seconds, seconds > 0 ? frames / seconds : 0.0, seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+           stats_get_counter(data->shared->stats, STATS_FRAMES_WRITTEN));
+    if (data->shared->stats_interval > 0) {
+        stats_log_interval(data->shared->stats, stderr);
+    }
+
+    thread_pool_destroy(data->shared->convert_pool);
+    data->shared->convert_pool = NULL;
+    capture_file_destroy(file);
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
-    struct app_data data = {0};
-    const char *v4l2_device = DEFAULT_V4L2_DEVICE;
+    struct app_shared app = {0};
+    struct app_data options = {0};  // Settings of every stream, copied into each
+    const char *devices[MAX_STREAMS] = { DEFAULT_V4L2_DEVICE };
+    uint32_t n_devices = 0;
 
     // Set up global reference for signal handling
-    global_app_data = &data;
+    global_app = &app;
 
     // Set up signal handlers for graceful shutdown
     struct sigaction sa;
@@ -1352,37 +3307,272 @@ int main(int argc, char *argv[]) {
     }
 
     // Check for debug mode via environment variable
-    if (getenv("DEBUG") || getenv("GNOME_V4L2_DEBUG")) {
-        debug_enabled = true;
-    }
-
-    DEBUG_PRINT("DEBUG: Starting main function\n");
-    DEBUG_PRINT("DEBUG: Initializing data structure\n");
-
-    data.width = 0;  // Will be set by PipeWire stream
-    data.height = 0; // Will be set by PipeWire stream
-    data.stride = 0; // Will be set by PipeWire stream
-    data.color_bars_mode = false;
+    bool debug_enabled = getenv("DEBUG") || getenv("GNOME_V4L2_DEBUG");
+    uint32_t trace_sample = TRACE_DEFAULT_SAMPLE;
+
+    options.width = 0;  // Will be set by PipeWire stream
+    options.height = 0; // Will be set by PipeWire stream
+    options.stride = 0; // Will be set by PipeWire stream
+    options.modifier = DRM_FORMAT_MOD_INVALID;
+    options.queue_depth = DEFAULT_QUEUE_DEPTH;
+    options.queue_policy = QUEUE_POLICY_DROP_OLDEST;
+    options.keep_alive_fps = DEFAULT_KEEP_ALIVE_FPS;
+    options.requested_format = OUTPUT_FORMAT_YUYV;
+    options.jpeg_quality = MJPEG_DEFAULT_QUALITY;
+    app.source_types = PORTAL_SOURCE_MONITOR;
+    app.reconnect = true;
+    pthread_mutex_init(&app.pipeline_lock, NULL);
+    sem_init(&app.worker_sem, 0, 0);
+    options.color_bars_mode = false;
+    // Opt-in: the last frame of each update stays in the ring until the next damage
+    uint32_t readback_depth = 0;
+    const char *record_path = NULL;
+    const char *stats_socket = NULL;  // Unix socket serving the stats (--stats-socket)
+    const char *restore_token_file = NULL;  // --restore-token
+    bool restore_session = true;
 
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--color-bars") == 0 || strcmp(argv[i], "-c") == 0) {
-            data.color_bars_mode = true;
+            options.color_bars_mode = true;
             printf("Color bars mode enabled\n");
         } else if (strcmp(argv[i], "--debug") == 0 || strcmp(argv[i], "-v") == 0) {
             debug_enabled = true;
             printf("Debug mode enabled\n");
+        } else if (strcmp(argv[i], "--trace-sample") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long every = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || every < 1) {
+                printf("Invalid trace sampling: %s (1 or more)\n", argv[i]);
+                return 1;
+            }
+            trace_sample = (uint32_t)every;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long threads = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || threads < 0 || threads > THREAD_POOL_MAX_THREADS) {
+                printf("Invalid thread count: %s (0-%d)\n", argv[i], THREAD_POOL_MAX_THREADS);
+                return 1;
+            }
+            app.convert_threads = (uint32_t)threads;
+        } else if (strcmp(argv[i], "--pin-cores") == 0) {
+            app.pin_cores = true;
+        } else if (strcmp(argv[i], "--rt") == 0) {
+            app.realtime = true;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long depth = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || depth < 1 || depth > 16) {
+                printf("Invalid queue depth: %s (1-16)\n", argv[i]);
+                return 1;
+            }
+            options.queue_depth = (uint32_t)depth;
+        } else if (strcmp(argv[i], "--queue-policy") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "drop-oldest") == 0) {
+                options.queue_policy = QUEUE_POLICY_DROP_OLDEST;
+            } else if (strcmp(argv[i], "block") == 0) {
+                options.queue_policy = QUEUE_POLICY_BLOCK;
+            } else {
+                printf("Invalid queue policy: %s (drop-oldest or block)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--keep-alive") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long fps = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || fps < 0 || fps > 60) {
+                printf("Invalid keep-alive rate: %s (0-60)\n", argv[i]);
+                return 1;
+            }
+            options.keep_alive_fps = (uint32_t)fps;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long interval = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || interval < 0 || interval > 3600) {
+                printf("Invalid stats interval: %s (0-3600)\n", argv[i]);
+                return 1;
+            }
+            app.stats_interval = (uint32_t)interval;
+        } else if (strcmp(argv[i], "--latency-barcode") == 0) {
+            options.latency_barcode = true;
+        } else if (strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc) {
+            stats_socket = argv[++i];
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long fps = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || fps < 0 || fps > FRAME_PACER_MAX_FPS) {
+                printf("Invalid frame rate: %s (0-%d)\n", argv[i], FRAME_PACER_MAX_FPS);
+                return 1;
+            }
+            options.max_fps = (uint32_t)fps;
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            unsigned int width, height;
+            char extra;
+            i++;
+            if (sscanf(argv[i], "%ux%u%c", &width, &height, &extra) != 2 ||
+                width == 0 || height == 0 || width > MAX_STREAM_SIZE || height > MAX_STREAM_SIZE) {
+                printf("Invalid output size: %s (WxH, up to %dx%d)\n", argv[i], MAX_STREAM_SIZE, MAX_STREAM_SIZE);
+                return 1;
+            }
+            options.requested_region.width = width;
+            options.requested_region.height = height;
+        } else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc) {
+            unsigned int x, y, width, height;
+            char extra;
+            i++;
+            if (sscanf(argv[i], "%u,%u,%u,%u%c", &x, &y, &width, &height, &extra) != 4 ||
+                width == 0 || height == 0) {
+                printf("Invalid crop rectangle: %s (x,y,w,h)\n", argv[i]);
+                return 1;
+            }
+            options.requested_region.crop_x = x;
+            options.requested_region.crop_y = y;
+            options.requested_region.crop_width = width;
+            options.requested_region.crop_height = height;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "yuyv") == 0) {
+                options.requested_format = OUTPUT_FORMAT_YUYV;
+            } else if (strcmp(argv[i], "nv12") == 0) {
+                options.requested_format = OUTPUT_FORMAT_NV12;
+            } else if (strcmp(argv[i], "i420") == 0) {
+                options.requested_format = OUTPUT_FORMAT_I420;
+            } else if (strcmp(argv[i], "mjpeg") == 0) {
+                if (!mjpeg_encoder_is_available()) {
+                    printf("MJPEG output is not available, built without libjpeg-turbo\n");
+                    return 1;
+                }
+                options.requested_format = OUTPUT_FORMAT_MJPEG;
+            } else {
+                printf("Invalid output format: %s (yuyv, nv12, i420 or mjpeg)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--jpeg-quality") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long quality = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || quality < 1 || quality > 100) {
+                printf("Invalid JPEG quality: %s (1-100)\n", argv[i]);
+                return 1;
+            }
+            options.jpeg_quality = (int)quality;
+        } else if (strcmp(argv[i], "--zero-copy") == 0) {
+            options.zero_copy = true;
+        } else if (strcmp(argv[i], "--restore-token") == 0 && i + 1 < argc) {
+            restore_token_file = argv[++i];
+        } else if (strcmp(argv[i], "--no-restore") == 0) {
+            restore_session = false;
+        } else if (strcmp(argv[i], "--no-reconnect") == 0) {
+            app.reconnect = false;
+        } else if (strcmp(argv[i], "--source") == 0 && i + 1 < argc) {
+            // Comma separated, e.g. monitor,window
+            app.source_types = 0;
+            char *types = argv[++i];
+            for (char *type = strtok(types, ","); type; type = strtok(NULL, ",")) {
+                if (strcmp(type, "monitor") == 0) {
+                    app.source_types |= PORTAL_SOURCE_MONITOR;
+                } else if (strcmp(type, "window") == 0) {
+                    app.source_types |= PORTAL_SOURCE_WINDOW;
+                } else if (strcmp(type, "virtual") == 0) {
+                    app.source_types |= PORTAL_SOURCE_VIRTUAL;
+                } else {
+                    printf("Invalid source type: %s (monitor, window or virtual)\n", type);
+                    return 1;
+                }
+            }
+            if (app.source_types == 0) {
+                printf("--source needs at least one of monitor, window or virtual\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--compose") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "side-by-side") == 0) {
+                app.compose = COMPOSE_SIDE_BY_SIDE;
+            } else if (strcmp(argv[i], "pip") == 0) {
+                app.compose = COMPOSE_PIP;
+            } else {
+                printf("Invalid layout: %s (side-by-side or pip)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            options.replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay-realtime") == 0) {
+            options.replay_realtime = true;
+        } else if (strcmp(argv[i], "--readback-depth") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long depth = strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || depth < 0) {
+                printf("Invalid readback depth: %s\n", argv[i]);
+                return 1;
+            }
+            readback_depth = (uint32_t)depth;
+        } else if (strcmp(argv[i], "--convert-backend") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "auto") == 0) {
+                options.requested_backend = CONVERT_BACKEND_AUTO;
+            } else if (strcmp(argv[i], "gl") == 0) {
+                options.requested_backend = CONVERT_BACKEND_GL;
+            } else if (strcmp(argv[i], "cpu") == 0) {
+                options.requested_backend = CONVERT_BACKEND_CPU;
+            } else if (strcmp(argv[i], "m2m") == 0) {
+                options.requested_backend = CONVERT_BACKEND_M2M;
+            } else {
+                printf("Invalid conversion backend: %s (auto, gl, cpu or m2m)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--render-node") == 0 && i + 1 < argc) {
+            app.render_node = argv[++i];
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
-            printf("Usage: %s [options] [/dev/videoN]\n", argv[0]);
+            printf("Usage: %s [options] [/dev/videoN ...]\n", argv[0]);
             printf("Options:\n");
             printf("  -c, --color-bars         Generate SMPTE color bars test pattern\n");
+            printf("  --latency-barcode        Stamp color bars with a frame counter and queue time barcode\n");
             printf("  -v, --debug              Enable debug logging\n");
+            printf("  --trace-sample N         Log per-frame details of 1 in N frames with --debug (default: %d)\n",
+                   TRACE_DEFAULT_SAMPLE);
+            printf("  --threads N              Color conversion threads, 0 = one per CPU up to 8 (default: 0)\n");
+            printf("  --pin-cores              Pin each conversion thread to its own CPU core\n");
+            printf("  --rt                     Real-time conversion threads (SCHED_FIFO, via rtkit) and locked buffers\n");
+            printf("  --queue-depth N          Frames the conversion thread may lag behind (default: 2)\n");
+            printf("  --queue-policy P         When it lags further: drop-oldest (default) or block\n");
+            printf("  --keep-alive N           Frames per second sent while the screen is idle, 0 = none (default: %d)\n",
+                   DEFAULT_KEEP_ALIVE_FPS);
+            printf("  --fps N                  Maximum frame rate, 0 = as fast as the screen updates (default: 0)\n");
+            printf("  --size WxH               Scale the output to WxH (default: stream or crop size)\n");
+            printf("  --crop x,y,w,h           Only output this rectangle of the stream\n");
+            printf("  --format F               Output format: yuyv (default), nv12, i420 or mjpeg\n");
+            printf("  --jpeg-quality N         JPEG quality of mjpeg output, 1-100 (default: %d)\n",
+                   MJPEG_DEFAULT_QUALITY);
+            printf("  --zero-copy              Pass DMA-BUFs to the device without conversion (DMA-BUF capable sinks)\n");
+            printf("  --source TYPES           What the portal offers: monitor (default), window, virtual, comma separated\n");
+            printf("  --restore-token FILE     Where the portal selection is kept for the next start\n");
+            printf("                           (default: per device setup in the XDG state directory)\n");
+            printf("  --no-restore             Show the portal dialog on every start, don't keep the selection\n");
+            printf("  --no-reconnect           Exit when the capture is lost instead of setting it up again\n");
+            printf("  --compose L              Composite every monitor picked into one device: side-by-side or pip\n");
+            printf("  --readback-depth N       Frames of GPU readback latency, 0 = synchronous (default: 0, max: 3)\n");
+            printf("                           Above 0 the last frame of an update shows only with the next one\n");
+            printf("  --convert-backend B      What converts DMA-BUFs: gl, cpu, m2m (V4L2 mem2mem device) or auto,\n");
+            printf("                           which times each on the first frames (default: auto)\n");
+            printf("  --render-node PATH       GPU for DMA-BUF import, e.g. /dev/dri/renderD128\n");
+            printf("                           (default: the GPU the display was booted on)\n");
+            printf("  --record FILE            Save the raw frames before conversion to FILE\n");
+            printf("  --replay FILE            Convert and output the frames of a --record FILE, no screen capture\n");
+            printf("  --replay-realtime        Replay at the recorded pace instead of as fast as possible\n");
+            printf("  --stats N                Print per-stage latencies to stderr every N seconds, 0 = never\n");
+            printf("  --stats-socket PATH      Serve counters and latencies on a Unix socket\n");
             printf("  -h, --help               Show this help message\n");
-            printf("\nIf no device is specified, %s is used by default.\n", DEFAULT_V4L2_DEVICE);
+            printf("\nIf no device is specified, %s is used by default. With several devices the\n", DEFAULT_V4L2_DEVICE);
+            printf("portal asks for as many monitors, the first one picked goes to the first device.\n");
             printf("\nDebug mode can also be enabled by setting DEBUG=1 or GNOME_V4L2_DEBUG=1 environment variable.\n");
             return 0;
         } else if (argv[i][0] != '-') {
-            v4l2_device = argv[i];
+            if (n_devices == MAX_STREAMS) {
+                printf("At most %d devices can be given\n", MAX_STREAMS);
+                return 1;
+            }
+            devices[n_devices++] = argv[i];
         } else {
             printf("Unknown option: %s\n", argv[i]);
             printf("Use --help for usage information.\n");
@@ -1390,154 +3580,295 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (n_devices == 0) {
+        n_devices = 1;
+    }
+    app.n_devices = n_devices;
+
+    if ((record_path || options.replay_path) && options.color_bars_mode) {
+        printf("--record and --replay don't apply to --color-bars\n");
+        return 1;
+    }
+    if (record_path && options.replay_path) {
+        printf("--record and --replay can't be combined\n");
+        return 1;
+    }
+    if (n_devices > 1 && (options.color_bars_mode || options.replay_path || record_path)) {
+        printf("--color-bars, --record and --replay use a single device\n");
+        return 1;
+    }
+
+    if (app.compose != COMPOSE_NONE) {
+        if (n_devices > 1 || options.color_bars_mode || options.replay_path || record_path) {
+            printf("--compose writes to a single device and needs screen capture\n");
+            return 1;
+        }
+        if (options.zero_copy || options.requested_region.crop_width != 0) {
+            printf("--compose can't be combined with --zero-copy or --crop\n");
+            return 1;
+        }
+    }
+
+    if (options.latency_barcode && !options.color_bars_mode) {
+        printf("--latency-barcode needs --color-bars\n");
+        return 1;
+    }
+
+    if (app.realtime) {
+        // Before the first frame buffer is allocated
+        realtime_enable_locked_memory();
+    }
+
+    if (debug_enabled && trace_start(trace_sample)) {
+        printf("Debug tracing enabled, per-frame details of 1 in %u frames\n", trace_sample);
+    }
+
+    app.stats = stats_create();
+    if (!app.stats) {
+        return 1;
+    }
+    if (stats_socket && !stats_start_server(app.stats, stats_socket)) {
+        stats_destroy(app.stats);
+        return 1;
+    }
+
     printf("Starting GNOME to V4L2 loopback\n");
-    printf("V4L2 device: %s\n", v4l2_device);
+    for (uint32_t i = 0; i < n_devices; i++) {
+        printf("V4L2 device: %s\n", devices[i]);
+    }
+    resolve_convert_threads(&app);
 
-    // Initialize OpenGL context for DMA buffer handling
-    printf("Initializing OpenGL/EGL context for DMA buffer support...\n");
-    data.gl_ctx = gl_context_create();
-    if (data.gl_ctx) {
-        if (gl_has_dma_buf_import_support(data.gl_ctx)) {
-            printf("OpenGL DMA buffer import support is available\n");
-        } else {
-            printf("Warning: OpenGL context created but DMA buffer import not supported\n");
-            printf("Will fall back to direct memory mapping when possible\n");
+    // The readback ring holds frames of whichever stream was imported before
+    if (n_devices > 1 && readback_depth > 0) {
+        printf("Readback is synchronous with several streams sharing the GPU context\n");
+        readback_depth = 0;
+    }
+    app.readback_depth = readback_depth;
+
+    // Found here rather than per format on the worker, which holds pipeline_lock
+    if (options.requested_backend == CONVERT_BACKEND_AUTO || options.requested_backend == CONVERT_BACKEND_M2M) {
+        app.n_m2m_devices = m2m_find_devices(devices, n_devices, app.m2m_devices, M2M_MAX_DEVICES);
+        for (uint32_t i = 0; i < app.n_m2m_devices; i++) {
+            printf("Mem2mem device: %s\n", app.m2m_devices[i].path);
         }
-    } else {
-        printf("Warning: Failed to create OpenGL context\n");
-        printf("DMA buffer handling will be limited - may fail on tiled buffers\n");
+        if (app.n_m2m_devices == 0 && options.requested_backend == CONVERT_BACKEND_M2M) {
+            printf("No mem2mem device found, converting with gl or cpu\n");
+        }
+    }
+
+    // Joined once the portal hands over the streams, the devices are opened meanwhile
+    start_gl_init(&app);
+
+    // Every stream starts from the command line settings with its own device
+    app.options = &options;
+    for (uint32_t i = 0; i < n_devices; i++) {
+        if (!create_stream(&app, devices[i])) {
+            goto cleanup;
+        }
+    }
+
+    if (app.compose != COMPOSE_NONE) {
+        // The device stream becomes the composite output, the sources are added per portal stream
+        app.compose_output = app.streams[0];
+        app.streams[0] = NULL;
+        app.n_streams = 0;
+        app.compose_width = options.requested_region.width;
+        app.compose_height = options.requested_region.height;
+        memset(&app.compose_output->requested_region, 0, sizeof(app.compose_output->requested_region));
+
+        // Nothing is queued on it, process_frame only reads the drop count
+        app.compose_output->frame_queue = frame_queue_create(1);
+        if (!app.compose_output->frame_queue) {
+            goto cleanup;
+        }
+    }
+
+    // Without screen capture there is nothing else to overlap with
+    if ((options.color_bars_mode || options.replay_path) && !join_gl_init(&app)) {
+        goto cleanup;
     }
 
-    if (data.color_bars_mode) {
+    // Color bars, recording and replay have a single stream
+    struct app_data *data = app.compose_output ? app.compose_output : app.streams[0];
+
+    if (data->color_bars_mode) {
         // For color bars mode, use default resolution
-        data.width = 1280;
-        data.height = 720;
-        data.stride = data.width * 4;  // No padding for color bars
-        printf("Resolution: %dx%d\n", data.width, data.height);
+        data->width = data->requested_region.width ? data->requested_region.width : 1280;
+        data->height = data->requested_region.height ? data->requested_region.height : 720;
+        data->stride = data->width * 4;  // No padding for color bars
+        printf("Resolution: %dx%d\n", data->width, data->height);
         printf("Mode: Color bars test pattern\n");
+        if (data->requested_format != OUTPUT_FORMAT_YUYV) {
+            printf("Color bars are always sent as YUYV, ignoring --format\n");
+        }
+    } else if (data->replay_path) {
+        printf("Mode: Replay of %s\n", data->replay_path);
     } else {
         printf("Mode: Screen capture (resolution will be determined by PipeWire)\n");
     }
 
-    data.v4l2_fd = setup_v4l2_device(v4l2_device);
-    if (data.v4l2_fd < 0) {
-        fprintf(stderr, "Failed to setup V4L2 device\n");
-        goto cleanup;
-    }
-
-    if (data.color_bars_mode) {
-        // First check device capabilities
-        struct v4l2_capability cap;
-        if (ioctl(data.v4l2_fd, VIDIOC_QUERYCAP, &cap) < 0) {
-            perror("Failed to query device capabilities");
+    if (record_path) {
+        data->recorder = capture_file_create(record_path);
+        if (!data->recorder) {
             goto cleanup;
         }
+        printf("Recording raw frames to %s\n", record_path);
+    }
 
-        printf("Device capabilities: 0x%x\n", cap.capabilities);
-        printf("Device supports: %s%s%s\n",
-               (cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ? "CAPTURE " : "",
-               (cap.capabilities & V4L2_CAP_VIDEO_OUTPUT) ? "OUTPUT " : "",
-               (cap.capabilities & V4L2_CAP_READWRITE) ? "READWRITE" : "");
-
-        // Set up V4L2 format for color bars - try both capture and output types
-        struct v4l2_format fmt = {0};
-        fmt.type = (cap.capabilities & V4L2_CAP_VIDEO_OUTPUT) ? V4L2_BUF_TYPE_VIDEO_OUTPUT : V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        fmt.fmt.pix.width = data.width;
-        fmt.fmt.pix.height = data.height;
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-        fmt.fmt.pix.field = V4L2_FIELD_NONE;
-        fmt.fmt.pix.bytesperline = data.width * 2;
-        fmt.fmt.pix.sizeimage = data.width * data.height * 2;
-
-        if (ioctl(data.v4l2_fd, VIDIOC_S_FMT, &fmt) < 0) {
-            // Try with XR24 format if YUYV fails
-            fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_XRGB32;
-            fmt.fmt.pix.bytesperline = data.width * 4;
-            fmt.fmt.pix.sizeimage = data.width * data.height * 4;
-
-            if (ioctl(data.v4l2_fd, VIDIOC_S_FMT, &fmt) < 0) {
-                perror("Failed to set V4L2 format for color bars");
-                printf("Trying to write to device without setting format...\n");
-            } else {
-                printf("V4L2 format set: %dx%d, XRGB32\n", data.width, data.height);
-            }
+    if (data->color_bars_mode) {
+        // Set up V4L2 format for color bars, try XR24 format if YUYV fails
+        bool using_yuyv = true;
+        if (v4l2_sink_configure(data->sink, data->width, data->height, V4L2_PIX_FMT_YUYV)) {
+            printf("V4L2 format set: %dx%d, YUYV\n", data->width, data->height);
+        } else if (v4l2_sink_configure(data->sink, data->width, data->height, V4L2_PIX_FMT_XRGB32)) {
+            printf("V4L2 format set: %dx%d, XRGB32\n", data->width, data->height);
+            using_yuyv = false;
         } else {
-            printf("V4L2 format set: %dx%d, YUYV\n", data.width, data.height);
+            fprintf(stderr, "Failed to set V4L2 format for color bars\n");
+            goto cleanup;
         }
 
-        // Allocate buffer for color bars - determine size based on format
-        bool using_yuyv = (fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV);
-        data.conversion_buffer_size = using_yuyv ?
-            data.width * data.height * 2 : data.width * data.height * 4;
-        data.conversion_buffer = malloc(data.conversion_buffer_size);
-        if (!data.conversion_buffer) {
-            fprintf(stderr, "Failed to allocate color bars buffer\n");
-            goto cleanup;
+        size_t frame_size = using_yuyv ?
+            data->width * data->height * 2 : data->width * data->height * 4;
+        if (data->latency_barcode && (!using_yuyv || data->width < LATENCY_BARCODE_MIN_WIDTH)) {
+            printf("Warning: Latency barcode needs YUYV output at least %d pixels wide, disabled\n",
+                   LATENCY_BARCODE_MIN_WIDTH);
+            data->latency_barcode = false;
         }
+        v4l2_sink_set_frame_rate(data->sink, data->max_fps > 0 ? data->max_fps : COLOR_BARS_FPS);
 
         // Generate and write color bars continuously
         printf("Generating color bars... Press Ctrl+C to stop.\n");
         while (1) {
+            size_t out_size = 0;
+            uint8_t *out_buffer = v4l2_sink_acquire(data->sink, &out_size);
+            if (!out_buffer || out_size < frame_size) {
+                perror("Failed to get V4L2 output buffer");
+                break;
+            }
             if (using_yuyv) {
-                generate_color_bars_yuyv(data.conversion_buffer, data.width, data.height);
+                generate_color_bars_yuyv(out_buffer, data->width, data->height);
             } else {
-                generate_color_bars_xrgb32(data.conversion_buffer, data.width, data.height);
+                generate_color_bars_xrgb32(out_buffer, data->width, data->height);
+            }
+            // Stamped last so the time is as close to the queue as possible
+            uint64_t timestamp_ns = 0;
+            if (data->latency_barcode) {
+                timestamp_ns = monotonic_ns();
+                draw_latency_barcode_yuyv(out_buffer, data->width, data->height, data->barcode_frame++, timestamp_ns);
             }
-            ssize_t written = write(data.v4l2_fd, data.conversion_buffer, data.conversion_buffer_size);
-            if (written < 0) {
+            if (!v4l2_sink_commit(data->sink, frame_size, timestamp_ns)) {
                 perror("Failed to write color bars to V4L2 device");
                 break;
             }
-            usleep(33333); // ~30 FPS
+            frame_pacer_wait(data->pacer);
+        }
+    } else if (data->replay_path) {
+        if (!run_replay(data)) {
+            fprintf(stderr, "Replay of %s failed\n", data->replay_path);
         }
     } else {
+        if (restore_session) {
+            app.restore_token_path = restore_token_file ? g_strdup(restore_token_file) :
+                                     default_restore_token_path(&app, devices, n_devices);
+        }
+
         DEBUG_PRINT("DEBUG: Initializing PipeWire\n");
         pw_init(&argc, &argv);
         DEBUG_PRINT("DEBUG: PipeWire initialized\n");
 
-        if (setup_pipewire_via_portal(&data) < 0) {
-            fprintf(stderr, "Failed to setup PipeWire via portal\n");
-            goto cleanup;
-        }
+        // The devices stay configured across reconnects, consumers keep getting
+        // the last frame and never see the camera go away
+        bool connected = false;
+        uint32_t failed_attempts = 0;
+        while (!__atomic_load_n(&app.stopping, __ATOMIC_RELAXED)) {
+            if (setup_pipewire_via_portal(&app) < 0) {
+                fprintf(stderr, "Failed to setup PipeWire via portal\n");
+                if (!connected) {
+                    goto cleanup;
+                }
+            } else {
+                printf("Starting main loop...\n");
+                // The portal setup will run its main loop until ready,
+                // then we'll switch to the PipeWire main loop
+                portal_run_main_loop(app.portal_session);
+            }
+
+            if (app.portal_ready && app.loop) {
+                printf("Portal ready, starting PipeWire main loop...\n");
+                connected = true;
+                failed_attempts = 0;
+                pw_main_loop_run(app.loop);
+            } else if (!connected) {
+                // Nothing was picked in the first dialog
+                break;
+            } else {
+                failed_attempts++;
+            }
 
-        printf("Starting main loop...\n");
-        // The portal setup will run its main loop until ready,
-        // then we'll switch to the PipeWire main loop
-        portal_run_main_loop(data.portal_session);
+            bool lost = __atomic_load_n(&app.reconnect_pending, __ATOMIC_ACQUIRE) || !app.portal_ready;
+            if (!app.reconnect || !lost || __atomic_load_n(&app.stopping, __ATOMIC_RELAXED)) {
+                break;
+            }
 
-        if (data.portal_ready && data.loop) {
-            printf("Portal ready, starting PipeWire main loop...\n");
-            pw_main_loop_run(data.loop);
+            uint64_t teardown_start_ns = monotonic_ns();
+            teardown_capture(&app);
+            __atomic_store_n(&app.reconnect_pending, false, __ATOMIC_RELEASE);
+            DEBUG_PRINT("DEBUG: Capture torn down in %.1f ms\n", (monotonic_ns() - teardown_start_ns) / 1e6);
+
+            // The first attempt is immediate, a portal that keeps failing is retried less and less often
+            if (failed_attempts > 0) {
+                uint32_t shift = failed_attempts - 1 < 5 ? failed_attempts - 1 : 5;
+                uint32_t delay_ms = RECONNECT_DELAY_MS << shift;
+                if (delay_ms > RECONNECT_MAX_DELAY_MS) {
+                    delay_ms = RECONNECT_MAX_DELAY_MS;
+                }
+                printf("Reconnect attempt %u failed, retrying in %u ms\n", failed_attempts, delay_ms);
+                struct timespec delay = { delay_ms / 1000, (long)(delay_ms % 1000) * 1000000L };
+                nanosleep(&delay, NULL);
+            }
         }
     }
 
 cleanup:
     // Clear global reference
-    global_app_data = NULL;
-
-    if (data.stream)
-        pw_stream_destroy(data.stream);
-    if (data.core)
-        pw_core_disconnect(data.core);
-    if (data.context)
-        pw_context_destroy(data.context);
-    if (data.portal_session)
-        portal_session_free(data.portal_session);
-    if (data.v4l2_fd >= 0)
-        close(data.v4l2_fd);
-    if (data.conversion_buffer)
-        free(data.conversion_buffer);
-    if (data.gl_buffer)
-        free(data.gl_buffer);
-    if (data.gl_ctx)
-        gl_context_destroy(data.gl_ctx);
-    if (data.loop)
-        pw_main_loop_destroy(data.loop);
-
-    if (!data.color_bars_mode) {
+    global_app = NULL;
+
+    // Buffers still queued or held by the device go away with the streams,
+    // the return events go away with the context's data loop
+    stop_conversion_worker(&app);
+    for (uint32_t i = 0; i < MAX_STREAMS; i++) {
+        destroy_stream(app.streams[i]);
+    }
+    destroy_stream(app.compose_output);
+    if (app.core)
+        pw_core_disconnect(app.core);
+    if (app.context)
+        pw_context_destroy(app.context);
+    if (app.portal_session)
+        portal_session_free(app.portal_session);
+    g_free(app.restore_token_path);
+    // Setup may have failed before the portal handed over the streams
+    if (app.gl_init_running)
+        pthread_join(app.gl_init_thread, NULL);
+    if (app.gl_ctx)
+        gl_context_destroy(app.gl_ctx);
+    if (app.loop && app.stats_timer)
+        pw_loop_destroy_source(pw_main_loop_get_loop(app.loop), app.stats_timer);
+    if (app.loop && app.portal_timer)
+        pw_loop_destroy_source(pw_main_loop_get_loop(app.loop), app.portal_timer);
+    if (app.loop)
+        pw_main_loop_destroy(app.loop);
+    stats_destroy(app.stats);
+
+    if (!options.color_bars_mode && !options.replay_path) {
         pw_deinit();
     }
 
+    sem_destroy(&app.worker_sem);
+    pthread_mutex_destroy(&app.pipeline_lock);
+
     printf("Application shutdown complete.\n");
+    trace_stop();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,145 @@
+#include "mjpeg_encoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+
+struct mjpeg_encoder {
+    tjhandle handle;
+    int quality;
+
+    // Used when the destination is smaller than the worst case compressed size,
+    // TurboJPEG would otherwise write past it
+    unsigned char *staging;
+    unsigned long staging_size;
+};
+
+// SPA names formats by byte order in memory, like TurboJPEG does
+static int spa_to_tj_format(uint32_t spa_format) {
+    switch (spa_format) {
+        case 7: return TJPF_RGBX;   // SPA_VIDEO_FORMAT_RGBx
+        case 8: return TJPF_BGRX;   // SPA_VIDEO_FORMAT_BGRx
+        case 9: return TJPF_XRGB;   // SPA_VIDEO_FORMAT_xRGB
+        case 10: return TJPF_XBGR;  // SPA_VIDEO_FORMAT_xBGR
+        case 11: return TJPF_RGBA;  // SPA_VIDEO_FORMAT_RGBA
+        case 12: return TJPF_BGRA;  // SPA_VIDEO_FORMAT_BGRA
+        case 13: return TJPF_ARGB;  // SPA_VIDEO_FORMAT_ARGB
+        case 14: return TJPF_ABGR;  // SPA_VIDEO_FORMAT_ABGR
+        case 15: return TJPF_RGB;   // SPA_VIDEO_FORMAT_RGB
+        case 16: return TJPF_BGR;   // SPA_VIDEO_FORMAT_BGR
+        default: return -1;
+    }
+}
+
+bool mjpeg_encoder_is_available(void) {
+    return true;
+}
+
+mjpeg_encoder* mjpeg_encoder_create(int quality) {
+    if (quality < 1 || quality > 100) {
+        fprintf(stderr, "Invalid JPEG quality: %d\n", quality);
+        return NULL;
+    }
+
+    mjpeg_encoder *enc = calloc(1, sizeof(mjpeg_encoder));
+    if (!enc) {
+        fprintf(stderr, "Failed to allocate MJPEG encoder\n");
+        return NULL;
+    }
+
+    enc->handle = tjInitCompress();
+    if (!enc->handle) {
+        fprintf(stderr, "Failed to initialize TurboJPEG: %s\n", tjGetErrorStr());
+        free(enc);
+        return NULL;
+    }
+
+    enc->quality = quality;
+    return enc;
+}
+
+void mjpeg_encoder_destroy(mjpeg_encoder *enc) {
+    if (!enc) {
+        return;
+    }
+
+    tjDestroy(enc->handle);
+    tjFree(enc->staging);
+    free(enc);
+}
+
+size_t mjpeg_encoder_encode(mjpeg_encoder *enc, const uint8_t *src, uint32_t spa_format,
+                            int width, int height, uint32_t stride,
+                            uint8_t *dst, size_t dst_size) {
+    if (!enc || !src || !dst) {
+        return 0;
+    }
+
+    int pixel_format = spa_to_tj_format(spa_format);
+    if (pixel_format < 0) {
+        fprintf(stderr, "Unsupported format %u for MJPEG\n", spa_format);
+        return 0;
+    }
+
+    // With TJFLAG_NOREALLOC the output buffer must hold the worst case
+    unsigned long max_size = tjBufSize(width, height, TJSAMP_422);
+    unsigned char *out = dst;
+    if (dst_size < max_size) {
+        if (enc->staging_size < max_size) {
+            tjFree(enc->staging);
+            enc->staging = tjAlloc((int)max_size);
+            enc->staging_size = enc->staging ? max_size : 0;
+            if (!enc->staging) {
+                fprintf(stderr, "Failed to allocate MJPEG staging buffer\n");
+                return 0;
+            }
+        }
+        out = enc->staging;
+    }
+
+    unsigned long jpeg_size = max_size;
+    if (tjCompress2(enc->handle, src, width, (int)stride, height, pixel_format,
+                    &out, &jpeg_size, TJSAMP_422, enc->quality,
+                    TJFLAG_NOREALLOC | TJFLAG_FASTDCT) != 0) {
+        fprintf(stderr, "JPEG compression failed: %s\n", tjGetErrorStr2(enc->handle));
+        return 0;
+    }
+
+    if (out != dst) {
+        if (jpeg_size > dst_size) {
+            fprintf(stderr, "JPEG frame of %lu bytes doesn't fit in %zu\n", jpeg_size, dst_size);
+            return 0;
+        }
+        memcpy(dst, out, jpeg_size);
+    }
+
+    return jpeg_size;
+}
+
+#else // HAVE_TURBOJPEG
+
+bool mjpeg_encoder_is_available(void) {
+    return false;
+}
+
+mjpeg_encoder* mjpeg_encoder_create(int quality) {
+    (void)quality;
+    fprintf(stderr, "MJPEG output needs libjpeg-turbo, rebuild with libturbojpeg installed\n");
+    return NULL;
+}
+
+void mjpeg_encoder_destroy(mjpeg_encoder *enc) {
+    (void)enc;
+}
+
+size_t mjpeg_encoder_encode(mjpeg_encoder *enc, const uint8_t *src, uint32_t spa_format,
+                            int width, int height, uint32_t stride,
+                            uint8_t *dst, size_t dst_size) {
+    (void)enc; (void)src; (void)spa_format; (void)width; (void)height;
+    (void)stride; (void)dst; (void)dst_size;
+    return 0;
+}
+
+#endif // HAVE_TURBOJPEG
@@ -0,0 +1,42 @@
+#ifndef MJPEG_ENCODER_H
+#define MJPEG_ENCODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Default JPEG quality of MJPEG output
+#define MJPEG_DEFAULT_QUALITY 85
+
+// JPEG compressor for MJPEG output, backed by libjpeg-turbo (TurboJPEG API)
+// Frames are compressed straight from the captured RGB layout with 4:2:2
+// chroma, so no conversion pass is needed.
+typedef struct mjpeg_encoder mjpeg_encoder;
+
+// Check whether MJPEG support was compiled in (HAVE_TURBOJPEG)
+bool mjpeg_encoder_is_available(void);
+
+// Create an encoder
+// Parameters:
+//   quality: JPEG quality, 1-100
+// Returns NULL on failure or without libjpeg-turbo
+mjpeg_encoder* mjpeg_encoder_create(int quality);
+
+void mjpeg_encoder_destroy(mjpeg_encoder *enc);
+
+// Compress one frame
+// Parameters:
+//   enc: The encoder
+//   src: Source frame in a packed RGB layout
+//   spa_format: SPA video format of src (RGBx ... BGR)
+//   width: Frame width in pixels
+//   height: Frame height in pixels
+//   stride: Stride of the source in bytes
+//   dst: Destination buffer
+//   dst_size: Size of dst in bytes
+// Returns: Size of the JPEG image, 0 on failure or if it doesn't fit in dst
+size_t mjpeg_encoder_encode(mjpeg_encoder *enc, const uint8_t *src, uint32_t spa_format,
+                            int width, int height, uint32_t stride,
+                            uint8_t *dst, size_t dst_size);
+
+#endif // MJPEG_ENCODER_H
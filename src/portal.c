@@ -21,6 +21,14 @@ static void on_session_closed(GDBusConnection *connection,
                              GVariant *parameters,
                              gpointer user_data);
 
+// Sessions are freed and created again when capture reconnects, their
+// signals must not reach a freed session
+static void track_subscription(PortalSession *session, guint id) {
+    if (session->n_subscriptions < PORTAL_MAX_SUBSCRIPTIONS) {
+        session->subscriptions[session->n_subscriptions++] = id;
+    }
+}
+
 PortalSession* portal_session_new(void) {
     PortalSession *session = g_malloc0(sizeof(PortalSession));
 
@@ -68,8 +76,14 @@ void portal_session_free(PortalSession *session) {
         close(session->pipewire_fd);
     }
 
+    for (uint32_t i = 0; i < session->n_subscriptions; i++) {
+        g_dbus_connection_signal_unsubscribe(session->connection, session->subscriptions[i]);
+    }
+
     g_free(session->session_handle);
     g_free(session->request_token);
+    g_free(session->restore_token);
+    g_free(session->restore_token_path);
 
     if (session->portal_proxy) {
         g_object_unref(session->portal_proxy);
@@ -86,6 +100,63 @@ void portal_session_free(PortalSession *session) {
     g_free(session);
 }
 
+void portal_set_restore_token_file(PortalSession *session, const char *path) {
+    if (!session) {
+        return;
+    }
+
+    g_free(session->restore_token_path);
+    session->restore_token_path = g_strdup(path);
+    g_free(session->restore_token);
+    session->restore_token = NULL;
+
+    gchar *contents = NULL;
+    if (path && g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_strstrip(contents);
+        if (contents[0] != '\0') {
+            session->restore_token = contents;
+            printf("Restoring the previous screen cast selection from %s\n", path);
+            return;
+        }
+    }
+    g_free(contents);
+}
+
+char* portal_restore_token_path(const char *name) {
+    char *file = g_strdup_printf("%s.token", name);
+    char *path = g_build_filename(g_get_user_state_dir(), "gnome-to-v4l2loopback", file, NULL);
+    g_free(file);
+    return path;
+}
+
+// Tokens are single use, the one a session returns replaces the old one
+static void save_restore_token(PortalSession *session, const char *token) {
+    g_free(session->restore_token);
+    session->restore_token = g_strdup(token);
+
+    char *dir = g_path_get_dirname(session->restore_token_path);
+    GError *error = NULL;
+    if (g_mkdir_with_parents(dir, 0700) < 0 ||
+        !g_file_set_contents_full(session->restore_token_path, token, -1,
+                                  G_FILE_SET_CONTENTS_CONSISTENT, 0600, &error)) {
+        fprintf(stderr, "Failed to save restore token to %s: %s\n", session->restore_token_path,
+                error ? error->message : "can't create its directory");
+        g_clear_error(&error);
+    }
+    g_free(dir);
+}
+
+// Version of the ScreenCast interface, 0 if the portal doesn't say
+static uint32_t portal_interface_version(PortalSession *session) {
+    GVariant *version = g_dbus_proxy_get_cached_property(session->portal_proxy, "version");
+    if (!version) {
+        return 0;
+    }
+    uint32_t value = g_variant_get_uint32(version);
+    g_variant_unref(version);
+    return value;
+}
+
 char* portal_generate_token(void) {
     static uint32_t counter = 0;
     counter++;
@@ -135,7 +206,7 @@ bool portal_create_session(PortalSession *session, PortalSessionCallback callbac
                                        sanitized_name_req, handle_token);
     g_free(sanitized_name_req);
 
-    g_dbus_connection_signal_subscribe(
+    track_subscription(session, g_dbus_connection_signal_subscribe(
         session->connection,
         PORTAL_BUS_NAME,
         PORTAL_REQUEST_INTERFACE,
@@ -145,10 +216,10 @@ bool portal_create_session(PortalSession *session, PortalSessionCallback callbac
         G_DBUS_SIGNAL_FLAGS_NONE,
         on_request_response,
         session,
-        NULL);
+        NULL));
 
     // Subscribe to session closed signal
-    g_dbus_connection_signal_subscribe(
+    track_subscription(session, g_dbus_connection_signal_subscribe(
         session->connection,
         PORTAL_BUS_NAME,
         PORTAL_SESSION_INTERFACE,
@@ -158,7 +229,7 @@ bool portal_create_session(PortalSession *session, PortalSessionCallback callbac
         G_DBUS_SIGNAL_FLAGS_NONE,
         on_session_closed,
         session,
-        NULL);
+        NULL));
 
     // Store callback for later use
     g_object_set_data(G_OBJECT(session->portal_proxy), "create_session_callback", callback);
@@ -193,11 +264,27 @@ bool portal_create_session(PortalSession *session, PortalSessionCallback callbac
     return true;
 }
 
-bool portal_select_sources(PortalSession *session, PortalSessionCallback callback, void *user_data) {
+bool portal_select_sources(PortalSession *session, uint32_t types, bool multiple,
+                           PortalSessionCallback callback, void *user_data) {
     if (!session || !session->portal_proxy || !session->session_handle) {
         return false;
     }
 
+    // Virtual monitors need version 4 of the interface, windows aren't offered by every backend
+    GVariant *available = g_dbus_proxy_get_cached_property(session->portal_proxy, "AvailableSourceTypes");
+    if (available) {
+        uint32_t available_types = g_variant_get_uint32(available);
+        g_variant_unref(available);
+        if ((types & available_types) != types) {
+            printf("Warning: The portal only offers source types 0x%x of 0x%x\n", types & available_types, types);
+        }
+        types &= available_types;
+        if (types == 0) {
+            fprintf(stderr, "None of the requested source types is available\n");
+            return false;
+        }
+    }
+
     char *handle_token = portal_generate_token();
 
     // Store request token for callback matching
@@ -208,9 +295,17 @@ bool portal_select_sources(PortalSession *session, PortalSessionCallback callbac
     GVariantBuilder builder;
     g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
     g_variant_builder_add(&builder, "{sv}", "handle_token", g_variant_new_string(handle_token));
-    g_variant_builder_add(&builder, "{sv}", "types", g_variant_new_uint32(1)); // MONITOR = 1
-    g_variant_builder_add(&builder, "{sv}", "multiple", g_variant_new_boolean(FALSE));
+    g_variant_builder_add(&builder, "{sv}", "types", g_variant_new_uint32(types));
+    g_variant_builder_add(&builder, "{sv}", "multiple", g_variant_new_boolean(multiple));
     g_variant_builder_add(&builder, "{sv}", "cursor_mode", g_variant_new_uint32(2)); // EMBEDDED = 2
+    if (session->restore_token_path && portal_interface_version(session) >= 4) {
+        g_variant_builder_add(&builder, "{sv}", "persist_mode", g_variant_new_uint32(2)); // Until revoked = 2
+        if (session->restore_token) {
+            g_variant_builder_add(&builder, "{sv}", "restore_token", g_variant_new_string(session->restore_token));
+        }
+    } else if (session->restore_token_path) {
+        printf("The portal doesn't support restoring sessions, the dialog will show on every start\n");
+    }
 
     // Subscribe to request response signal
     char *sanitized_name_req = sanitize_unique_name(g_dbus_connection_get_unique_name(session->connection));
@@ -218,7 +313,7 @@ bool portal_select_sources(PortalSession *session, PortalSessionCallback callbac
                                        sanitized_name_req, handle_token);
     g_free(sanitized_name_req);
 
-    g_dbus_connection_signal_subscribe(
+    track_subscription(session, g_dbus_connection_signal_subscribe(
         session->connection,
         PORTAL_BUS_NAME,
         PORTAL_REQUEST_INTERFACE,
@@ -228,7 +323,7 @@ bool portal_select_sources(PortalSession *session, PortalSessionCallback callbac
         G_DBUS_SIGNAL_FLAGS_NONE,
         on_request_response,
         session,
-        NULL);
+        NULL));
 
     // Store callback for later use
     g_object_set_data(G_OBJECT(session->portal_proxy), "select_sources_callback", callback);
@@ -283,7 +378,7 @@ bool portal_start_session(PortalSession *session, PortalNodeCallback callback, v
                                        sanitized_name_req, handle_token);
     g_free(sanitized_name_req);
 
-    g_dbus_connection_signal_subscribe(
+    track_subscription(session, g_dbus_connection_signal_subscribe(
         session->connection,
         PORTAL_BUS_NAME,
         PORTAL_REQUEST_INTERFACE,
@@ -293,7 +388,7 @@ bool portal_start_session(PortalSession *session, PortalNodeCallback callback, v
         G_DBUS_SIGNAL_FLAGS_NONE,
         on_request_response,
         session,
-        NULL);
+        NULL));
 
     // Store callback for later use
     g_object_set_data(G_OBJECT(session->portal_proxy), "start_session_callback", callback);
@@ -391,6 +486,17 @@ void portal_run_main_loop(PortalSession *session) {
     }
 }
 
+void portal_dispatch_pending(PortalSession *session) {
+    if (!session || !session->main_loop) {
+        return;
+    }
+
+    GMainContext *context = g_main_loop_get_context(session->main_loop);
+    while (g_main_context_pending(context)) {
+        g_main_context_iteration(context, FALSE);
+    }
+}
+
 void portal_quit_main_loop(PortalSession *session) {
     if (session && session->main_loop && g_main_loop_is_running(session->main_loop)) {
         g_main_loop_quit(session->main_loop);
@@ -424,34 +530,65 @@ static void on_request_response(GDBusConnection *connection,
     // Check if this is a Start response (contains streams)
     GVariant *streams = g_variant_lookup_value(results, "streams", G_VARIANT_TYPE("a(ua{sv})"));
     if (streams) {
-        // Extract node ID from first stream
+        // Collect the node ID of every stream
         GVariantIter iter;
         g_variant_iter_init(&iter, streams);
 
+        session->n_nodes = 0;
         GVariant *stream_data;
-        if (g_variant_iter_next(&iter, "@(ua{sv})", &stream_data)) {
+        while (g_variant_iter_next(&iter, "@(ua{sv})", &stream_data)) {
             guint32 node_id;
             GVariant *stream_properties;
             g_variant_get(stream_data, "(u@a{sv})", &node_id, &stream_properties);
 
-            session->node_id = node_id;
+            gint32 x = 0, y = 0, width = 0, height = 0;
+            guint32 source_type = 0;
+            g_variant_lookup(stream_properties, "position", "(ii)", &x, &y);
+            g_variant_lookup(stream_properties, "size", "(ii)", &width, &height);
+            g_variant_lookup(stream_properties, "source_type", "u", &source_type);
+
+            if (session->n_nodes < PORTAL_MAX_STREAMS) {
+                const char *type_name = source_type == PORTAL_SOURCE_WINDOW ? "window" :
+                                        source_type == PORTAL_SOURCE_VIRTUAL ? "virtual monitor" : "monitor";
+                session->source_types[session->n_nodes] = source_type;
+                session->node_sizes[session->n_nodes].width = width > 0 ? (uint32_t)width : 0;
+                session->node_sizes[session->n_nodes].height = height > 0 ? (uint32_t)height : 0;
+                session->node_ids[session->n_nodes++] = node_id;
+                printf("Screen capture stream %u: PipeWire node ID %u, %s, %dx%d at %d,%d\n",
+                       session->n_nodes, node_id, type_name, width, height, x, y);
+            } else {
+                printf("Ignoring stream of PipeWire node ID %u, at most %d streams are supported\n",
+                       node_id, PORTAL_MAX_STREAMS);
+            }
+
+            g_variant_unref(stream_properties);
+            g_variant_unref(stream_data);
+        }
+
+        g_variant_unref(streams);
+
+        const gchar *restore_token = NULL;
+        if (session->restore_token_path && g_variant_lookup(results, "restore_token", "&s", &restore_token)) {
+            save_restore_token(session, restore_token);
+        }
+
+        if (session->n_nodes > 0) {
+            session->node_id = session->node_ids[0];
             session->session_active = true;
 
-            printf("Screen capture session started. PipeWire node ID: %u\n", node_id);
+            printf("Screen capture session started with %u stream(s)\n", session->n_nodes);
 
             // Call the start session callback
             PortalNodeCallback callback = g_object_get_data(G_OBJECT(session->portal_proxy), "start_session_callback");
             void *callback_user_data = g_object_get_data(G_OBJECT(session->portal_proxy), "start_session_user_data");
 
             if (callback) {
-                callback(session, node_id, session->pipewire_fd, callback_user_data);
+                callback(session, session->node_id, session->pipewire_fd, callback_user_data);
             }
-
-            g_variant_unref(stream_properties);
-            g_variant_unref(stream_data);
+        } else {
+            fprintf(stderr, "Portal session started without any stream\n");
+            portal_quit_main_loop(session);
         }
-
-        g_variant_unref(streams);
     } else {
         // Handle other responses (CreateSession, SelectSources)
         printf("Portal operation completed successfully\n");
@@ -12,6 +12,22 @@
 #define PORTAL_REQUEST_INTERFACE "org.freedesktop.portal.Request"
 #define PORTAL_SESSION_INTERFACE "org.freedesktop.portal.Session"
 
+// Most streams one session asks for, one per selected monitor
+#define PORTAL_MAX_STREAMS 8
+
+// Signal subscriptions of one session: Closed and a Response per request
+#define PORTAL_MAX_SUBSCRIPTIONS 8
+
+// Source types of SelectSources, a mask of what the dialog offers
+#define PORTAL_SOURCE_MONITOR 1
+#define PORTAL_SOURCE_WINDOW 2
+#define PORTAL_SOURCE_VIRTUAL 4
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+} PortalDimensions;
+
 // Forward declaration for callback types
 typedef struct PortalSession PortalSession;
 typedef void (*PortalSessionCallback)(PortalSession *session, bool success, void *user_data);
@@ -23,34 +39,53 @@ struct PortalSession {
     GDBusProxy *portal_proxy;
     char *session_handle;
     char *request_token;
-    uint32_t node_id;
+    uint32_t node_id;       // Node of the first stream
+    uint32_t node_ids[PORTAL_MAX_STREAMS];  // Nodes of every stream, in the order the user picked them
+    uint32_t source_types[PORTAL_MAX_STREAMS];  // PORTAL_SOURCE_* of every stream, 0 if not reported
+    PortalDimensions node_sizes[PORTAL_MAX_STREAMS];  // Size of every stream, 0x0 if not reported
+    uint32_t n_nodes;
     int pipewire_fd;
+    char *restore_token;       // Loaded from and saved to restore_token_path, NULL if none
+    char *restore_token_path;  // NULL = sessions aren't persisted, the dialog shows every time
     bool session_active;
     GMainLoop *main_loop;
     PortalSessionClosedCallback session_closed_callback;
     void *session_closed_user_data;
+    guint subscriptions[PORTAL_MAX_SUBSCRIPTIONS];  // Dropped when the session is freed
+    uint32_t n_subscriptions;
 };
 
-typedef struct {
-    uint32_t width;
-    uint32_t height;
-} PortalDimensions;
-
 // Core portal functions
 PortalSession* portal_session_new(void);
 void portal_session_free(PortalSession *session);
 
 // Portal workflow functions
 bool portal_create_session(PortalSession *session, PortalSessionCallback callback, void *user_data);
-bool portal_select_sources(PortalSession *session, PortalSessionCallback callback, void *user_data);
+// types: PORTAL_SOURCE_* mask, types the portal doesn't offer are left out
+// multiple: let the user pick more than one source, each becomes a stream
+bool portal_select_sources(PortalSession *session, uint32_t types, bool multiple,
+                           PortalSessionCallback callback, void *user_data);
 bool portal_start_session(PortalSession *session, PortalNodeCallback callback, void *user_data);
 bool portal_open_pipewire_remote(PortalSession *session, PortalNodeCallback callback, void *user_data);
 
+// Persist the selection across runs (persist_mode), so that the next session
+// with the same token file starts without a dialog. The token of a previous
+// session is read from path when sources are selected, and the new one is
+// written back when the session starts. A stale token makes the portal show
+// the dialog again. Needs version 4 of the ScreenCast interface.
+void portal_set_restore_token_file(PortalSession *session, const char *path);
+
+// Default token file for name in the XDG state directory, free with g_free
+char* portal_restore_token_path(const char *name);
+
 // Utility functions
 char* portal_generate_token(void);
 void portal_run_main_loop(PortalSession *session);
 void portal_quit_main_loop(PortalSession *session);
 
+// Deliver portal signals (e.g. Closed) received while another loop runs
+void portal_dispatch_pending(PortalSession *session);
+
 // Session event handling
 void portal_set_session_closed_callback(PortalSession *session, PortalSessionClosedCallback callback, void *user_data);
 
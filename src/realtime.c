@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "realtime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <gio/gio.h>
+
+#define RTKIT_BUS_NAME "org.freedesktop.RealtimeKit1"
+#define RTKIT_OBJECT_PATH "/org/freedesktop/RealtimeKit1"
+
+// Transparent huge page size on x86-64 and arm64 with 4 KiB pages
+#define REALTIME_HUGE_PAGE_SIZE (2u * 1024 * 1024)
+
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK 0x40000000
+#endif
+
+static bool lock_memory = false;
+static bool memlock_warned = false;
+
+void realtime_enable_locked_memory(void) {
+    __atomic_store_n(&lock_memory, true, __ATOMIC_RELEASE);
+}
+
+void* realtime_realloc(void *ptr, size_t old_size, size_t size) {
+    if (!__atomic_load_n(&lock_memory, __ATOMIC_ACQUIRE)) {
+        return realloc(ptr, size);
+    }
+
+    // Whole pages, so mlock covers no memory shared with other allocations
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t alignment = size >= REALTIME_HUGE_PAGE_SIZE ? REALTIME_HUGE_PAGE_SIZE : page;
+    size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, alignment, rounded) != 0) {
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (alignment == REALTIME_HUGE_PAGE_SIZE) {
+        // Hint only, fewer TLB misses on the full-frame passes if THP is enabled
+        madvise(buffer, rounded, MADV_HUGEPAGE);
+    }
+#endif
+
+    // Pre-fault every page now rather than on the first frame
+    memset(buffer, 0, rounded);
+    if (mlock(buffer, rounded) != 0 && !__atomic_exchange_n(&memlock_warned, true, __ATOMIC_RELAXED)) {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+            fprintf(stderr, "Warning: Failed to lock %zu bytes of frame buffers (%s), RLIMIT_MEMLOCK is %" PRIu64 " KiB, "
+                    "raise it (ulimit -l) to keep them in RAM\n",
+                    rounded, strerror(errno), (uint64_t)limit.rlim_cur / 1024);
+        } else {
+            fprintf(stderr, "Warning: Failed to lock %zu bytes of frame buffers: %s\n", rounded, strerror(errno));
+        }
+    }
+
+    if (ptr) {
+        memcpy(buffer, ptr, old_size < size ? old_size : size);
+        munlock(ptr, old_size);
+        free(ptr);
+    }
+    return buffer;
+}
+
+// Read an rtkit property, returns NULL if rtkit isn't running
+static GVariant* get_rtkit_property(GDBusConnection *connection, const char *name) {
+    GError *error = NULL;
+    GVariant *result = g_dbus_connection_call_sync(
+        connection,
+        RTKIT_BUS_NAME,
+        RTKIT_OBJECT_PATH,
+        "org.freedesktop.DBus.Properties",
+        "Get",
+        g_variant_new("(ss)", RTKIT_BUS_NAME, name),
+        G_VARIANT_TYPE("(v)"),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        &error);
+
+    if (error) {
+        g_error_free(error);
+        return NULL;
+    }
+
+    GVariant *value = NULL;
+    g_variant_get(result, "(v)", &value);
+    g_variant_unref(result);
+    return value;
+}
+
+// Ask rtkit for SCHED_FIFO on a thread of this process
+static bool make_realtime_with_rtkit(pid_t tid, int priority) {
+    GError *error = NULL;
+    GDBusConnection *connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+    if (error) {
+        fprintf(stderr, "Failed to connect to system bus for rtkit: %s\n", error->message);
+        g_error_free(error);
+        return false;
+    }
+
+    GVariant *value = get_rtkit_property(connection, "MaxRealtimePriority");
+    if (value) {
+        gint32 max_priority = 0;
+        g_variant_get(value, "i", &max_priority);
+        g_variant_unref(value);
+        if (priority > max_priority) {
+            priority = max_priority;
+        }
+    }
+
+    // rtkit refuses processes that can run real-time without ever yielding
+    value = get_rtkit_property(connection, "RTTimeUSecMax");
+    if (value) {
+        gint64 max_usec = 0;
+        g_variant_get(value, "x", &max_usec);
+        g_variant_unref(value);
+
+        struct rlimit limit;
+        if (max_usec > 0 && getrlimit(RLIMIT_RTTIME, &limit) == 0 &&
+            (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > (rlim_t)max_usec)) {
+            limit.rlim_cur = (rlim_t)max_usec;
+            limit.rlim_max = (rlim_t)max_usec;
+            setrlimit(RLIMIT_RTTIME, &limit);
+        }
+    }
+
+    GVariant *result = g_dbus_connection_call_sync(
+        connection,
+        RTKIT_BUS_NAME,
+        RTKIT_OBJECT_PATH,
+        "org.freedesktop.RealtimeKit1",
+        "MakeThreadRealtime",
+        g_variant_new("(tu)", (guint64)tid, (guint32)priority),
+        NULL,
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        &error);
+
+    g_object_unref(connection);
+    if (error) {
+        fprintf(stderr, "rtkit refused real-time priority for thread %d: %s\n", (int)tid, error->message);
+        g_error_free(error);
+        return false;
+    }
+
+    g_variant_unref(result);
+    return true;
+}
+
+bool realtime_make_thread_realtime(pid_t tid, int priority) {
+    if (tid == 0) {
+        tid = (pid_t)syscall(SYS_gettid);
+    }
+
+    int min_priority = sched_get_priority_min(SCHED_FIFO);
+    int max_priority = sched_get_priority_max(SCHED_FIFO);
+    if (priority < min_priority) priority = min_priority;
+    if (priority > max_priority) priority = max_priority;
+
+    // Forked children start with normal scheduling again
+    struct sched_param param = { .sched_priority = priority };
+    if (sched_setscheduler(tid, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == 0) {
+        return true;
+    }
+    if (errno != EPERM) {
+        fprintf(stderr, "Failed to set SCHED_FIFO on thread %d: %s\n", (int)tid, strerror(errno));
+        return false;
+    }
+
+    return make_realtime_with_rtkit(tid, priority);
+}
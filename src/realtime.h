@@ -0,0 +1,38 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// SCHED_FIFO priority of the conversion threads, below PipeWire's data
+// threads (88 by default) so that buffers keep moving while a frame converts
+#define REALTIME_PRIORITY 20
+
+// Real-time mode (--rt)
+// Frame buffers are allocated locked into RAM and pre-faulted, so the frame
+// path never takes a page fault or waits on swap, and the conversion threads
+// run with SCHED_FIFO, directly if the process may, otherwise granted by
+// rtkit (org.freedesktop.RealtimeKit1 on the system bus).
+
+// Allocate frame buffers through realtime_realloc locked and pre-faulted from now on
+void realtime_enable_locked_memory(void);
+
+// realloc that, once locked memory is enabled, allocates whole pages aligned
+// for transparent huge pages (2 MiB and larger buffers), touches every page
+// and mlocks them, as far as RLIMIT_MEMLOCK allows. The contents are kept.
+// Parameters:
+//   ptr: Buffer to grow, NULL for a new one, must come from realtime_realloc
+//   old_size: Size ptr was allocated with, 0 if ptr is NULL
+//   size: New size in bytes
+// Returns NULL on failure, ptr is then still valid
+void* realtime_realloc(void *ptr, size_t old_size, size_t size);
+
+// Give a thread SCHED_FIFO, through rtkit if setting it directly isn't permitted
+// Parameters:
+//   tid: Kernel thread id (gettid), 0 = the calling thread
+//   priority: Wanted priority, lowered to what rtkit allows
+// Returns: false if neither way worked
+bool realtime_make_thread_realtime(pid_t tid, int priority);
+
+#endif // REALTIME_H
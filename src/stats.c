@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include "stats.h"
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+// 8 exact buckets below 8 us, then 8 per power of two up to 2^27 us (~2 min)
+#define STATS_SUB_BUCKETS 8
+#define STATS_MAX_BIT 27
+#define STATS_BUCKETS ((STATS_MAX_BIT - 1) * STATS_SUB_BUCKETS)
+
+struct stats_histogram {
+    uint64_t buckets[STATS_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+};
+
+struct stats {
+    struct stats_histogram stages[STATS_STAGE_COUNT];
+    uint64_t counters[STATS_COUNTER_COUNT];
+
+    // Totals at the previous stats_log_interval
+    struct stats_histogram last_stages[STATS_STAGE_COUNT];
+    uint64_t last_counters[STATS_COUNTER_COUNT];
+
+    // Unix socket server
+    int listen_fd;
+    char *socket_path;
+    pthread_t server_thread;
+    bool server_running;
+};
+
+static const char *stage_names[STATS_STAGE_COUNT] = {
+    "capture", "queue", "import", "readback", "convert", "write", "total", "latency",
+};
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+    "frames_in", "frames_queue_dropped", "frames_paced", "frames_invalid",
+    "frames_unchanged", "frames_written", "frames_repeated", "write_errors",
+    "deadlines_missed",
+};
+
+static uint32_t bucket_index(uint64_t us) {
+    if (us < STATS_SUB_BUCKETS) {
+        return (uint32_t)us;
+    }
+
+    uint32_t bit = 63 - (uint32_t)__builtin_clzll(us);
+    if (bit > STATS_MAX_BIT) {
+        return STATS_BUCKETS - 1;
+    }
+
+    uint32_t sub = (uint32_t)(us >> (bit - 3)) & (STATS_SUB_BUCKETS - 1);
+    return (bit - 2) * STATS_SUB_BUCKETS + sub;
+}
+
+// Largest value falling into a bucket
+static uint64_t bucket_upper_bound(uint32_t index) {
+    if (index < STATS_SUB_BUCKETS) {
+        return index;
+    }
+
+    uint32_t bit = index / STATS_SUB_BUCKETS + 2;
+    uint64_t lower = (uint64_t)(STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS) << (bit - 3);
+    return lower + ((uint64_t)1 << (bit - 3)) - 1;
+}
+
+stats* stats_create(void) {
+    stats *s = calloc(1, sizeof(stats));
+    if (!s) {
+        fprintf(stderr, "Failed to allocate stats\n");
+        return NULL;
+    }
+
+    s->listen_fd = -1;
+    return s;
+}
+
+void stats_destroy(stats *s) {
+    if (!s) {
+        return;
+    }
+
+    if (s->server_running) {
+        // Wakes up the blocking accept()
+        shutdown(s->listen_fd, SHUT_RDWR);
+        pthread_join(s->server_thread, NULL);
+    }
+    if (s->listen_fd >= 0) {
+        close(s->listen_fd);
+        unlink(s->socket_path);
+    }
+
+    free(s->socket_path);
+    free(s);
+}
+
+void stats_record(stats *s, stats_stage stage, uint64_t duration_ns) {
+    if (!s || stage >= STATS_STAGE_COUNT) {
+        return;
+    }
+
+    struct stats_histogram *h = &s->stages[stage];
+    uint64_t us = duration_ns / 1000;
+
+    __atomic_fetch_add(&h->buckets[bucket_index(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    while (us > max &&
+           !__atomic_compare_exchange_n(&h->max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // max was reloaded by the failed exchange
+    }
+}
+
+void stats_count(stats *s, stats_counter counter) {
+    if (!s || counter >= STATS_COUNTER_COUNT) {
+        return;
+    }
+    __atomic_fetch_add(&s->counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_get_counter(stats *s, stats_counter counter) {
+    if (!s || counter >= STATS_COUNTER_COUNT) {
+        return 0;
+    }
+    return __atomic_load_n(&s->counters[counter], __ATOMIC_RELAXED);
+}
+
+// Copy a histogram that may be updated concurrently, buckets and count may
+// disagree by the few samples recorded meanwhile
+static void load_histogram(const struct stats_histogram *h, struct stats_histogram *out) {
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        out->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    }
+    out->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    out->sum_us = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+    out->max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+}
+
+// Value below which a fraction q of the samples fall
+static uint64_t histogram_percentile(const struct stats_histogram *h, double q) {
+    uint64_t total = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        total += h->buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(q * (double)total + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            return bucket_upper_bound(i);
+        }
+    }
+    return bucket_upper_bound(STATS_BUCKETS - 1);
+}
+
+// Largest non-empty bucket, the max of an interval isn't tracked exactly
+static uint64_t histogram_max_bucket(const struct stats_histogram *h) {
+    for (int i = STATS_BUCKETS - 1; i >= 0; i--) {
+        if (h->buckets[i] > 0) {
+            return bucket_upper_bound(i);
+        }
+    }
+    return 0;
+}
+
+size_t stats_format(stats *s, char *buf, size_t size) {
+    if (!s || !buf || size == 0) {
+        return 0;
+    }
+
+    size_t len = 0;
+#define STATS_APPEND(...) do { \
+    int n = snprintf(buf + len, size - len, __VA_ARGS__); \
+    if (n < 0 || (size_t)n >= size - len) { \
+        return size - 1; \
+    } \
+    len += (size_t)n; \
+} while (0)
+
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        STATS_APPEND("%s %" PRIu64 "\n", counter_names[i], stats_get_counter(s, (stats_counter)i));
+    }
+
+    for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+        struct stats_histogram h;
+        load_histogram(&s->stages[i], &h);
+        STATS_APPEND("stage_latency_us{stage=\"%s\",quantile=\"0.5\"} %" PRIu64 "\n",
+                     stage_names[i], histogram_percentile(&h, 0.5));
+        STATS_APPEND("stage_latency_us{stage=\"%s\",quantile=\"0.99\"} %" PRIu64 "\n",
+                     stage_names[i], histogram_percentile(&h, 0.99));
+        STATS_APPEND("stage_latency_us_max{stage=\"%s\"} %" PRIu64 "\n", stage_names[i], h.max_us);
+        STATS_APPEND("stage_latency_us_sum{stage=\"%s\"} %" PRIu64 "\n", stage_names[i], h.sum_us);
+        STATS_APPEND("stage_latency_us_count{stage=\"%s\"} %" PRIu64 "\n", stage_names[i], h.count);
+    }
+
+#undef STATS_APPEND
+    return len;
+}
+
+void stats_log_interval(stats *s, FILE *out) {
+    if (!s || !out) {
+        return;
+    }
+
+    uint64_t counters[STATS_COUNTER_COUNT];
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        counters[i] = stats_get_counter(s, (stats_counter)i);
+    }
+
+    fprintf(out, "Stats: in %" PRIu64 ", written %" PRIu64 ", queue dropped %" PRIu64
+                 ", paced %" PRIu64 ", invalid %" PRIu64 ", unchanged %" PRIu64
+                 ", repeated %" PRIu64 ", write errors %" PRIu64 ", deadlines missed %" PRIu64 "\n",
+            counters[STATS_FRAMES_IN] - s->last_counters[STATS_FRAMES_IN],
+            counters[STATS_FRAMES_WRITTEN] - s->last_counters[STATS_FRAMES_WRITTEN],
+            counters[STATS_FRAMES_QUEUE_DROPPED] - s->last_counters[STATS_FRAMES_QUEUE_DROPPED],
+            counters[STATS_FRAMES_PACED] - s->last_counters[STATS_FRAMES_PACED],
+            counters[STATS_FRAMES_INVALID] - s->last_counters[STATS_FRAMES_INVALID],
+            counters[STATS_FRAMES_UNCHANGED] - s->last_counters[STATS_FRAMES_UNCHANGED],
+            counters[STATS_FRAMES_REPEATED] - s->last_counters[STATS_FRAMES_REPEATED],
+            counters[STATS_WRITE_ERRORS] - s->last_counters[STATS_WRITE_ERRORS],
+            counters[STATS_DEADLINES_MISSED] - s->last_counters[STATS_DEADLINES_MISSED]);
+    memcpy(s->last_counters, counters, sizeof(counters));
+
+    for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+        struct stats_histogram now;
+        load_histogram(&s->stages[i], &now);
+
+        // Totals only grow, the difference is the histogram of this interval
+        struct stats_histogram interval;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            interval.buckets[b] = now.buckets[b] - s->last_stages[i].buckets[b];
+        }
+        interval.count = now.count - s->last_stages[i].count;
+        s->last_stages[i] = now;
+
+        if (interval.count == 0) {
+            continue;
+        }
+        fprintf(out, "Stats: %-8s p50 %6" PRIu64 " us, p99 %6" PRIu64 " us, max %6" PRIu64 " us (%" PRIu64 " frames)\n",
+                stage_names[i], histogram_percentile(&interval, 0.5), histogram_percentile(&interval, 0.99),
+                histogram_max_bucket(&interval), interval.count);
+    }
+}
+
+static void* server_thread_func(void *user_data) {
+    stats *s = user_data;
+    char report[8192];
+
+    while (true) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Socket shut down by stats_destroy
+            break;
+        }
+
+        size_t len = stats_format(s, report, sizeof(report));
+        size_t written = 0;
+        while (written < len) {
+            ssize_t n = send(fd, report + written, len - written, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            written += (size_t)n;
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+bool stats_start_server(stats *s, const char *path) {
+    if (!s || !path || s->listen_fd >= 0) {
+        return false;
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create stats socket");
+        return false;
+    }
+
+    // A previous run may have left its socket behind, anything else at the path is kept
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Stats socket path %s exists and is not a socket\n", path);
+            close(fd);
+            return false;
+        }
+
+        // Only a socket nobody listens on is stale
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int err = probe < 0 ? errno : connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0 ? 0 : errno;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (err != ECONNREFUSED) {
+            if (err == 0) {
+                fprintf(stderr, "Stats socket %s is in use, e.g. by another running instance\n", path);
+            } else {
+                fprintf(stderr, "Failed to check stats socket %s: %s\n", path, strerror(err));
+            }
+            close(fd);
+            return false;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        perror("Failed to listen on stats socket");
+        close(fd);
+        return false;
+    }
+
+    s->listen_fd = fd;
+    s->socket_path = strdup(path);
+    if (pthread_create(&s->server_thread, NULL, server_thread_func, s) != 0) {
+        fprintf(stderr, "Failed to start stats server thread\n");
+        return false;
+    }
+
+    s->server_running = true;
+    printf("Serving stats on %s\n", path);
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Pipeline stages timed per frame
+typedef enum {
+    STATS_STAGE_CAPTURE,   // Compositor's buffer pts until dequeued from PipeWire
+    STATS_STAGE_QUEUE,     // Dequeued from PipeWire until the worker picks it up
+    STATS_STAGE_IMPORT,    // GL import and render passes, or mmap
+    STATS_STAGE_READBACK,  // GPU readback (glReadPixels or PBO copy)
+    STATS_STAGE_CONVERT,   // Scaling, color conversion or JPEG compression
+    STATS_STAGE_WRITE,     // Commit to the V4L2 device
+    STATS_STAGE_TOTAL,     // Dequeued until written
+    STATS_STAGE_LATENCY,   // Compositor's buffer pts until queued on the V4L2 device
+    STATS_STAGE_COUNT,
+} stats_stage;
+
+// Frame counters
+typedef enum {
+    STATS_FRAMES_IN,             // Buffers dequeued from PipeWire
+    STATS_FRAMES_QUEUE_DROPPED,  // Evicted while the worker was behind
+    STATS_FRAMES_PACED,          // Dropped over the --fps cap
+    STATS_FRAMES_INVALID,        // Corrupted, unmappable or mostly black frames
+    STATS_FRAMES_UNCHANGED,      // Not converted as they matched the previous frame
+    STATS_FRAMES_WRITTEN,        // Frames written to the device
+    STATS_FRAMES_REPEATED,       // Keep-alive repeats while the screen was idle
+    STATS_WRITE_ERRORS,          // Failed V4L2 writes
+    STATS_DEADLINES_MISSED,      // Written more than one frame interval after dequeue
+    STATS_COUNTER_COUNT,
+} stats_counter;
+
+// Lock-free per-stage latency histograms and frame counters
+// Recording is a few relaxed atomic operations and may happen on any thread.
+// Histograms have 8 buckets per power of two microseconds, so percentiles
+// are reported with at most 12.5% error.
+typedef struct stats stats;
+
+stats* stats_create(void);
+
+// Stop the socket server if running and free the stats
+void stats_destroy(stats *s);
+
+// Record the duration of a stage in nanoseconds
+void stats_record(stats *s, stats_stage stage, uint64_t duration_ns);
+
+// Increment a counter
+void stats_count(stats *s, stats_counter counter);
+
+uint64_t stats_get_counter(stats *s, stats_counter counter);
+
+// Format all counters and stage percentiles since creation, one value per line
+// in the Prometheus text format
+// Returns: Length of the report, truncated to size - 1
+size_t stats_format(stats *s, char *buf, size_t size);
+
+// Log a summary of the interval since the previous call (p50/p99/max per stage)
+// Keeps the previous totals internally, so only one thread may call it.
+void stats_log_interval(stats *s, FILE *out);
+
+// Serve stats_format to every client connecting to a Unix socket at path
+// A stale socket file at path is replaced. Runs on its own thread until
+// stats_destroy.
+// Returns: true if the socket is listening
+bool stats_start_server(stats *s, const char *path);
+
+#endif // STATS_H
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+// What a thread works on, copied under the lock when it joins a job
+struct pool_job {
+    thread_pool_fn fn;
+    void *user_data;
+    uint32_t n_bands;
+    uint32_t generation;  // Low 32 bits of the pool's generation the job was published as
+};
+
+struct thread_pool {
+    pthread_t threads[THREAD_POOL_MAX_THREADS];
+    pid_t thread_ids[THREAD_POOL_MAX_THREADS];
+    uint32_t n_helpers;  // Threads started, the caller of thread_pool_run is not counted
+    uint32_t n_ready;    // Helpers that stored their thread id
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;  // A new job generation was published
+    pthread_cond_t job_done;   // The last band of the job finished, or a helper started
+    uint64_t generation;
+    bool stopping;
+
+    // Current job
+    struct pool_job job;
+    uint64_t next_claim;       // generation << 32 | next band to claim (atomic)
+    uint32_t bands_left;       // Bands not finished yet (atomic)
+};
+
+// Claim and process bands until none are left
+// A thread still looping after the last band of an earlier job sees another
+// generation in next_claim and stops, instead of claiming a band of the new job.
+static void run_bands(thread_pool *pool, const struct pool_job *job) {
+    uint64_t claim = __atomic_load_n(&pool->next_claim, __ATOMIC_ACQUIRE);
+    while (true) {
+        uint32_t band = (uint32_t)claim;
+        if ((uint32_t)(claim >> 32) != job->generation || band >= job->n_bands) {
+            return;
+        }
+        if (!__atomic_compare_exchange_n(&pool->next_claim, &claim, claim + 1, true,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        job->fn(job->user_data, band, job->n_bands);
+
+        if (__atomic_sub_fetch(&pool->bands_left, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->job_done);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        claim = __atomic_load_n(&pool->next_claim, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void* pool_thread(void *arg) {
+    thread_pool *pool = arg;
+    uint64_t seen = 0;
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&pool->lock);
+    for (uint32_t i = 0; i < THREAD_POOL_MAX_THREADS; i++) {
+        if (pthread_equal(pool->threads[i], pthread_self())) {
+            pool->thread_ids[i] = tid;
+            break;
+        }
+    }
+    pool->n_ready++;
+    pthread_cond_signal(&pool->job_done);
+
+    while (true) {
+        while (!pool->stopping && pool->generation == seen) {
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        seen = pool->generation;
+        struct pool_job job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_bands(pool, &job);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void pin_thread(pthread_t thread, uint32_t index) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus <= 0) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % n_cpus, &set);
+
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "Failed to pin conversion thread to CPU %ld: %s\n", index % n_cpus, strerror(err));
+    }
+}
+
+thread_pool* thread_pool_create(uint32_t n_threads, bool pin_cores) {
+    if (n_threads == 0 || n_threads > THREAD_POOL_MAX_THREADS) {
+        fprintf(stderr, "Invalid thread count: %u\n", n_threads);
+        return NULL;
+    }
+
+    thread_pool *pool = calloc(1, sizeof(thread_pool));
+    if (!pool) {
+        fprintf(stderr, "Failed to allocate thread pool\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+
+    // Helpers look up their slot in threads[], which is only written under the lock
+    pthread_mutex_lock(&pool->lock);
+    for (uint32_t i = 0; i + 1 < n_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_thread, pool) != 0) {
+            fprintf(stderr, "Failed to start conversion thread %u\n", i + 1);
+            pthread_mutex_unlock(&pool->lock);
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+        pool->n_helpers = i + 1;
+
+        if (pin_cores) {
+            pin_thread(pool->threads[i], i + 1);
+        }
+    }
+
+    while (pool->n_ready < pool->n_helpers) {
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pin_cores) {
+        // The thread creating the pool is the one that runs jobs on it
+        pin_thread(pthread_self(), 0);
+    }
+
+    return pool;
+}
+
+void thread_pool_destroy(thread_pool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->n_helpers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->job_done);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void thread_pool_run(thread_pool *pool, thread_pool_fn fn, void *user_data, uint32_t n_bands) {
+    if (n_bands == 0) {
+        return;
+    }
+
+    if (!pool || pool->n_helpers == 0 || n_bands == 1) {
+        for (uint32_t band = 0; band < n_bands; band++) {
+            fn(user_data, band, n_bands);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    struct pool_job job = { fn, user_data, n_bands, (uint32_t)pool->generation };
+    pool->job = job;
+    __atomic_store_n(&pool->bands_left, n_bands, __ATOMIC_RELEASE);
+    // Publishing the new generation ends every claim on the previous job
+    __atomic_store_n(&pool->next_claim, (uint64_t)job.generation << 32, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_bands(pool, &job);
+
+    // Helpers may still be finishing the bands they claimed
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->bands_left, __ATOMIC_ACQUIRE) != 0) {
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+uint32_t thread_pool_get_size(thread_pool *pool) {
+    return pool ? pool->n_helpers + 1 : 1;
+}
+
+uint32_t thread_pool_get_thread_ids(thread_pool *pool, pid_t *ids, uint32_t max) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; pool && i < pool->n_helpers && count < max; i++) {
+        ids[count++] = pool->thread_ids[i];
+    }
+    return count;
+}
@@ -0,0 +1,42 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Upper bound of threads in a pool, including the calling thread
+#define THREAD_POOL_MAX_THREADS 32
+
+// Persistent pool of threads that split a job into independent bands
+typedef struct thread_pool thread_pool;
+
+// Work on one band of a job
+// Parameters:
+//   user_data: The pointer passed to thread_pool_run
+//   band: Index of the band to process, 0 <= band < n_bands
+//   n_bands: Total number of bands of the job
+typedef void (*thread_pool_fn)(void *user_data, uint32_t band, uint32_t n_bands);
+
+// Create a pool with n_threads threads in total, the caller of
+// thread_pool_run being one of them (so n_threads - 1 are started)
+// With pin_cores, helper thread i is bound to CPU i + 1 (modulo the online CPUs).
+// Returns NULL on failure
+thread_pool* thread_pool_create(uint32_t n_threads, bool pin_cores);
+
+// Stop and join the threads
+void thread_pool_destroy(thread_pool *pool);
+
+// Run fn on n_bands bands in parallel and wait until all of them are done
+// Bands are handed out dynamically, the calling thread works on them too.
+// Only one thread may run jobs on a pool at a time.
+void thread_pool_run(thread_pool *pool, thread_pool_fn fn, void *user_data, uint32_t n_bands);
+
+// Number of threads working on a job, including the caller
+uint32_t thread_pool_get_size(thread_pool *pool);
+
+// Kernel thread ids (gettid) of the helper threads, e.g. to change their scheduling
+// Returns: Number of ids written, at most max
+uint32_t thread_pool_get_thread_ids(thread_pool *pool, pid_t *ids, uint32_t max);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifndef NO_TRACE
+
+// Power of two, about 256 KiB of messages
+#define TRACE_RING_SLOTS 1024
+#define TRACE_MESSAGE_SIZE 256
+
+// How often the drain thread empties the ring
+#define TRACE_DRAIN_INTERVAL_NS (20 * 1000000L)
+
+// Bounded multi-producer queue: a slot is free for position p while its
+// sequence is p, and holds a message for the consumer once it is p + 1
+struct trace_slot {
+    uint64_t sequence;
+    char message[TRACE_MESSAGE_SIZE];
+};
+
+static struct trace_slot ring[TRACE_RING_SLOTS];
+static uint64_t ring_head;  // Next position to claim (atomic, producers)
+static uint64_t ring_tail;  // Next position to drain, drain thread only
+static uint64_t dropped;    // Messages lost to a full ring (atomic)
+
+static uint32_t sample_every = 1;
+static pthread_t drain_thread;
+static bool drain_running;
+static bool started;
+
+bool trace_enabled = false;
+__thread bool trace_frame_sampled = false;
+static __thread uint32_t frame_counter = 0;
+
+void trace_write(const char *format, ...) {
+    uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    struct trace_slot *slot;
+
+    while (true) {
+        slot = &ring[pos & (TRACE_RING_SLOTS - 1)];
+        uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The drain thread hasn't caught up, never wait for it
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->message, sizeof(slot->message), format, args);
+    va_end(args);
+
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+bool trace_begin_frame(void) {
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) {
+        trace_frame_sampled = false;
+        return false;
+    }
+
+    trace_frame_sampled = frame_counter++ % sample_every == 0;
+    return trace_frame_sampled;
+}
+
+// Write out every complete message, in the order they were claimed
+static void drain_ring(void) {
+    static uint64_t reported_dropped = 0;
+    bool wrote = false;
+
+    while (true) {
+        struct trace_slot *slot = &ring[ring_tail & (TRACE_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring_tail + 1) {
+            break;
+        }
+
+        fputs(slot->message, stdout);
+        wrote = true;
+        __atomic_store_n(&slot->sequence, ring_tail + TRACE_RING_SLOTS, __ATOMIC_RELEASE);
+        ring_tail++;
+    }
+
+    uint64_t lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (lost != reported_dropped) {
+        printf("[trace] %" PRIu64 " message(s) dropped, the ring was full\n", lost - reported_dropped);
+        reported_dropped = lost;
+        wrote = true;
+    }
+
+    if (wrote) {
+        fflush(stdout);
+    }
+}
+
+static void* drain_loop(void *user_data) {
+    (void)user_data;
+    struct timespec interval = { 0, TRACE_DRAIN_INTERVAL_NS };
+
+    while (__atomic_load_n(&drain_running, __ATOMIC_ACQUIRE)) {
+        drain_ring();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+bool trace_start(uint32_t every) {
+    if (started) {
+        return true;
+    }
+
+    for (uint64_t i = 0; i < TRACE_RING_SLOTS; i++) {
+        ring[i].sequence = i;
+    }
+    sample_every = every > 0 ? every : 1;
+
+    __atomic_store_n(&drain_running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&drain_thread, NULL, drain_loop, NULL) != 0) {
+        fprintf(stderr, "Failed to start trace thread, debug output disabled\n");
+        drain_running = false;
+        return false;
+    }
+
+    started = true;
+    __atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+void trace_stop(void) {
+    if (!started) {
+        return;
+    }
+
+    __atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&drain_running, false, __ATOMIC_RELEASE);
+    pthread_join(drain_thread, NULL);
+
+    // Messages claimed after the thread's last pass
+    drain_ring();
+    started = false;
+}
+
+#else // NO_TRACE
+
+bool trace_start(uint32_t sample_every) {
+    (void)sample_every;
+    fprintf(stderr, "Debug output was compiled out (built with NO_TRACE)\n");
+    return false;
+}
+
+void trace_stop(void) {
+}
+
+#endif // NO_TRACE
@@ -0,0 +1,66 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-frame diagnostics are traced on 1 in this many frames by default
+#define TRACE_DEFAULT_SAMPLE 30
+
+// Debug tracing (--debug)
+// Messages are formatted into a lock-free ring and written to stdout by a
+// drain thread, so trace points never take locks or make syscalls on the
+// capture and conversion threads. When the ring is full messages are dropped
+// and counted. Building with -DNO_TRACE (make TRACE=0) compiles every trace
+// point out.
+
+// Start the drain thread and enable tracing
+// Parameters:
+//   sample_every: TRACE_FRAME messages are kept for 1 in this many frames of
+//                 each thread, 1 = every frame
+// Returns: false if tracing was compiled out or the thread can't be started
+bool trace_start(uint32_t sample_every);
+
+// Disable tracing, write out what is left in the ring and stop the drain thread
+void trace_stop(void);
+
+#ifdef NO_TRACE
+
+// Arguments are still type-checked and count as used, but never evaluated
+static inline __attribute__((format(printf, 1, 2))) void trace_discard(const char *format, ...) {
+    (void)format;
+}
+
+#define TRACE(...) do { if (0) trace_discard(__VA_ARGS__); } while (0)
+#define TRACE_FRAME(...) do { if (0) trace_discard(__VA_ARGS__); } while (0)
+#define trace_begin_frame() false
+
+#else
+
+extern bool trace_enabled;
+extern __thread bool trace_frame_sampled;
+
+// Queue a message, use the macros below instead
+void trace_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Decide whether the frame the calling thread starts on is sampled
+// Returns: true if TRACE_FRAME messages are kept until the next call
+bool trace_begin_frame(void);
+
+// Trace a message whenever tracing is on, for setup and rare events
+#define TRACE(...) do { \
+    if (__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) { \
+        trace_write(__VA_ARGS__); \
+    } \
+} while (0)
+
+// Trace a message only on sampled frames of this thread, for per-frame details
+#define TRACE_FRAME(...) do { \
+    if (__builtin_expect(trace_frame_sampled, 0)) { \
+        trace_write(__VA_ARGS__); \
+    } \
+} while (0)
+
+#endif // NO_TRACE
+
+#endif // TRACE_H
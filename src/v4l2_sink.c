@@ -0,0 +1,669 @@
+#define _GNU_SOURCE
+#include "v4l2_sink.h"
+#include "realtime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <linux/videodev2.h>
+
+struct v4l2_sink_buffer {
+    void *start;
+    size_t length;
+    bool queued;  // Currently owned by the driver
+
+    // DMA-BUF passthrough
+    int dmabuf_fd;  // Imported fd, kept to reuse the slot's attachment for the same buffer
+    void *cookie;   // Caller's handle, returned through the release callback
+};
+
+struct v4l2_sink {
+    int fd;
+    enum v4l2_buf_type buf_type;
+
+    // Negotiated format
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelformat;
+    uint32_t bytesperline;
+    size_t sizeimage;
+
+    // Streaming I/O state
+    bool streaming_io;
+    bool dmabuf_io;  // Buffers are imported DMA-BUFs (V4L2_MEMORY_DMABUF) instead of mmap'd
+    bool stream_on;
+    struct v4l2_sink_buffer buffers[V4L2_SINK_MAX_BUFFERS];
+    uint32_t n_buffers;
+    int current;  // Index of the acquired buffer, -1 if none
+    int last;     // Index of the last committed buffer, -1 if none
+    size_t last_bytesused;
+
+    // Staging buffer for the write() fallback
+    uint8_t *write_buffer;
+    size_t write_buffer_size;
+
+    // Called when the driver is done with a queued DMA-BUF
+    v4l2_sink_release_fn release;
+    void *release_data;
+};
+
+static int xioctl(int fd, unsigned long request, void *arg) {
+    int ret;
+    do {
+        ret = ioctl(fd, request, arg);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+v4l2_sink* v4l2_sink_open(const char *device) {
+    v4l2_sink *out = calloc(1, sizeof(v4l2_sink));
+    if (!out) {
+        fprintf(stderr, "Failed to allocate V4L2 sink\n");
+        return NULL;
+    }
+
+    out->fd = open(device, O_RDWR);
+    if (out->fd < 0) {
+        perror("Failed to open V4L2 device");
+        free(out);
+        return NULL;
+    }
+
+    out->current = -1;
+    out->last = -1;
+    out->buf_type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+    struct v4l2_capability cap;
+    if (xioctl(out->fd, VIDIOC_QUERYCAP, &cap) == 0) {
+        uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+
+        printf("Device capabilities: 0x%x\n", caps);
+        printf("Device supports: %s%s%s%s\n",
+               (caps & V4L2_CAP_VIDEO_CAPTURE) ? "CAPTURE " : "",
+               (caps & V4L2_CAP_VIDEO_OUTPUT) ? "OUTPUT " : "",
+               (caps & V4L2_CAP_READWRITE) ? "READWRITE " : "",
+               (caps & V4L2_CAP_STREAMING) ? "STREAMING" : "");
+
+        if (!(caps & V4L2_CAP_VIDEO_OUTPUT) && (caps & V4L2_CAP_VIDEO_CAPTURE)) {
+            out->buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        }
+    } else {
+        perror("Failed to query device capabilities");
+    }
+
+    printf("V4L2 device opened: %s\n", device);
+    return out;
+}
+
+// Hand a DMA-BUF slot's buffer back to its owner
+static void release_dmabuf_slot(v4l2_sink *out, struct v4l2_sink_buffer *buffer) {
+    void *cookie = buffer->cookie;
+    buffer->cookie = NULL;
+    buffer->queued = false;
+
+    if (cookie && out->release) {
+        out->release(cookie, out->release_data);
+    }
+}
+
+static void release_buffers(v4l2_sink *out) {
+    if (out->stream_on) {
+        enum v4l2_buf_type type = out->buf_type;
+        if (xioctl(out->fd, VIDIOC_STREAMOFF, &type) < 0) {
+            perror("VIDIOC_STREAMOFF failed");
+        }
+        out->stream_on = false;
+    }
+
+    for (uint32_t i = 0; i < out->n_buffers; i++) {
+        if (out->buffers[i].start && out->buffers[i].start != MAP_FAILED) {
+            munmap(out->buffers[i].start, out->buffers[i].length);
+        }
+        out->buffers[i].start = NULL;
+
+        // STREAMOFF returned every queued DMA-BUF
+        if (out->dmabuf_io) {
+            release_dmabuf_slot(out, &out->buffers[i]);
+        }
+        out->buffers[i].queued = false;
+        out->buffers[i].dmabuf_fd = -1;
+    }
+
+    if (out->streaming_io) {
+        struct v4l2_requestbuffers req = {0};
+        req.count = 0;
+        req.type = out->buf_type;
+        req.memory = out->dmabuf_io ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+        xioctl(out->fd, VIDIOC_REQBUFS, &req);
+    }
+
+    out->n_buffers = 0;
+    out->streaming_io = false;
+    out->dmabuf_io = false;
+    out->current = -1;
+    out->last = -1;
+    out->last_bytesused = 0;
+}
+
+static bool setup_streaming(v4l2_sink *out) {
+    struct v4l2_requestbuffers req = {0};
+    req.count = V4L2_SINK_NUM_BUFFERS;
+    req.type = out->buf_type;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    if (xioctl(out->fd, VIDIOC_REQBUFS, &req) < 0) {
+        printf("Device refused streaming I/O (%s), falling back to write()\n", strerror(errno));
+        return false;
+    }
+
+    if (req.count == 0) {
+        printf("Device returned no streaming buffers, falling back to write()\n");
+        return false;
+    }
+
+    if (req.count > V4L2_SINK_MAX_BUFFERS) {
+        req.count = V4L2_SINK_MAX_BUFFERS;
+    }
+
+    out->streaming_io = true;
+
+    for (uint32_t i = 0; i < req.count; i++) {
+        struct v4l2_buffer buf = {0};
+        buf.type = out->buf_type;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+
+        if (xioctl(out->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+            perror("VIDIOC_QUERYBUF failed");
+            release_buffers(out);
+            return false;
+        }
+
+        void *start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, buf.m.offset);
+        if (start == MAP_FAILED) {
+            perror("Failed to mmap V4L2 buffer");
+            release_buffers(out);
+            return false;
+        }
+
+        out->buffers[i].start = start;
+        out->buffers[i].length = buf.length;
+        out->buffers[i].queued = false;
+        out->n_buffers = i + 1;
+    }
+
+    printf("V4L2 streaming I/O enabled: %u mmap'd buffers\n", out->n_buffers);
+    return true;
+}
+
+// Line pitch and frame size we ask for, the driver may still adjust them
+// Planar formats give the pitch of the luma plane, compressed ones have none.
+static void format_layout(uint32_t pixelformat, uint32_t width, uint32_t height,
+                          uint32_t *bytesperline, uint32_t *sizeimage) {
+    uint32_t chroma_size = ((width + 1) / 2) * ((height + 1) / 2);
+
+    switch (pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+            *bytesperline = width * 2;
+            *sizeimage = *bytesperline * height;
+            break;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_YUV420:
+            *bytesperline = width;
+            *sizeimage = width * height + 2 * chroma_size;
+            break;
+        case V4L2_PIX_FMT_MJPEG:
+            // Size hint for the worst compressed frame, about YUYV's
+            *bytesperline = 0;
+            *sizeimage = width * height * 2;
+            break;
+        default:
+            *bytesperline = width * 4;
+            *sizeimage = *bytesperline * height;
+            break;
+    }
+}
+
+// Apply the format with VIDIOC_S_FMT and store what the driver settled on
+static bool set_format(v4l2_sink *out, uint32_t width, uint32_t height, uint32_t pixelformat,
+                       uint32_t bytesperline, uint32_t sizeimage) {
+    struct v4l2_format fmt = {0};
+    fmt.type = out->buf_type;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = pixelformat;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    fmt.fmt.pix.bytesperline = bytesperline;
+    fmt.fmt.pix.sizeimage = sizeimage;
+
+    if (xioctl(out->fd, VIDIOC_S_FMT, &fmt) < 0) {
+        perror("Failed to update V4L2 format");
+        return false;
+    }
+
+    if (fmt.fmt.pix.pixelformat != pixelformat) {
+        fprintf(stderr, "V4L2 device changed the requested pixel format\n");
+        return false;
+    }
+
+    // Frames are written as packed rows of the requested size, and DMA-BUFs
+    // are read with their own stride
+    if (fmt.fmt.pix.width != width || fmt.fmt.pix.height != height ||
+        (bytesperline && fmt.fmt.pix.bytesperline && fmt.fmt.pix.bytesperline != bytesperline)) {
+        fprintf(stderr, "V4L2 device adjusted %ux%u, %u bytes per line to %ux%u, %u bytes per line\n",
+                width, height, bytesperline, fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.bytesperline);
+        return false;
+    }
+
+    out->width = fmt.fmt.pix.width;
+    out->height = fmt.fmt.pix.height;
+    out->pixelformat = fmt.fmt.pix.pixelformat;
+    out->bytesperline = fmt.fmt.pix.bytesperline ? fmt.fmt.pix.bytesperline : bytesperline;
+    out->sizeimage = fmt.fmt.pix.sizeimage ? fmt.fmt.pix.sizeimage : sizeimage;
+    return true;
+}
+
+bool v4l2_sink_try_format(v4l2_sink *out, uint32_t width, uint32_t height, uint32_t pixelformat) {
+    if (!out || out->fd < 0) {
+        return false;
+    }
+
+    uint32_t bytesperline, sizeimage;
+    format_layout(pixelformat, width, height, &bytesperline, &sizeimage);
+
+    struct v4l2_format fmt = {0};
+    fmt.type = out->buf_type;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = pixelformat;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    fmt.fmt.pix.bytesperline = bytesperline;
+    fmt.fmt.pix.sizeimage = sizeimage;
+
+    if (xioctl(out->fd, VIDIOC_TRY_FMT, &fmt) < 0) {
+        // Drivers without TRY_FMT are left to S_FMT
+        return errno == ENOTTY;
+    }
+
+    return fmt.fmt.pix.pixelformat == pixelformat &&
+           fmt.fmt.pix.width == width && fmt.fmt.pix.height == height;
+}
+
+bool v4l2_sink_configure(v4l2_sink *out, uint32_t width, uint32_t height, uint32_t pixelformat) {
+    if (!out || out->fd < 0) {
+        return false;
+    }
+
+    // Buffers must be released before the driver accepts a new format
+    release_buffers(out);
+
+    uint32_t bytesperline, sizeimage;
+    format_layout(pixelformat, width, height, &bytesperline, &sizeimage);
+    if (!set_format(out, width, height, pixelformat, bytesperline, sizeimage)) {
+        return false;
+    }
+
+    if (setup_streaming(out)) {
+        free(out->write_buffer);
+        out->write_buffer = NULL;
+        out->write_buffer_size = 0;
+        return true;
+    }
+
+    // write() fallback needs a staging buffer
+    if (out->write_buffer_size < out->sizeimage) {
+        uint8_t *buffer = realtime_realloc(out->write_buffer, out->write_buffer_size, out->sizeimage);
+        if (!buffer) {
+            fprintf(stderr, "Failed to allocate V4L2 write buffer\n");
+            return false;
+        }
+        out->write_buffer = buffer;
+        out->write_buffer_size = out->sizeimage;
+    }
+
+    return true;
+}
+
+bool v4l2_sink_configure_dmabuf(v4l2_sink *out, uint32_t width, uint32_t height,
+                                uint32_t pixelformat, uint32_t bytesperline) {
+    if (!out || out->fd < 0) {
+        return false;
+    }
+
+    release_buffers(out);
+
+    // Fails if the driver would read the buffers with a different stride
+    if (!set_format(out, width, height, pixelformat, bytesperline, bytesperline * height)) {
+        return false;
+    }
+
+    struct v4l2_requestbuffers req = {0};
+    req.count = V4L2_SINK_NUM_BUFFERS;
+    req.type = out->buf_type;
+    req.memory = V4L2_MEMORY_DMABUF;
+
+    if (xioctl(out->fd, VIDIOC_REQBUFS, &req) < 0 || req.count == 0) {
+        printf("Device does not accept DMA-BUF buffers (%s)\n", req.count ? "no buffers" : strerror(errno));
+        return false;
+    }
+
+    if (req.count > V4L2_SINK_MAX_BUFFERS) {
+        req.count = V4L2_SINK_MAX_BUFFERS;
+    }
+
+    out->streaming_io = true;
+    out->dmabuf_io = true;
+    out->n_buffers = req.count;
+    for (uint32_t i = 0; i < out->n_buffers; i++) {
+        out->buffers[i].start = NULL;
+        out->buffers[i].length = 0;
+        out->buffers[i].queued = false;
+        out->buffers[i].dmabuf_fd = -1;
+        out->buffers[i].cookie = NULL;
+    }
+
+    free(out->write_buffer);
+    out->write_buffer = NULL;
+    out->write_buffer_size = 0;
+
+    printf("V4L2 DMA-BUF passthrough enabled: %u buffer slots\n", out->n_buffers);
+    return true;
+}
+
+bool v4l2_sink_set_frame_rate(v4l2_sink *out, uint32_t fps) {
+    if (!out || out->fd < 0 || fps == 0) {
+        return false;
+    }
+
+    struct v4l2_streamparm parm = {0};
+    parm.type = out->buf_type;
+    parm.parm.output.timeperframe.numerator = 1;
+    parm.parm.output.timeperframe.denominator = fps;
+
+    if (xioctl(out->fd, VIDIOC_S_PARM, &parm) < 0) {
+        perror("Failed to set V4L2 frame rate");
+        return false;
+    }
+
+    return true;
+}
+
+void v4l2_sink_set_release_callback(v4l2_sink *out, v4l2_sink_release_fn release, void *user_data) {
+    if (!out) {
+        return;
+    }
+
+    out->release = release;
+    out->release_data = user_data;
+}
+
+void v4l2_sink_reclaim_dmabufs(v4l2_sink *out) {
+    if (!out || !out->dmabuf_io) {
+        return;
+    }
+
+    // Dequeue without blocking whatever the driver has finished reading
+    struct pollfd pfd = { .fd = out->fd, .events = POLLOUT };
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT)) {
+        struct v4l2_buffer buf = {0};
+        buf.type = out->buf_type;
+        buf.memory = V4L2_MEMORY_DMABUF;
+
+        if (xioctl(out->fd, VIDIOC_DQBUF, &buf) < 0 || buf.index >= out->n_buffers) {
+            break;
+        }
+
+        release_dmabuf_slot(out, &out->buffers[buf.index]);
+    }
+}
+
+// A zero timestamp is left for the driver to fill in at queue time
+static void set_buffer_timestamp(struct v4l2_buffer *buf, uint64_t timestamp_ns) {
+    if (timestamp_ns) {
+        buf->timestamp.tv_sec = (time_t)(timestamp_ns / 1000000000ull);
+        buf->timestamp.tv_usec = (suseconds_t)(timestamp_ns % 1000000000ull / 1000);
+    }
+}
+
+bool v4l2_sink_queue_dmabuf(v4l2_sink *out, int dmabuf_fd, size_t length, size_t bytesused,
+                            uint64_t timestamp_ns, void *cookie) {
+    if (!out || out->fd < 0 || !out->dmabuf_io) {
+        errno = EINVAL;
+        return false;
+    }
+
+    v4l2_sink_reclaim_dmabufs(out);
+
+    // Prefer the slot that last held this fd so the driver can keep its attachment
+    int slot = -1;
+    uint32_t in_flight = 0;
+    for (uint32_t i = 0; i < out->n_buffers; i++) {
+        if (out->buffers[i].queued) {
+            in_flight++;
+        } else if (slot < 0 || out->buffers[i].dmabuf_fd == dmabuf_fd) {
+            slot = (int)i;
+        }
+    }
+
+    // The producer's pool is small, leave it buffers to render into
+    if (slot < 0 || in_flight >= V4L2_SINK_MAX_DMABUF_IN_FLIGHT) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    struct v4l2_buffer buf = {0};
+    buf.type = out->buf_type;
+    buf.memory = V4L2_MEMORY_DMABUF;
+    buf.index = (uint32_t)slot;
+    buf.m.fd = dmabuf_fd;
+    buf.length = (uint32_t)length;
+    buf.bytesused = (uint32_t)bytesused;
+    buf.field = V4L2_FIELD_NONE;
+    set_buffer_timestamp(&buf, timestamp_ns);
+
+    // Started before the first buffer is queued, so that on failure the caller
+    // still owns the buffer and nothing was handed to the driver
+    if (!out->stream_on) {
+        enum v4l2_buf_type type = out->buf_type;
+        if (xioctl(out->fd, VIDIOC_STREAMON, &type) < 0) {
+            return false;
+        }
+        out->stream_on = true;
+    }
+
+    if (xioctl(out->fd, VIDIOC_QBUF, &buf) < 0) {
+        return false;
+    }
+
+    out->buffers[slot].queued = true;
+    out->buffers[slot].dmabuf_fd = dmabuf_fd;
+    out->buffers[slot].cookie = cookie;
+
+    return true;
+}
+
+void v4l2_sink_forget_dmabuf(v4l2_sink *out, void *cookie) {
+    if (!out || !cookie) {
+        return;
+    }
+
+    // The driver keeps its own reference to the memory, only the handle goes stale
+    for (uint32_t i = 0; i < out->n_buffers; i++) {
+        if (out->buffers[i].cookie == cookie) {
+            out->buffers[i].cookie = NULL;
+        }
+    }
+}
+
+bool v4l2_sink_is_dmabuf(v4l2_sink *out) {
+    return out && out->dmabuf_io;
+}
+
+uint8_t* v4l2_sink_acquire(v4l2_sink *out, size_t *size) {
+    if (!out || out->fd < 0 || out->dmabuf_io) {
+        return NULL;
+    }
+
+    if (!out->streaming_io) {
+        if (size) {
+            *size = out->write_buffer_size;
+        }
+        return out->write_buffer;
+    }
+
+    if (out->current < 0) {
+        // Use buffers that have never been handed to the driver first
+        for (uint32_t i = 0; i < out->n_buffers; i++) {
+            if (!out->buffers[i].queued) {
+                out->current = (int)i;
+                break;
+            }
+        }
+    }
+
+    if (out->current < 0) {
+        // All buffers are queued, wait for the driver to give one back
+        struct v4l2_buffer buf = {0};
+        buf.type = out->buf_type;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        if (xioctl(out->fd, VIDIOC_DQBUF, &buf) < 0) {
+            return NULL;
+        }
+
+        if (buf.index >= out->n_buffers) {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        out->buffers[buf.index].queued = false;
+        out->current = (int)buf.index;
+    }
+
+    if (size) {
+        *size = out->buffers[out->current].length;
+    }
+    return out->buffers[out->current].start;
+}
+
+bool v4l2_sink_commit(v4l2_sink *out, size_t bytesused, uint64_t timestamp_ns) {
+    if (!out || out->fd < 0) {
+        errno = EBADF;
+        return false;
+    }
+
+    if (out->dmabuf_io) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (!out->streaming_io) {
+        if (!out->write_buffer) {
+            errno = ENOMEM;
+            return false;
+        }
+        ssize_t written = write(out->fd, out->write_buffer, bytesused);
+        if (written < 0) {
+            return false;
+        }
+        out->last_bytesused = bytesused;
+        return true;
+    }
+
+    if (out->current < 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    struct v4l2_buffer buf = {0};
+    buf.type = out->buf_type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = (uint32_t)out->current;
+    buf.bytesused = (uint32_t)bytesused;
+    buf.field = V4L2_FIELD_NONE;
+    set_buffer_timestamp(&buf, timestamp_ns);
+
+    if (xioctl(out->fd, VIDIOC_QBUF, &buf) < 0) {
+        return false;
+    }
+
+    out->buffers[out->current].queued = true;
+    out->last = out->current;
+    out->last_bytesused = bytesused;
+    out->current = -1;
+
+    if (!out->stream_on) {
+        enum v4l2_buf_type type = out->buf_type;
+        if (xioctl(out->fd, VIDIOC_STREAMON, &type) < 0) {
+            return false;
+        }
+        out->stream_on = true;
+    }
+
+    return true;
+}
+
+bool v4l2_sink_repeat(v4l2_sink *out) {
+    if (!out || out->fd < 0 || out->dmabuf_io || out->last_bytesused == 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (!out->streaming_io) {
+        // The staging buffer still holds the last frame written
+        return v4l2_sink_commit(out, out->last_bytesused, 0);
+    }
+
+    if (out->last < 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    // The driver only reads output buffers, so the queued one can be copied from
+    const struct v4l2_sink_buffer *last = &out->buffers[out->last];
+    size_t size = 0;
+    uint8_t *dst = v4l2_sink_acquire(out, &size);
+    if (!dst || size < out->last_bytesused) {
+        return false;
+    }
+    if (dst != last->start) {
+        memcpy(dst, last->start, out->last_bytesused);
+    }
+
+    return v4l2_sink_commit(out, out->last_bytesused, 0);
+}
+
+uint32_t v4l2_sink_get_pixelformat(v4l2_sink *out) {
+    return out ? out->pixelformat : 0;
+}
+
+uint32_t v4l2_sink_get_bytesperline(v4l2_sink *out) {
+    return out ? out->bytesperline : 0;
+}
+
+size_t v4l2_sink_get_frame_size(v4l2_sink *out) {
+    return out ? out->sizeimage : 0;
+}
+
+bool v4l2_sink_is_streaming(v4l2_sink *out) {
+    return out && out->streaming_io;
+}
+
+void v4l2_sink_destroy(v4l2_sink *out) {
+    if (!out) {
+        return;
+    }
+
+    if (out->fd >= 0) {
+        release_buffers(out);
+        close(out->fd);
+    }
+
+    free(out->write_buffer);
+    free(out);
+}
@@ -0,0 +1,126 @@
+#ifndef V4L2_SINK_H
+#define V4L2_SINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of mmap'd buffers requested from the device in streaming mode
+#define V4L2_SINK_NUM_BUFFERS 4
+#define V4L2_SINK_MAX_BUFFERS 8
+
+// DMA-BUFs held by the device at once in passthrough mode
+#define V4L2_SINK_MAX_DMABUF_IN_FLIGHT 2
+
+// Forward declaration to avoid exposing V4L2 internals
+typedef struct v4l2_sink v4l2_sink;
+
+// Called when the device has finished with a DMA-BUF queued by v4l2_sink_queue_dmabuf
+typedef void (*v4l2_sink_release_fn)(void *cookie, void *user_data);
+
+// Open the V4L2 loopback device
+// Returns NULL if the device cannot be opened
+v4l2_sink* v4l2_sink_open(const char *device);
+
+// Stop streaming, unmap buffers and close the device
+void v4l2_sink_destroy(v4l2_sink *out);
+
+// Set the device format and negotiate the output buffers
+// Tries V4L2 streaming I/O (VIDIOC_REQBUFS + mmap) first and falls back to
+// write() only if the device refuses streaming.
+// Parameters:
+//   out: The output device
+//   width: Frame width in pixels
+//   height: Frame height in pixels
+//   pixelformat: V4L2 pixel format (YUYV, NV12, YUV420, MJPEG or packed RGB)
+// Returns: true on success, false if the format was rejected or the driver
+// adjusted the size or line pitch, as frames are always written with packed rows
+bool v4l2_sink_configure(v4l2_sink *out, uint32_t width, uint32_t height, uint32_t pixelformat);
+
+// Check whether the device would accept a format, without changing it (VIDIOC_TRY_FMT)
+// Parameters:
+//   out: The output device
+//   width: Frame width in pixels
+//   height: Frame height in pixels
+//   pixelformat: V4L2 pixel format (e.g., V4L2_PIX_FMT_NV12)
+// Returns: true if the format would be accepted unchanged, or if the device
+//          doesn't implement VIDIOC_TRY_FMT
+bool v4l2_sink_try_format(v4l2_sink *out, uint32_t width, uint32_t height, uint32_t pixelformat);
+
+// Set the device format and switch to DMA-BUF passthrough (V4L2_MEMORY_DMABUF)
+// Frames are then handed over with v4l2_sink_queue_dmabuf, without any copy.
+// Parameters:
+//   out: The output device
+//   width: Frame width in pixels
+//   height: Frame height in pixels
+//   pixelformat: V4L2 pixel format matching the DMA-BUF contents
+//   bytesperline: Stride of the DMA-BUFs, the device must accept it as is
+// Returns: true on success, false if the device can't import DMA-BUFs
+bool v4l2_sink_configure_dmabuf(v4l2_sink *out, uint32_t width, uint32_t height,
+                                uint32_t pixelformat, uint32_t bytesperline);
+
+// Advertise the frame rate to consumers (VIDIOC_S_PARM timeperframe)
+// Only informs readers of the device, frames are still sent as they are committed.
+// Returns: true on success, false if the device doesn't support it
+bool v4l2_sink_set_frame_rate(v4l2_sink *out, uint32_t fps);
+
+// Set the callback that returns DMA-BUFs once the device is done with them
+// It is also invoked for every buffer still queued when streaming stops.
+void v4l2_sink_set_release_callback(v4l2_sink *out, v4l2_sink_release_fn release, void *user_data);
+
+// Queue a DMA-BUF for output (passthrough mode only)
+// The buffer must stay valid until the release callback gets its cookie.
+// Parameters:
+//   out: The output device
+//   dmabuf_fd: File descriptor of the DMA-BUF
+//   length: Size of the DMA-BUF in bytes
+//   bytesused: Number of bytes of valid frame data
+//   timestamp_ns: CLOCK_MONOTONIC capture time for v4l2_buffer.timestamp, 0 to let the driver set it
+//   cookie: Caller's handle for the buffer, passed to the release callback
+// Returns: true if queued, false on failure (errno is EAGAIN when all slots are busy)
+bool v4l2_sink_queue_dmabuf(v4l2_sink *out, int dmabuf_fd, size_t length, size_t bytesused,
+                            uint64_t timestamp_ns, void *cookie);
+
+// Release the DMA-BUFs the device has finished with, without blocking
+void v4l2_sink_reclaim_dmabufs(v4l2_sink *out);
+
+// Forget a queued DMA-BUF whose owner is going away, it won't be released
+void v4l2_sink_forget_dmabuf(v4l2_sink *out, void *cookie);
+
+// Get a buffer to render the next frame into
+// In streaming mode this is a dequeued (or not yet queued) mmap'd buffer,
+// in write() mode it is an internal staging buffer.
+// Calling this again without a commit returns the same buffer.
+// Parameters:
+//   out: The output device
+//   size: Receives the size of the returned buffer in bytes
+// Returns: Pointer to the frame buffer, or NULL on failure
+uint8_t* v4l2_sink_acquire(v4l2_sink *out, size_t *size);
+
+// Hand the acquired buffer to the device (VIDIOC_QBUF or write())
+// Parameters:
+//   out: The output device
+//   bytesused: Number of bytes of valid frame data in the buffer
+//   timestamp_ns: CLOCK_MONOTONIC capture time for v4l2_buffer.timestamp, 0 to let the
+//                 driver set it. v4l2loopback passes it on to readers; write() can't carry it.
+// Returns: true on success, false on failure (errno is set)
+bool v4l2_sink_commit(v4l2_sink *out, size_t bytesused, uint64_t timestamp_ns);
+
+// Send the last committed frame again, e.g. to keep consumers from timing out
+// while the source is idle
+// Returns: true on success, false if nothing was committed since the format
+// was set or in DMA-BUF passthrough mode (errno is set)
+bool v4l2_sink_repeat(v4l2_sink *out);
+
+// Query the negotiated format
+uint32_t v4l2_sink_get_pixelformat(v4l2_sink *out);
+uint32_t v4l2_sink_get_bytesperline(v4l2_sink *out);
+size_t v4l2_sink_get_frame_size(v4l2_sink *out);
+
+// Check whether frames go out through mmap'd streaming buffers
+bool v4l2_sink_is_streaming(v4l2_sink *out);
+
+// Check whether the device is in DMA-BUF passthrough mode
+bool v4l2_sink_is_dmabuf(v4l2_sink *out);
+
+#endif // V4L2_SINK_H